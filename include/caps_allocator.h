@@ -0,0 +1,227 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file caps_allocator.h
+/// This file declares heap tiers which allocate memory with a specific set of
+/// heap capabilities (internal DMA capable, internal or PSRAM) and track their
+/// usage, as well as STL compatible allocators for each tier.
+
+#pragma once
+
+#include <atomic>
+#include <esp_heap_caps.h>
+#include <new>
+#include <stdlib.h>
+#include "sdkconfig.h"
+
+/// Usage statistics of a heap tier.
+typedef struct
+{
+    /// Number of successful allocations.
+    uint32_t allocations;
+
+    /// Number of allocations which have been released.
+    uint32_t frees;
+
+    /// Number of allocations which could not be satisfied.
+    uint32_t failures;
+
+    /// Number of allocations satisfied by the fallback capabilities.
+    uint32_t fallbacks;
+
+    /// Number of bytes currently allocated.
+    size_t bytes_in_use;
+
+    /// Largest number of bytes allocated at the same time.
+    size_t peak_bytes;
+} esp_heap_tier_stats_t;
+
+/// Heap tier which allocates memory with the PRIMARY heap capabilities,
+/// falling back to the FALLBACK capabilities (when non-zero) if that fails.
+///
+/// Each instantiation keeps its own usage statistics.
+template <uint32_t PRIMARY, uint32_t FALLBACK = 0>
+class HeapTier
+{
+public:
+    /// Allocates memory from this tier.
+    ///
+    /// @param size is the number of bytes to allocate.
+    /// @param alignment is the required alignment of the memory.
+    ///
+    /// @return pointer to the allocated memory or nullptr if no memory with
+    /// the required capabilities is available.
+    static void *allocate(size_t size, size_t alignment = 4)
+    {
+        void *p = heap_alloc(size, alignment, PRIMARY);
+        if (p == nullptr && FALLBACK)
+        {
+            p = heap_alloc(size, alignment, FALLBACK);
+            if (p)
+            {
+                fallbacks_++;
+            }
+        }
+        if (p == nullptr)
+        {
+            failures_++;
+            return nullptr;
+        }
+        allocations_++;
+        size_t in_use = bytes_in_use_ += size;
+        size_t peak = peak_bytes_;
+        while (in_use > peak &&
+               !peak_bytes_.compare_exchange_weak(peak, in_use))
+        {
+        }
+        return p;
+    }
+
+    /// Releases memory allocated by @ref allocate.
+    ///
+    /// @param p is the memory to release, nullptr is ignored.
+    /// @param size is the number of bytes passed to @ref allocate.
+    static void deallocate(void *p, size_t size)
+    {
+        if (p)
+        {
+            heap_caps_free(p);
+            frees_++;
+            bytes_in_use_ -= size;
+        }
+    }
+
+    /// Retrieves the usage statistics of this tier.
+    ///
+    /// @param stats will receive the usage statistics.
+    static void get_stats(esp_heap_tier_stats_t *stats)
+    {
+        stats->allocations = allocations_;
+        stats->frees = frees_;
+        stats->failures = failures_;
+        stats->fallbacks = fallbacks_;
+        stats->bytes_in_use = bytes_in_use_;
+        stats->peak_bytes = peak_bytes_;
+    }
+
+private:
+    /// Allocates memory from the heap.
+    ///
+    /// @param size is the number of bytes to allocate.
+    /// @param alignment is the required alignment of the memory.
+    /// @param caps is the heap capabilities to use.
+    ///
+    /// @return pointer to the allocated memory or nullptr.
+    static void *heap_alloc(size_t size, size_t alignment, uint32_t caps)
+    {
+        // the heap always returns memory aligned to at least four bytes.
+        return alignment <= 4 ? heap_caps_malloc(size, caps)
+                              : heap_caps_aligned_alloc(alignment, size, caps);
+    }
+
+    /// Number of successful allocations.
+    static inline std::atomic<uint32_t> allocations_{0};
+
+    /// Number of released allocations.
+    static inline std::atomic<uint32_t> frees_{0};
+
+    /// Number of failed allocations.
+    static inline std::atomic<uint32_t> failures_{0};
+
+    /// Number of allocations satisfied by the fallback capabilities.
+    static inline std::atomic<uint32_t> fallbacks_{0};
+
+    /// Number of bytes currently allocated.
+    static inline std::atomic<size_t> bytes_in_use_{0};
+
+    /// Largest value of @ref bytes_in_use_.
+    static inline std::atomic<size_t> peak_bytes_{0};
+};
+
+/// Internal memory which can be accessed by the DMA, used for buffers which
+/// are handed to the USB peripheral.
+using InternalDMAHeap = HeapTier<MALLOC_CAP_INTERNAL | MALLOC_CAP_DMA>;
+
+/// Internal memory, used for frequently accessed data which should not be
+/// subject to the PSRAM access latency.
+using InternalHeap = HeapTier<MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT>;
+
+#if CONFIG_SPIRAM
+/// PSRAM when available, otherwise the default heap. Used for large and
+/// infrequently accessed data.
+using PSRAMHeap = HeapTier<MALLOC_CAP_SPIRAM, MALLOC_CAP_DEFAULT>;
+#else
+/// PSRAM when available, otherwise the default heap. Used for large and
+/// infrequently accessed data.
+using PSRAMHeap = HeapTier<MALLOC_CAP_DEFAULT>;
+#endif // CONFIG_SPIRAM
+
+/// STL compatible allocator which provides memory from a @ref HeapTier.
+template <class T, class Tier>
+class CapsAllocator
+{
+public:
+    using value_type = T;
+
+    CapsAllocator() noexcept
+    {
+    }
+
+    template <class U> constexpr CapsAllocator(const CapsAllocator<U, Tier>&) noexcept
+    {
+    }
+
+    [[nodiscard]] value_type* allocate(std::size_t n)
+    {
+        auto p = static_cast<value_type*>(Tier::allocate(n * sizeof(value_type)));
+        if (p)
+        {
+            return p;
+        }
+
+#if __cpp_exceptions
+        throw std::bad_alloc();
+#else
+        abort();
+#endif // __cpp_exceptions
+    }
+
+    void deallocate(value_type* p, std::size_t n) noexcept
+    {
+        Tier::deallocate(p, n * sizeof(value_type));
+    }
+};
+template <class T, class U, class Tier>
+bool operator==(const CapsAllocator<T, Tier>&, const CapsAllocator<U, Tier>&)
+{
+    return true;
+}
+template <class T, class U, class Tier>
+bool operator!=(const CapsAllocator<T, Tier>& x, const CapsAllocator<U, Tier>& y)
+{
+    return !(x == y);
+}
+
+/// Allocator providing internal DMA capable memory.
+template <class T>
+using InternalDMAAllocator = CapsAllocator<T, InternalDMAHeap>;
+
+/// Allocator providing internal memory.
+template <class T>
+using InternalAllocator = CapsAllocator<T, InternalHeap>;
+
+/// Allocator providing memory from PSRAM, falling back to the default heap.
+template <class T>
+using PSRAMAllocator = CapsAllocator<T, PSRAMHeap>;
@@ -0,0 +1,370 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file caps_memory_resource.h
+/// This file declares memory resources (std::pmr::memory_resource) backed by
+/// the heap capabilities allocator:
+///
+/// - @ref CapsResource allocates directly from the heap, trying a list of
+///   heap capabilities in order.
+/// - @ref HeapTierResource allocates from one of the heap tiers declared in
+///   caps_allocator.h so the memory is included in the tier statistics.
+/// - @ref MonotonicArenaResource hands out memory from large chunks which are
+///   only released when the arena is released, deallocation is a no-op.
+/// - @ref PoolResource keeps free lists of small fixed size blocks carved from
+///   larger chunks.
+/// - @ref NullResource fails every allocation, it is used as the upstream of
+///   resources which must only use their static buffer.
+///
+/// Each resource tracks its usage, including the number of allocations it
+/// made from its upstream resource (or the heap).
+///
+/// NOTE: The resources are not thread safe, the caller must ensure a resource
+/// is only used by one task at a time.
+
+#pragma once
+
+#include <esp_heap_caps.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "caps_allocator.h"
+#include "sdkconfig.h"
+
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+
+/// Base class of all memory resources.
+using memory_resource_t = std::pmr::memory_resource;
+#else
+// GCC 8 (ESP-IDF v4.4) only provides the Library Fundamentals TS version.
+#include <experimental/memory_resource>
+
+/// Base class of all memory resources.
+using memory_resource_t = std::experimental::pmr::memory_resource;
+#endif
+
+/// Usage statistics of a memory resource.
+typedef struct
+{
+    /// Number of successful allocations.
+    uint32_t allocations;
+
+    /// Number of deallocations.
+    uint32_t deallocations;
+
+    /// Number of allocations which could not be satisfied, a failure of an
+    /// upstream resource is only counted by the upstream resource.
+    uint32_t failures;
+
+    /// Number of allocations satisfied by a fallback heap capability, only
+    /// used by @ref CapsResource.
+    uint32_t fallbacks;
+
+    /// Number of allocations made from the upstream resource (or the heap).
+    uint32_t upstream_allocations;
+
+    /// Number of bytes currently allocated by users of the resource.
+    size_t bytes_in_use;
+
+    /// Largest value of bytes_in_use.
+    size_t peak_bytes;
+} esp_memory_resource_stats_t;
+
+/// Base class for the memory resources which tracks usage statistics.
+class AccountingResource : public memory_resource_t
+{
+public:
+    /// Retrieves the usage statistics of this resource.
+    ///
+    /// @param stats will receive the usage statistics.
+    void get_stats(esp_memory_resource_stats_t *stats) const;
+
+protected:
+    /// Records a successful allocation.
+    ///
+    /// @param bytes is the number of bytes allocated.
+    void record_allocation(size_t bytes);
+
+    /// Records a deallocation.
+    ///
+    /// @param bytes is the number of bytes released.
+    void record_deallocation(size_t bytes);
+
+    /// Records a failed allocation.
+    void record_failure()
+    {
+        stats_.failures++;
+    }
+
+    /// Records an allocation from the upstream resource (or the heap).
+    void record_upstream_allocation()
+    {
+        stats_.upstream_allocations++;
+    }
+
+    /// Compares two resources, resources are only equal to themselves.
+    bool do_is_equal(const memory_resource_t &other) const noexcept override
+    {
+        return this == &other;
+    }
+
+    /// Usage statistics of this resource.
+    esp_memory_resource_stats_t stats_{};
+};
+
+/// Memory resource which allocates from the heap, the heap capabilities are
+/// tried in the order provided.
+class CapsResource : public AccountingResource
+{
+public:
+    /// Constructor.
+    ///
+    /// @param caps is the preferred heap capabilities.
+    /// @param fallback_caps is used when no memory with @param caps is
+    /// available, zero for none.
+    CapsResource(uint32_t caps, uint32_t fallback_caps = 0)
+        : caps_{caps, fallback_caps}
+    {
+    }
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+
+private:
+    /// Heap capabilities to try, in order.
+    const uint32_t caps_[2];
+};
+
+/// Memory resource which allocates from a @ref HeapTier, the allocations are
+/// counted both by this resource and by the tier.
+template <class Tier>
+class HeapTierResource : public AccountingResource
+{
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        void *p = Tier::allocate(bytes, alignment);
+        if (p == nullptr)
+        {
+            record_failure();
+#if __cpp_exceptions
+            throw std::bad_alloc();
+#else
+            abort();
+#endif // __cpp_exceptions
+        }
+        record_upstream_allocation();
+        record_allocation(bytes);
+        return p;
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override
+    {
+        Tier::deallocate(p, bytes);
+        record_deallocation(bytes);
+    }
+};
+
+/// Memory resource which fails every allocation.
+class NullResource : public AccountingResource
+{
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+};
+
+/// Memory resource which serves allocations from large chunks of memory
+/// obtained from an upstream resource. Deallocation does nothing, all memory
+/// is returned to the upstream resource by @ref release.
+///
+/// This is intended for data which is created once and lives until the
+/// application restarts, many small allocations only require a single
+/// upstream allocation when the initial size covers them.
+class MonotonicArenaResource : public AccountingResource
+{
+public:
+    /// Constructor.
+    ///
+    /// @param initial_size is the size of the first chunk to allocate, each
+    /// further chunk is twice the size of the previous one.
+    /// @param upstream is the resource to allocate chunks from.
+    ///
+    /// NOTE: No memory is allocated until the first allocation request.
+    MonotonicArenaResource(size_t initial_size, memory_resource_t *upstream)
+        : next_chunk_size_(initial_size), initial_chunk_size_(initial_size),
+          upstream_(upstream)
+    {
+    }
+
+    /// Constructor.
+    ///
+    /// @param buffer is used for allocations before any chunk is allocated
+    /// from @param upstream, it is not released by @ref release.
+    /// @param size is the size of @param buffer in bytes.
+    /// @param upstream is the resource to allocate chunks from once
+    /// @param buffer is exhausted.
+    MonotonicArenaResource(void *buffer, size_t size,
+                           memory_resource_t *upstream)
+        : current_(static_cast<uint8_t *>(buffer)), available_(size),
+          next_chunk_size_(size * 2), initial_chunk_size_(size * 2),
+          upstream_(upstream),
+          buffer_(static_cast<uint8_t *>(buffer)), buffer_size_(size)
+    {
+    }
+
+    /// Destructor, releases all chunks.
+    ~MonotonicArenaResource();
+
+    /// Returns all chunks to the upstream resource, all memory handed out by
+    /// this resource becomes invalid.
+    void release();
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+
+private:
+    /// Header of a chunk obtained from the upstream resource.
+    typedef struct chunk
+    {
+        /// Previously allocated chunk.
+        struct chunk *next;
+
+        /// Size of the chunk, including this header.
+        size_t size;
+    } chunk_t;
+
+    /// Most recently allocated chunk.
+    chunk_t *chunks_{nullptr};
+
+    /// Next free byte in the most recent chunk.
+    uint8_t *current_{nullptr};
+
+    /// Number of free bytes at @ref current_.
+    size_t available_{0};
+
+    /// Size of the next chunk to allocate.
+    size_t next_chunk_size_;
+
+    /// Size of the first chunk, @ref next_chunk_size_ is reset to this by
+    /// @ref release.
+    const size_t initial_chunk_size_;
+
+    /// Resource the chunks are allocated from.
+    memory_resource_t *upstream_;
+
+    /// Buffer provided to the constructor, used before any chunk.
+    uint8_t *const buffer_{nullptr};
+
+    /// Size of @ref buffer_.
+    const size_t buffer_size_{0};
+};
+
+/// Memory resource which keeps free lists of small blocks (up to
+/// @ref MAX_BLOCK_SIZE bytes) in power of two size classes. Blocks are carved
+/// from chunks obtained from an upstream resource and are reused once
+/// released, larger allocations are passed to the upstream resource.
+class PoolResource : public AccountingResource
+{
+public:
+    /// Largest allocation served from the free lists.
+    static constexpr size_t MAX_BLOCK_SIZE = 256;
+
+    /// Constructor.
+    ///
+    /// @param upstream is the resource to allocate chunks from.
+    /// @param chunk_size is the size of the chunks to allocate, this is
+    /// increased when it can not hold at least one block of
+    /// @ref MAX_BLOCK_SIZE bytes.
+    PoolResource(memory_resource_t *upstream, size_t chunk_size = 1024)
+        : chunk_size_(chunk_size < sizeof(chunk_t) + MAX_BLOCK_SIZE ?
+                      sizeof(chunk_t) + MAX_BLOCK_SIZE : chunk_size),
+          upstream_(upstream)
+    {
+    }
+
+    /// Destructor, releases all chunks.
+    ~PoolResource();
+
+    /// Returns all chunks to the upstream resource, all blocks handed out by
+    /// this resource become invalid. Allocations larger than
+    /// @ref MAX_BLOCK_SIZE were made from the upstream resource and must
+    /// still be deallocated individually.
+    void release();
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+
+private:
+    /// Smallest block size, blocks are aligned to this size.
+    static constexpr size_t MIN_BLOCK_SIZE = 8;
+
+    /// Number of block size classes (8 to @ref MAX_BLOCK_SIZE bytes).
+    static constexpr size_t SIZE_CLASS_COUNT = 6;
+
+    /// Free block, the link is stored in the block itself.
+    typedef struct block
+    {
+        /// Next free block of the same size class.
+        struct block *next;
+    } block_t;
+
+    /// Chunk obtained from the upstream resource.
+    typedef struct chunk
+    {
+        /// Previously allocated chunk.
+        struct chunk *next;
+
+        /// Alignment padding so the blocks after the header are aligned.
+        uint32_t padding;
+    } chunk_t;
+
+    /// Calculates the size class for an allocation.
+    ///
+    /// @param bytes is the requested size.
+    ///
+    /// @return index into @ref free_lists_.
+    static size_t size_class(size_t bytes);
+
+    /// Tracks if an allocation is passed to the upstream resource.
+    ///
+    /// @param bytes is the requested size.
+    /// @param alignment is the requested alignment.
+    static bool is_large(size_t bytes, size_t alignment)
+    {
+        return bytes > MAX_BLOCK_SIZE || alignment > MIN_BLOCK_SIZE;
+    }
+
+    /// Free blocks for each size class.
+    block_t *free_lists_[SIZE_CLASS_COUNT]{};
+
+    /// All chunks allocated from the upstream resource.
+    chunk_t *chunks_{nullptr};
+
+    /// Number of outstanding allocations passed to the upstream resource,
+    /// these are not released by @ref release.
+    uint32_t large_allocations_{0};
+
+    /// Number of bytes in @ref large_allocations_.
+    size_t large_bytes_{0};
+
+    /// Size of the chunks allocated from the upstream resource.
+    const size_t chunk_size_;
+
+    /// Resource the chunks are allocated from.
+    memory_resource_t *upstream_;
+};
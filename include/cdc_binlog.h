@@ -0,0 +1,124 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file cdc_binlog.h
+/// This file declares a deferred (binary) logging transport over the USB CDC.
+///
+/// Rather than formatting log messages on the device, each log call sends the
+/// address of the format string, a timestamp and the raw arguments. The
+/// format strings are resolved from the application ELF file on the host by
+/// tools/binlog_decode.py.
+///
+/// Each record is encoded as follows (all fields are little-endian):
+///
+/// | offset  | size    | description                                     |
+/// |---------|---------|-------------------------------------------------|
+/// | 0       | 1       | @ref BINLOG_RECORD_MARKER                       |
+/// | 1       | 1       | total record length, including marker and CRC   |
+/// | 2       | 1       | number of arguments (0-@ref BINLOG_MAX_ARGS)    |
+/// | 3       | 4       | address of the format string                    |
+/// | 7       | 4       | lower 32 bits of esp_timer_get_time()           |
+/// | 11      | 4 * N   | arguments, each extended to 32 bits             |
+/// | 11 + 4N | 2       | CRC-16 (esp_rom_crc16_le) of all prior bytes    |
+///
+/// The length and CRC allow the host to find record boundaries without
+/// relying on the format string address, the marker byte can also appear in
+/// arguments or in text written via write_to_cdc.
+///
+/// Arguments must be integers, enums or pointers of 32 bits or less. The "%s"
+/// format specifier is only supported for strings which are stored in flash
+/// (string literals or const data) since only the address is sent.
+
+#pragma once
+
+#include "sdkconfig.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+
+/// Marker byte which starts every binary log record.
+static constexpr uint8_t BINLOG_RECORD_MARKER = 0xB1;
+
+/// Maximum number of arguments per binary log record.
+static constexpr size_t BINLOG_MAX_ARGS = 8;
+
+/// Size of the binary log record header.
+static constexpr size_t BINLOG_HEADER_SIZE = 11;
+
+/// Size of the CRC which ends every binary log record.
+static constexpr size_t BINLOG_CRC_SIZE = 2;
+
+/// Sends a binary log record to the USB CDC.
+///
+/// @param fmt is the format string for the record, this must be stored in
+/// flash (typically a string literal).
+/// @param args are the arguments for the record.
+/// @param argc is the number of arguments.
+///
+/// NOTE: This should not be called directly, use @ref USB_BINLOG instead.
+/// This must not be called from an ISR. Records are dropped if the CDC is not
+/// connected, the TX buffer is full or another task is writing a record at
+/// the same time.
+void binlog_write(const char *fmt, const uint32_t *args, size_t argc);
+
+/// @return the number of binary log records which have been dropped.
+uint32_t binlog_dropped_count();
+
+/// Converts a binary log argument to its 32-bit wire representation.
+///
+/// @param value is the argument to convert.
+///
+/// @return the argument as a 32-bit value.
+template <typename T>
+inline uint32_t binlog_arg(T value)
+{
+    static_assert(std::is_integral<T>::value || std::is_enum<T>::value ||
+                  std::is_pointer<T>::value,
+                  "binary log arguments must be integers, enums or pointers");
+    static_assert(sizeof(T) <= sizeof(uint32_t),
+                  "binary log arguments must be 32 bits or smaller");
+    if constexpr (std::is_pointer<T>::value)
+    {
+        return (uint32_t)reinterpret_cast<uintptr_t>(value);
+    }
+    else
+    {
+        return (uint32_t)value;
+    }
+}
+
+/// Collects the arguments for a binary log record and sends it.
+///
+/// @param fmt is the format string for the record.
+/// @param args are the arguments for the record.
+template <typename... Args>
+inline void binlog_record(const char *fmt, Args... args)
+{
+    static_assert(sizeof...(Args) <= BINLOG_MAX_ARGS,
+                  "too many arguments for binary log record");
+    // one extra entry avoids a zero length array when there are no args.
+    const uint32_t words[sizeof...(Args) + 1] = {binlog_arg(args)...};
+    binlog_write(fmt, words, sizeof...(Args));
+}
+
+#if CONFIG_ESPUSB_CDC_BINLOG
+/// Sends a binary log record to the USB CDC.
+///
+/// @param fmt is a printf style format string literal.
+#define USB_BINLOG(fmt, ...) binlog_record(fmt, ##__VA_ARGS__)
+#else
+#define USB_BINLOG(fmt, ...) do {} while (0)
+#endif // CONFIG_ESPUSB_CDC_BINLOG
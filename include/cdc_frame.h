@@ -0,0 +1,200 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file cdc_frame.h
+/// This file declares a framed packet protocol on top of the USB CDC.
+///
+/// Each frame is the payload followed by the CRC-32 (IEEE 802.3, as used by
+/// zlib) of the payload in little-endian format. The result is COBS encoded
+/// and terminated by a single zero byte. tools/cdc_frame.py provides the host
+/// side implementation.
+
+#pragma once
+
+#include "sdkconfig.h"
+
+#include <endian.h>
+#include <esp_rom_crc.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/// Size of the CRC appended to each frame.
+static constexpr size_t CDC_FRAME_CRC_SIZE = sizeof(uint32_t);
+
+/// Calculates the worst case encoded size of a frame.
+///
+/// @param size is the size of the payload.
+///
+/// @return the maximum number of bytes the encoded frame can occupy including
+/// the CRC, COBS overhead and frame delimiter.
+static constexpr size_t cdc_frame_encoded_size(size_t size)
+{
+    return (size + CDC_FRAME_CRC_SIZE) +
+           ((size + CDC_FRAME_CRC_SIZE) / 254) + 1 + 1;
+}
+
+/// Sends a frame to the USB CDC if there is a device connected.
+///
+/// @param buf is the payload to send.
+/// @param size is the size of the payload.
+///
+/// @return true if the frame was queued, false if the host is not connected
+/// or the TX buffer did not have space for the frame before the write
+/// timeout.
+///
+/// NOTE: The payload is encoded directly into the CDC TX buffer, no copy of
+/// the payload is made. A frame is only started when the TX buffer can hold
+/// the worst case encoded size. Frames from multiple tasks will not be
+/// interleaved but data written via @ref write_to_cdc may be, when that uses
+/// up the space the frame waits for the host to drain the TX buffer. A frame
+/// which could not be completed before the write timeout is terminated early
+/// (the host discards it due to the CRC mismatch) and false is returned.
+bool write_frame_to_cdc(const void *buf, size_t size);
+
+/// Callback for frames received from the USB CDC.
+///
+/// @param data is the payload of the frame (without CRC).
+/// @param size is the size of the payload.
+///
+/// NOTE: This is called from the USB task and @param data is only valid
+/// until this callback returns. The default implementation discards the
+/// frame.
+void cdc_frame_received_cb(const uint8_t *data, size_t size);
+
+/// @return the number of received frames which were discarded due to a CRC
+/// error, invalid encoding or exceeding CONFIG_ESPUSB_CDC_FRAME_MAX_SIZE.
+uint32_t cdc_frame_rx_errors();
+
+/// Streaming COBS frame decoder.
+///
+/// Bytes are decoded into a fixed buffer as they arrive so no intermediate
+/// copy of the encoded data is required. Once the frame delimiter is received
+/// and the CRC has been verified the payload is delivered in place.
+///
+/// @param MAX_FRAME_SIZE is the largest payload that can be received.
+template <size_t MAX_FRAME_SIZE>
+class CobsFrameDecoder
+{
+public:
+    /// Decodes received data.
+    ///
+    /// @param buf is the received (encoded) data.
+    /// @param size is the number of bytes received.
+    /// @param frame_cb is invoked with (const uint8_t *data, size_t size) for
+    /// each complete and valid frame.
+    template <typename F>
+    void feed(const uint8_t *buf, size_t size, F frame_cb)
+    {
+        for (size_t index = 0; index < size; index++)
+        {
+            uint8_t ch = buf[index];
+            if (ch == 0)
+            {
+                finish(frame_cb);
+            }
+            else if (remaining_ == 0)
+            {
+                // start of a new block, the previous block ended with an
+                // implied zero unless it was a full (0xFF) block.
+                if (pending_zero_)
+                {
+                    append(0);
+                }
+                remaining_ = ch - 1;
+                pending_zero_ = (ch != 0xFF);
+            }
+            else
+            {
+                append(ch);
+                remaining_--;
+            }
+        }
+    }
+
+    /// @return the number of frames which have been discarded.
+    uint32_t errors() const
+    {
+        return errors_;
+    }
+
+private:
+    /// Size of the decode buffer.
+    static constexpr size_t BUFFER_SIZE = MAX_FRAME_SIZE + CDC_FRAME_CRC_SIZE;
+
+    /// Decoded data for the current frame.
+    uint8_t buffer_[BUFFER_SIZE];
+
+    /// Number of bytes used in @ref buffer_.
+    size_t len_{0};
+
+    /// Number of data bytes remaining in the current COBS block.
+    uint8_t remaining_{0};
+
+    /// Tracks if a zero must be inserted before the next COBS block.
+    bool pending_zero_{false};
+
+    /// Tracks if the current frame has exceeded @ref BUFFER_SIZE.
+    bool overflow_{false};
+
+    /// Number of frames which have been discarded.
+    uint32_t errors_{0};
+
+    /// Adds a decoded byte to the current frame.
+    ///
+    /// @param ch is the byte to add.
+    void append(uint8_t ch)
+    {
+        if (len_ < BUFFER_SIZE)
+        {
+            buffer_[len_++] = ch;
+        }
+        else
+        {
+            overflow_ = true;
+        }
+    }
+
+    /// Handles a frame delimiter.
+    ///
+    /// @param frame_cb is invoked when the frame is valid.
+    template <typename F>
+    void finish(F frame_cb)
+    {
+        // consecutive delimiters are used by the host to resynchronize.
+        bool empty = (len_ == 0 && !pending_zero_ && remaining_ == 0);
+        bool valid = !overflow_ && remaining_ == 0 &&
+                     len_ >= CDC_FRAME_CRC_SIZE;
+        if (valid)
+        {
+            size_t payload = len_ - CDC_FRAME_CRC_SIZE;
+            uint32_t crc;
+            memcpy(&crc, buffer_ + payload, sizeof(crc));
+            valid = (le32toh(crc) == esp_rom_crc32_le(0, buffer_, payload));
+            if (valid)
+            {
+                frame_cb(buffer_, payload);
+            }
+        }
+        if (!valid && !empty)
+        {
+            errors_++;
+        }
+        len_ = 0;
+        remaining_ = 0;
+        pending_zero_ = false;
+        overflow_ = false;
+    }
+};
@@ -0,0 +1,115 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file latency_histogram.h
+/// This file declares a fixed size histogram which can be used to estimate
+/// latency percentiles without any dynamic memory usage.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/// Histogram of microsecond samples using power of two buckets.
+///
+/// Bucket zero holds samples of 0us, bucket N holds samples in the range of
+/// [2^(N-1), 2^N) microseconds. Percentiles are reported as the upper bound
+/// of the bucket which contains the requested sample.
+class LatencyHistogram
+{
+public:
+    /// Number of buckets in the histogram, the last bucket is used for any
+    /// sample of 2^(BUCKET_COUNT-2) microseconds or more (~4 seconds).
+    static constexpr size_t BUCKET_COUNT = 24;
+
+    /// Adds a sample to the histogram.
+    ///
+    /// @param usec is the sample value in microseconds.
+    void add(uint32_t usec)
+    {
+        size_t index = usec ? (32 - __builtin_clz(usec)) : 0;
+        if (index >= BUCKET_COUNT)
+        {
+            index = BUCKET_COUNT - 1;
+        }
+        buckets_[index]++;
+        count_++;
+        if (usec > max_)
+        {
+            max_ = usec;
+        }
+    }
+
+    /// Estimates a percentile from the collected samples.
+    ///
+    /// @param pct is the percentile to estimate (1-100).
+    ///
+    /// @return upper bound (in microseconds) of the bucket holding the
+    /// requested percentile, or zero if no samples have been collected.
+    uint32_t percentile(uint8_t pct) const
+    {
+        if (count_ == 0)
+        {
+            return 0;
+        }
+        uint64_t target = (((uint64_t)count_ * pct) + 99) / 100;
+        uint64_t seen = 0;
+        for (size_t index = 0; index < BUCKET_COUNT; index++)
+        {
+            seen += buckets_[index];
+            if (seen >= target)
+            {
+                if (index == 0)
+                {
+                    return 0;
+                }
+                uint32_t upper = (1UL << index) - 1;
+                return upper < max_ ? upper : max_;
+            }
+        }
+        return max_;
+    }
+
+    /// @return the number of samples collected.
+    uint32_t count() const
+    {
+        return count_;
+    }
+
+    /// @return the largest sample collected.
+    uint32_t max() const
+    {
+        return max_;
+    }
+
+    /// Discards all collected samples.
+    void reset()
+    {
+        memset(buckets_, 0, sizeof(buckets_));
+        count_ = 0;
+        max_ = 0;
+    }
+
+private:
+    /// Sample counts per bucket.
+    uint32_t buckets_[BUCKET_COUNT] = {0};
+
+    /// Total number of samples collected.
+    uint32_t count_{0};
+
+    /// Largest sample collected.
+    uint32_t max_{0};
+};
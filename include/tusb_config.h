@@ -73,6 +73,42 @@ extern "C"
 #define CONFIG_ESPUSB_HID 0
 #endif
 
+#ifndef CONFIG_ESPUSB_HID_KEYBOARD
+#define CONFIG_ESPUSB_HID_KEYBOARD 0
+#endif
+
+#ifndef CONFIG_ESPUSB_HID_KEYBOARD_NKRO
+#define CONFIG_ESPUSB_HID_KEYBOARD_NKRO 0
+#endif
+
+#ifndef CONFIG_ESPUSB_HID_RAW
+#define CONFIG_ESPUSB_HID_RAW 0
+#endif
+
+#ifndef CONFIG_ESPUSB_HID_RAW_POLL_INTERVAL
+#define CONFIG_ESPUSB_HID_RAW_POLL_INTERVAL 1
+#endif
+
+#ifndef CONFIG_ESPUSB_HID_RAW_TX_QUEUE_DEPTH
+#define CONFIG_ESPUSB_HID_RAW_TX_QUEUE_DEPTH 8
+#endif
+
+#ifndef CONFIG_ESPUSB_HID_MOUSE
+#define CONFIG_ESPUSB_HID_MOUSE 0
+#endif
+
+#ifndef CONFIG_ESPUSB_HID_CONSUMER
+#define CONFIG_ESPUSB_HID_CONSUMER 0
+#endif
+
+#ifndef CONFIG_ESPUSB_HID_GAMEPAD
+#define CONFIG_ESPUSB_HID_GAMEPAD 0
+#endif
+
+#ifndef CONFIG_ESPUSB_HID_SHARED_INTERFACE
+#define CONFIG_ESPUSB_HID_SHARED_INTERFACE 0
+#endif
+
 #ifndef CONFIG_ESPUSB_MIDI
 #define CONFIG_ESPUSB_MIDI 0
 #endif
@@ -97,14 +133,62 @@ extern "C"
 #define CONFIG_ESPUSB_CDC_TX_BUFSIZE 64
 #endif
 
+#ifndef CONFIG_ESPUSB_CDC_EP_BUFSIZE
+#define CONFIG_ESPUSB_CDC_EP_BUFSIZE 64
+#endif
+
 #ifndef CONFIG_ESPUSB_MSC_BUFSIZE
 #define CONFIG_ESPUSB_MSC_BUFSIZE 512
 #endif
 
+#ifndef CONFIG_ESPUSB_MSC_VDISK_IMAGE
+#define CONFIG_ESPUSB_MSC_VDISK_IMAGE 0
+#endif
+
+#ifndef CONFIG_ESPUSB_MSC_PARTITION_MMAP
+#define CONFIG_ESPUSB_MSC_PARTITION_MMAP 0
+#endif
+
+#ifndef CONFIG_ESPUSB_MSC_PARTITION_MMAP_WINDOW
+#define CONFIG_ESPUSB_MSC_PARTITION_MMAP_WINDOW 256
+#endif
+
 #ifndef CONFIG_ESPUSB_HID_BUFSIZE
 #define CONFIG_ESPUSB_HID_BUFSIZE 16
 #endif
 
+#ifndef CONFIG_ESPUSB_HID_POLL_INTERVAL
+#define CONFIG_ESPUSB_HID_POLL_INTERVAL 10
+#endif
+
+#ifndef CONFIG_ESPUSB_VENDOR_STREAMING
+#define CONFIG_ESPUSB_VENDOR_STREAMING 0
+#endif
+
+#ifndef CONFIG_ESPUSB_VENDOR_XFER_QUEUE_DEPTH
+#define CONFIG_ESPUSB_VENDOR_XFER_QUEUE_DEPTH 4
+#endif
+
+#ifndef CONFIG_ESPUSB_VENDOR_OTA
+#define CONFIG_ESPUSB_VENDOR_OTA 0
+#endif
+
+#ifndef CONFIG_ESPUSB_VENDOR_WINUSB
+#define CONFIG_ESPUSB_VENDOR_WINUSB 0
+#endif
+
+#ifndef CONFIG_ESPUSB_VENDOR_WINUSB_GUID
+#define CONFIG_ESPUSB_VENDOR_WINUSB_GUID "{975F44D9-0D08-43FD-8B3E-127CA8AFFF9D}"
+#endif
+
+#ifndef CONFIG_ESPUSB_VENDOR_WEBUSB
+#define CONFIG_ESPUSB_VENDOR_WEBUSB 0
+#endif
+
+#ifndef CONFIG_ESPUSB_VENDOR_WEBUSB_URL
+#define CONFIG_ESPUSB_VENDOR_WEBUSB_URL ""
+#endif
+
 #ifndef CONFIG_ESPUSB_VENDOR_RX_BUFSIZE
 #define CONFIG_ESPUSB_VENDOR_RX_BUFSIZE 64
 #endif
@@ -121,6 +205,50 @@ extern "C"
 #define CONFIG_ESPUSB_MIDI_TX_BUFSIZE 64
 #endif
 
+#ifndef CONFIG_ESPUSB_MIDI_RX_QUEUE_DEPTH
+#define CONFIG_ESPUSB_MIDI_RX_QUEUE_DEPTH 64
+#endif
+
+#ifndef CONFIG_ESPUSB_TX_FIFO_PLAN
+#define CONFIG_ESPUSB_TX_FIFO_PLAN 0
+#endif
+
+#ifndef CONFIG_ESPUSB_CDC_TX_FIFO_PACKETS
+#define CONFIG_ESPUSB_CDC_TX_FIFO_PACKETS 2
+#endif
+
+#ifndef CONFIG_ESPUSB_MSC_TX_FIFO_PACKETS
+#define CONFIG_ESPUSB_MSC_TX_FIFO_PACKETS 4
+#endif
+
+#ifndef CONFIG_ESPUSB_VENDOR_TX_FIFO_PACKETS
+#define CONFIG_ESPUSB_VENDOR_TX_FIFO_PACKETS 4
+#endif
+
+#ifndef CONFIG_ESPUSB_MIDI_TX_FIFO_PACKETS
+#define CONFIG_ESPUSB_MIDI_TX_FIFO_PACKETS 1
+#endif
+
+#ifndef CONFIG_ESPUSB_DCD_DMA
+#define CONFIG_ESPUSB_DCD_DMA 0
+#endif
+
+#ifndef CONFIG_ESPUSB_DCD_DMA_BOUNCE_SIZE
+#define CONFIG_ESPUSB_DCD_DMA_BOUNCE_SIZE 512
+#endif
+
+#ifndef CONFIG_ESPUSB_STATIC_ALLOCATION
+#define CONFIG_ESPUSB_STATIC_ALLOCATION 0
+#endif
+
+#ifndef CONFIG_ESPUSB_STATIC_DESCRIPTOR_LEN
+#define CONFIG_ESPUSB_STATIC_DESCRIPTOR_LEN 32
+#endif
+
+#ifndef CONFIG_ESPUSB_HEAP_GUARD
+#define CONFIG_ESPUSB_HEAP_GUARD 0
+#endif
+
 #ifndef CONFIG_ESPUSB_DFU_BUFSIZE
 #define CONFIG_ESPUSB_DFU_BUFSIZE 1024
 #endif
@@ -130,9 +258,19 @@ extern "C"
 //--------------------------------------------------------------------
 #define CFG_TUD_CDC CONFIG_ESPUSB_CDC
 #define CFG_TUD_MSC CONFIG_ESPUSB_MSC
-#define CFG_TUD_HID CONFIG_ESPUSB_HID
+// NOTE: Each enabled HID report type uses a separate HID interface unless
+// they share a single interface, the raw interface is always separate.
+#if CONFIG_ESPUSB_HID_SHARED_INTERFACE
+#define CFG_TUD_HID (CONFIG_ESPUSB_HID * (1 + CONFIG_ESPUSB_HID_RAW))
+#else
+#define CFG_TUD_HID (CONFIG_ESPUSB_HID * \
+                     (CONFIG_ESPUSB_HID_KEYBOARD + CONFIG_ESPUSB_HID_MOUSE + \
+                      CONFIG_ESPUSB_HID_CONSUMER + CONFIG_ESPUSB_HID_GAMEPAD + \
+                      CONFIG_ESPUSB_HID_RAW))
+#endif // CONFIG_ESPUSB_HID_SHARED_INTERFACE
 #define CFG_TUD_MIDI CONFIG_ESPUSB_MIDI
-#define CFG_TUD_VENDOR CONFIG_ESPUSB_VENDOR
+// NOTE: The streaming API replaces the TinyUSB vendor driver.
+#define CFG_TUD_VENDOR (CONFIG_ESPUSB_VENDOR && !CONFIG_ESPUSB_VENDOR_STREAMING)
 #define CFG_TUD_CUSTOM_CLASS CONFIG_ESPUSB_CUSTOM_CLASS
 #define CFG_TUD_DFU_RT CONFIG_ESPUSB_DFU
 
@@ -141,6 +279,7 @@ extern "C"
 //--------------------------------------------------------------------
 #define CFG_TUD_CDC_RX_BUFSIZE CONFIG_ESPUSB_CDC_RX_BUFSIZE
 #define CFG_TUD_CDC_TX_BUFSIZE CONFIG_ESPUSB_CDC_TX_BUFSIZE
+#define CFG_TUD_CDC_EP_BUFSIZE CONFIG_ESPUSB_CDC_EP_BUFSIZE
 
 //--------------------------------------------------------------------
 // MSC BUFFER CONFIGURATION
@@ -62,15 +62,58 @@ typedef enum
 } esp_usb_descriptor_index_t;
 
 /// USB HID device report types.
+///
+/// NOTE: Each report type is presented to the host as a separate HID interface
+/// with a dedicated IN endpoint, the reports do not carry a report ID. With
+/// CONFIG_ESPUSB_HID_SHARED_INTERFACE all report types use a single interface
+/// and these values are used as the report ID.
 typedef enum
 {
     /// The reported event is from a keyboard.
     REPORT_ID_KEYBOARD = 1,
 
     /// The reported event is from a mouse.
-    REPORT_ID_MOUSE
+    REPORT_ID_MOUSE,
+
+    /// The reported event is from a consumer control (media keys).
+    REPORT_ID_CONSUMER_CONTROL,
+
+    /// The reported event is from a gamepad.
+    REPORT_ID_GAMEPAD,
+
+    /// This is used internally and will be ignored by callers if used.
+    REPORT_ID_MAX_COUNT
 } esp_usb_hid_report_t;
 
+/// USB HID interface instances, one for each enabled report type or a single
+/// one shared by all report types.
+///
+/// NOTE: This is used internally and the order must match the order of the HID
+/// interfaces in the configuration descriptor.
+typedef enum
+{
+#if CONFIG_ESPUSB_HID_SHARED_INTERFACE
+    HID_INSTANCE_SHARED,
+#else
+#if CONFIG_ESPUSB_HID_KEYBOARD
+    HID_INSTANCE_KEYBOARD,
+#endif
+#if CONFIG_ESPUSB_HID_MOUSE
+    HID_INSTANCE_MOUSE,
+#endif
+#if CONFIG_ESPUSB_HID_CONSUMER
+    HID_INSTANCE_CONSUMER,
+#endif
+#if CONFIG_ESPUSB_HID_GAMEPAD
+    HID_INSTANCE_GAMEPAD,
+#endif
+#endif // CONFIG_ESPUSB_HID_SHARED_INTERFACE
+#if CONFIG_ESPUSB_HID_RAW
+    HID_INSTANCE_RAW,
+#endif
+    HID_INSTANCE_COUNT
+} esp_usb_hid_instance_t;
+
 /// USB CDC line state.
 typedef enum
 {
@@ -101,7 +144,12 @@ typedef enum
 
     /// This state is used by the usb shutdown hook to trigger a restart into
     /// DFU download mode.
-    LINE_STATE_REQUEST_DOWNLOAD_DFU
+    LINE_STATE_REQUEST_DOWNLOAD_DFU,
+
+    /// This state is used when the esptool download request sequence has been
+    /// handled by the in-application flasher (CONFIG_ESPUSB_CDC_FLASHER)
+    /// instead of restarting into the ROM download mode.
+    LINE_STATE_FLASHING
 } esp_line_state_t;
 
 /// Initializes the USB peripheral and prepares the default descriptors.
@@ -121,8 +169,519 @@ void start_usb_task();
 /// @param size is the size of the buffer.
 ///
 /// @return the number of bytes transmitted.
+///
+/// NOTE: When CONFIG_ESPUSB_CDC_BULK_MODE is enabled only complete packets
+/// will be queued until the last part of the buffer, which is then flushed.
+///
+/// NOTE: When CONFIG_ESPUSB_CDC_FLUSH_COALESCE is enabled the data may be held
+/// in the TX buffer for up to CONFIG_ESPUSB_CDC_FLUSH_COALESCE_US before it is
+/// sent to the host, use @ref flush_cdc to send it immediately.
+///
+/// NOTE: When a diagnostic mode or CONFIG_ESPUSB_CDC_UART_BRIDGE is enabled no
+/// data will be sent.
 size_t write_to_cdc(const char *buf, size_t size);
 
+/// Flushes any data pending in the USB CDC TX buffer to the host.
+void flush_cdc();
+
+/// USB CDC transmit statistics.
+typedef struct
+{
+    /// Number of calls to @ref write_to_cdc which queued data.
+    uint32_t writes;
+
+    /// Number of bytes queued via @ref write_to_cdc.
+    uint32_t bytes;
+
+    /// Number of flushes which started a new transfer.
+    uint32_t flushes;
+
+    /// Number of completed IN transfers.
+    uint32_t transfers;
+
+    /// Number of packets sent, including zero length packets. A transfer is
+    /// sent as several packets when CONFIG_ESPUSB_CDC_EP_BUFSIZE is larger
+    /// than one packet.
+    uint32_t packets;
+
+    /// Number of packets sent per KiB of data queued, 16 when all packets
+    /// are full.
+    uint32_t packets_per_kib;
+
+    /// Per-write latency (write to flush) percentiles in microseconds.
+    uint32_t latency_p50_us;
+    uint32_t latency_p90_us;
+    uint32_t latency_p99_us;
+    uint32_t latency_max_us;
+
+    /// Smoothed time the host takes to collect a transfer in microseconds.
+    uint32_t host_poll_us;
+} esp_usb_cdc_stats_t;
+
+/// Retrieves the USB CDC transmit statistics.
+///
+/// @param stats will be populated with the current statistics.
+///
+/// NOTE: This requires CONFIG_ESPUSB_CDC_STATS to be enabled, otherwise all
+/// statistics will be reported as zero.
+void get_cdc_stats(esp_usb_cdc_stats_t *stats);
+
+/// Resets the USB CDC transmit statistics.
+void reset_cdc_stats();
+
+/// USB CDC diagnostic mode statistics.
+typedef struct
+{
+    /// Number of bytes received from the host.
+    uint32_t rx_bytes;
+
+    /// Number of bytes sent to the host.
+    uint32_t tx_bytes;
+
+    /// Number of counter values received which did not match the expected
+    /// value (sink mode only).
+    uint32_t errors;
+
+    /// Number of counter values missing from the received data (sink mode) or
+    /// echo records which could not be sent due to the TX buffer being full
+    /// (echo mode).
+    uint32_t dropped;
+} esp_usb_cdc_diag_stats_t;
+
+/// Retrieves the USB CDC diagnostic mode statistics.
+///
+/// @param stats will be populated with the current statistics.
+///
+/// NOTE: All statistics will be zero unless a diagnostic mode has been
+/// selected via CONFIG_ESPUSB_CDC_DIAG_MODE.
+void get_cdc_diag_stats(esp_usb_cdc_diag_stats_t *stats);
+
+#if CONFIG_ESPUSB_HID
+/// Queues a HID keyboard report.
+///
+/// @param modifier is the bitmask of active modifier keys.
+/// @param keycode is the list of up to six pressed keys.
+///
+/// @return true if the report was queued, false if the USB device is not
+/// mounted.
+///
+/// NOTE: Only the newest keyboard state is kept while the HID endpoint is
+/// busy, a pending state which is replaced by a different state before it
+/// could be sent is counted as dropped.
+bool send_hid_keyboard_report(uint8_t modifier, const uint8_t keycode[6]);
+
+/// Number of keycodes (starting from zero) which can be reported via the
+/// N-key rollover keyboard report.
+static constexpr size_t HID_NKRO_KEY_COUNT = 128;
+
+/// N-key rollover keyboard report, each bit of @ref keys represents the
+/// keycode matching its bit position.
+typedef struct TU_ATTR_PACKED
+{
+    /// Bitmask of active modifier keys.
+    uint8_t modifier;
+
+    /// Bitmap of pressed keys.
+    uint8_t keys[HID_NKRO_KEY_COUNT / 8];
+} hid_nkro_keyboard_report_t;
+
+/// Queues a HID keyboard report with any number of pressed keys.
+///
+/// @param modifier is the bitmask of active modifier keys.
+/// @param keycodes is the list of pressed keys.
+/// @param count is the number of entries in @param keycodes.
+///
+/// @return true if the report was queued, false if the USB device is not
+/// mounted.
+///
+/// NOTE: All keys are only reported when CONFIG_ESPUSB_HID_KEYBOARD_NKRO is
+/// enabled and the host uses the report protocol, otherwise only the first
+/// six keys are reported. Keycodes of @ref HID_NKRO_KEY_COUNT or higher are
+/// ignored in N-key rollover mode.
+bool send_hid_keyboard_keys(uint8_t modifier, const uint8_t *keycodes,
+                            size_t count);
+
+/// Types an ASCII string via the HID keyboard.
+///
+/// @param str is the string to type.
+/// @param timeout_ms is the maximum time to wait for the host to collect each
+/// report.
+///
+/// @return the number of characters typed.
+///
+/// NOTE: This blocks until the string has been typed. Each character is sent
+/// as a single report which keeps the previous key held while the next key is
+/// pressed, a release report is only needed for repeated keys and when the
+/// shift state changes. Characters which have no keyboard mapping are
+/// skipped. Calls from different tasks are serialized, a string is typed
+/// completely before the next one starts.
+size_t send_hid_keyboard_string(const char *str, uint32_t timeout_ms = 1000);
+
+/// Queues a HID mouse report.
+///
+/// @param buttons is the bitmask of pressed buttons.
+/// @param x is the horizontal movement.
+/// @param y is the vertical movement.
+/// @param vertical is the vertical scroll wheel movement.
+/// @param horizontal is the horizontal scroll wheel (pan) movement.
+///
+/// @return true if the report was queued, false if the USB device is not
+/// mounted.
+///
+/// NOTE: Movement is accumulated while the HID endpoint is busy and sent with
+/// the next report, movement larger than a single report can carry is split
+/// across multiple reports so no movement is lost.
+bool send_hid_mouse_report(uint8_t buttons, int16_t x, int16_t y,
+                           int16_t vertical = 0, int16_t horizontal = 0);
+
+/// Queues a HID consumer control report.
+///
+/// @param usage is the consumer control usage code, zero for release.
+///
+/// @return true if the report was queued, false if the USB device is not
+/// mounted.
+bool send_hid_consumer_report(uint16_t usage);
+
+/// Queues a HID gamepad report.
+///
+/// @param report is the gamepad state.
+///
+/// @return true if the report was queued, false if the USB device is not
+/// mounted.
+///
+/// NOTE: Only the newest gamepad state is kept while the HID endpoint is
+/// busy.
+bool send_hid_gamepad_report(const hid_gamepad_report_t *report);
+
+/// HID report queue statistics.
+typedef struct
+{
+    /// Number of reports queued by the application.
+    uint32_t queued;
+
+    /// Number of reports sent to the host.
+    uint32_t sent;
+
+    /// Number of reports which were combined with a pending report.
+    uint32_t merged;
+
+    /// Number of pending states which were replaced before they could be sent
+    /// (button or key transitions the host did not see).
+    uint32_t dropped;
+
+    /// Input latency (report queued until collected by the host) percentiles
+    /// in microseconds.
+    uint32_t latency_p50_us;
+    uint32_t latency_p90_us;
+    uint32_t latency_p99_us;
+    uint32_t latency_max_us;
+
+    /// Endpoint latency (report submitted until collected by the host)
+    /// percentiles in microseconds, this is bounded by
+    /// CONFIG_ESPUSB_HID_POLL_INTERVAL.
+    uint32_t endpoint_p50_us;
+    uint32_t endpoint_p99_us;
+    uint32_t endpoint_max_us;
+} esp_usb_hid_report_stats_t;
+
+/// Retrieves the HID report queue statistics.
+///
+/// @param report is the report type to retrieve statistics for.
+/// @param stats will be populated with the current statistics.
+///
+/// NOTE: The latency statistics require CONFIG_ESPUSB_HID_LATENCY_STATS to be
+/// enabled, otherwise they will be reported as zero.
+void get_hid_report_stats(esp_usb_hid_report_t report,
+                          esp_usb_hid_report_stats_t *stats);
+
+/// Resets the HID report queue statistics.
+void reset_hid_report_stats();
+
+/// Callback for HID SET_REPORT requests and OUT reports received from the
+/// host.
+///
+/// @param instance is the HID interface instance the report was sent to.
+/// @param report_id is the report ID from the request, zero for OUT reports.
+/// @param report_type is the report type from the request.
+/// @param buffer is the received report.
+/// @param bufsize is the size of the received report.
+///
+/// NOTE: This is called from the USB task and must not block, the default
+/// implementation discards the report. Reports for the raw HID interface are
+/// delivered to @ref hid_raw_report_received_cb instead, this replaces
+/// overriding tud_hid_set_report_cb which is implemented by this library.
+void hid_set_report_cb(uint8_t instance, uint8_t report_id,
+                       hid_report_type_t report_type, const uint8_t *buffer,
+                       uint16_t bufsize);
+
+#if CONFIG_ESPUSB_HID_RAW
+/// Size of the raw HID IN and OUT reports.
+static constexpr size_t HID_RAW_REPORT_SIZE = 64;
+
+/// Queues a raw HID IN report.
+///
+/// @param data is the report to send.
+/// @param size is the size of the report, up to @ref HID_RAW_REPORT_SIZE
+/// bytes. Shorter reports are padded with zeros.
+/// @param timeout_ms is the maximum time to wait for space in the queue.
+///
+/// @return true if the report was queued, false if the USB device is not
+/// mounted, the report is too large or the queue remained full.
+///
+/// NOTE: Queued reports are submitted from the completion of the previous
+/// report so one report is sent on every host poll while the queue is not
+/// empty.
+bool send_hid_raw_report(const void *data, size_t size,
+                         uint32_t timeout_ms = 0);
+
+/// Callback for raw HID OUT reports received from the host.
+///
+/// @param data is the received report.
+/// @param size is the size of the received report.
+///
+/// NOTE: This is called from the USB task and must not block, @param data is
+/// only valid until this callback returns. The default implementation
+/// discards the report. This is not called when CONFIG_ESPUSB_HID_RAW_ECHO
+/// is enabled.
+void hid_raw_report_received_cb(const uint8_t *data, size_t size);
+
+/// Raw HID transfer statistics.
+typedef struct
+{
+    /// Number of IN reports sent to the host.
+    uint32_t tx_reports;
+
+    /// Number of IN reports which could not be queued.
+    uint32_t tx_dropped;
+
+    /// Number of times a report was not moved to the endpoint immediately
+    /// because another context was submitting, the report stays queued and
+    /// is submitted by that context.
+    uint32_t tx_submit_busy;
+
+    /// Number of IN reports waiting in the queue.
+    uint32_t tx_queued;
+
+    /// Number of OUT reports received from the host.
+    uint32_t rx_reports;
+} esp_usb_hid_raw_stats_t;
+
+/// Retrieves the raw HID transfer statistics.
+///
+/// @param stats will be populated with the current statistics.
+void get_hid_raw_stats(esp_usb_hid_raw_stats_t *stats);
+#endif // CONFIG_ESPUSB_HID_RAW
+#endif // CONFIG_ESPUSB_HID
+
+#if CONFIG_ESPUSB_VENDOR_STREAMING
+/// Callback invoked when a vendor interface request completes.
+///
+/// @param buf is the buffer passed to @ref queue_vendor_write or
+/// @ref queue_vendor_read.
+/// @param size is the number of bytes transferred.
+/// @param arg is the argument passed when the request was queued.
+///
+/// NOTE: This is called from the USB task and must not block, it is safe to
+/// queue a new request from the callback.
+typedef void (*vendor_xfer_cb_t)(void *buf, size_t size, void *arg);
+
+/// Queues a buffer to be sent to the host via the vendor interface.
+///
+/// @param buf is the data to send, this must remain valid until @param cb is
+/// invoked.
+/// @param size is the number of bytes to send.
+/// @param cb is invoked when the data has been sent, this can be nullptr.
+/// @param arg is passed to @param cb.
+///
+/// @return true if the request was queued, false if the vendor interface is
+/// not configured by the host or CONFIG_ESPUSB_VENDOR_XFER_QUEUE_DEPTH
+/// requests are already queued.
+///
+/// NOTE: The buffer is transferred directly by the USB endpoint without being
+/// copied into a FIFO. Queued requests are sent back to back without a zero
+/// length packet between them. With CONFIG_ESPUSB_DCD_DMA the buffer should be
+/// allocated from @ref InternalDMAHeap (see caps_allocator.h), other buffers
+/// are copied through a bounce buffer.
+bool queue_vendor_write(const void *buf, size_t size, vendor_xfer_cb_t cb,
+                        void *arg = nullptr);
+
+/// Queues a buffer to receive data from the host via the vendor interface.
+///
+/// @param buf is the buffer to receive into, this must remain valid until
+/// @param cb is invoked.
+/// @param size is the size of @param buf.
+/// @param cb is invoked when the buffer has been filled or the host ended the
+/// transfer with a short packet.
+/// @param arg is passed to @param cb.
+///
+/// @return true if the request was queued, false if the vendor interface is
+/// not configured by the host or CONFIG_ESPUSB_VENDOR_XFER_QUEUE_DEPTH
+/// requests are already queued.
+///
+/// NOTE: Pending requests are completed with the number of bytes transferred
+/// so far when the host resets the device. With CONFIG_ESPUSB_DCD_DMA the
+/// buffer is only filled directly when it is allocated from
+/// @ref InternalDMAHeap and @param size is a multiple of 64 bytes.
+bool queue_vendor_read(void *buf, size_t size, vendor_xfer_cb_t cb,
+                       void *arg = nullptr);
+
+/// Vendor interface transfer statistics.
+typedef struct
+{
+    /// Number of bytes sent to the host.
+    uint32_t tx_bytes;
+
+    /// Number of completed write requests.
+    uint32_t tx_requests;
+
+    /// Number of bytes received from the host.
+    uint32_t rx_bytes;
+
+    /// Number of completed read requests.
+    uint32_t rx_requests;
+
+    /// Number of counter values received which did not match the expected
+    /// value (sink diagnostic mode only).
+    uint32_t errors;
+} esp_usb_vendor_stats_t;
+
+/// Retrieves the vendor interface transfer statistics.
+///
+/// @param stats will be populated with the current statistics.
+void get_vendor_stats(esp_usb_vendor_stats_t *stats);
+
+#if CONFIG_ESPUSB_VENDOR_OTA
+/// Callback for firmware update progress over the vendor interface.
+///
+/// @param written is the number of image bytes written so far.
+/// @param total is the size of the image being received.
+///
+/// NOTE: This is called from the update task after each block has been
+/// written. The default implementation logs the progress in 10% steps.
+void vendor_ota_progress_cb(size_t written, size_t total);
+
+/// Callback for a completed firmware update over the vendor interface.
+///
+/// NOTE: This is called from the update task once the image has been verified
+/// and selected for the next boot. The default implementation restarts the
+/// device, when overridden the application is responsible for restarting.
+void vendor_ota_complete_cb();
+#endif // CONFIG_ESPUSB_VENDOR_OTA
+#endif // CONFIG_ESPUSB_VENDOR_STREAMING
+
+#if CONFIG_ESPUSB_MIDI
+/// USB-MIDI event packet, see the USB Device Class Definition for MIDI
+/// Devices section 4.
+typedef struct
+{
+    /// Cable number (upper four bits) and Code Index Number (lower four
+    /// bits).
+    uint8_t header;
+
+    /// MIDI bytes carried by the packet, unused bytes are zero.
+    uint8_t data[3];
+} esp_usb_midi_packet_t;
+
+/// MIDI event received from the host.
+typedef struct
+{
+    /// Time (esp_timer_get_time) at which the USB transfer carrying the event
+    /// was received.
+    int64_t timestamp_us;
+
+    /// Virtual cable the event was received on.
+    uint8_t cable;
+
+    /// Number of valid bytes in @ref data.
+    uint8_t size;
+
+    /// MIDI bytes of the event, System Exclusive messages are delivered as a
+    /// series of events carrying up to three bytes each (the first starting
+    /// with 0xF0 and the last ending with 0xF7).
+    uint8_t data[3];
+} esp_usb_midi_event_t;
+
+/// MIDI transfer statistics.
+typedef struct
+{
+    /// Number of event packets sent to the host.
+    uint32_t tx_packets;
+
+    /// Number of event packets which could not be sent before the timeout.
+    uint32_t tx_dropped;
+
+    /// Number of event packets received from the host.
+    uint32_t rx_packets;
+
+    /// Number of received events dropped due to the receive queue being full.
+    uint32_t rx_dropped;
+} esp_usb_midi_stats_t;
+
+/// Sends a MIDI channel voice, system common or real-time message.
+///
+/// @param cable is the virtual cable number (0-15).
+/// @param msg is the complete message, including the status byte.
+/// @param size is the number of bytes in @param msg, this must match the
+/// message type.
+/// @param timeout_ms is the maximum time to wait for space in the MIDI TX
+/// buffer.
+///
+/// @return true if the message was queued for transmission.
+///
+/// NOTE: When the IN endpoint is idle the message is sent immediately,
+/// otherwise it is sent together with up to 15 other queued packets when the
+/// host collects the previous transfer. Use @ref send_midi_sysex for System
+/// Exclusive messages.
+bool send_midi_message(uint8_t cable, const uint8_t *msg, size_t size,
+                       uint32_t timeout_ms = 0);
+
+/// Sends pre-built USB-MIDI event packets.
+///
+/// @param packets are the packets to send.
+/// @param count is the number of packets in @param packets.
+/// @param timeout_ms is the maximum time to wait for space in the MIDI TX
+/// buffer.
+///
+/// @return the number of packets queued for transmission.
+///
+/// NOTE: The packets are queued as a batch so they are sent in as few bulk
+/// transfers (16 packets each) as possible.
+size_t send_midi_packets(const esp_usb_midi_packet_t *packets, size_t count,
+                         uint32_t timeout_ms = 0);
+
+/// Sends part of a System Exclusive message.
+///
+/// @param cable is the virtual cable number (0-15).
+/// @param data is the next part of the message, the first part must start
+/// with 0xF0 and the final part must end with 0xF7.
+/// @param size is the number of bytes in @param data.
+/// @param timeout_ms is the maximum time to wait for space in the MIDI TX
+/// buffer.
+///
+/// @return the number of bytes consumed from @param data, this is less than
+/// @param size when the timeout expired. Only bytes which were sent (or are
+/// held back as described below) are consumed, the message can be continued
+/// by passing the remaining bytes to a later call.
+///
+/// NOTE: Large dumps can be sent in parts of any size, at most two bytes per
+/// cable are held back until a complete event packet can be built.
+size_t send_midi_sysex(uint8_t cable, const uint8_t *data, size_t size,
+                       uint32_t timeout_ms = 0);
+
+/// Retrieves the next MIDI event received from the host.
+///
+/// @param event will be populated with the received event.
+/// @param timeout_ms is the maximum time to wait for an event.
+///
+/// @return true if @param event was populated.
+bool receive_midi_event(esp_usb_midi_event_t *event, uint32_t timeout_ms = 0);
+
+/// Retrieves the MIDI transfer statistics.
+///
+/// @param stats will be populated with the current statistics.
+void get_midi_stats(esp_usb_midi_stats_t *stats);
+#endif // CONFIG_ESPUSB_MIDI
+
 /// Configures the USB descriptor.
 ///
 /// @param desc when not null will replace the default descriptor.
@@ -167,6 +726,17 @@ void request_dfu_mode();
 bool usb_line_state_changed_cb(esp_line_state_t status,
                                bool download_mode_requested);
 
+/// Callback for data received on the USB CDC for application code.
+///
+/// @param itf is the CDC interface which received the data.
+///
+/// NOTE: When CONFIG_ESPUSB_CDC_FLASHER is enabled the library defines
+/// tud_cdc_rx_cb itself and the application must not define it. This is
+/// invoked from the USB task instead while no flashing session is active and
+/// the data can be read via tud_cdc_read. The default implementation leaves
+/// the data in the RX buffer.
+void cdc_app_rx_cb(uint8_t itf);
+
 /// Configures a 4MB virtual disk.
 ///
 /// @param label will be used as the disk label that may be displayed by the
@@ -233,4 +803,46 @@ bool ota_update_start_cb(esp_app_desc_t *app_desc);
 ///
 /// @param received_bytes is the number of bytes received as part of the update.
 /// @param err is the status of the OTA update.
-void ota_update_end_cb(size_t received_bytes, esp_err_t err);
\ No newline at end of file
+void ota_update_end_cb(size_t received_bytes, esp_err_t err);
+
+/// Virtual disk partition read statistics.
+typedef struct
+{
+    /// Number of reads copied from a memory mapped partition window.
+    uint32_t mapped_reads;
+
+    /// Number of bytes copied from a memory mapped partition window.
+    uint32_t mapped_bytes;
+
+    /// Time spent on reads from a memory mapped window (microseconds),
+    /// including moving the window.
+    uint32_t mapped_us;
+
+    /// Number of reads using esp_partition_read.
+    uint32_t flash_reads;
+
+    /// Number of bytes read using esp_partition_read.
+    uint32_t flash_bytes;
+
+    /// Time spent in esp_partition_read (microseconds).
+    uint32_t flash_us;
+
+    /// Number of times a memory mapped window was created.
+    uint32_t window_maps;
+
+    /// Number of times a window could not be mapped, these reads use
+    /// esp_partition_read.
+    uint32_t map_failures;
+} esp_usb_msc_read_stats_t;
+
+/// Retrieves the virtual disk partition read statistics.
+///
+/// @param stats will be populated with the current statistics.
+///
+/// NOTE: Comparing bytes per microsecond of the two read paths gives the
+/// time the USB task spends on each sector, tools/msc_bench.py can be used to
+/// measure the throughput seen by the host.
+void get_msc_read_stats(esp_usb_msc_read_stats_t *stats);
+
+/// Resets the virtual disk partition read statistics.
+void reset_msc_read_stats();
\ No newline at end of file
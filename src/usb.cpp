@@ -29,6 +29,7 @@
 #include <driver/periph_ctrl.h>
 #include <esp_idf_version.h>
 #include <esp_log.h>
+#include <esp_rom_sys.h>
 #include <esp_task.h>
 #if CONFIG_IDF_TARGET_ESP32S2
 #include <esp32s2/rom/gpio.h>
@@ -47,6 +48,8 @@
 #include <soc/gpio_periph.h>
 #include <soc/rtc_cntl_reg.h>
 #include <soc/usb_periph.h>
+#include <soc/usb_reg.h>
+#include <soc/usb_struct.h>
 #include <soc/usb_wrap_struct.h>
 #include <string>
 #include "usb.h"
@@ -54,6 +57,33 @@
 static constexpr const char * const TAG = "USB";
 
 void init_usb_cdc();
+#if CONFIG_ESPUSB_HID_KEYBOARD
+void init_usb_hid_keyboard();
+#endif // CONFIG_ESPUSB_HID_KEYBOARD
+#if CONFIG_ESPUSB_HID_RAW
+void init_usb_hid_raw();
+#endif // CONFIG_ESPUSB_HID_RAW
+#if CONFIG_ESPUSB_HID_LATENCY_PROBE
+void init_usb_hid_latency_probe();
+#endif // CONFIG_ESPUSB_HID_LATENCY_PROBE
+
+/// Tracks if the BOS descriptor is provided to the host.
+#define USB_BOS_ENABLED \
+    (CONFIG_ESPUSB_VENDOR && \
+     (CONFIG_ESPUSB_VENDOR_WINUSB || CONFIG_ESPUSB_VENDOR_WEBUSB))
+
+#if CONFIG_ESPUSB_MIDI
+void init_usb_midi();
+#endif // CONFIG_ESPUSB_MIDI
+#if CONFIG_ESPUSB_VENDOR_OTA
+void init_usb_vendor_ota();
+#endif // CONFIG_ESPUSB_VENDOR_OTA
+
+static void assign_usb_endpoints();
+
+#if USB_BOS_ENABLED
+static void init_usb_bos_descriptors();
+#endif // USB_BOS_ENABLED
 
 void init_usb_subsystem(bool external_phy)
 {
@@ -113,9 +143,29 @@ void init_usb_subsystem(bool external_phy)
         }
     }
 
+    assign_usb_endpoints();
+
 #if CONFIG_ESPUSB_CDC
     init_usb_cdc();
 #endif
+#if CONFIG_ESPUSB_HID_KEYBOARD
+    init_usb_hid_keyboard();
+#endif // CONFIG_ESPUSB_HID_KEYBOARD
+#if CONFIG_ESPUSB_HID_RAW
+    init_usb_hid_raw();
+#endif // CONFIG_ESPUSB_HID_RAW
+#if CONFIG_ESPUSB_HID_LATENCY_PROBE
+    init_usb_hid_latency_probe();
+#endif // CONFIG_ESPUSB_HID_LATENCY_PROBE
+#if CONFIG_ESPUSB_MIDI
+    init_usb_midi();
+#endif // CONFIG_ESPUSB_MIDI
+#if CONFIG_ESPUSB_VENDOR_OTA
+    init_usb_vendor_ota();
+#endif // CONFIG_ESPUSB_VENDOR_OTA
+#if USB_BOS_ENABLED
+    init_usb_bos_descriptors();
+#endif // USB_BOS_ENABLED
 
     ESP_LOGI(TAG, "USB system initialized");
 }
@@ -141,18 +191,124 @@ static void usb_device_task(void *param)
 static_assert(CONFIG_ESPUSB_TASK_PRIORITY > ESP_TASK_MAIN_PRIO,
               "EspUSB task must have a higher priority than the app_main task.");
 
+/// Stack of the USB task.
+static StackType_t s_usb_task_stack[CONFIG_ESPUSB_TASK_STACK_SIZE];
+
+/// Storage for the USB task.
+static StaticTask_t s_usb_task_storage;
+
+#if CONFIG_ESPUSB_HEAP_GUARD
+/// USB task, the heap allocation functions abort when called by this task.
+static TaskHandle_t s_usb_task = nullptr;
+
+/// Nesting depth of @ref usb_heap_guard_suspend, the USB task may use the
+/// heap while this is non-zero. This is only modified by the USB task.
+static uint32_t s_usb_heap_guard_suspended = 0;
+
+// Allows heap usage by the USB task until usb_heap_guard_resume is called.
+void usb_heap_guard_suspend()
+{
+    s_usb_heap_guard_suspended++;
+}
+
+// Ends a usb_heap_guard_suspend section.
+void usb_heap_guard_resume()
+{
+    s_usb_heap_guard_suspended--;
+}
+
+/// Aborts when called from the USB task.
+///
+/// @param func is the name of the heap allocation function.
+/// @param size is the requested allocation size.
+static void usb_heap_guard(const char *func, size_t size)
+{
+    if (s_usb_task && xTaskGetCurrentTaskHandle() == s_usb_task &&
+        !s_usb_heap_guard_suspended)
+    {
+        // ESP_LOG can not be used as it may allocate from the heap itself.
+        esp_rom_printf("%s(%d) called from the USB task!\n", func,
+                       (int)size);
+        abort();
+    }
+}
+
+extern "C"
+{
+
+// these are provided by the linker due to the --wrap options, see
+// CMakeLists.txt.
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__real_heap_caps_malloc(size_t size, uint32_t caps);
+void *__real_heap_caps_calloc(size_t count, size_t size, uint32_t caps);
+void *__real_heap_caps_realloc(void *ptr, size_t size, uint32_t caps);
+void *__real_heap_caps_aligned_alloc(size_t alignment, size_t size,
+                                     uint32_t caps);
+
+void *__wrap_malloc(size_t size)
+{
+    usb_heap_guard("malloc", size);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    usb_heap_guard("calloc", count * size);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    usb_heap_guard("realloc", size);
+    return __real_realloc(ptr, size);
+}
+
+void *__wrap_heap_caps_malloc(size_t size, uint32_t caps)
+{
+    usb_heap_guard("heap_caps_malloc", size);
+    return __real_heap_caps_malloc(size, caps);
+}
+
+void *__wrap_heap_caps_calloc(size_t count, size_t size, uint32_t caps)
+{
+    usb_heap_guard("heap_caps_calloc", count * size);
+    return __real_heap_caps_calloc(count, size, caps);
+}
+
+void *__wrap_heap_caps_realloc(void *ptr, size_t size, uint32_t caps)
+{
+    usb_heap_guard("heap_caps_realloc", size);
+    return __real_heap_caps_realloc(ptr, size, caps);
+}
+
+void *__wrap_heap_caps_aligned_alloc(size_t alignment, size_t size,
+                                     uint32_t caps)
+{
+    usb_heap_guard("heap_caps_aligned_alloc", size);
+    return __real_heap_caps_aligned_alloc(alignment, size, caps);
+}
+
+} // extern "C"
+#endif // CONFIG_ESPUSB_HEAP_GUARD
+
 void start_usb_task()
 {
-    BaseType_t res =
-        xTaskCreatePinnedToCore(
+    TaskHandle_t task =
+        xTaskCreateStaticPinnedToCore(
             usb_device_task, CONFIG_ESPUSB_TASK_NAME,
             CONFIG_ESPUSB_TASK_STACK_SIZE, nullptr,
-            CONFIG_ESPUSB_TASK_PRIORITY, nullptr, CONFIG_ESPUSB_TASK_AFFINITY);
-    if (res != pdPASS)
+            CONFIG_ESPUSB_TASK_PRIORITY, s_usb_task_stack,
+            &s_usb_task_storage, CONFIG_ESPUSB_TASK_AFFINITY);
+    if (task == nullptr)
     {
         ESP_LOGE(TAG, "Failed to create task for USB.");
         abort();
     }
+#if CONFIG_ESPUSB_HEAP_GUARD
+    s_usb_task = task;
+#endif // CONFIG_ESPUSB_HEAP_GUARD
     ESP_LOGI(TAG, "Created EspUSB task: %s", CONFIG_ESPUSB_TASK_NAME);
 }
 
@@ -167,15 +323,22 @@ void start_usb_task()
 #define USB_DEVICE_PROTOCOL 0x00
 #endif
 
+// The BOS descriptor is only requested by the host for USB 2.1 devices.
+#if USB_BOS_ENABLED
+#define USB_BCD 0x0210
+#else
+#define USB_BCD 0x0200
+#endif // USB_BOS_ENABLED
+
 // Used to generate the USB PID based on enabled interfaces.
-#define _PID_MAP(itf, n)  ((CFG_TUD_##itf) << (n))
+#define _PID_MAP(itf, n)  (((CFG_TUD_##itf) > 0) << (n))
 
 /// USB Device Descriptor.
 static tusb_desc_device_t s_descriptor =
 {
     .bLength            = sizeof(tusb_desc_device_t),
     .bDescriptorType    = TUSB_DESC_DEVICE,
-    .bcdUSB             = 0x0200,
+    .bcdUSB             = USB_BCD,
     .bDeviceClass       = USB_DEVICE_CLASS,
     .bDeviceSubClass    = USB_DEVICE_SUBCLASS,
     .bDeviceProtocol    = USB_DEVICE_PROTOCOL,
@@ -183,7 +346,7 @@ static tusb_desc_device_t s_descriptor =
     .idVendor           = CONFIG_ESPUSB_USB_VENDOR_ID,
     .idProduct          = (0x4000 | _PID_MAP(CDC, 0) | _PID_MAP(MSC, 1) |
                            _PID_MAP(HID, 2) | _PID_MAP(MIDI, 3) |
-                           _PID_MAP(VENDOR, 4) | _PID_MAP(DFU_RT, 5)),
+                           (CONFIG_ESPUSB_VENDOR << 4) | _PID_MAP(DFU_RT, 5)),
     .bcdDevice          = CONFIG_ESPUSB_DESC_BCDDEVICE,
     .iManufacturer      = USB_DESC_MANUFACTURER,
     .iProduct           = USB_DESC_PRODUCT,
@@ -191,53 +354,94 @@ static tusb_desc_device_t s_descriptor =
     .bNumConfigurations = 0x01
 };
 
-/// USB Device Endpoint assignments.
-///
-/// NOTE: The ESP32-S2 has four input FIFOs available, unfortunately this will
-/// result in some overlap between features. The notification endpoint is not
-/// connected to the FIFOs.
+/// Logical USB Device Endpoints.
 ///
-/// @todo switch to dynamic endpoint assignment except for CDC and NOTIF which
-/// require static definitions.
+/// These are placeholder addresses used while building
+/// @ref desc_configuration, they are replaced with the endpoint addresses
+/// assigned by @ref assign_usb_endpoints during initialization.
 typedef enum
 {
-    /// Vendor endpoint.
-    ENDPOINT_VENDOR_OUT = 0x01,
+    /// CDC endpoint.
+    ENDPOINT_CDC_OUT = 0x01,
 
     /// Mass Storage endpoint.
     ENDPOINT_MSC_OUT = 0x02,
 
-    /// CDC endpoint.
-    ///
-    /// NOTE: This matches the ESP32-S2 ROM code mapping.
-    ENDPOINT_CDC_OUT = 0x03,
+    /// Vendor endpoint.
+    ENDPOINT_VENDOR_OUT = 0x03,
 
     /// MIDI endpoint.
     ENDPOINT_MIDI_OUT = 0x04,
 
-    /// HID endpoint.
-    ENDPOINT_HID_IN = 0x81,
+    /// HID raw data endpoint.
+    ENDPOINT_HID_RAW_OUT = 0x05,
+
+    /// CDC endpoint.
+    ENDPOINT_CDC_IN = 0x81,
+
+    /// CDC Notification endpoint.
+    ENDPOINT_NOTIF = 0x82,
 
     /// Mass Storage endpoint.
-    ENDPOINT_MSC_IN = 0x82,
+    ENDPOINT_MSC_IN = 0x83,
 
     /// Vendor endpoint.
-    ENDPOINT_VENDOR_IN = 0x83,
+    ENDPOINT_VENDOR_IN = 0x84,
 
     /// MIDI endpoint.
-    ENDPOINT_MIDI_IN = 0x83,
+    ENDPOINT_MIDI_IN = 0x85,
 
-    /// CDC endpoint.
-    ///
-    /// NOTE: This matches the ESP32-S2 ROM code mapping.
-    ENDPOINT_CDC_IN = 0x84,
-
-    /// Notification endpoint.
-    ///
-    /// NOTE: This matches the ESP32-S2 ROM code mapping.
-    ENDPOINT_NOTIF = 0x85,
+    /// HID raw data endpoint.
+    ENDPOINT_HID_RAW_IN = 0x86,
+
+    /// HID keyboard endpoint.
+    ENDPOINT_HID_KEYBOARD_IN = 0x87,
+
+    /// HID mouse endpoint.
+    ENDPOINT_HID_MOUSE_IN = 0x88,
+
+    /// HID consumer control endpoint.
+    ENDPOINT_HID_CONSUMER_IN = 0x89,
+
+    /// HID gamepad endpoint.
+    ENDPOINT_HID_GAMEPAD_IN = 0x8A,
+
+    /// HID endpoint shared by all report types.
+    ENDPOINT_HID_SHARED_IN = 0x8B,
 } esp_usb_endpoint_t;
 
+/// Highest endpoint number supported by the ESP32-S2/S3.
+static constexpr uint8_t USB_MAX_ENDPOINT_NUM = 6;
+
+/// Number of IN FIFOs available for endpoints other than EP0.
+static constexpr uint8_t USB_IN_FIFO_COUNT = 4;
+
+/// CDC OUT endpoint number, this matches the ESP32-S2 ROM code mapping.
+static constexpr uint8_t CDC_OUT_ENDPOINT_NUM = 3;
+
+/// CDC IN endpoint number, this matches the ESP32-S2 ROM code mapping.
+static constexpr uint8_t CDC_IN_ENDPOINT_NUM = 4;
+
+/// CDC Notification endpoint number, this matches the ESP32-S2 ROM code
+/// mapping.
+///
+/// NOTE: IN endpoint 5 is not connected to a FIFO by the device driver so it
+/// is reserved for the notification endpoint (which does not need one) even
+/// when CDC is disabled.
+static constexpr uint8_t NOTIF_ENDPOINT_NUM = 5;
+
+/// Number of IN endpoints (other than the CDC notification endpoint) used by
+/// the enabled classes, each requires a dedicated IN FIFO.
+static constexpr uint8_t USB_IN_ENDPOINT_COUNT =
+    CONFIG_ESPUSB_CDC + CONFIG_ESPUSB_MSC + CFG_TUD_HID +
+    CONFIG_ESPUSB_VENDOR + CONFIG_ESPUSB_MIDI;
+
+static_assert(USB_IN_ENDPOINT_COUNT <= USB_IN_FIFO_COUNT,
+              "Enabled USB classes require more IN endpoints than the four "
+              "IN FIFOs available, disable some of CDC, MSC, Vendor, MIDI "
+              "or the HID interface types or share one HID interface "
+              "between the report types");
+
 /// USB Interface indexes.
 typedef enum
 {
@@ -248,8 +452,24 @@ typedef enum
 #if CONFIG_ESPUSB_MSC
     ITF_NUM_MSC,
 #endif
-#if CONFIG_ESPUSB_HID
-    ITF_NUM_HID,
+#if CONFIG_ESPUSB_HID_SHARED_INTERFACE
+    ITF_NUM_HID_SHARED,
+#else
+#if CONFIG_ESPUSB_HID_KEYBOARD
+    ITF_NUM_HID_KEYBOARD,
+#endif
+#if CONFIG_ESPUSB_HID_MOUSE
+    ITF_NUM_HID_MOUSE,
+#endif
+#if CONFIG_ESPUSB_HID_CONSUMER
+    ITF_NUM_HID_CONSUMER,
+#endif
+#if CONFIG_ESPUSB_HID_GAMEPAD
+    ITF_NUM_HID_GAMEPAD,
+#endif
+#endif // CONFIG_ESPUSB_HID_SHARED_INTERFACE
+#if CONFIG_ESPUSB_HID_RAW
+    ITF_NUM_HID_RAW,
 #endif
 #if CONFIG_ESPUSB_MIDI
     ITF_NUM_MIDI,
@@ -269,11 +489,14 @@ static constexpr uint16_t USB_DESCRIPTORS_CONFIG_TOTAL_LEN =
     TUD_CONFIG_DESC_LEN +
     (CONFIG_ESPUSB_CDC * TUD_CDC_DESC_LEN) +
     (CONFIG_ESPUSB_MSC * TUD_MSC_DESC_LEN) +
-    (CONFIG_ESPUSB_HID * TUD_HID_DESC_LEN) +
+    ((CFG_TUD_HID - CONFIG_ESPUSB_HID_RAW) * TUD_HID_DESC_LEN) +
+    (CONFIG_ESPUSB_HID_RAW * TUD_HID_INOUT_DESC_LEN) +
     (CONFIG_ESPUSB_VENDOR * TUD_VENDOR_DESC_LEN) +
     (CONFIG_ESPUSB_MIDI * TUD_MIDI_DESC_LEN) +
     (CONFIG_ESPUSB_DFU * TUD_DFU_RT_DESC_LEN);
 
+// Full speed bulk endpoints are limited to 64 byte packets, the depth of the
+// IN FIFOs backing them is configured via the TX FIFO plan instead.
 #if CONFIG_ESPUSB_CDC
 static_assert(CONFIG_ESPUSB_CDC_FIFO_SIZE == 64, "CDC FIFO size must be 64");
 #endif
@@ -289,24 +512,152 @@ static_assert(CONFIG_ESPUSB_MIDI_FIFO_SIZE == 64
 #endif
 
 #if CONFIG_ESPUSB_HID
-// HID Report Descriptor
-static uint8_t const desc_hid_report[] =
+static_assert(HID_INSTANCE_COUNT > 0,
+              "At least one HID interface type must be enabled");
+
+#if CONFIG_ESPUSB_HID_KEYBOARD_NKRO
+/// HID N-key rollover keyboard report descriptor, this matches the layout of
+/// @ref hid_nkro_keyboard_report_t. Additional items (report ID) can be
+/// passed in the same way as for the TinyUSB report descriptor templates.
+#define HID_REPORT_DESC_KEYBOARD(...) \
+    HID_USAGE_PAGE(HID_USAGE_PAGE_DESKTOP), \
+    HID_USAGE(HID_USAGE_DESKTOP_KEYBOARD), \
+    HID_COLLECTION(HID_COLLECTION_APPLICATION), \
+        __VA_ARGS__ \
+        /* 8 bits modifier (left/right ctrl, shift, alt, gui) */ \
+        HID_USAGE_PAGE(HID_USAGE_PAGE_KEYBOARD), \
+            HID_USAGE_MIN(224), \
+            HID_USAGE_MAX(231), \
+            HID_LOGICAL_MIN(0), \
+            HID_LOGICAL_MAX(1), \
+            HID_REPORT_COUNT(8), \
+            HID_REPORT_SIZE(1), \
+            HID_INPUT(HID_DATA | HID_VARIABLE | HID_ABSOLUTE), \
+        /* one bit per keycode */ \
+        HID_USAGE_PAGE(HID_USAGE_PAGE_KEYBOARD), \
+            HID_USAGE_MIN(0), \
+            HID_USAGE_MAX(HID_NKRO_KEY_COUNT - 1), \
+            HID_LOGICAL_MIN(0), \
+            HID_LOGICAL_MAX(1), \
+            HID_REPORT_COUNT(HID_NKRO_KEY_COUNT), \
+            HID_REPORT_SIZE(1), \
+            HID_INPUT(HID_DATA | HID_VARIABLE | HID_ABSOLUTE), \
+        /* 5 bits LED Kana | Compose | ScrollLock | CapsLock | NumLock */ \
+        HID_USAGE_PAGE(HID_USAGE_PAGE_LED), \
+            HID_USAGE_MIN(1), \
+            HID_USAGE_MAX(5), \
+            HID_REPORT_COUNT(5), \
+            HID_REPORT_SIZE(1), \
+            HID_OUTPUT(HID_DATA | HID_VARIABLE | HID_ABSOLUTE), \
+            /* led padding */ \
+            HID_REPORT_COUNT(1), \
+            HID_REPORT_SIZE(3), \
+            HID_OUTPUT(HID_CONSTANT), \
+    HID_COLLECTION_END
+#else
+/// HID keyboard report descriptor.
+#define HID_REPORT_DESC_KEYBOARD(...) TUD_HID_REPORT_DESC_KEYBOARD(__VA_ARGS__)
+#endif // CONFIG_ESPUSB_HID_KEYBOARD_NKRO
+
+#if CONFIG_ESPUSB_HID_SHARED_INTERFACE
+/// HID report descriptor for the interface shared by all report types, each
+/// report type is identified by its @ref esp_usb_hid_report_t report ID.
+static uint8_t const desc_hid_shared_report[] =
+{
+#if CONFIG_ESPUSB_HID_KEYBOARD
+    HID_REPORT_DESC_KEYBOARD(HID_REPORT_ID(REPORT_ID_KEYBOARD)),
+#endif // CONFIG_ESPUSB_HID_KEYBOARD
+#if CONFIG_ESPUSB_HID_MOUSE
+    TUD_HID_REPORT_DESC_MOUSE(HID_REPORT_ID(REPORT_ID_MOUSE)),
+#endif // CONFIG_ESPUSB_HID_MOUSE
+#if CONFIG_ESPUSB_HID_CONSUMER
+    TUD_HID_REPORT_DESC_CONSUMER(HID_REPORT_ID(REPORT_ID_CONSUMER_CONTROL)),
+#endif // CONFIG_ESPUSB_HID_CONSUMER
+#if CONFIG_ESPUSB_HID_GAMEPAD
+    TUD_HID_REPORT_DESC_GAMEPAD(HID_REPORT_ID(REPORT_ID_GAMEPAD)),
+#endif // CONFIG_ESPUSB_HID_GAMEPAD
+};
+#else
+#if CONFIG_ESPUSB_HID_KEYBOARD
+/// HID keyboard report descriptor.
+static uint8_t const desc_hid_keyboard_report[] =
+{
+    HID_REPORT_DESC_KEYBOARD()
+};
+#endif // CONFIG_ESPUSB_HID_KEYBOARD
+
+#if CONFIG_ESPUSB_HID_MOUSE
+/// HID mouse report descriptor.
+static uint8_t const desc_hid_mouse_report[] =
+{
+    TUD_HID_REPORT_DESC_MOUSE()
+};
+#endif // CONFIG_ESPUSB_HID_MOUSE
+
+#if CONFIG_ESPUSB_HID_CONSUMER
+/// HID consumer control report descriptor.
+static uint8_t const desc_hid_consumer_report[] =
 {
-  TUD_HID_REPORT_DESC_KEYBOARD( HID_REPORT_ID(REPORT_ID_KEYBOARD         )),
-  TUD_HID_REPORT_DESC_MOUSE   ( HID_REPORT_ID(REPORT_ID_MOUSE            )),
-  TUD_HID_REPORT_DESC_CONSUMER( HID_REPORT_ID(REPORT_ID_CONSUMER_CONTROL )),
-  TUD_HID_REPORT_DESC_GAMEPAD ( HID_REPORT_ID(REPORT_ID_GAMEPAD          ))
+    TUD_HID_REPORT_DESC_CONSUMER()
 };
+#endif // CONFIG_ESPUSB_HID_CONSUMER
+
+#if CONFIG_ESPUSB_HID_GAMEPAD
+/// HID gamepad report descriptor.
+static uint8_t const desc_hid_gamepad_report[] =
+{
+    TUD_HID_REPORT_DESC_GAMEPAD()
+};
+#endif // CONFIG_ESPUSB_HID_GAMEPAD
+#endif // CONFIG_ESPUSB_HID_SHARED_INTERFACE
+
+#if CONFIG_ESPUSB_HID_RAW
+/// HID raw data report descriptor.
+static uint8_t const desc_hid_raw_report[] =
+{
+    TUD_HID_REPORT_DESC_GENERIC_INOUT(HID_RAW_REPORT_SIZE)
+};
+#endif // CONFIG_ESPUSB_HID_RAW
 
 // Invoked when received GET HID REPORT DESCRIPTOR request
-const uint8_t *tud_hid_descriptor_report_cb(void)
+uint8_t const *tud_hid_descriptor_report_cb(uint8_t instance)
 {
-    return desc_hid_report;
+    switch (instance)
+    {
+#if CONFIG_ESPUSB_HID_SHARED_INTERFACE
+        case HID_INSTANCE_SHARED:
+            return desc_hid_shared_report;
+#else
+#if CONFIG_ESPUSB_HID_KEYBOARD
+        case HID_INSTANCE_KEYBOARD:
+            return desc_hid_keyboard_report;
+#endif // CONFIG_ESPUSB_HID_KEYBOARD
+#if CONFIG_ESPUSB_HID_MOUSE
+        case HID_INSTANCE_MOUSE:
+            return desc_hid_mouse_report;
+#endif // CONFIG_ESPUSB_HID_MOUSE
+#if CONFIG_ESPUSB_HID_CONSUMER
+        case HID_INSTANCE_CONSUMER:
+            return desc_hid_consumer_report;
+#endif // CONFIG_ESPUSB_HID_CONSUMER
+#if CONFIG_ESPUSB_HID_GAMEPAD
+        case HID_INSTANCE_GAMEPAD:
+            return desc_hid_gamepad_report;
+#endif // CONFIG_ESPUSB_HID_GAMEPAD
+#endif // CONFIG_ESPUSB_HID_SHARED_INTERFACE
+#if CONFIG_ESPUSB_HID_RAW
+        case HID_INSTANCE_RAW:
+            return desc_hid_raw_report;
+#endif // CONFIG_ESPUSB_HID_RAW
+    }
+    return nullptr;
 }
 #endif // CONFIG_ESPUSB_HID
 
 /// USB device descriptor configuration data.
-uint8_t const desc_configuration[USB_DESCRIPTORS_CONFIG_TOTAL_LEN] =
+///
+/// NOTE: The endpoint addresses are updated by @ref assign_usb_endpoints.
+static uint8_t desc_configuration[USB_DESCRIPTORS_CONFIG_TOTAL_LEN] =
 {
     TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0,
                           USB_DESCRIPTORS_CONFIG_TOTAL_LEN,
@@ -321,10 +672,46 @@ uint8_t const desc_configuration[USB_DESCRIPTORS_CONFIG_TOTAL_LEN] =
     TUD_MSC_DESCRIPTOR(ITF_NUM_MSC, USB_DESC_MSC, ENDPOINT_MSC_OUT,
                        ENDPOINT_MSC_IN, CONFIG_ESPUSB_MSC_FIFO_SIZE),
 #endif
-#if CONFIG_ESPUSB_HID
-    TUD_HID_DESCRIPTOR(ITF_NUM_HID, USB_DESC_HID, HID_ITF_PROTOCOL_NONE,
-                       sizeof(desc_hid_report), ENDPOINT_HID_IN,
-                       CONFIG_ESPUSB_HID_BUFSIZE, 10),
+#if CONFIG_ESPUSB_HID_SHARED_INTERFACE
+    TUD_HID_DESCRIPTOR(ITF_NUM_HID_SHARED, USB_DESC_HID,
+                       HID_ITF_PROTOCOL_NONE, sizeof(desc_hid_shared_report),
+                       ENDPOINT_HID_SHARED_IN, CONFIG_ESPUSB_HID_BUFSIZE,
+                       CONFIG_ESPUSB_HID_POLL_INTERVAL),
+#else
+#if CONFIG_ESPUSB_HID_KEYBOARD
+    TUD_HID_DESCRIPTOR(ITF_NUM_HID_KEYBOARD, USB_DESC_HID,
+                       HID_ITF_PROTOCOL_KEYBOARD,
+                       sizeof(desc_hid_keyboard_report),
+                       ENDPOINT_HID_KEYBOARD_IN, CONFIG_ESPUSB_HID_BUFSIZE,
+                       CONFIG_ESPUSB_HID_POLL_INTERVAL),
+#endif
+#if CONFIG_ESPUSB_HID_MOUSE
+    TUD_HID_DESCRIPTOR(ITF_NUM_HID_MOUSE, USB_DESC_HID,
+                       HID_ITF_PROTOCOL_MOUSE, sizeof(desc_hid_mouse_report),
+                       ENDPOINT_HID_MOUSE_IN, CONFIG_ESPUSB_HID_BUFSIZE,
+                       CONFIG_ESPUSB_HID_POLL_INTERVAL),
+#endif
+#if CONFIG_ESPUSB_HID_CONSUMER
+    TUD_HID_DESCRIPTOR(ITF_NUM_HID_CONSUMER, USB_DESC_HID,
+                       HID_ITF_PROTOCOL_NONE,
+                       sizeof(desc_hid_consumer_report),
+                       ENDPOINT_HID_CONSUMER_IN, CONFIG_ESPUSB_HID_BUFSIZE,
+                       CONFIG_ESPUSB_HID_POLL_INTERVAL),
+#endif
+#if CONFIG_ESPUSB_HID_GAMEPAD
+    TUD_HID_DESCRIPTOR(ITF_NUM_HID_GAMEPAD, USB_DESC_HID,
+                       HID_ITF_PROTOCOL_NONE, sizeof(desc_hid_gamepad_report),
+                       ENDPOINT_HID_GAMEPAD_IN, CONFIG_ESPUSB_HID_BUFSIZE,
+                       CONFIG_ESPUSB_HID_POLL_INTERVAL),
+#endif
+#endif // CONFIG_ESPUSB_HID_SHARED_INTERFACE
+#if CONFIG_ESPUSB_HID_RAW
+    TUD_HID_INOUT_DESCRIPTOR(ITF_NUM_HID_RAW, USB_DESC_HID,
+                             HID_ITF_PROTOCOL_NONE,
+                             sizeof(desc_hid_raw_report),
+                             ENDPOINT_HID_RAW_OUT, ENDPOINT_HID_RAW_IN,
+                             HID_RAW_REPORT_SIZE,
+                             CONFIG_ESPUSB_HID_RAW_POLL_INTERVAL),
 #endif
 #if CONFIG_ESPUSB_VENDOR
     TUD_VENDOR_DESCRIPTOR(ITF_NUM_VENDOR, USB_DESC_VENDOR, ENDPOINT_VENDOR_OUT,
@@ -341,6 +728,575 @@ uint8_t const desc_configuration[USB_DESCRIPTORS_CONFIG_TOTAL_LEN] =
 #endif
 };
 
+/// Endpoints used by an enabled class.
+typedef struct
+{
+    /// Name used when reporting the assignment.
+    const char *name;
+
+    /// Placeholder IN endpoint address, zero when not used.
+    uint8_t in;
+
+    /// Placeholder OUT endpoint address, zero when not used.
+    uint8_t out;
+
+    /// Fixed IN endpoint number, zero when assigned dynamically.
+    uint8_t fixed_in;
+
+    /// Fixed OUT endpoint number, zero when assigned dynamically.
+    uint8_t fixed_out;
+
+    /// Number of bytes reserved in the IN FIFO, zero when the IN endpoint
+    /// does not use a FIFO.
+    uint16_t tx_fifo_size;
+} esp_usb_endpoint_usage_t;
+
+/// Endpoints used by the enabled classes, dynamically assigned endpoints are
+/// allocated in this order so the high bandwidth (bulk) classes are assigned
+/// first and the interrupt endpoints last.
+static constexpr esp_usb_endpoint_usage_t USB_ENDPOINT_USAGE[] =
+{
+#if CONFIG_ESPUSB_CDC
+    {"CDC", ENDPOINT_CDC_IN, ENDPOINT_CDC_OUT, CDC_IN_ENDPOINT_NUM,
+     CDC_OUT_ENDPOINT_NUM,
+     CONFIG_ESPUSB_CDC_TX_FIFO_PACKETS * CONFIG_ESPUSB_CDC_FIFO_SIZE},
+    {"CDC-NOTIF", ENDPOINT_NOTIF, 0, NOTIF_ENDPOINT_NUM, 0, 0},
+#endif
+#if CONFIG_ESPUSB_MSC
+    {"MSC", ENDPOINT_MSC_IN, ENDPOINT_MSC_OUT, 0, 0,
+     CONFIG_ESPUSB_MSC_TX_FIFO_PACKETS * CONFIG_ESPUSB_MSC_FIFO_SIZE},
+#endif
+#if CONFIG_ESPUSB_VENDOR
+    {"Vendor", ENDPOINT_VENDOR_IN, ENDPOINT_VENDOR_OUT, 0, 0,
+     CONFIG_ESPUSB_VENDOR_TX_FIFO_PACKETS * CONFIG_ESPUSB_VENDOR_FIFO_SIZE},
+#endif
+#if CONFIG_ESPUSB_MIDI
+    {"MIDI", ENDPOINT_MIDI_IN, ENDPOINT_MIDI_OUT, 0, 0,
+     CONFIG_ESPUSB_MIDI_TX_FIFO_PACKETS * CONFIG_ESPUSB_MIDI_FIFO_SIZE},
+#endif
+#if CONFIG_ESPUSB_HID_RAW
+    {"HID-RAW", ENDPOINT_HID_RAW_IN, ENDPOINT_HID_RAW_OUT, 0, 0,
+     HID_RAW_REPORT_SIZE},
+#endif
+#if CONFIG_ESPUSB_HID_SHARED_INTERFACE
+    {"HID", ENDPOINT_HID_SHARED_IN, 0, 0, 0, CONFIG_ESPUSB_HID_BUFSIZE},
+#else
+#if CONFIG_ESPUSB_HID_KEYBOARD
+    {"HID-KEYBOARD", ENDPOINT_HID_KEYBOARD_IN, 0, 0, 0,
+     CONFIG_ESPUSB_HID_BUFSIZE},
+#endif
+#if CONFIG_ESPUSB_HID_MOUSE
+    {"HID-MOUSE", ENDPOINT_HID_MOUSE_IN, 0, 0, 0, CONFIG_ESPUSB_HID_BUFSIZE},
+#endif
+#if CONFIG_ESPUSB_HID_CONSUMER
+    {"HID-CONSUMER", ENDPOINT_HID_CONSUMER_IN, 0, 0, 0,
+     CONFIG_ESPUSB_HID_BUFSIZE},
+#endif
+#if CONFIG_ESPUSB_HID_GAMEPAD
+    {"HID-GAMEPAD", ENDPOINT_HID_GAMEPAD_IN, 0, 0, 0,
+     CONFIG_ESPUSB_HID_BUFSIZE},
+#endif
+#endif // CONFIG_ESPUSB_HID_SHARED_INTERFACE
+    // terminates the list, this also keeps the array non-empty when no
+    // class with endpoints is enabled.
+    {nullptr, 0, 0, 0, 0, 0}
+};
+
+#if CONFIG_ESPUSB_TX_FIFO_PLAN
+/// Size of the USB peripheral FIFO RAM in 32-bit words.
+static constexpr uint16_t USB_FIFO_RAM_WORDS = 256;
+
+/// Size of the receive FIFO in 32-bit words, as configured by the device
+/// driver on bus reset.
+static constexpr uint16_t USB_RX_FIFO_WORDS = 52;
+
+/// Size of the control endpoint IN FIFO in 32-bit words, as configured by
+/// the device driver on bus reset.
+static constexpr uint16_t USB_EP0_TX_FIFO_WORDS = 16;
+
+/// Minimum depth of an IN FIFO in 32-bit words.
+static constexpr uint16_t USB_TX_FIFO_MIN_WORDS = 16;
+
+/// Converts an IN FIFO size in bytes to the FIFO depth in 32-bit words.
+///
+/// @param size is the number of bytes to reserve, zero for none.
+///
+/// @return number of 32-bit words to reserve in the FIFO RAM.
+static constexpr uint16_t usb_tx_fifo_words(uint16_t size)
+{
+    return size == 0 ? 0 :
+           (size + 3) / 4 < USB_TX_FIFO_MIN_WORDS ? USB_TX_FIFO_MIN_WORDS :
+           (size + 3) / 4;
+}
+
+/// Calculates the FIFO RAM required by the IN FIFOs of the enabled classes.
+///
+/// @return number of 32-bit words required.
+static constexpr uint16_t usb_tx_fifo_plan_words()
+{
+    uint16_t words = 0;
+    for (auto &usage : USB_ENDPOINT_USAGE)
+    {
+        words += usb_tx_fifo_words(usage.tx_fifo_size);
+    }
+    return words;
+}
+
+static_assert(usb_tx_fifo_plan_words() <=
+              USB_FIFO_RAM_WORDS - USB_RX_FIFO_WORDS - USB_EP0_TX_FIFO_WORDS,
+              "IN FIFO depths exceed the available FIFO RAM, reduce the "
+              "FIFO depths under Endpoint FIFO configuration");
+
+/// Location of an IN FIFO in the FIFO RAM.
+typedef struct
+{
+    /// Offset of the FIFO in 32-bit words, relative to the end of the
+    /// control endpoint IN FIFO.
+    uint16_t offset;
+
+    /// Depth of the FIFO in 32-bit words, zero when not planned.
+    uint16_t words;
+} esp_usb_tx_fifo_t;
+
+/// IN FIFO locations indexed by the assigned IN endpoint number.
+static esp_usb_tx_fifo_t s_tx_fifo_plan[USB_MAX_ENDPOINT_NUM + 1];
+#endif // CONFIG_ESPUSB_TX_FIFO_PLAN
+
+/// Endpoint addresses assigned to the placeholder addresses, indexed by
+/// direction (0 = OUT, 1 = IN) and placeholder endpoint number.
+static uint8_t s_endpoint_map[2][16];
+
+/// Assigns endpoint numbers to the enabled classes and updates the endpoint
+/// addresses in @ref desc_configuration.
+///
+/// The CDC endpoints keep the numbers used by the ROM code, all others are
+/// assigned the lowest free number. An interface using both directions gets
+/// the same number for IN and OUT when possible. Each IN endpoint is given
+/// its own number (and with it a dedicated IN FIFO), the build fails when the
+/// enabled classes need more IN FIFOs than available.
+///
+/// When the TX FIFO plan is enabled the location of each IN FIFO in the FIFO
+/// RAM is also determined here, in the same order as the endpoints are
+/// assigned.
+static void assign_usb_endpoints()
+{
+    // endpoint 0 is the control endpoint and IN endpoint 5 is not connected
+    // to a FIFO.
+    bool in_used[USB_MAX_ENDPOINT_NUM + 1] = {true};
+    bool out_used[USB_MAX_ENDPOINT_NUM + 1] = {true};
+    in_used[NOTIF_ENDPOINT_NUM] = true;
+
+    bzero(s_endpoint_map, sizeof(s_endpoint_map));
+#if CONFIG_ESPUSB_TX_FIFO_PLAN
+    bzero(s_tx_fifo_plan, sizeof(s_tx_fifo_plan));
+    uint16_t tx_fifo_offset = 0;
+#endif // CONFIG_ESPUSB_TX_FIFO_PLAN
+    for (auto &usage : USB_ENDPOINT_USAGE)
+    {
+        if (usage.fixed_in)
+        {
+            s_endpoint_map[1][usage.in & 0x0F] = 0x80 | usage.fixed_in;
+            in_used[usage.fixed_in] = true;
+        }
+        if (usage.fixed_out)
+        {
+            s_endpoint_map[0][usage.out & 0x0F] = usage.fixed_out;
+            out_used[usage.fixed_out] = true;
+        }
+    }
+
+    for (auto &usage : USB_ENDPOINT_USAGE)
+    {
+        uint8_t in_num = 0;
+        uint8_t out_num = 0;
+        if (usage.in && !usage.fixed_in)
+        {
+            // prefer a number which is also free for the OUT endpoint.
+            for (uint8_t num = 1; num <= USB_MAX_ENDPOINT_NUM; num++)
+            {
+                if (!in_used[num] &&
+                    (!in_num || (usage.out && !out_used[num])))
+                {
+                    in_num = num;
+                    if (!usage.out || !out_used[num])
+                    {
+                        break;
+                    }
+                }
+            }
+            if (!in_num)
+            {
+                ESP_LOGE(TAG, "No IN endpoint available for %s", usage.name);
+                abort();
+            }
+            in_used[in_num] = true;
+            s_endpoint_map[1][usage.in & 0x0F] = 0x80 | in_num;
+        }
+        if (usage.out && !usage.fixed_out)
+        {
+            if (in_num && !out_used[in_num])
+            {
+                out_num = in_num;
+            }
+            for (uint8_t num = 1; !out_num && num <= USB_MAX_ENDPOINT_NUM;
+                 num++)
+            {
+                if (!out_used[num])
+                {
+                    out_num = num;
+                }
+            }
+            if (!out_num)
+            {
+                ESP_LOGE(TAG, "No OUT endpoint available for %s", usage.name);
+                abort();
+            }
+            out_used[out_num] = true;
+            s_endpoint_map[0][usage.out & 0x0F] = out_num;
+        }
+#if CONFIG_ESPUSB_TX_FIFO_PLAN
+        if (usage.tx_fifo_size)
+        {
+            uint8_t in_addr = s_endpoint_map[1][usage.in & 0x0F];
+            esp_usb_tx_fifo_t &fifo = s_tx_fifo_plan[in_addr & 0x0F];
+            fifo.offset = tx_fifo_offset;
+            fifo.words = usb_tx_fifo_words(usage.tx_fifo_size);
+            tx_fifo_offset += fifo.words;
+            ESP_LOGI(TAG, "%s IN FIFO: %d bytes", usage.name, fifo.words * 4);
+        }
+#endif // CONFIG_ESPUSB_TX_FIFO_PLAN
+        if (usage.name)
+        {
+            ESP_LOGI(TAG, "%s endpoints: IN:%02x OUT:%02x", usage.name,
+                     s_endpoint_map[1][usage.in & 0x0F],
+                     s_endpoint_map[0][usage.out & 0x0F]);
+        }
+    }
+
+    // replace the placeholder addresses in the endpoint descriptors.
+    for (size_t offs = 0; offs + 2 < sizeof(desc_configuration);
+         offs += desc_configuration[offs])
+    {
+        if (desc_configuration[offs] == 0)
+        {
+            ESP_LOGE(TAG, "Malformed configuration descriptor at %zu", offs);
+            abort();
+        }
+        if (desc_configuration[offs + 1] == TUSB_DESC_ENDPOINT)
+        {
+            uint8_t &addr = desc_configuration[offs + 2];
+            uint8_t assigned = s_endpoint_map[tu_edpt_dir(addr)][addr & 0x0F];
+            if (!assigned)
+            {
+                ESP_LOGE(TAG, "No endpoint assigned for %02x", addr);
+                abort();
+            }
+            addr = assigned;
+        }
+    }
+}
+
+#if CONFIG_ESPUSB_TX_FIFO_PLAN
+/// Maximum time to wait for the core to complete an IN FIFO flush.
+static constexpr uint32_t USB_FIFO_FLUSH_TIMEOUT_US = 1000;
+
+/// Opens an endpoint in the device driver (dcd_esp32sx.c or
+/// usb_dcd_dma.cpp).
+extern "C" bool __real_dcd_edpt_open(uint8_t rhport,
+                                     tusb_desc_endpoint_t const *desc_edpt);
+
+/// Opens an endpoint and resizes the IN FIFO assigned to it by the device
+/// driver according to @ref s_tx_fifo_plan.
+///
+/// @param rhport is the USB port.
+/// @param desc_edpt is the endpoint descriptor.
+///
+/// @return true if the endpoint was opened, false otherwise.
+///
+/// NOTE: The device driver splits the FIFO RAM evenly between the IN FIFOs,
+/// all calls to dcd_edpt_open are redirected to this function by the linker
+/// (see CMakeLists.txt). The FIFO is still empty at this point so it can be
+/// moved without losing data.
+extern "C" bool __wrap_dcd_edpt_open(uint8_t rhport,
+                                     tusb_desc_endpoint_t const *desc_edpt)
+{
+    if (!__real_dcd_edpt_open(rhport, desc_edpt))
+    {
+        return false;
+    }
+    uint8_t epnum = tu_edpt_number(desc_edpt->bEndpointAddress);
+    if (tu_edpt_dir(desc_edpt->bEndpointAddress) != TUSB_DIR_IN ||
+        epnum > USB_MAX_ENDPOINT_NUM || !s_tx_fifo_plan[epnum].words)
+    {
+        return true;
+    }
+    uint32_t fifo_num =
+        (USB0.in_ep_reg[epnum].diepctl & USB_D_TXFNUM1_M) >> USB_D_TXFNUM1_S;
+    if (fifo_num == 0)
+    {
+        return true;
+    }
+
+    // the plan starts after the receive FIFO and the control endpoint IN FIFO
+    // which are configured by the device driver on bus reset.
+    uint32_t base = (USB0.grxfsiz & 0xFFFF) +
+                    ((USB0.gnptxfsiz >> USB_NPTXFDEP_S) & 0xFFFF);
+    uint32_t offset = base + s_tx_fifo_plan[epnum].offset;
+    uint32_t words = s_tx_fifo_plan[epnum].words;
+    if (offset + words > USB_FIFO_RAM_WORDS)
+    {
+        ESP_LOGW(TAG, "IN FIFO for endpoint %d does not fit, using default",
+                 epnum);
+        return true;
+    }
+    USB0.dieptxf[fifo_num - 1] =
+        (offset << USB_NPTXFSTADDR_S) | (words << USB_NPTXFDEP_S);
+
+    // flush the FIFO so the new start address and depth take effect, the
+    // core clears the flag within a few PHY clocks unless it is stuck.
+    USB0.grstctl = (fifo_num << USB_TXFNUM_S) | USB_TXFFLSH_M;
+    uint32_t waited_us = 0;
+    while ((USB0.grstctl & USB_TXFFLSH_M) &&
+           waited_us++ < USB_FIFO_FLUSH_TIMEOUT_US)
+    {
+        esp_rom_delay_us(1);
+    }
+    if (USB0.grstctl & USB_TXFFLSH_M)
+    {
+        ESP_LOGE(TAG, "Timeout flushing IN FIFO %d for endpoint %d", fifo_num,
+                 epnum);
+    }
+    return true;
+}
+#endif // CONFIG_ESPUSB_TX_FIFO_PLAN
+
+#if CONFIG_ESPUSB_CDC && CONFIG_ESPUSB_CDC_STATS
+// Returns the address assigned to the CDC IN endpoint.
+uint8_t get_usb_cdc_in_endpoint()
+{
+    return s_endpoint_map[1][ENDPOINT_CDC_IN & 0x0F];
+}
+#endif // CONFIG_ESPUSB_CDC && CONFIG_ESPUSB_CDC_STATS
+
+#if CONFIG_ESPUSB_MIDI
+// Returns the address assigned to the MIDI IN endpoint.
+uint8_t get_usb_midi_in_endpoint()
+{
+    return s_endpoint_map[1][ENDPOINT_MIDI_IN & 0x0F];
+}
+#endif // CONFIG_ESPUSB_MIDI
+
+#if USB_BOS_ENABLED
+/// Vendor request codes advertised in the BOS platform capabilities.
+typedef enum
+{
+    /// WebUSB GET_URL request.
+    VENDOR_REQUEST_WEBUSB = 1,
+
+    /// Microsoft OS 2.0 descriptor set request.
+    VENDOR_REQUEST_MICROSOFT = 2,
+} esp_usb_vendor_request_t;
+
+/// wIndex value of the WebUSB GET_URL request.
+static constexpr uint16_t WEBUSB_REQUEST_GET_URL = 2;
+
+/// wIndex value of the Microsoft OS 2.0 descriptor set request.
+static constexpr uint16_t MS_OS_20_DESCRIPTOR_INDEX = 7;
+
+/// Maximum length of the WebUSB landing page URL, the URL descriptor length is
+/// a single byte and includes a three byte header.
+static constexpr size_t WEBUSB_URL_MAX_LEN = 252;
+
+/// Index of the WebUSB landing page URL, zero when there is no landing page.
+static constexpr uint8_t WEBUSB_LANDING_PAGE_INDEX =
+    CONFIG_ESPUSB_VENDOR_WEBUSB && sizeof(CONFIG_ESPUSB_VENDOR_WEBUSB_URL) > 1;
+
+static_assert(sizeof(CONFIG_ESPUSB_VENDOR_WEBUSB_URL) - 1 <= WEBUSB_URL_MAX_LEN,
+              "WebUSB landing page URL is too long");
+
+/// Number of characters in a device interface GUID string, including the
+/// braces.
+static constexpr size_t WINUSB_GUID_LEN = 38;
+
+static_assert(sizeof(CONFIG_ESPUSB_VENDOR_WINUSB_GUID) - 1 == WINUSB_GUID_LEN,
+              "WinUSB device interface GUID must be in the form "
+              "{xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}");
+
+/// Registry property holding the device interface GUID.
+static constexpr char WINUSB_GUID_PROPERTY[] = "DeviceInterfaceGUIDs";
+
+/// Microsoft OS 2.0 descriptor set header length.
+static constexpr uint16_t MS_OS_20_SET_HEADER_LEN = 10;
+
+/// Microsoft OS 2.0 configuration and function subset header length.
+static constexpr uint16_t MS_OS_20_SUBSET_HEADER_LEN = 8;
+
+/// Microsoft OS 2.0 compatible ID feature descriptor length.
+static constexpr uint16_t MS_OS_20_COMPATIBLE_ID_LEN = 20;
+
+/// Microsoft OS 2.0 registry property feature descriptor length, the name and
+/// value (REG_MULTI_SZ) are UTF-16 with terminating NULLs.
+static constexpr uint16_t MS_OS_20_REG_PROPERTY_LEN =
+    10 + (sizeof(WINUSB_GUID_PROPERTY) * 2) + ((WINUSB_GUID_LEN + 2) * 2);
+
+/// Tracks if the vendor interface is part of a composite device, the function
+/// subset is only used in this case so the WinUSB driver is bound to the
+/// vendor interface rather than the whole device.
+static constexpr bool MS_OS_20_USE_FUNCTION_SUBSET = ITF_NUM_TOTAL > 1;
+
+/// Total size of the Microsoft OS 2.0 descriptor set.
+static constexpr uint16_t MS_OS_20_DESC_LEN =
+    MS_OS_20_SET_HEADER_LEN +
+    (MS_OS_20_USE_FUNCTION_SUBSET * 2 * MS_OS_20_SUBSET_HEADER_LEN) +
+    MS_OS_20_COMPATIBLE_ID_LEN + MS_OS_20_REG_PROPERTY_LEN;
+
+/// Total size of the BOS descriptor.
+static constexpr uint16_t USB_BOS_TOTAL_LEN =
+    TUD_BOS_DESC_LEN +
+    (CONFIG_ESPUSB_VENDOR_WEBUSB * TUD_BOS_WEBUSB_DESC_LEN) +
+    (CONFIG_ESPUSB_VENDOR_WINUSB * TUD_BOS_MICROSOFT_OS_DESC_LEN);
+
+/// USB Binary Object Store descriptor.
+static uint8_t const desc_bos[USB_BOS_TOTAL_LEN] =
+{
+    TUD_BOS_DESCRIPTOR(USB_BOS_TOTAL_LEN,
+                       CONFIG_ESPUSB_VENDOR_WEBUSB +
+                       CONFIG_ESPUSB_VENDOR_WINUSB),
+#if CONFIG_ESPUSB_VENDOR_WEBUSB
+    TUD_BOS_WEBUSB_DESCRIPTOR(VENDOR_REQUEST_WEBUSB,
+                              WEBUSB_LANDING_PAGE_INDEX),
+#endif // CONFIG_ESPUSB_VENDOR_WEBUSB
+#if CONFIG_ESPUSB_VENDOR_WINUSB
+    TUD_BOS_MS_OS_20_DESCRIPTOR(MS_OS_20_DESC_LEN, VENDOR_REQUEST_MICROSOFT),
+#endif // CONFIG_ESPUSB_VENDOR_WINUSB
+};
+
+#if CONFIG_ESPUSB_VENDOR_WINUSB
+/// Microsoft OS 2.0 descriptor set, populated by
+/// @ref init_usb_bos_descriptors.
+static uint8_t s_ms_os_20_desc[MS_OS_20_DESC_LEN];
+#endif // CONFIG_ESPUSB_VENDOR_WINUSB
+
+#if CONFIG_ESPUSB_VENDOR_WEBUSB
+/// WebUSB URL descriptor, populated by @ref init_usb_bos_descriptors.
+static uint8_t s_webusb_url_desc[3 + WEBUSB_URL_MAX_LEN];
+#endif // CONFIG_ESPUSB_VENDOR_WEBUSB
+
+/// Writes a 16-bit little-endian value.
+///
+/// @param pos is the location to write to.
+/// @param value is the value to write.
+///
+/// @return the location following the written value.
+static uint8_t *put_u16(uint8_t *pos, uint16_t value)
+{
+    *pos++ = TU_U16_LOW(value);
+    *pos++ = TU_U16_HIGH(value);
+    return pos;
+}
+
+/// Writes a NULL terminated UTF-16LE string.
+///
+/// @param pos is the location to write to.
+/// @param str is the ASCII string to write.
+///
+/// @return the location following the written NULL terminator.
+static uint8_t *put_utf16(uint8_t *pos, const char *str)
+{
+    while (*str)
+    {
+        pos = put_u16(pos, *str++);
+    }
+    return put_u16(pos, 0);
+}
+
+/// Populates the descriptors which are returned via vendor requests.
+static void init_usb_bos_descriptors()
+{
+#if CONFIG_ESPUSB_VENDOR_WINUSB
+    uint8_t *pos = s_ms_os_20_desc;
+    pos = put_u16(pos, MS_OS_20_SET_HEADER_LEN);
+    pos = put_u16(pos, MS_OS_20_SET_HEADER_DESCRIPTOR);
+    // dwWindowsVersion: Windows 8.1
+    pos = put_u16(pos, 0x0000);
+    pos = put_u16(pos, 0x0603);
+    pos = put_u16(pos, MS_OS_20_DESC_LEN);
+    if (MS_OS_20_USE_FUNCTION_SUBSET)
+    {
+        pos = put_u16(pos, MS_OS_20_SUBSET_HEADER_LEN);
+        pos = put_u16(pos, MS_OS_20_SUBSET_HEADER_CONFIGURATION);
+        *pos++ = 0; // bConfigurationValue (index of the configuration)
+        *pos++ = 0; // bReserved
+        pos = put_u16(pos, MS_OS_20_DESC_LEN - MS_OS_20_SET_HEADER_LEN);
+
+        pos = put_u16(pos, MS_OS_20_SUBSET_HEADER_LEN);
+        pos = put_u16(pos, MS_OS_20_SUBSET_HEADER_FUNCTION);
+        *pos++ = ITF_NUM_VENDOR; // bFirstInterface
+        *pos++ = 0; // bReserved
+        pos = put_u16(pos, MS_OS_20_DESC_LEN - MS_OS_20_SET_HEADER_LEN -
+                           MS_OS_20_SUBSET_HEADER_LEN);
+    }
+
+    pos = put_u16(pos, MS_OS_20_COMPATIBLE_ID_LEN);
+    pos = put_u16(pos, MS_OS_20_FEATURE_COMPATBLE_ID);
+    // CompatibleID and SubCompatibleID are 8 bytes each, NULL padded.
+    bzero(pos, 16);
+    memcpy(pos, "WINUSB", 6);
+    pos += 16;
+
+    pos = put_u16(pos, MS_OS_20_REG_PROPERTY_LEN);
+    pos = put_u16(pos, MS_OS_20_FEATURE_REG_PROPERTY);
+    pos = put_u16(pos, 0x0007); // REG_MULTI_SZ
+    pos = put_u16(pos, sizeof(WINUSB_GUID_PROPERTY) * 2);
+    pos = put_utf16(pos, WINUSB_GUID_PROPERTY);
+    pos = put_u16(pos, (WINUSB_GUID_LEN + 2) * 2);
+    pos = put_utf16(pos, CONFIG_ESPUSB_VENDOR_WINUSB_GUID);
+    // REG_MULTI_SZ values end with an additional NULL.
+    pos = put_u16(pos, 0);
+    configASSERT(pos == s_ms_os_20_desc + MS_OS_20_DESC_LEN);
+#endif // CONFIG_ESPUSB_VENDOR_WINUSB
+
+#if CONFIG_ESPUSB_VENDOR_WEBUSB
+    // bScheme: 0 = http://, 1 = https://, 255 = included in the URL.
+    const char *url = CONFIG_ESPUSB_VENDOR_WEBUSB_URL;
+    uint8_t scheme = 255;
+    if (!strncmp(url, "https://", 8))
+    {
+        scheme = 1;
+        url += 8;
+    }
+    else if (!strncmp(url, "http://", 7))
+    {
+        scheme = 0;
+        url += 7;
+    }
+    size_t url_len = strlen(url);
+    s_webusb_url_desc[0] = 3 + url_len;
+    s_webusb_url_desc[1] = 3; // WEBUSB_URL descriptor type
+    s_webusb_url_desc[2] = scheme;
+    memcpy(s_webusb_url_desc + 3, url, url_len);
+    if (WEBUSB_LANDING_PAGE_INDEX)
+    {
+        ESP_LOGI(TAG, "WebUSB landing page: %s",
+                 CONFIG_ESPUSB_VENDOR_WEBUSB_URL);
+    }
+#endif // CONFIG_ESPUSB_VENDOR_WEBUSB
+}
+#endif // USB_BOS_ENABLED
+
+#if CONFIG_ESPUSB_STATIC_ALLOCATION
+/// Maximum length of the USB device descriptor strings.
+static constexpr size_t MAX_DESCRIPTOR_LEN =
+    CONFIG_ESPUSB_STATIC_DESCRIPTOR_LEN;
+
+/// USB device descriptor strings, the first entry (LANGUAGE) is unused.
+///
+/// NOTE: Only ASCII characters are supported at this time.
+static char s_str_descriptor[USB_DESC_MAX_COUNT][MAX_DESCRIPTOR_LEN + 1];
+#else
+/// Maximum length of the USB device descriptor strings.
+static constexpr size_t MAX_DESCRIPTOR_LEN = 126;
+
 /// USB device descriptor strings.
 ///
 /// NOTE: Only ASCII characters are supported at this time.
@@ -357,9 +1313,7 @@ static std::string s_str_descriptor[USB_DESC_MAX_COUNT] =
     "",     // USB_DESC_MIDI
     "",     // USB_DESC_DFU
 };
-
-/// Maximum length of the USB device descriptor strings.
-static constexpr size_t MAX_DESCRIPTOR_LEN = 126;
+#endif // CONFIG_ESPUSB_STATIC_ALLOCATION
 
 /// Temporary holding buffer for USB device descriptor string data in UTF-16
 /// format.
@@ -375,6 +1329,14 @@ void configure_usb_descriptor(tusb_desc_device_t *desc, uint16_t version)
     if (desc)
     {
         memcpy(&s_descriptor, desc, sizeof(tusb_desc_device_t));
+#if USB_BOS_ENABLED
+        // the BOS descriptor is ignored by the host unless the device
+        // reports USB 2.1 or later.
+        if (s_descriptor.bcdUSB < USB_BCD)
+        {
+            s_descriptor.bcdUSB = USB_BCD;
+        }
+#endif // USB_BOS_ENABLED
     }
     else if (version)
     {
@@ -393,9 +1355,16 @@ void configure_usb_descriptor_str(esp_usb_descriptor_index_t index,
                  index, str_len, MAX_DESCRIPTOR_LEN);
         str_len = MAX_DESCRIPTOR_LEN;
     }
+#if CONFIG_ESPUSB_STATIC_ALLOCATION
+    memcpy(s_str_descriptor[index], value, str_len);
+    s_str_descriptor[index][str_len] = '\0';
+    ESP_LOGI(TAG, "USB descriptor(%d) text:%s", index,
+             s_str_descriptor[index]);
+#else
     s_str_descriptor[index].assign(value, str_len);
     ESP_LOGI(TAG, "USB descriptor(%d) text:%s", index,
              s_str_descriptor[index].c_str());
+#endif // CONFIG_ESPUSB_STATIC_ALLOCATION
 }
 
 // =============================================================================
@@ -432,7 +1401,9 @@ uint16_t const *tud_descriptor_string_cb(uint8_t index, uint16_t langid)
     }
     else if (index >= USB_DESC_MAX_COUNT)
     {
-        // Note: the 0xEE index string is a Microsoft OS 1.0 Descriptors.
+        // Note: the 0xEE index string is a Microsoft OS 1.0 Descriptors,
+        // only the Microsoft OS 2.0 Descriptors (provided via the BOS
+        // descriptor) are supported.
         // https://docs.microsoft.com/en-us/windows-hardware/drivers/usbcon/microsoft-defined-usb-descriptors
         return NULL;
     }
@@ -440,11 +1411,18 @@ uint16_t const *tud_descriptor_string_cb(uint8_t index, uint16_t langid)
     {
         // copy the string into the temporary array starting at offset 1
         size_t idx = 1;
+#if CONFIG_ESPUSB_STATIC_ALLOCATION
+        for (const char *ch = s_str_descriptor[index]; *ch; ch++)
+        {
+            _desc_str[idx++] = tu_htole16(*ch);
+        }
+#else
         for (char ch : s_str_descriptor[index])
         {
             _desc_str[idx++] = tu_htole16(ch);
         }
-        chr_count = s_str_descriptor[index].length();
+#endif // CONFIG_ESPUSB_STATIC_ALLOCATION
+        chr_count = idx - 1;
     }
 
     // length and type
@@ -453,6 +1431,53 @@ uint16_t const *tud_descriptor_string_cb(uint8_t index, uint16_t langid)
     return _desc_str;
 }
 
+#if USB_BOS_ENABLED
+// Invoked when received GET BOS DESCRIPTOR request
+uint8_t const *tud_descriptor_bos_cb(void)
+{
+    return desc_bos;
+}
+
+// Invoked when a vendor request with a device recipient is received, this
+// provides the descriptors referenced by the BOS platform capabilities.
+bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage,
+                                tusb_control_request_t const *request)
+{
+    // nothing to do for the DATA and ACK stages.
+    if (stage != CONTROL_STAGE_SETUP)
+    {
+        return true;
+    }
+
+    switch (request->bRequest)
+    {
+#if CONFIG_ESPUSB_VENDOR_WEBUSB
+        case VENDOR_REQUEST_WEBUSB:
+            if (request->wIndex == WEBUSB_REQUEST_GET_URL &&
+                WEBUSB_LANDING_PAGE_INDEX &&
+                request->wValue == WEBUSB_LANDING_PAGE_INDEX)
+            {
+                return tud_control_xfer(rhport, request, s_webusb_url_desc,
+                                        s_webusb_url_desc[0]);
+            }
+            break;
+#endif // CONFIG_ESPUSB_VENDOR_WEBUSB
+#if CONFIG_ESPUSB_VENDOR_WINUSB
+        case VENDOR_REQUEST_MICROSOFT:
+            if (request->wIndex == MS_OS_20_DESCRIPTOR_INDEX)
+            {
+                return tud_control_xfer(rhport, request, s_ms_os_20_desc,
+                                        MS_OS_20_DESC_LEN);
+            }
+            break;
+#endif // CONFIG_ESPUSB_VENDOR_WINUSB
+    }
+
+    // stall unknown requests
+    return false;
+}
+#endif // USB_BOS_ENABLED
+
 #if CONFIG_ESPUSB_DFU
 // Invoked when the DFU Runtime mode is requested
 void tud_dfu_rt_reboot_to_dfu(void)
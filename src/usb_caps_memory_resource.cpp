@@ -0,0 +1,246 @@
+// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include "caps_memory_resource.h"
+
+/// Reports a failed allocation, memory resources must not return nullptr so
+/// this is fatal when exceptions are disabled (the ESP-IDF default).
+[[noreturn]] static void allocation_failed()
+{
+#if __cpp_exceptions
+    throw std::bad_alloc();
+#else
+    abort();
+#endif // __cpp_exceptions
+}
+
+// Retrieves the usage statistics of this resource.
+void AccountingResource::get_stats(esp_memory_resource_stats_t *stats) const
+{
+    memcpy(stats, &stats_, sizeof(esp_memory_resource_stats_t));
+}
+
+// Records a successful allocation.
+void AccountingResource::record_allocation(size_t bytes)
+{
+    stats_.allocations++;
+    stats_.bytes_in_use += bytes;
+    stats_.peak_bytes = std::max(stats_.peak_bytes, stats_.bytes_in_use);
+}
+
+// Records a deallocation.
+void AccountingResource::record_deallocation(size_t bytes)
+{
+    stats_.deallocations++;
+    stats_.bytes_in_use -= std::min(bytes, stats_.bytes_in_use);
+}
+
+// Allocates from the heap, trying each of the heap capabilities in order.
+void *CapsResource::do_allocate(size_t bytes, size_t alignment)
+{
+    for (size_t index = 0;
+         index < sizeof(caps_) / sizeof(caps_[0]) && caps_[index]; index++)
+    {
+        // the heap always returns memory aligned to at least four bytes.
+        void *p = alignment <= 4 ? heap_caps_malloc(bytes, caps_[index])
+                                 : heap_caps_aligned_alloc(alignment, bytes,
+                                                           caps_[index]);
+        if (p)
+        {
+            if (index)
+            {
+                stats_.fallbacks++;
+            }
+            record_upstream_allocation();
+            record_allocation(bytes);
+            return p;
+        }
+    }
+    record_failure();
+    allocation_failed();
+}
+
+// Returns memory to the heap.
+void CapsResource::do_deallocate(void *p, size_t bytes, size_t alignment)
+{
+    heap_caps_free(p);
+    record_deallocation(bytes);
+}
+
+// Fails the allocation.
+void *NullResource::do_allocate(size_t bytes, size_t alignment)
+{
+    record_failure();
+    allocation_failed();
+}
+
+// Nothing to release, no memory is ever handed out.
+void NullResource::do_deallocate(void *p, size_t bytes, size_t alignment)
+{
+}
+
+// Destructor, releases all chunks.
+MonotonicArenaResource::~MonotonicArenaResource()
+{
+    release();
+}
+
+// Returns all chunks to the upstream resource.
+void MonotonicArenaResource::release()
+{
+    while (chunks_)
+    {
+        chunk_t *chunk = chunks_;
+        chunks_ = chunk->next;
+        upstream_->deallocate(chunk, chunk->size, alignof(chunk_t));
+    }
+    current_ = buffer_;
+    available_ = buffer_size_;
+    next_chunk_size_ = initial_chunk_size_;
+    stats_.deallocations += stats_.allocations - stats_.deallocations;
+    stats_.bytes_in_use = 0;
+}
+
+// Allocates from the current chunk, allocating a new chunk if the current
+// chunk can not hold the allocation.
+void *MonotonicArenaResource::do_allocate(size_t bytes, size_t alignment)
+{
+    size_t padding = (alignment - ((uintptr_t)current_ & (alignment - 1))) &
+                     (alignment - 1);
+    if (current_ == nullptr || padding + bytes > available_)
+    {
+        // the remainder of the current chunk is abandoned.
+        size_t size = std::max(next_chunk_size_,
+                               sizeof(chunk_t) + alignment + bytes);
+        chunk_t *chunk = static_cast<chunk_t *>(
+            upstream_->allocate(size, alignof(chunk_t)));
+        record_upstream_allocation();
+        chunk->next = chunks_;
+        chunk->size = size;
+        chunks_ = chunk;
+        current_ = reinterpret_cast<uint8_t *>(chunk + 1);
+        available_ = size - sizeof(chunk_t);
+        next_chunk_size_ = size * 2;
+        padding = (alignment - ((uintptr_t)current_ & (alignment - 1))) &
+                  (alignment - 1);
+    }
+    void *p = current_ + padding;
+    current_ += padding + bytes;
+    available_ -= padding + bytes;
+    record_allocation(bytes);
+    return p;
+}
+
+// Deallocation is a no-op, the memory is reclaimed by release().
+void MonotonicArenaResource::do_deallocate(void *p, size_t bytes,
+                                           size_t alignment)
+{
+    record_deallocation(bytes);
+}
+
+// Destructor, releases all chunks.
+PoolResource::~PoolResource()
+{
+    release();
+}
+
+// Returns all chunks to the upstream resource, every outstanding block is
+// accounted as deallocated. Large allocations are still owned by the caller.
+void PoolResource::release()
+{
+    while (chunks_)
+    {
+        chunk_t *chunk = chunks_;
+        chunks_ = chunk->next;
+        upstream_->deallocate(chunk, chunk_size_, MIN_BLOCK_SIZE);
+    }
+    memset(free_lists_, 0, sizeof(free_lists_));
+    stats_.deallocations +=
+        stats_.allocations - stats_.deallocations - large_allocations_;
+    stats_.bytes_in_use = large_bytes_;
+}
+
+// Calculates the size class for an allocation.
+size_t PoolResource::size_class(size_t bytes)
+{
+    size_t index = 0;
+    for (size_t size = MIN_BLOCK_SIZE; size < bytes; size <<= 1)
+    {
+        index++;
+    }
+    return index;
+}
+
+// Allocates a block from the free list of the matching size class, refilling
+// the free list from a new chunk when it is empty.
+void *PoolResource::do_allocate(size_t bytes, size_t alignment)
+{
+    if (is_large(bytes, alignment))
+    {
+        void *p = upstream_->allocate(bytes, alignment);
+        record_upstream_allocation();
+        record_allocation(bytes);
+        large_allocations_++;
+        large_bytes_ += bytes;
+        return p;
+    }
+
+    size_t index = size_class(bytes);
+    if (free_lists_[index] == nullptr)
+    {
+        chunk_t *chunk = static_cast<chunk_t *>(
+            upstream_->allocate(chunk_size_, MIN_BLOCK_SIZE));
+        record_upstream_allocation();
+        chunk->next = chunks_;
+        chunks_ = chunk;
+
+        // split the chunk into blocks of this size class.
+        size_t block_size = MIN_BLOCK_SIZE << index;
+        uint8_t *block = reinterpret_cast<uint8_t *>(chunk + 1);
+        uint8_t *end = reinterpret_cast<uint8_t *>(chunk) + chunk_size_;
+        for (; block + block_size <= end; block += block_size)
+        {
+            block_t *free_block = reinterpret_cast<block_t *>(block);
+            free_block->next = free_lists_[index];
+            free_lists_[index] = free_block;
+        }
+    }
+    block_t *block = free_lists_[index];
+    free_lists_[index] = block->next;
+    record_allocation(bytes);
+    return block;
+}
+
+// Returns a block to the free list of its size class.
+void PoolResource::do_deallocate(void *p, size_t bytes, size_t alignment)
+{
+    if (is_large(bytes, alignment))
+    {
+        upstream_->deallocate(p, bytes, alignment);
+        large_allocations_--;
+        large_bytes_ -= bytes;
+    }
+    else
+    {
+        size_t index = size_class(bytes);
+        block_t *block = static_cast<block_t *>(p);
+        block->next = free_lists_[index];
+        free_lists_[index] = block;
+    }
+    record_deallocation(bytes);
+}
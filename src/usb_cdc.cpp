@@ -17,6 +17,7 @@
 #include <driver/periph_ctrl.h>
 #include <esp_idf_version.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #if CONFIG_IDF_TARGET_ESP32S2
 #include <esp32s2/rom/usb/chip_usb_dw_wrapper.h>
 #include <esp32s2/rom/usb/usb_persist.h>
@@ -28,10 +29,13 @@
 #endif
 
 #include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
 #include <freertos/task.h>
 #include <soc/gpio_periph.h>
 #include <soc/rtc_cntl_reg.h>
 #include <soc/usb_periph.h>
+#include <string.h>
+#include "latency_histogram.h"
 #include "usb.h"
 
 /// Tag used for all logging.
@@ -39,6 +43,36 @@ static constexpr const char * const TAG = "USB:CDC";
 
 #if CONFIG_ESPUSB_CDC
 
+#if CONFIG_ESPUSB_CDC_BINLOG
+void init_usb_cdc_binlog();
+#endif // CONFIG_ESPUSB_CDC_BINLOG
+
+#if CONFIG_ESPUSB_CDC_FRAMING
+void init_usb_cdc_frame();
+#endif // CONFIG_ESPUSB_CDC_FRAMING
+
+#if CONFIG_ESPUSB_CDC_UART_BRIDGE
+void init_usb_uart_bridge();
+void uart_bridge_tx_complete();
+void uart_bridge_line_state(bool dtr, bool rts);
+#endif // CONFIG_ESPUSB_CDC_UART_BRIDGE
+
+#if CONFIG_ESPUSB_CDC_FLASHER
+void init_usb_cdc_flasher();
+void cdc_flasher_start();
+void cdc_flasher_stop();
+#endif // CONFIG_ESPUSB_CDC_FLASHER
+
+#if CONFIG_ESPUSB_CDC_STATS
+uint8_t get_usb_cdc_in_endpoint();
+#endif // CONFIG_ESPUSB_CDC_STATS
+
+#if CONFIG_ESPUSB_CDC_DIAG
+void init_usb_cdc_diag();
+void cdc_diag_connected();
+void cdc_diag_tx_complete();
+#endif // CONFIG_ESPUSB_CDC_DIAG
+
 /// Current state of the USB CDC interface.
 static esp_line_state_t cdc_line_state = LINE_STATE_DISCONNECTED;
 
@@ -46,6 +80,196 @@ static esp_line_state_t cdc_line_state = LINE_STATE_DISCONNECTED;
 static constexpr TickType_t WRITE_TIMEOUT_TICKS =
     pdMS_TO_TICKS(CONFIG_ESPUSB_CDC_WRITE_FLUSH_TIMEOUT);
 
+/// Size of a single packet on the CDC IN endpoint.
+static constexpr uint32_t CDC_PACKET_SIZE = CONFIG_ESPUSB_CDC_FIFO_SIZE;
+
+static_assert((CONFIG_ESPUSB_CDC_EP_BUFSIZE % CDC_PACKET_SIZE) == 0,
+              "CDC endpoint transfer size must be a multiple of the packet "
+              "size");
+
+/// Event bit set by @ref tud_cdc_tx_complete_cb when the host has collected
+/// an IN transfer.
+static constexpr EventBits_t TX_COMPLETE_BIT = BIT0;
+
+/// Events used for waking writers waiting for space in the TX buffer, an
+/// event group is used so all waiting writers are woken by one completion.
+static EventGroupHandle_t s_tx_events = nullptr;
+
+/// Storage for @ref s_tx_events.
+static StaticEventGroup_t s_tx_events_storage;
+
+/// Lock protecting the TX flush scheduler state and statistics.
+static portMUX_TYPE s_flush_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/// Time (in microseconds) at which the current IN transfer was started, zero
+/// when there is no transfer in flight.
+static int64_t s_xfer_start_us = 0;
+
+/// Smoothed time (in microseconds) taken by the host to collect a transfer.
+static uint32_t s_host_poll_us = 1000;
+
+#if CONFIG_ESPUSB_CDC_FLUSH_COALESCE
+/// Minimum coalescing window, this is one high-speed micro-frame.
+static constexpr uint32_t MIN_COALESCE_WINDOW_US = 125;
+
+/// Timer used for flushing coalesced writes.
+static esp_timer_handle_t s_flush_timer = nullptr;
+
+/// Tracks if @ref s_flush_timer has been started, protected by
+/// @ref s_flush_lock. This is only cleared by the timer callback so it never
+/// reports the timer as stopped while it is still running.
+static bool s_flush_timer_armed = false;
+#endif // CONFIG_ESPUSB_CDC_FLUSH_COALESCE
+
+#if CONFIG_ESPUSB_CDC_STATS
+/// Maximum number of writes that will be sampled for latency between two
+/// flushes, additional writes will be counted but not sampled.
+static constexpr size_t MAX_PENDING_WRITE_SAMPLES = 32;
+
+/// Start time of each write which has not yet been flushed.
+static int64_t s_pending_write_us[MAX_PENDING_WRITE_SAMPLES];
+
+/// Number of entries used in @ref s_pending_write_us.
+static size_t s_pending_write_count = 0;
+
+/// Per-write latency samples.
+static LatencyHistogram s_write_latency;
+
+/// Current TX statistics, latency fields are populated on demand.
+static esp_usb_cdc_stats_t s_stats;
+#endif // CONFIG_ESPUSB_CDC_STATS
+
+/// Flushes the CDC TX buffer and records latency for all pending writes.
+static void cdc_flush()
+{
+    uint32_t flushed = tud_cdc_write_flush();
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&s_flush_lock);
+    if (flushed)
+    {
+        s_xfer_start_us = now;
+    }
+#if CONFIG_ESPUSB_CDC_STATS
+    if (flushed)
+    {
+        s_stats.flushes++;
+    }
+    for (size_t index = 0; index < s_pending_write_count; index++)
+    {
+        s_write_latency.add(now - s_pending_write_us[index]);
+    }
+    s_pending_write_count = 0;
+#endif // CONFIG_ESPUSB_CDC_STATS
+    portEXIT_CRITICAL(&s_flush_lock);
+}
+
+#if CONFIG_ESPUSB_CDC_FLUSH_COALESCE
+/// esp_timer callback used to flush coalesced writes.
+///
+/// @param arg is not used.
+static void cdc_flush_timer_cb(void *arg)
+{
+    portENTER_CRITICAL(&s_flush_lock);
+    s_flush_timer_armed = false;
+    portEXIT_CRITICAL(&s_flush_lock);
+    cdc_flush();
+}
+
+/// Starts the flush timer if it is not already running.
+///
+/// The timer is left running when data is flushed early, it is a one-shot
+/// timer so this costs at most one empty flush per window and avoids
+/// stopping a timer which another writer has just started.
+///
+/// The window is the smaller of the configured window and the observed time
+/// the host takes to collect a transfer, holding data longer than that only
+/// adds latency as anything written while a transfer is in flight will be
+/// sent together in the next transfer.
+static void cdc_schedule_flush()
+{
+    uint32_t window = CONFIG_ESPUSB_CDC_FLUSH_COALESCE_US;
+    portENTER_CRITICAL(&s_flush_lock);
+    window = std::min(window,
+                      std::max(s_host_poll_us, MIN_COALESCE_WINDOW_US));
+    bool start = !s_flush_timer_armed;
+    s_flush_timer_armed = true;
+    portEXIT_CRITICAL(&s_flush_lock);
+
+    // the timer is started outside the critical section as esp_timer takes
+    // its own lock, only the writer which set the flag starts it.
+    if (start && esp_timer_start_once(s_flush_timer, window) != ESP_OK)
+    {
+        portENTER_CRITICAL(&s_flush_lock);
+        s_flush_timer_armed = false;
+        portEXIT_CRITICAL(&s_flush_lock);
+        // the data must not be left in the buffer without a flush pending.
+        cdc_flush();
+    }
+}
+#endif // CONFIG_ESPUSB_CDC_FLUSH_COALESCE
+
+/// Applies the flush policy after data has been queued in the TX buffer.
+///
+/// @param buf is the data which was queued, nullptr when the queued data is
+/// binary and must not be checked for newlines.
+/// @param size is the number of bytes which were queued.
+/// @param start_us is the time at which the write started.
+///
+/// NOTE: This is also used by the binary log and framing transports.
+void cdc_written(const char *buf, size_t size, int64_t start_us)
+{
+#if CONFIG_ESPUSB_CDC_STATS
+    portENTER_CRITICAL(&s_flush_lock);
+    s_stats.writes++;
+    s_stats.bytes += size;
+    if (s_pending_write_count < MAX_PENDING_WRITE_SAMPLES)
+    {
+        s_pending_write_us[s_pending_write_count++] = start_us;
+    }
+    portEXIT_CRITICAL(&s_flush_lock);
+#endif // CONFIG_ESPUSB_CDC_STATS
+
+#if CONFIG_ESPUSB_CDC_FLUSH_COALESCE
+    uint32_t pending = CFG_TUD_CDC_TX_BUFSIZE - tud_cdc_write_available();
+    bool flush_now = pending >= CONFIG_ESPUSB_CDC_FLUSH_COALESCE_BYTES;
+#if CONFIG_ESPUSB_CDC_FLUSH_ON_NEWLINE
+    flush_now = flush_now ||
+        (buf != nullptr && memchr(buf, '\n', size) != nullptr);
+#endif // CONFIG_ESPUSB_CDC_FLUSH_ON_NEWLINE
+    if (flush_now)
+    {
+        cdc_flush();
+    }
+    else
+    {
+        cdc_schedule_flush();
+    }
+#else
+    cdc_flush();
+#endif // CONFIG_ESPUSB_CDC_FLUSH_COALESCE
+}
+
+/// Waits for the host to collect an IN transfer, a transfer is started first
+/// if there is data pending in the TX buffer and none is in flight.
+///
+/// @param ticks is the maximum number of ticks to wait.
+///
+/// @return true if a transfer completed before the timeout expired.
+///
+/// NOTE: This is also used by the framing transport.
+bool cdc_wait_tx_complete(TickType_t ticks)
+{
+    // cleared before flushing so a completion which arrives before the wait
+    // below starts is not lost.
+    xEventGroupClearBits(s_tx_events, TX_COMPLETE_BIT);
+    cdc_flush();
+    EventBits_t bits =
+        xEventGroupWaitBits(s_tx_events, TX_COMPLETE_BIT, pdTRUE, pdFALSE,
+                            ticks);
+    return (bits & TX_COMPLETE_BIT) != 0;
+}
+
 /// System shutdown hook used for flagging that the restart should go into a
 /// download mode rather than normal startup mode.
 ///
@@ -83,12 +307,42 @@ void init_usb_cdc()
 {
     // register shutdown hook for rebooting into download mode
     ESP_ERROR_CHECK(esp_register_shutdown_handler(usb_shutdown_hook));
+
+    s_tx_events = xEventGroupCreateStatic(&s_tx_events_storage);
+
+#if CONFIG_ESPUSB_CDC_FLUSH_COALESCE
+    esp_timer_create_args_t timer_args = {};
+    timer_args.callback = cdc_flush_timer_cb;
+    timer_args.name = "cdc_flush";
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &s_flush_timer));
+#endif // CONFIG_ESPUSB_CDC_FLUSH_COALESCE
+
+#if CONFIG_ESPUSB_CDC_BINLOG
+    init_usb_cdc_binlog();
+#endif // CONFIG_ESPUSB_CDC_BINLOG
+
+#if CONFIG_ESPUSB_CDC_FRAMING
+    init_usb_cdc_frame();
+#endif // CONFIG_ESPUSB_CDC_FRAMING
+
+#if CONFIG_ESPUSB_CDC_UART_BRIDGE
+    init_usb_uart_bridge();
+#endif // CONFIG_ESPUSB_CDC_UART_BRIDGE
+
+#if CONFIG_ESPUSB_CDC_FLASHER
+    init_usb_cdc_flasher();
+#endif // CONFIG_ESPUSB_CDC_FLASHER
+
+#if CONFIG_ESPUSB_CDC_DIAG
+    init_usb_cdc_diag();
+#endif // CONFIG_ESPUSB_CDC_DIAG
 }
 
 // Attempts to write a buffer to the USB CDC if a device is present.
 size_t write_to_cdc(const char *buf, size_t size)
 {
     size_t offs = 0;
+    int64_t start_us = esp_timer_get_time();
     uint32_t ticks_start = xTaskGetTickCount();
     uint32_t ticks_now = ticks_start;
     if (cdc_line_state != LINE_STATE_CONNECTED &&
@@ -97,6 +351,13 @@ size_t write_to_cdc(const char *buf, size_t size)
         goto exit_write_to_cdc;
     }
 
+#if (CONFIG_ESPUSB_CDC_DIAG && !CONFIG_ESPUSB_CDC_DIAG_WRITE) || \
+    CONFIG_ESPUSB_CDC_UART_BRIDGE
+    // the diagnostic mode or UART bridge owns the CDC data stream.
+    goto exit_write_to_cdc;
+#endif // (CONFIG_ESPUSB_CDC_DIAG && !CONFIG_ESPUSB_CDC_DIAG_WRITE) ||
+       // CONFIG_ESPUSB_CDC_UART_BRIDGE
+
     // while there is still data remaining and we have not timed out keep
     // trying to send data
     while (offs < size)
@@ -109,32 +370,106 @@ size_t write_to_cdc(const char *buf, size_t size)
         }
 
         // pick the smallest buffer size that we can push to the CDC
-        uint32_t to_send = std::min(tud_cdc_write_available(), size - offs);
+        uint32_t available = tud_cdc_write_available();
+        uint32_t to_send = std::min(available, size - offs);
+
+#if CONFIG_ESPUSB_CDC_BULK_MODE
+        // While more data is pending than fits in the TX FIFO only queue
+        // whole packets. TinyUSB flushes everything in the FIFO (up to the
+        // endpoint buffer size) when it starts a transfer so the fill level,
+        // which may include a partial packet from an earlier write, must end
+        // on a packet boundary to keep short packets out of the middle of
+        // the stream.
+        if (to_send < (size - offs))
+        {
+            uint32_t queued = CFG_TUD_CDC_TX_BUFSIZE - available;
+            uint32_t partial = (queued + to_send) % CDC_PACKET_SIZE;
+            to_send = (partial <= to_send) ? to_send - partial : 0;
+        }
+#endif // CONFIG_ESPUSB_CDC_BULK_MODE
+
+        if (to_send == 0)
+        {
+            // the FIFO is full, wait for the host to collect a transfer
+            // rather than polling for space.
+            cdc_wait_tx_complete(WRITE_TIMEOUT_TICKS -
+                                 (ticks_now - ticks_start));
+            continue;
+        }
 
         // attempt to send the full buffer in one shot, this will send only
         // up to the point of filling the FIFO and return the amount sent.
-        uint16_t sent = tud_cdc_write(buf + offs, to_send);
-
-        // if we successfully queued at least one character in the CDC TX
-        // buffer, flush it out onto the wire.
-        if (sent > 0)
+        // Complete packets are flushed by TinyUSB as they are queued, the
+        // trailing partial packet is handled by the flush policy below.
+        offs += tud_cdc_write(buf + offs, to_send);
+#if CONFIG_ESPUSB_CDC_BULK_MODE
+        if (offs < size)
         {
+            // the FIFO holds only whole packets, make sure they are in
+            // flight while waiting for space for the rest of the data.
             tud_cdc_write_flush();
         }
-        offs += sent;
+#endif // CONFIG_ESPUSB_CDC_BULK_MODE
     }
 
     // If we still have some data left to transmit by the time we reach
     // here a FIFO overflow occurred.
-    if (size)
+    if (offs < size)
+    {
+        ESP_LOGE(TAG, "TX FIFO Overflow! %zu remaining after timeout.",
+                 size - offs);
+    }
+
+    // If the final transfer ends on a packet boundary TinyUSB will follow it
+    // with a zero length packet so the host sees the end of the transfer.
+    if (offs)
     {
-        ESP_LOGE(TAG, "TX FIFO Overflow! %d remaining after timeout.", size);
+        cdc_written(buf, offs, start_us);
     }
 
 exit_write_to_cdc:
     return offs;
 }
 
+// Flushes any pending data in the TX buffer.
+void flush_cdc()
+{
+    cdc_flush();
+}
+
+// Retrieves the current TX statistics.
+void get_cdc_stats(esp_usb_cdc_stats_t *stats)
+{
+    bzero(stats, sizeof(esp_usb_cdc_stats_t));
+    portENTER_CRITICAL(&s_flush_lock);
+#if CONFIG_ESPUSB_CDC_STATS
+    memcpy(stats, &s_stats, sizeof(esp_usb_cdc_stats_t));
+    if (stats->bytes)
+    {
+        stats->packets_per_kib =
+            ((uint64_t)stats->packets * 1024) / stats->bytes;
+    }
+    stats->latency_p50_us = s_write_latency.percentile(50);
+    stats->latency_p90_us = s_write_latency.percentile(90);
+    stats->latency_p99_us = s_write_latency.percentile(99);
+    stats->latency_max_us = s_write_latency.max();
+#endif // CONFIG_ESPUSB_CDC_STATS
+    stats->host_poll_us = s_host_poll_us;
+    portEXIT_CRITICAL(&s_flush_lock);
+}
+
+// Resets the TX statistics.
+void reset_cdc_stats()
+{
+#if CONFIG_ESPUSB_CDC_STATS
+    portENTER_CRITICAL(&s_flush_lock);
+    bzero(&s_stats, sizeof(esp_usb_cdc_stats_t));
+    s_write_latency.reset();
+    s_pending_write_count = 0;
+    portEXIT_CRITICAL(&s_flush_lock);
+#endif // CONFIG_ESPUSB_CDC_STATS
+}
+
 // Default implementation of usb_line_state_changed_cb which allows restart.
 TU_ATTR_WEAK bool usb_line_state_changed_cb(esp_line_state_t state, bool download)
 {
@@ -159,11 +494,100 @@ extern "C"
 // TinyUSB CALLBACKS
 // =============================================================================
 
+// Invoked when a CDC IN transfer has completed.
+void tud_cdc_tx_complete_cb(uint8_t itf)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&s_flush_lock);
+    if (s_xfer_start_us)
+    {
+        uint32_t sample = now - s_xfer_start_us;
+        s_host_poll_us = ((s_host_poll_us * 7) + sample) / 8;
+    }
+    // TinyUSB will start the next transfer immediately after this callback
+    // returns if there is more data pending.
+    s_xfer_start_us =
+        (tud_cdc_write_available() < CFG_TUD_CDC_TX_BUFSIZE) ? now : 0;
+#if CONFIG_ESPUSB_CDC_STATS
+    s_stats.transfers++;
+#endif // CONFIG_ESPUSB_CDC_STATS
+    portEXIT_CRITICAL(&s_flush_lock);
+    xEventGroupSetBits(s_tx_events, TX_COMPLETE_BIT);
+
+#if CONFIG_ESPUSB_CDC_DIAG
+    cdc_diag_tx_complete();
+#endif // CONFIG_ESPUSB_CDC_DIAG
+#if CONFIG_ESPUSB_CDC_UART_BRIDGE
+    uart_bridge_tx_complete();
+#endif // CONFIG_ESPUSB_CDC_UART_BRIDGE
+}
+
+#if CONFIG_ESPUSB_CDC_STATS
+/// Handles a completed transfer in the CDC class driver (cdc_device.c).
+bool __real_cdcd_xfer_cb(uint8_t rhport, uint8_t ep_addr,
+                         xfer_result_t result, uint32_t xferred_bytes);
+
+/// Counts the packets of a completed CDC IN transfer.
+///
+/// @param rhport is the USB port.
+/// @param ep_addr is the endpoint address.
+/// @param result is the transfer result.
+/// @param xferred_bytes is the number of bytes transferred.
+///
+/// @return the result of the class driver.
+///
+/// NOTE: @ref tud_cdc_tx_complete_cb does not provide the size of the
+/// transfer, all calls to cdcd_xfer_cb are redirected to this function by the
+/// linker (see CMakeLists.txt). A transfer larger than one packet is sent as
+/// several packets when CONFIG_ESPUSB_CDC_EP_BUFSIZE is above 64 bytes and a
+/// zero length transfer is a single (empty) packet.
+bool __wrap_cdcd_xfer_cb(uint8_t rhport, uint8_t ep_addr,
+                         xfer_result_t result, uint32_t xferred_bytes)
+{
+    if (ep_addr == get_usb_cdc_in_endpoint())
+    {
+        uint32_t packets =
+            (xferred_bytes + CDC_PACKET_SIZE - 1) / CDC_PACKET_SIZE;
+        portENTER_CRITICAL(&s_flush_lock);
+        s_stats.packets += std::max(packets, (uint32_t)1);
+        portEXIT_CRITICAL(&s_flush_lock);
+    }
+    return __real_cdcd_xfer_cb(rhport, ep_addr, result, xferred_bytes);
+}
+#endif // CONFIG_ESPUSB_CDC_STATS
+
 // Invoked when cdc when line state changed e.g connected/disconnected
 void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts)
 {
     ESP_LOGV(TAG, "tud_cdc_line_state_cb(%d, %d, %d), state: %d", itf, dtr,
              rts, cdc_line_state);
+#if CONFIG_ESPUSB_CDC_UART_BRIDGE
+    // DTR/RTS belong to the bridged device so the esptool download request
+    // sequence is not tracked, DTR alone indicates the host has the port open.
+    uart_bridge_line_state(dtr, rts);
+    cdc_line_state = dtr ? LINE_STATE_CONNECTED : LINE_STATE_DISCONNECTED;
+    usb_line_state_changed_cb(cdc_line_state, false);
+    return;
+#endif // CONFIG_ESPUSB_CDC_UART_BRIDGE
+
+#if CONFIG_ESPUSB_CDC_DIAG
+    bool was_connected = (cdc_line_state == LINE_STATE_CONNECTED ||
+                          cdc_line_state == LINE_STATE_MAYBE_CONNECTED);
+#endif // CONFIG_ESPUSB_CDC_DIAG
+#if CONFIG_ESPUSB_CDC_FLASHER
+    if (cdc_line_state == LINE_STATE_FLASHING)
+    {
+        // esptool keeps both DTR and RTS deasserted while it is talking to
+        // the flasher, any other state is either the reset pulse at the end
+        // of the session or another application opening the port.
+        if (!dtr && !rts)
+        {
+            return;
+        }
+        cdc_flasher_stop();
+        cdc_line_state = LINE_STATE_DISCONNECTED;
+    }
+#endif // CONFIG_ESPUSB_CDC_FLASHER
     if (!dtr && rts)
     {
         if (cdc_line_state == LINE_STATE_DISCONNECTED ||
@@ -218,10 +642,29 @@ void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts)
             cdc_line_state = LINE_STATE_DISCONNECTED;
         }
     }
+#if CONFIG_ESPUSB_CDC_DIAG
+    // a host which raises RTS before DTR ends up in the MAYBE_CONNECTED state
+    // rather than CONNECTED, both have DTR and RTS asserted.
+    if (!was_connected && (cdc_line_state == LINE_STATE_CONNECTED ||
+                           cdc_line_state == LINE_STATE_MAYBE_CONNECTED))
+    {
+        cdc_diag_connected();
+    }
+#endif // CONFIG_ESPUSB_CDC_DIAG
     // check if the callback will handle the restart when there is a download
     // request pending.
     bool download = (cdc_line_state == LINE_STATE_REQUEST_DOWNLOAD ||
                      cdc_line_state == LINE_STATE_REQUEST_DOWNLOAD_DFU);
+#if CONFIG_ESPUSB_CDC_FLASHER
+    if (cdc_line_state == LINE_STATE_REQUEST_DOWNLOAD)
+    {
+        // handle the download request in the running application rather
+        // than restarting into the ROM download mode.
+        cdc_line_state = LINE_STATE_FLASHING;
+        download = false;
+        cdc_flasher_start();
+    }
+#endif // CONFIG_ESPUSB_CDC_FLASHER
     bool restart = usb_line_state_changed_cb(cdc_line_state, download);
 
     // restart the system if the callback is not going to handle it and there
@@ -0,0 +1,123 @@
+// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+
+#include <atomic>
+#include <endian.h>
+#include <esp_rom_crc.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <string.h>
+#include "cdc_binlog.h"
+#include "usb.h"
+
+#if CONFIG_ESPUSB_CDC && CONFIG_ESPUSB_CDC_BINLOG
+
+void cdc_written(const char *buf, size_t size, int64_t start_us);
+
+/// Lock used to ensure records are written to the TX buffer as a single unit.
+static SemaphoreHandle_t s_binlog_lock = nullptr;
+
+/// Storage for @ref s_binlog_lock.
+static StaticSemaphore_t s_binlog_lock_storage;
+
+/// Number of records that have been dropped, this is updated from any task
+/// calling @ref binlog_write including when @ref s_binlog_lock is not held.
+static std::atomic<uint32_t> s_binlog_dropped{0};
+
+/// Writes a 16-bit value in little-endian format.
+///
+/// @param dst is the location to write to.
+/// @param value is the value to write.
+static inline void put_le16(uint8_t *dst, uint16_t value)
+{
+    value = htole16(value);
+    memcpy(dst, &value, sizeof(uint16_t));
+}
+
+/// Writes a 32-bit value in little-endian format.
+///
+/// @param dst is the location to write to.
+/// @param value is the value to write.
+static inline void put_le32(uint8_t *dst, uint32_t value)
+{
+    value = htole32(value);
+    memcpy(dst, &value, sizeof(uint32_t));
+}
+
+/// Initializes the binary log transport.
+void init_usb_cdc_binlog()
+{
+    s_binlog_lock = xSemaphoreCreateMutexStatic(&s_binlog_lock_storage);
+}
+
+void binlog_write(const char *fmt, const uint32_t *args, size_t argc)
+{
+    int64_t now = esp_timer_get_time();
+    if (s_binlog_lock == nullptr || !tud_cdc_connected())
+    {
+        s_binlog_dropped++;
+        return;
+    }
+
+    uint8_t record[BINLOG_HEADER_SIZE + (BINLOG_MAX_ARGS * sizeof(uint32_t)) +
+                   BINLOG_CRC_SIZE];
+    size_t len = BINLOG_HEADER_SIZE + (argc * sizeof(uint32_t));
+    record[0] = BINLOG_RECORD_MARKER;
+    record[1] = len + BINLOG_CRC_SIZE;
+    record[2] = argc;
+    put_le32(record + 3, (uint32_t)(uintptr_t)fmt);
+    put_le32(record + 7, (uint32_t)now);
+    for (size_t index = 0; index < argc; index++)
+    {
+        put_le32(record + BINLOG_HEADER_SIZE + (index * sizeof(uint32_t)),
+                 args[index]);
+    }
+    put_le16(record + len, esp_rom_crc16_le(0, record, len));
+    len += BINLOG_CRC_SIZE;
+
+    // The record is either written completely or dropped so that the host
+    // never sees a partial record. This does not block waiting for the host
+    // or for another task writing a record so that it is safe to use from
+    // the USB task itself.
+    if (xSemaphoreTake(s_binlog_lock, 0) != pdTRUE)
+    {
+        s_binlog_dropped++;
+        return;
+    }
+    bool queued = false;
+    if (tud_cdc_write_available() >= len)
+    {
+        queued = (tud_cdc_write(record, len) == len);
+    }
+    xSemaphoreGive(s_binlog_lock);
+
+    if (queued)
+    {
+        cdc_written((const char *)record, len, now);
+    }
+    else
+    {
+        s_binlog_dropped++;
+    }
+}
+
+uint32_t binlog_dropped_count()
+{
+    return s_binlog_dropped;
+}
+
+#endif // CONFIG_ESPUSB_CDC && CONFIG_ESPUSB_CDC_BINLOG
@@ -0,0 +1,347 @@
+// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+
+// if Esp32USB debug is enabled set the local log level higher than any of the
+// pre-defined log levels.
+#if CONFIG_ESPUSB_DEBUG
+#define LOG_LOCAL_LEVEL 0xFF
+#endif
+
+#include <endian.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <string.h>
+#include "usb.h"
+
+/// Tag used for all logging.
+static constexpr const char * const TAG = "USB:CDC:DIAG";
+
+#if CONFIG_ESPUSB_CDC
+
+#if CONFIG_ESPUSB_CDC_DIAG
+
+/// Lock protecting the diagnostic statistics.
+static portMUX_TYPE s_diag_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/// Diagnostic mode statistics.
+static esp_usb_cdc_diag_stats_t s_diag_stats;
+
+/// Size of the temporary buffer used for moving data in and out of the CDC
+/// FIFOs, this matches the CDC packet size.
+static constexpr size_t DIAG_CHUNK_SIZE = 64;
+
+#if CONFIG_ESPUSB_CDC_DIAG_ECHO
+/// Probe record used in echo mode, all fields are little-endian.
+typedef struct TU_ATTR_PACKED
+{
+    /// Sequence number assigned by the host.
+    uint32_t sequence;
+
+    /// Timestamp assigned by the host, this is not used by the device.
+    uint32_t host_timestamp;
+
+    /// Lower 32 bits of the device timestamp (in microseconds) when the
+    /// record was received.
+    uint32_t device_rx_us;
+
+    /// Lower 32 bits of the device timestamp (in microseconds) when the
+    /// record was queued for transmit.
+    uint32_t device_tx_us;
+} echo_record_t;
+
+static_assert(sizeof(echo_record_t) == 16, "echo_record_t should be 16 bytes");
+
+/// Partially received echo record.
+static echo_record_t s_echo_record;
+
+/// Number of bytes received for @ref s_echo_record.
+static size_t s_echo_record_len = 0;
+#endif // CONFIG_ESPUSB_CDC_DIAG_ECHO
+
+#if CONFIG_ESPUSB_CDC_DIAG_SOURCE
+/// Next counter value to send.
+static uint32_t s_source_counter = 0;
+#endif // CONFIG_ESPUSB_CDC_DIAG_SOURCE
+
+#if CONFIG_ESPUSB_CDC_DIAG_WRITE
+/// Number of counter values sent by each write_to_cdc call.
+static constexpr size_t DIAG_WRITE_WORDS =
+    CONFIG_ESPUSB_CDC_DIAG_WRITE_SIZE / sizeof(uint32_t);
+
+static_assert(DIAG_WRITE_WORDS > 0, "Diagnostic write size is too small");
+
+/// Stack size for @ref s_write_task.
+static constexpr size_t DIAG_WRITE_TASK_STACK_SIZE =
+    2048 + (DIAG_WRITE_WORDS * sizeof(uint32_t));
+
+/// Task which sends the counter through write_to_cdc.
+static TaskHandle_t s_write_task = nullptr;
+
+/// Stack of @ref s_write_task.
+static StackType_t s_write_task_stack[DIAG_WRITE_TASK_STACK_SIZE];
+
+/// Storage for @ref s_write_task.
+static StaticTask_t s_write_task_storage;
+#endif // CONFIG_ESPUSB_CDC_DIAG_WRITE
+
+#if CONFIG_ESPUSB_CDC_DIAG_SINK
+/// Next expected counter value.
+static uint32_t s_sink_expected = 0;
+
+/// Tracks if @ref s_sink_expected has been initialized from the received
+/// data.
+static bool s_sink_synced = false;
+
+/// Partially received counter value.
+static uint32_t s_sink_word = 0;
+
+/// Number of bytes received for @ref s_sink_word.
+static uint8_t s_sink_word_len = 0;
+#endif // CONFIG_ESPUSB_CDC_DIAG_SINK
+
+/// Fills the CDC TX FIFO with the counter pattern (source mode only).
+static void cdc_diag_fill()
+{
+#if CONFIG_ESPUSB_CDC_DIAG_SOURCE
+    uint32_t words[DIAG_CHUNK_SIZE / sizeof(uint32_t)];
+    uint32_t sent = 0;
+    while (tud_cdc_write_available() >= sizeof(words))
+    {
+        for (auto &word : words)
+        {
+            word = htole32(s_source_counter++);
+        }
+        sent += tud_cdc_write(words, sizeof(words));
+    }
+    tud_cdc_write_flush();
+    portENTER_CRITICAL(&s_diag_lock);
+    s_diag_stats.tx_bytes += sent;
+    portEXIT_CRITICAL(&s_diag_lock);
+#endif // CONFIG_ESPUSB_CDC_DIAG_SOURCE
+}
+
+#if CONFIG_ESPUSB_CDC_DIAG_WRITE
+/// Sends the counter pattern through write_to_cdc in the same way as an
+/// application would, this allows measuring the throughput of write_to_cdc
+/// with and without the bulk streaming mode.
+///
+/// @param param is not used.
+static void cdc_diag_write_task(void *param)
+{
+    uint32_t words[DIAG_WRITE_WORDS];
+    uint32_t counter = 0;
+    size_t offs = sizeof(words);
+    while (true)
+    {
+        // a new connection restarts the counter.
+        if (ulTaskNotifyTake(pdTRUE, 0))
+        {
+            counter = 0;
+            offs = sizeof(words);
+        }
+        if (offs == sizeof(words))
+        {
+            for (auto &word : words)
+            {
+                word = htole32(counter++);
+            }
+            offs = 0;
+        }
+        // a partial write is continued from where it stopped so the host
+        // sees an uninterrupted counter.
+        size_t sent = write_to_cdc((const char *)words + offs,
+                                   sizeof(words) - offs);
+        offs += sent;
+        if (sent)
+        {
+            portENTER_CRITICAL(&s_diag_lock);
+            s_diag_stats.tx_bytes += sent;
+            portEXIT_CRITICAL(&s_diag_lock);
+        }
+        else if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100)))
+        {
+            // the host is not connected (or stopped reading), wait for the
+            // next connection before trying again.
+            counter = 0;
+            offs = sizeof(words);
+        }
+    }
+}
+#endif // CONFIG_ESPUSB_CDC_DIAG_WRITE
+
+/// Processes data received in echo mode.
+///
+/// @param buf is the received data.
+/// @param size is the number of bytes received.
+/// @param rx_us is the time at which the data was received.
+static void cdc_diag_echo(const uint8_t *buf, size_t size, uint32_t rx_us)
+{
+#if CONFIG_ESPUSB_CDC_DIAG_ECHO
+    uint8_t *record = (uint8_t *)&s_echo_record;
+    while (size)
+    {
+        size_t len = std::min(size, sizeof(echo_record_t) - s_echo_record_len);
+        memcpy(record + s_echo_record_len, buf, len);
+        s_echo_record_len += len;
+        buf += len;
+        size -= len;
+        if (s_echo_record_len < sizeof(echo_record_t))
+        {
+            break;
+        }
+        s_echo_record_len = 0;
+        s_echo_record.device_rx_us = htole32(rx_us);
+        s_echo_record.device_tx_us = htole32((uint32_t)esp_timer_get_time());
+        if (tud_cdc_write_available() >= sizeof(echo_record_t))
+        {
+            tud_cdc_write(&s_echo_record, sizeof(echo_record_t));
+            portENTER_CRITICAL(&s_diag_lock);
+            s_diag_stats.tx_bytes += sizeof(echo_record_t);
+            portEXIT_CRITICAL(&s_diag_lock);
+        }
+        else
+        {
+            portENTER_CRITICAL(&s_diag_lock);
+            s_diag_stats.dropped++;
+            portEXIT_CRITICAL(&s_diag_lock);
+        }
+    }
+    tud_cdc_write_flush();
+#endif // CONFIG_ESPUSB_CDC_DIAG_ECHO
+}
+
+/// Verifies data received in sink mode.
+///
+/// @param buf is the received data.
+/// @param size is the number of bytes received.
+static void cdc_diag_sink(const uint8_t *buf, size_t size)
+{
+#if CONFIG_ESPUSB_CDC_DIAG_SINK
+    for (size_t index = 0; index < size; index++)
+    {
+        s_sink_word |= ((uint32_t)buf[index]) << (8 * s_sink_word_len);
+        if (++s_sink_word_len < sizeof(uint32_t))
+        {
+            continue;
+        }
+        if (s_sink_synced && s_sink_word != s_sink_expected)
+        {
+            ESP_LOGV(TAG, "Counter mismatch: %u != %u", s_sink_word,
+                     s_sink_expected);
+            portENTER_CRITICAL(&s_diag_lock);
+            s_diag_stats.errors++;
+            if (s_sink_word > s_sink_expected)
+            {
+                s_diag_stats.dropped += s_sink_word - s_sink_expected;
+            }
+            portEXIT_CRITICAL(&s_diag_lock);
+        }
+        // resynchronize on the received value so a single error does not
+        // cause all following values to be reported as errors.
+        s_sink_expected = s_sink_word + 1;
+        s_sink_synced = true;
+        s_sink_word = 0;
+        s_sink_word_len = 0;
+    }
+#endif // CONFIG_ESPUSB_CDC_DIAG_SINK
+}
+
+/// Initializes the diagnostic mode.
+void init_usb_cdc_diag()
+{
+#if CONFIG_ESPUSB_CDC_DIAG_WRITE
+    s_write_task =
+        xTaskCreateStaticPinnedToCore(cdc_diag_write_task, "usb-cdc-diag",
+                                      DIAG_WRITE_TASK_STACK_SIZE, nullptr,
+                                      tskIDLE_PRIORITY + 1,
+                                      s_write_task_stack,
+                                      &s_write_task_storage,
+                                      CONFIG_ESPUSB_TASK_AFFINITY);
+    if (s_write_task == nullptr)
+    {
+        ESP_LOGE(TAG, "Failed to create diagnostic write task.");
+        abort();
+    }
+#endif // CONFIG_ESPUSB_CDC_DIAG_WRITE
+}
+
+/// Invoked by the CDC layer when the host connects.
+void cdc_diag_connected()
+{
+    ESP_LOGI(TAG, "Host connected, starting diagnostic mode");
+#if CONFIG_ESPUSB_CDC_DIAG_ECHO
+    s_echo_record_len = 0;
+#endif // CONFIG_ESPUSB_CDC_DIAG_ECHO
+#if CONFIG_ESPUSB_CDC_DIAG_SOURCE
+    s_source_counter = 0;
+#endif // CONFIG_ESPUSB_CDC_DIAG_SOURCE
+#if CONFIG_ESPUSB_CDC_DIAG_SINK
+    s_sink_synced = false;
+    s_sink_word = 0;
+    s_sink_word_len = 0;
+#endif // CONFIG_ESPUSB_CDC_DIAG_SINK
+    portENTER_CRITICAL(&s_diag_lock);
+    bzero(&s_diag_stats, sizeof(esp_usb_cdc_diag_stats_t));
+    portEXIT_CRITICAL(&s_diag_lock);
+    cdc_diag_fill();
+#if CONFIG_ESPUSB_CDC_DIAG_WRITE
+    xTaskNotifyGive(s_write_task);
+#endif // CONFIG_ESPUSB_CDC_DIAG_WRITE
+}
+
+/// Invoked by the CDC layer when an IN transfer has completed.
+void cdc_diag_tx_complete()
+{
+    cdc_diag_fill();
+}
+
+extern "C"
+{
+
+// Invoked when data has been received on the CDC OUT endpoint.
+void tud_cdc_rx_cb(uint8_t itf)
+{
+    uint32_t rx_us = (uint32_t)esp_timer_get_time();
+    uint8_t buf[DIAG_CHUNK_SIZE];
+    uint32_t len;
+    while ((len = tud_cdc_read(buf, sizeof(buf))) > 0)
+    {
+        portENTER_CRITICAL(&s_diag_lock);
+        s_diag_stats.rx_bytes += len;
+        portEXIT_CRITICAL(&s_diag_lock);
+        cdc_diag_echo(buf, len, rx_us);
+        cdc_diag_sink(buf, len);
+    }
+}
+
+} // extern "C"
+
+#endif // CONFIG_ESPUSB_CDC_DIAG
+
+// Retrieves the diagnostic mode statistics.
+void get_cdc_diag_stats(esp_usb_cdc_diag_stats_t *stats)
+{
+    bzero(stats, sizeof(esp_usb_cdc_diag_stats_t));
+#if CONFIG_ESPUSB_CDC_DIAG
+    portENTER_CRITICAL(&s_diag_lock);
+    memcpy(stats, &s_diag_stats, sizeof(esp_usb_cdc_diag_stats_t));
+    portEXIT_CRITICAL(&s_diag_lock);
+#endif // CONFIG_ESPUSB_CDC_DIAG
+}
+
+#endif // CONFIG_ESPUSB_CDC
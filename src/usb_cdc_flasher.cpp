@@ -0,0 +1,854 @@
+// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+
+// if Esp32USB debug is enabled set the local log level higher than any of the
+// pre-defined log levels.
+#if CONFIG_ESPUSB_DEBUG
+#define LOG_LOCAL_LEVEL 0xFF
+#endif
+
+#include <endian.h>
+#include <esp_log.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <esp_rom_md5.h>
+#include <esp_system.h>
+#if CONFIG_IDF_TARGET_ESP32S2
+#include <esp32s2/rom/miniz.h>
+#elif CONFIG_IDF_TARGET_ESP32S3
+#include <esp32s3/rom/miniz.h>
+#else
+#error Unsupported architecture.
+#endif
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <soc/soc.h>
+#include <stdlib.h>
+#include <string.h>
+#include "caps_allocator.h"
+#include "usb.h"
+
+/// Tag used for all logging.
+static constexpr const char * const TAG = "USB:FLASH";
+
+#if CONFIG_ESPUSB_CDC && CONFIG_ESPUSB_CDC_FLASHER
+
+/// esptool serial protocol commands which are recognized.
+typedef enum
+{
+    CMD_FLASH_BEGIN = 0x02,
+    CMD_FLASH_DATA = 0x03,
+    CMD_FLASH_END = 0x04,
+    CMD_MEM_BEGIN = 0x05,
+    CMD_MEM_END = 0x06,
+    CMD_MEM_DATA = 0x07,
+    CMD_SYNC = 0x08,
+    CMD_WRITE_REG = 0x09,
+    CMD_READ_REG = 0x0A,
+    CMD_SPI_SET_PARAMS = 0x0B,
+    CMD_SPI_ATTACH = 0x0D,
+    CMD_CHANGE_BAUDRATE = 0x0F,
+    CMD_FLASH_DEFL_BEGIN = 0x10,
+    CMD_FLASH_DEFL_DATA = 0x11,
+    CMD_FLASH_DEFL_END = 0x12,
+    CMD_SPI_FLASH_MD5 = 0x13,
+} flasher_command_t;
+
+/// esptool serial protocol error codes, these match the ROM loader.
+typedef enum
+{
+    FLASHER_ERR_NONE = 0x00,
+    FLASHER_ERR_INVALID_MESSAGE = 0x05,
+    FLASHER_ERR_FAILED = 0x06,
+    FLASHER_ERR_INVALID_CRC = 0x07,
+    FLASHER_ERR_FLASH_WRITE = 0x08,
+    FLASHER_ERR_FLASH_READ = 0x09,
+    FLASHER_ERR_DEFLATE = 0x0B,
+} flasher_error_t;
+
+/// SLIP frame delimiter.
+static constexpr uint8_t SLIP_END = 0xC0;
+
+/// SLIP escape byte.
+static constexpr uint8_t SLIP_ESC = 0xDB;
+
+/// Escaped form of @ref SLIP_END.
+static constexpr uint8_t SLIP_ESC_END = 0xDC;
+
+/// Escaped form of @ref SLIP_ESC.
+static constexpr uint8_t SLIP_ESC_ESC = 0xDD;
+
+/// Size of the command packet header.
+static constexpr size_t COMMAND_HEADER_SIZE = 8;
+
+/// Size of the header which precedes the payload of *_DATA commands.
+static constexpr size_t DATA_HEADER_SIZE = 16;
+
+/// Largest data block accepted, this matches the block size esptool uses
+/// when it is talking to its flasher stub.
+static constexpr size_t MAX_BLOCK_SIZE = 0x4000;
+
+/// Largest command packet accepted.
+static constexpr size_t MAX_PACKET_SIZE =
+    COMMAND_HEADER_SIZE + DATA_HEADER_SIZE + MAX_BLOCK_SIZE;
+
+/// Initial value for the *_DATA command checksum.
+static constexpr uint8_t CHECKSUM_SEED = 0xEF;
+
+/// Number of responses sent for a SYNC command, this matches the ROM loader.
+static constexpr size_t SYNC_RESPONSE_COUNT = 8;
+
+/// Stack size for the flasher task.
+static constexpr uint32_t FLASHER_TASK_STACK_SIZE = 4096;
+
+/// Address esptool reads to identify the chip.
+static constexpr uint32_t CHIP_DETECT_MAGIC_REG = 0x40001000;
+
+#if CONFIG_IDF_TARGET_ESP32S2
+/// ROM loader variable esptool reads to check if the USB-OTG console is used.
+static constexpr uint32_t UARTDEV_BUF_NO_REG = 0x3FFFFD14;
+
+/// Start of the peripheral register space which can be read via READ_REG.
+static constexpr uint32_t READ_REG_LOW = 0x3F400000;
+
+/// End of the peripheral register space which can be read via READ_REG.
+static constexpr uint32_t READ_REG_HIGH = 0x3F500000;
+#elif CONFIG_IDF_TARGET_ESP32S3
+/// ROM loader variable esptool reads to check if the USB-OTG console is used.
+static constexpr uint32_t UARTDEV_BUF_NO_REG = 0x3FCEF14C;
+
+/// Start of the peripheral register space which can be read via READ_REG.
+static constexpr uint32_t READ_REG_LOW = 0x60000000;
+
+/// End of the peripheral register space which can be read via READ_REG.
+static constexpr uint32_t READ_REG_HIGH = 0x600D1000;
+#endif
+
+/// Task which processes the flasher protocol.
+static TaskHandle_t s_flasher_task = nullptr;
+
+/// Stack of @ref s_flasher_task.
+static StackType_t s_flasher_task_stack[FLASHER_TASK_STACK_SIZE];
+
+/// Storage for @ref s_flasher_task.
+static StaticTask_t s_flasher_task_storage;
+
+/// Tracks if the flasher owns the CDC data stream.
+static volatile bool s_flasher_active = false;
+
+/// Tracks if the flasher session should be ended.
+static volatile bool s_flasher_stop = false;
+
+/// Decoded command packet.
+static uint8_t s_packet[MAX_PACKET_SIZE];
+
+/// Number of bytes used in @ref s_packet.
+static size_t s_packet_len = 0;
+
+/// Tracks if the SLIP decoder is inside a frame.
+static bool s_slip_in_frame = false;
+
+/// Tracks if the previous byte was @ref SLIP_ESC.
+static bool s_slip_escape = false;
+
+/// Tracks if the current frame has exceeded @ref MAX_PACKET_SIZE.
+static bool s_slip_overflow = false;
+
+/// Partition receiving the image.
+static const esp_partition_t *s_target = nullptr;
+
+/// OTA handle for @ref s_target.
+static esp_ota_handle_t s_ota_handle = 0;
+
+/// Flash offset requested by the host, this is mapped to @ref s_target.
+static uint32_t s_flash_offset = 0;
+
+/// Number of bytes the host will write.
+static uint32_t s_flash_size = 0;
+
+/// Number of bytes written to @ref s_target.
+static uint32_t s_flash_written = 0;
+
+/// Next expected data block sequence number.
+static uint32_t s_flash_sequence = 0;
+
+/// Decompressor used for FLASH_DEFL_* commands, this is accessed for every
+/// decompressed byte and is allocated from internal memory.
+static tinfl_decompressor *s_inflator = nullptr;
+
+/// Dictionary (and output buffer) for @ref s_inflator, allocated from PSRAM
+/// when available.
+static uint8_t *s_inflate_dict = nullptr;
+
+#if CONFIG_ESPUSB_STATIC_ALLOCATION
+/// Static storage for @ref s_inflator.
+static tinfl_decompressor s_inflator_storage;
+
+/// Static storage for @ref s_inflate_dict.
+static uint8_t s_inflate_dict_storage[TINFL_LZ_DICT_SIZE];
+#endif // CONFIG_ESPUSB_STATIC_ALLOCATION
+
+/// Offset of the next output byte in @ref s_inflate_dict.
+static size_t s_inflate_offs = 0;
+
+/// Writes data to the CDC, waiting for space in the TX buffer.
+///
+/// @param buf is the data to write.
+/// @param size is the number of bytes to write.
+///
+/// NOTE: esptool keeps DTR deasserted for the whole session so
+/// tud_cdc_connected() is always false here, only the USB device state is
+/// checked.
+static void flasher_write(const uint8_t *buf, size_t size)
+{
+    size_t offs = 0;
+    while (offs < size && tud_ready())
+    {
+        uint32_t written = tud_cdc_write(buf + offs, size - offs);
+        if (written == 0)
+        {
+            flush_cdc();
+            vTaskDelay(1);
+        }
+        offs += written;
+    }
+}
+
+/// Writes data to the CDC with SLIP escaping applied.
+///
+/// @param buf is the data to write.
+/// @param size is the number of bytes to write.
+static void slip_write(const uint8_t *buf, size_t size)
+{
+    static constexpr uint8_t ESCAPED_END[] = {SLIP_ESC, SLIP_ESC_END};
+    static constexpr uint8_t ESCAPED_ESC[] = {SLIP_ESC, SLIP_ESC_ESC};
+    size_t start = 0;
+    for (size_t index = 0; index < size; index++)
+    {
+        if (buf[index] == SLIP_END || buf[index] == SLIP_ESC)
+        {
+            flasher_write(buf + start, index - start);
+            flasher_write(buf[index] == SLIP_END ? ESCAPED_END : ESCAPED_ESC,
+                          2);
+            start = index + 1;
+        }
+    }
+    flasher_write(buf + start, size - start);
+}
+
+/// Sends a command response to the host.
+///
+/// @param op is the command being responded to.
+/// @param value is the value field of the response.
+/// @param data is the optional response payload.
+/// @param size is the size of @param data.
+/// @param error is the error code, @ref FLASHER_ERR_NONE for success.
+static void flasher_respond(uint8_t op, uint32_t value,
+                            const uint8_t *data = nullptr, size_t size = 0,
+                            flasher_error_t error = FLASHER_ERR_NONE)
+{
+    uint8_t header[COMMAND_HEADER_SIZE];
+    uint8_t status[2] =
+    {
+        (uint8_t)(error != FLASHER_ERR_NONE), (uint8_t)error
+    };
+    uint16_t len = htole16(size + sizeof(status));
+    value = htole32(value);
+    header[0] = 0x01;
+    header[1] = op;
+    memcpy(header + 2, &len, sizeof(len));
+    memcpy(header + 4, &value, sizeof(value));
+
+    flasher_write(&SLIP_END, 1);
+    slip_write(header, sizeof(header));
+    slip_write(data, size);
+    slip_write(status, sizeof(status));
+    flasher_write(&SLIP_END, 1);
+    flush_cdc();
+
+    if (error != FLASHER_ERR_NONE)
+    {
+        ESP_LOGW(TAG, "Command %02x failed: %02x", op, error);
+    }
+}
+
+/// Reads a 32-bit little-endian parameter from a command payload.
+///
+/// @param data is the command payload.
+/// @param index is the parameter index.
+///
+/// @return the parameter value.
+static inline uint32_t flasher_param(const uint8_t *data, size_t index)
+{
+    uint32_t value;
+    memcpy(&value, data + (index * sizeof(uint32_t)), sizeof(uint32_t));
+    return le32toh(value);
+}
+
+/// Releases the decompressor used for FLASH_DEFL_* commands.
+static void flasher_free_inflator()
+{
+#if !CONFIG_ESPUSB_STATIC_ALLOCATION
+    InternalHeap::deallocate(s_inflator, sizeof(tinfl_decompressor));
+    PSRAMHeap::deallocate(s_inflate_dict, TINFL_LZ_DICT_SIZE);
+#endif // !CONFIG_ESPUSB_STATIC_ALLOCATION
+    s_inflator = nullptr;
+    s_inflate_dict = nullptr;
+}
+
+/// Aborts any in-progress image write.
+static void flasher_abort()
+{
+    if (s_ota_handle)
+    {
+        ESP_LOGW(TAG, "Aborting image write after %u/%u bytes",
+                 s_flash_written, s_flash_size);
+        esp_ota_abort(s_ota_handle);
+    }
+    s_ota_handle = 0;
+    s_target = nullptr;
+    s_flash_written = 0;
+    s_flash_size = 0;
+    flasher_free_inflator();
+}
+
+/// Finalizes a completely received image and switches the boot partition to
+/// it.
+///
+/// @return true if the new image will be used on the next restart.
+static bool flasher_finish()
+{
+    if (!s_ota_handle || s_flash_written < s_flash_size)
+    {
+        flasher_abort();
+        return false;
+    }
+    const esp_partition_t *target = s_target;
+    esp_err_t err = ESP_ERROR_CHECK_WITHOUT_ABORT(esp_ota_end(s_ota_handle));
+    s_ota_handle = 0;
+    flasher_abort();
+    if (err == ESP_OK)
+    {
+        err = ESP_ERROR_CHECK_WITHOUT_ABORT(
+            esp_ota_set_boot_partition(target));
+    }
+    ESP_LOGI(TAG, "Image write to %s complete: %s", target->label,
+             esp_err_to_name(err));
+    return err == ESP_OK;
+}
+
+/// Writes image data to the target partition.
+///
+/// @param data is the image data.
+/// @param size is the number of bytes available.
+///
+/// @return true if the data was written successfully.
+static bool flasher_write_image(const uint8_t *data, size_t size)
+{
+    // the final block is padded by the host, discard the padding.
+    size = std::min(size, (size_t)(s_flash_size - s_flash_written));
+    if (size == 0)
+    {
+        return true;
+    }
+    if (ESP_ERROR_CHECK_WITHOUT_ABORT(
+            esp_ota_write(s_ota_handle, data, size)) != ESP_OK)
+    {
+        return false;
+    }
+    s_flash_written += size;
+    return true;
+}
+
+/// Handles FLASH_BEGIN and FLASH_DEFL_BEGIN.
+///
+/// @param op is the command.
+/// @param data is the command payload.
+/// @param size is the size of the command payload.
+///
+/// @return the error code to report to the host.
+static flasher_error_t flasher_begin(uint8_t op, const uint8_t *data,
+                                     size_t size)
+{
+    if (size < 4 * sizeof(uint32_t))
+    {
+        return FLASHER_ERR_INVALID_MESSAGE;
+    }
+    uint32_t write_size = flasher_param(data, 0);
+    uint32_t offset = flasher_param(data, 3);
+
+    // esptool sends a zero length begin after the last image, this must not
+    // discard the image that was just written.
+    if (write_size == 0)
+    {
+        return FLASHER_ERR_NONE;
+    }
+
+    // Only application images are supported, they are redirected to the next
+    // OTA partition rather than overwriting the running application.
+    bool is_app_offset = false;
+    esp_partition_iterator_t it =
+        esp_partition_find(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY,
+                           nullptr);
+    while (it != nullptr && !is_app_offset)
+    {
+        is_app_offset = (esp_partition_get(it)->address == offset);
+        it = esp_partition_next(it);
+    }
+    esp_partition_iterator_release(it);
+    const esp_partition_t *target = esp_ota_get_next_update_partition(nullptr);
+    if (!is_app_offset || target == nullptr ||
+        target == esp_ota_get_running_partition() || write_size > target->size)
+    {
+        ESP_LOGE(TAG, "Unable to write %u bytes at 0x%x, only application "
+                 "images can be written.", write_size, offset);
+        return FLASHER_ERR_FAILED;
+    }
+
+    // starting a new image replaces any previous image from this session.
+    flasher_abort();
+    if (op == CMD_FLASH_DEFL_BEGIN)
+    {
+#if CONFIG_ESPUSB_STATIC_ALLOCATION
+        s_inflator = &s_inflator_storage;
+        s_inflate_dict = s_inflate_dict_storage;
+#else
+        s_inflator = (tinfl_decompressor *)
+            InternalHeap::allocate(sizeof(tinfl_decompressor));
+        s_inflate_dict = (uint8_t *)PSRAMHeap::allocate(TINFL_LZ_DICT_SIZE);
+#endif // CONFIG_ESPUSB_STATIC_ALLOCATION
+        if (s_inflator == nullptr || s_inflate_dict == nullptr)
+        {
+            ESP_LOGE(TAG, "Unable to allocate decompression buffers.");
+            flasher_free_inflator();
+            return FLASHER_ERR_FAILED;
+        }
+        tinfl_init(s_inflator);
+        s_inflate_offs = 0;
+    }
+
+    ESP_LOGI(TAG, "Writing %u bytes for 0x%x to %s", write_size, offset,
+             target->label);
+    if (ESP_ERROR_CHECK_WITHOUT_ABORT(
+            esp_ota_begin(target, write_size, &s_ota_handle)) != ESP_OK)
+    {
+        s_ota_handle = 0;
+        flasher_free_inflator();
+        return FLASHER_ERR_FAILED;
+    }
+    s_target = target;
+    s_flash_offset = offset;
+    s_flash_size = write_size;
+    s_flash_written = 0;
+    s_flash_sequence = 0;
+    return FLASHER_ERR_NONE;
+}
+
+/// Handles FLASH_DATA and FLASH_DEFL_DATA.
+///
+/// @param op is the command.
+/// @param data is the command payload.
+/// @param size is the size of the command payload.
+///
+/// @return the error code to report to the host.
+static flasher_error_t flasher_data(uint8_t op, const uint8_t *data,
+                                    size_t size)
+{
+    if (!s_ota_handle || size < DATA_HEADER_SIZE ||
+        (op == CMD_FLASH_DEFL_DATA) != (s_inflator != nullptr))
+    {
+        return FLASHER_ERR_FAILED;
+    }
+    uint32_t len = flasher_param(data, 0);
+    uint32_t sequence = flasher_param(data, 1);
+    if (len != size - DATA_HEADER_SIZE || sequence != s_flash_sequence)
+    {
+        return FLASHER_ERR_INVALID_MESSAGE;
+    }
+    s_flash_sequence++;
+    data += DATA_HEADER_SIZE;
+
+    if (op == CMD_FLASH_DATA)
+    {
+        return flasher_write_image(data, len) ? FLASHER_ERR_NONE :
+                                                FLASHER_ERR_FLASH_WRITE;
+    }
+
+    // The decompressed output is written straight from the dictionary, it
+    // wraps around so each step produces at most the remaining dictionary
+    // space.
+    size_t in_offs = 0;
+    tinfl_status status;
+    do
+    {
+        size_t in_len = len - in_offs;
+        size_t out_len = TINFL_LZ_DICT_SIZE - s_inflate_offs;
+        status =
+            tinfl_decompress(s_inflator, data + in_offs, &in_len,
+                             s_inflate_dict, s_inflate_dict + s_inflate_offs,
+                             &out_len,
+                             TINFL_FLAG_PARSE_ZLIB_HEADER |
+                             TINFL_FLAG_HAS_MORE_INPUT);
+        in_offs += in_len;
+        if (status < TINFL_STATUS_DONE)
+        {
+            ESP_LOGE(TAG, "Decompression failed: %d", status);
+            return FLASHER_ERR_DEFLATE;
+        }
+        if (!flasher_write_image(s_inflate_dict + s_inflate_offs, out_len))
+        {
+            return FLASHER_ERR_FLASH_WRITE;
+        }
+        s_inflate_offs = (s_inflate_offs + out_len) & (TINFL_LZ_DICT_SIZE - 1);
+    } while (status == TINFL_STATUS_HAS_MORE_OUTPUT ||
+             (status == TINFL_STATUS_NEEDS_MORE_INPUT && in_offs < len));
+    return FLASHER_ERR_NONE;
+}
+
+/// Handles SPI_FLASH_MD5.
+///
+/// @param data is the command payload.
+/// @param size is the size of the command payload.
+/// @param digest receives the MD5 digest.
+///
+/// @return the error code to report to the host.
+static flasher_error_t flasher_md5(const uint8_t *data, size_t size,
+                                   uint8_t digest[ESP_ROM_MD5_DIGEST_LEN])
+{
+    if (size < 2 * sizeof(uint32_t))
+    {
+        return FLASHER_ERR_INVALID_MESSAGE;
+    }
+    uint32_t addr = flasher_param(data, 0);
+    uint32_t len = flasher_param(data, 1);
+    const esp_partition_t *target =
+        s_target ? s_target : esp_ota_get_next_update_partition(nullptr);
+    if (target == nullptr || addr < s_flash_offset ||
+        (addr - s_flash_offset) + len > target->size)
+    {
+        return FLASHER_ERR_FAILED;
+    }
+    // the image data is held in the packet buffer only transiently, reuse
+    // part of it as the read buffer.
+    uint8_t *buf = s_packet;
+    size_t offs = addr - s_flash_offset;
+    md5_context_t ctx;
+    esp_rom_md5_init(&ctx);
+    while (len)
+    {
+        size_t chunk = std::min((size_t)len, MAX_BLOCK_SIZE);
+        if (esp_partition_read(target, offs, buf, chunk) != ESP_OK)
+        {
+            return FLASHER_ERR_FLASH_READ;
+        }
+        esp_rom_md5_update(&ctx, buf, chunk);
+        offs += chunk;
+        len -= chunk;
+    }
+    esp_rom_md5_final(digest, &ctx);
+    return FLASHER_ERR_NONE;
+}
+
+/// Handles READ_REG, only the peripheral register space and the chip
+/// detection register can be read.
+///
+/// @param addr is the register address.
+/// @param value receives the register value.
+///
+/// @return the error code to report to the host.
+static flasher_error_t flasher_read_reg(uint32_t addr, uint32_t *value)
+{
+    if (addr == UARTDEV_BUF_NO_REG)
+    {
+        // report the UART console so esptool uses the classic reset sequence
+        // which ends the flashing session.
+        *value = 0;
+    }
+    else if ((addr & 3) == 0 &&
+             (addr == CHIP_DETECT_MAGIC_REG ||
+              (addr >= READ_REG_LOW && addr < READ_REG_HIGH)))
+    {
+        *value = REG_READ(addr);
+    }
+    else
+    {
+        return FLASHER_ERR_FAILED;
+    }
+    return FLASHER_ERR_NONE;
+}
+
+/// Processes a complete command packet.
+static void flasher_process_packet()
+{
+    if (s_packet_len < COMMAND_HEADER_SIZE || s_packet[0] != 0x00)
+    {
+        return;
+    }
+    uint8_t op = s_packet[1];
+    uint16_t size;
+    uint32_t checksum;
+    memcpy(&size, s_packet + 2, sizeof(size));
+    memcpy(&checksum, s_packet + 4, sizeof(checksum));
+    size = le16toh(size);
+    checksum = le32toh(checksum);
+    const uint8_t *data = s_packet + COMMAND_HEADER_SIZE;
+    if (size != s_packet_len - COMMAND_HEADER_SIZE)
+    {
+        flasher_respond(op, 0, nullptr, 0, FLASHER_ERR_INVALID_MESSAGE);
+        return;
+    }
+
+    if (op == CMD_FLASH_DATA || op == CMD_FLASH_DEFL_DATA || op == CMD_MEM_DATA)
+    {
+        uint8_t expected = CHECKSUM_SEED;
+        for (size_t index = DATA_HEADER_SIZE; index < size; index++)
+        {
+            expected ^= data[index];
+        }
+        if (size < DATA_HEADER_SIZE || expected != checksum)
+        {
+            flasher_respond(op, 0, nullptr, 0, FLASHER_ERR_INVALID_CRC);
+            return;
+        }
+    }
+
+    ESP_LOGV(TAG, "Command %02x (%u bytes)", op, size);
+    switch (op)
+    {
+        case CMD_SYNC:
+            // the zero value tells esptool that a flasher stub is already
+            // running so it does not try to upload one.
+            for (size_t count = 0; count < SYNC_RESPONSE_COUNT; count++)
+            {
+                flasher_respond(op, 0);
+            }
+            break;
+        case CMD_READ_REG:
+        {
+            uint32_t value = 0;
+            flasher_error_t err = FLASHER_ERR_INVALID_MESSAGE;
+            if (size >= sizeof(uint32_t))
+            {
+                err = flasher_read_reg(flasher_param(data, 0), &value);
+            }
+            flasher_respond(op, value, nullptr, 0, err);
+            break;
+        }
+        case CMD_WRITE_REG:
+        case CMD_SPI_SET_PARAMS:
+        case CMD_SPI_ATTACH:
+        case CMD_CHANGE_BAUDRATE:
+        case CMD_MEM_BEGIN:
+        case CMD_MEM_DATA:
+            // the running application already owns the flash and registers,
+            // these are accepted without any action.
+            flasher_respond(op, 0);
+            break;
+        case CMD_MEM_END:
+        {
+            // older esptool versions upload a flasher stub and wait for it to
+            // announce itself.
+            static constexpr uint8_t STUB_HELLO[] = {'O', 'H', 'A', 'I'};
+            flasher_respond(op, 0);
+            flasher_write(&SLIP_END, 1);
+            slip_write(STUB_HELLO, sizeof(STUB_HELLO));
+            flasher_write(&SLIP_END, 1);
+            flush_cdc();
+            break;
+        }
+        case CMD_FLASH_BEGIN:
+        case CMD_FLASH_DEFL_BEGIN:
+            flasher_respond(op, 0, nullptr, 0, flasher_begin(op, data, size));
+            break;
+        case CMD_FLASH_DATA:
+        case CMD_FLASH_DEFL_DATA:
+        {
+            flasher_error_t err = flasher_data(op, data, size);
+            if (err != FLASHER_ERR_NONE)
+            {
+                flasher_abort();
+            }
+            flasher_respond(op, 0, nullptr, 0, err);
+            break;
+        }
+        case CMD_FLASH_END:
+        case CMD_FLASH_DEFL_END:
+            flasher_respond(op, 0);
+            // a zero flag requests a reboot into the new image.
+            if (size >= sizeof(uint32_t) && flasher_param(data, 0) == 0)
+            {
+                s_flasher_stop = true;
+            }
+            break;
+        case CMD_SPI_FLASH_MD5:
+        {
+            uint8_t digest[ESP_ROM_MD5_DIGEST_LEN];
+            flasher_error_t err = flasher_md5(data, size, digest);
+            flasher_respond(op, 0, digest,
+                            err == FLASHER_ERR_NONE ? sizeof(digest) : 0, err);
+            break;
+        }
+        default:
+            flasher_respond(op, 0, nullptr, 0, FLASHER_ERR_INVALID_MESSAGE);
+    }
+}
+
+/// Decodes SLIP framed data received from the host.
+///
+/// @param buf is the received data.
+/// @param size is the number of bytes received.
+static void flasher_receive(const uint8_t *buf, size_t size)
+{
+    for (size_t index = 0; index < size; index++)
+    {
+        uint8_t ch = buf[index];
+        if (ch == SLIP_END)
+        {
+            if (s_slip_in_frame && s_packet_len && !s_slip_overflow)
+            {
+                flasher_process_packet();
+            }
+            s_slip_in_frame = true;
+            s_slip_escape = false;
+            s_slip_overflow = false;
+            s_packet_len = 0;
+            continue;
+        }
+        if (!s_slip_in_frame)
+        {
+            continue;
+        }
+        if (s_slip_escape)
+        {
+            ch = (ch == SLIP_ESC_END) ? SLIP_END :
+                 (ch == SLIP_ESC_ESC) ? SLIP_ESC : ch;
+            s_slip_escape = false;
+        }
+        else if (ch == SLIP_ESC)
+        {
+            s_slip_escape = true;
+            continue;
+        }
+        if (s_packet_len < MAX_PACKET_SIZE)
+        {
+            s_packet[s_packet_len++] = ch;
+        }
+        else
+        {
+            s_slip_overflow = true;
+        }
+    }
+}
+
+/// Processes the flasher protocol, image writes and erases can take a long
+/// time so this is kept out of the USB task.
+///
+/// @param param is not used.
+static void flasher_task(void *param)
+{
+    uint8_t buf[CONFIG_ESPUSB_CDC_FIFO_SIZE];
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        uint32_t len;
+        while (s_flasher_active && !s_flasher_stop &&
+               (len = tud_cdc_read(buf, sizeof(buf))) > 0)
+        {
+            flasher_receive(buf, len);
+        }
+        if (s_flasher_stop)
+        {
+            bool restart = flasher_finish();
+            s_flasher_active = false;
+            s_flasher_stop = false;
+            ESP_LOGI(TAG, "Flashing session ended");
+            if (restart)
+            {
+                ESP_LOGI(TAG, "Restarting...");
+                // give the host time to collect the final response.
+                vTaskDelay(pdMS_TO_TICKS(100));
+                esp_restart();
+            }
+        }
+    }
+}
+
+/// Initializes the in-application flasher.
+void init_usb_cdc_flasher()
+{
+    s_flasher_task =
+        xTaskCreateStaticPinnedToCore(flasher_task, "usb-flasher",
+                                      FLASHER_TASK_STACK_SIZE, nullptr,
+                                      CONFIG_ESPUSB_TASK_PRIORITY - 1,
+                                      s_flasher_task_stack,
+                                      &s_flasher_task_storage,
+                                      CONFIG_ESPUSB_TASK_AFFINITY);
+    if (s_flasher_task == nullptr)
+    {
+        ESP_LOGE(TAG, "Failed to create flasher task.");
+        abort();
+    }
+}
+
+/// Starts a flashing session, all CDC data is processed by the flasher until
+/// @ref cdc_flasher_stop is called.
+void cdc_flasher_start()
+{
+    ESP_LOGI(TAG, "Starting in-application flashing session");
+    s_slip_in_frame = false;
+    s_packet_len = 0;
+    s_flasher_stop = false;
+    s_flasher_active = true;
+    xTaskNotifyGive(s_flasher_task);
+}
+
+/// Ends the flashing session, when a complete image has been received the
+/// system is restarted into it.
+void cdc_flasher_stop()
+{
+    if (s_flasher_active)
+    {
+        s_flasher_stop = true;
+        xTaskNotifyGive(s_flasher_task);
+    }
+}
+
+// Default implementation of cdc_app_rx_cb which leaves the data in the RX
+// buffer.
+TU_ATTR_WEAK void cdc_app_rx_cb(uint8_t itf)
+{
+}
+
+extern "C"
+{
+
+// Invoked when data has been received on the CDC OUT endpoint, the data
+// belongs to the application unless a flashing session is active.
+void tud_cdc_rx_cb(uint8_t itf)
+{
+    if (s_flasher_active)
+    {
+        xTaskNotifyGive(s_flasher_task);
+    }
+    else
+    {
+        cdc_app_rx_cb(itf);
+    }
+}
+
+} // extern "C"
+
+#endif // CONFIG_ESPUSB_CDC && CONFIG_ESPUSB_CDC_FLASHER
@@ -0,0 +1,284 @@
+// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+
+// if Esp32USB debug is enabled set the local log level higher than any of the
+// pre-defined log levels.
+#if CONFIG_ESPUSB_DEBUG
+#define LOG_LOCAL_LEVEL 0xFF
+#endif
+
+#include <endian.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <string.h>
+#include "cdc_frame.h"
+#include "usb.h"
+
+/// Tag used for all logging.
+static constexpr const char * const TAG = "USB:CDC:FRAME";
+
+#if CONFIG_ESPUSB_CDC && CONFIG_ESPUSB_CDC_FRAMING
+
+void cdc_written(const char *buf, size_t size, int64_t start_us);
+bool cdc_wait_tx_complete(TickType_t ticks);
+
+/// Maximum number of ticks to wait for space in the TX buffer.
+static constexpr TickType_t WRITE_TIMEOUT_TICKS =
+    pdMS_TO_TICKS(CONFIG_ESPUSB_CDC_WRITE_FLUSH_TIMEOUT);
+
+/// Largest COBS block payload.
+static constexpr size_t COBS_MAX_RUN = 254;
+
+/// Lock used to ensure frames are written to the TX buffer as a single unit.
+static SemaphoreHandle_t s_frame_lock = nullptr;
+
+/// Storage for @ref s_frame_lock.
+static StaticSemaphore_t s_frame_lock_storage;
+
+/// Decoder for frames received from the host.
+static CobsFrameDecoder<CONFIG_ESPUSB_CDC_FRAME_MAX_SIZE> s_frame_decoder;
+
+/// Payload and CRC of a frame being encoded, the two segments are encoded as
+/// if they were a single contiguous buffer.
+typedef struct
+{
+    /// Payload of the frame.
+    const uint8_t *data;
+
+    /// Size of the payload.
+    size_t size;
+
+    /// CRC of the payload in little-endian format.
+    uint8_t crc[CDC_FRAME_CRC_SIZE];
+} frame_source_t;
+
+/// Finds the number of non-zero bytes starting at an offset.
+///
+/// @param src is the frame being encoded.
+/// @param offs is the offset to start from.
+///
+/// @return the number of non-zero bytes, up to @ref COBS_MAX_RUN.
+static size_t cobs_run(const frame_source_t &src, size_t offs)
+{
+    size_t run = 0;
+    if (offs < src.size)
+    {
+        size_t len = std::min(src.size - offs, COBS_MAX_RUN);
+        const uint8_t *zero =
+            (const uint8_t *)memchr(src.data + offs, 0, len);
+        if (zero)
+        {
+            return zero - (src.data + offs);
+        }
+        run = len;
+        offs += len;
+        if (offs < src.size)
+        {
+            // the run filled a complete block before reaching the CRC.
+            return run;
+        }
+    }
+    offs -= src.size;
+    while (run < COBS_MAX_RUN && offs < CDC_FRAME_CRC_SIZE && src.crc[offs])
+    {
+        run++;
+        offs++;
+    }
+    return run;
+}
+
+/// Writes data to the CDC TX buffer, waiting for space if other writers
+/// (@ref write_to_cdc) have used up the space available when the frame was
+/// started.
+///
+/// @param data is the data to write.
+/// @param len is the number of bytes to write.
+/// @param ticks_start is the tick count at which the frame write started.
+///
+/// @return true if all data was written before the write timeout expired.
+static bool cdc_frame_write(const void *data, size_t len,
+                            TickType_t ticks_start)
+{
+    const uint8_t *ptr = (const uint8_t *)data;
+    while (len)
+    {
+        uint32_t written = tud_cdc_write(ptr, len);
+        ptr += written;
+        len -= written;
+        if (len)
+        {
+            TickType_t elapsed = xTaskGetTickCount() - ticks_start;
+            if (elapsed > WRITE_TIMEOUT_TICKS)
+            {
+                return false;
+            }
+            cdc_wait_tx_complete(WRITE_TIMEOUT_TICKS - elapsed);
+        }
+    }
+    return true;
+}
+
+/// Writes a range of the frame to the CDC TX buffer.
+///
+/// @param src is the frame being encoded.
+/// @param offs is the offset to start from.
+/// @param len is the number of bytes to write.
+/// @param ticks_start is the tick count at which the frame write started.
+///
+/// @return true if the range was written completely.
+static bool cobs_copy(const frame_source_t &src, size_t offs, size_t len,
+                      TickType_t ticks_start)
+{
+    if (offs < src.size)
+    {
+        size_t count = std::min(src.size - offs, len);
+        if (!cdc_frame_write(src.data + offs, count, ticks_start))
+        {
+            return false;
+        }
+        offs += count;
+        len -= count;
+    }
+    return !len ||
+           cdc_frame_write(src.crc + (offs - src.size), len, ticks_start);
+}
+
+/// Initializes the CDC framing layer.
+void init_usb_cdc_frame()
+{
+    s_frame_lock = xSemaphoreCreateMutexStatic(&s_frame_lock_storage);
+}
+
+// Sends a frame to the USB CDC.
+bool write_frame_to_cdc(const void *buf, size_t size)
+{
+    int64_t start_us = esp_timer_get_time();
+    size_t required = cdc_frame_encoded_size(size);
+    if (s_frame_lock == nullptr || !tud_cdc_connected() ||
+        required > CFG_TUD_CDC_TX_BUFSIZE)
+    {
+        return false;
+    }
+
+    frame_source_t src;
+    src.data = (const uint8_t *)buf;
+    src.size = size;
+    uint32_t crc = htole32(esp_rom_crc32_le(0, src.data, size));
+    memcpy(src.crc, &crc, sizeof(crc));
+
+    xSemaphoreTake(s_frame_lock, portMAX_DELAY);
+    TickType_t ticks_start = xTaskGetTickCount();
+    while (tud_cdc_write_available() < required)
+    {
+        TickType_t elapsed = xTaskGetTickCount() - ticks_start;
+        if (elapsed > WRITE_TIMEOUT_TICKS)
+        {
+            xSemaphoreGive(s_frame_lock);
+            ESP_LOGE(TAG, "TX FIFO full, dropping %zu byte frame.", size);
+            return false;
+        }
+        cdc_wait_tx_complete(WRITE_TIMEOUT_TICKS - elapsed);
+    }
+
+    // Each COBS block is a code byte followed by up to 254 non-zero bytes
+    // which are copied straight from the caller's buffer into the TX FIFO.
+    size_t total = size + CDC_FRAME_CRC_SIZE;
+    size_t offs = 0;
+    size_t encoded = 0;
+    bool more = true;
+    bool complete = true;
+    while (more)
+    {
+        size_t run = cobs_run(src, offs);
+        uint8_t code = run + 1;
+        if (!cdc_frame_write(&code, 1, ticks_start) ||
+            !cobs_copy(src, offs, run, ticks_start))
+        {
+            complete = false;
+            break;
+        }
+        encoded += run + 1;
+        offs += run;
+        if (offs < total && run < COBS_MAX_RUN)
+        {
+            // skip the zero replaced by this block, another block always
+            // follows (possibly empty) to carry the remaining data.
+            offs++;
+        }
+        else
+        {
+            more = (offs < total);
+        }
+    }
+    uint8_t delimiter = 0;
+    if (complete)
+    {
+        complete = cdc_frame_write(&delimiter, 1, ticks_start);
+        encoded += complete;
+    }
+    else
+    {
+        // terminate the partial frame if possible so the host drops it on
+        // the CRC check rather than merging it with the next frame, this
+        // fails when the FIFO is still full.
+        encoded += tud_cdc_write(&delimiter, 1);
+    }
+    xSemaphoreGive(s_frame_lock);
+
+    // account for the encoded bytes actually queued, the payload is binary
+    // so it is not checked for newlines.
+    cdc_written(nullptr, encoded, start_us);
+    if (!complete)
+    {
+        ESP_LOGE(TAG, "TX FIFO full, %zu byte frame truncated.", size);
+        return false;
+    }
+    ESP_LOGV(TAG, "Queued %zu byte frame (%zu encoded)", size, encoded);
+    return true;
+}
+
+// Default implementation of cdc_frame_received_cb which discards the frame.
+TU_ATTR_WEAK void cdc_frame_received_cb(const uint8_t *data, size_t size)
+{
+    ESP_LOGV(TAG, "Discarding %zu byte frame", size);
+}
+
+// Retrieves the number of discarded frames.
+uint32_t cdc_frame_rx_errors()
+{
+    return s_frame_decoder.errors();
+}
+
+extern "C"
+{
+
+// Invoked when data has been received on the CDC OUT endpoint.
+void tud_cdc_rx_cb(uint8_t itf)
+{
+    uint8_t buf[CONFIG_ESPUSB_CDC_FIFO_SIZE];
+    uint32_t len;
+    while ((len = tud_cdc_read(buf, sizeof(buf))) > 0)
+    {
+        s_frame_decoder.feed(buf, len, cdc_frame_received_cb);
+    }
+}
+
+} // extern "C"
+
+#endif // CONFIG_ESPUSB_CDC && CONFIG_ESPUSB_CDC_FRAMING
@@ -0,0 +1,956 @@
+// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+
+// if Esp32USB debug is enabled set the local log level higher than any of the
+// pre-defined log levels.
+#if CONFIG_ESPUSB_DEBUG
+#define LOG_LOCAL_LEVEL 0xFF
+#endif
+
+#include <algorithm>
+#include <esp_bit_defs.h>
+#include <esp_intr_alloc.h>
+#include <esp_log.h>
+#include <esp_rom_sys.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <soc/soc_memory_layout.h>
+#include <soc/usb_struct.h>
+#include <string.h>
+#include "caps_allocator.h"
+
+#include <device/dcd.h>
+
+/// Tag used for all logging.
+static constexpr const char * const TAG = "USB:DCD";
+
+#if CONFIG_ESPUSB_DCD_DMA
+
+// This is a replacement for the TinyUSB dcd_esp32sx.c device driver which
+// uses the descriptor (scatter/gather) DMA mode of the USB peripheral. Each
+// endpoint direction has a short list of DMA descriptors in internal RAM, a
+// transfer is started by filling in the descriptors and enabling the
+// endpoint. The DMA then moves every packet of the transfer between memory
+// and the FIFOs and the CPU is only interrupted when the last descriptor has
+// been completed, or once per bounce buffer for application buffers the DMA
+// can not access directly.
+//
+// The FIFO RAM layout (receive FIFO, control endpoint IN FIFO and the even
+// split of the IN FIFOs) matches dcd_esp32sx.c so the TX FIFO plan continues
+// to work with this driver.
+//
+// tools/host/dcd_dma_sim.cpp runs this driver against a register level
+// simulation of the USB peripheral.
+
+/// Number of endpoints (in each direction) supported by the USB peripheral.
+static constexpr uint8_t EP_MAX = 7;
+
+/// Number of IN FIFOs, including the FIFO used by the control endpoint.
+static constexpr uint8_t EP_FIFO_NUM = 5;
+
+/// Size of the FIFO RAM in bytes.
+static constexpr uint16_t EP_FIFO_SIZE = 1024;
+
+/// Size of the receive FIFO in 32-bit words.
+static constexpr uint16_t RX_FIFO_WORDS = 52;
+
+/// Size of the control endpoint IN FIFO in 32-bit words.
+static constexpr uint16_t EP0_TX_FIFO_WORDS = 16;
+
+/// Size of the control endpoint packets.
+static constexpr uint16_t EP0_MAX_PACKET_SIZE = 64;
+
+/// IN endpoint that is not connected to a FIFO, this is only used by the CDC
+/// notification endpoint which is never written to.
+static constexpr uint8_t EP_NOTIF_NUM = 5;
+
+/// Number of DMA descriptors per endpoint direction. A descriptor holds up to
+/// 64KiB - 1 bytes so two cover the largest transfer the stack can request.
+static constexpr uint8_t DESC_PER_EP = 2;
+
+/// Maximum time to wait for the core to acknowledge an endpoint or FIFO
+/// command.
+static constexpr uint32_t CORE_TIMEOUT_US = 1000;
+
+// DWC2 register fields used by this driver, the names follow the DWC2
+// databook.
+static constexpr uint32_t GAHBCFG_GLBLINTRMSK = BIT(0);
+static constexpr uint32_t GAHBCFG_HBSTLEN_INCR4 = (3 << 1);
+static constexpr uint32_t GAHBCFG_DMAEN = BIT(5);
+static constexpr uint32_t GOTGINT_SESENDDET = BIT(2);
+static constexpr uint32_t GRSTCTL_TXFFLSH = BIT(5);
+static constexpr uint32_t GRSTCTL_TXFNUM_S = 6;
+static constexpr uint32_t GINTSTS_OTGINT = BIT(2);
+static constexpr uint32_t GINTSTS_SOF = BIT(3);
+static constexpr uint32_t GINTSTS_GOUTNAKEFF = BIT(7);
+static constexpr uint32_t GINTSTS_USBSUSP = BIT(11);
+static constexpr uint32_t GINTSTS_USBRST = BIT(12);
+static constexpr uint32_t GINTSTS_ENUMDONE = BIT(13);
+static constexpr uint32_t GINTSTS_IEPINT = BIT(18);
+static constexpr uint32_t GINTSTS_OEPINT = BIT(19);
+static constexpr uint32_t GINTSTS_WKUPINT = BIT(31);
+static constexpr uint32_t DCFG_NZSTSOUTHSHK = BIT(2);
+static constexpr uint32_t DCFG_DEVSPD_FS = 3;
+static constexpr uint32_t DCFG_DEVADDR_S = 4;
+static constexpr uint32_t DCFG_DEVADDR_M = (0x7F << DCFG_DEVADDR_S);
+static constexpr uint32_t DCFG_DESCDMA = BIT(23);
+static constexpr uint32_t DCTL_RMTWKUPSIG = BIT(0);
+static constexpr uint32_t DCTL_SFTDISCON = BIT(1);
+static constexpr uint32_t DCTL_SGOUTNAK = BIT(9);
+static constexpr uint32_t DCTL_CGOUTNAK = BIT(10);
+static constexpr uint32_t DEPCTL_MPS_M = 0x7FF;
+static constexpr uint32_t DIEPCTL0_MPS_M = 0x3;
+static constexpr uint32_t DEPCTL_USBACTEP = BIT(15);
+static constexpr uint32_t DEPCTL_EPTYPE_S = 18;
+static constexpr uint32_t DEPCTL_STALL = BIT(21);
+static constexpr uint32_t DEPCTL_TXFNUM_S = 22;
+static constexpr uint32_t DEPCTL_TXFNUM_M = (0xF << DEPCTL_TXFNUM_S);
+static constexpr uint32_t DEPCTL_CNAK = BIT(26);
+static constexpr uint32_t DEPCTL_SNAK = BIT(27);
+static constexpr uint32_t DEPCTL_SD0PID = BIT(28);
+static constexpr uint32_t DEPCTL_EPDIS = BIT(30);
+static constexpr uint32_t DEPCTL_EPENA = BIT(31);
+static constexpr uint32_t DEPINT_XFERCOMPL = BIT(0);
+static constexpr uint32_t DEPINT_EPDISBLD = BIT(1);
+static constexpr uint32_t DOEPINT_SETUP = BIT(3);
+static constexpr uint32_t DIEPINT_INEPNAKEFF = BIT(6);
+static constexpr uint32_t DEPINT_BNA = BIT(9);
+
+// DMA descriptor status fields for bulk, interrupt and control endpoints.
+static constexpr uint32_t DESC_BS_M = (3U << 30);
+static constexpr uint32_t DESC_BS_HOST_READY = (0U << 30);
+static constexpr uint32_t DESC_BS_DMA_DONE = (2U << 30);
+static constexpr uint32_t DESC_STS_M = (3 << 28);
+static constexpr uint32_t DESC_L = BIT(27);
+static constexpr uint32_t DESC_SP = BIT(26);
+static constexpr uint32_t DESC_IOC = BIT(25);
+static constexpr uint32_t DESC_SR = BIT(24);
+static constexpr uint32_t DESC_BYTES_M = 0xFFFF;
+
+/// DMA descriptor, the layout is defined by the USB peripheral.
+typedef struct
+{
+    /// Buffer status, transfer status, flags and number of bytes. The DMA
+    /// writes the number of bytes remaining when the descriptor is done.
+    volatile uint32_t status;
+
+    /// Address of the data buffer.
+    volatile uint32_t buffer;
+} dma_desc_t;
+
+/// State of a transfer on one endpoint direction.
+typedef struct
+{
+    /// Buffer provided by the stack.
+    uint8_t *buffer;
+
+    /// DMA capable buffer used when @ref buffer can not be accessed by the
+    /// DMA directly.
+    uint8_t *bounce;
+
+    /// Size of @ref bounce, a multiple of @ref max_size.
+    uint16_t bounce_size;
+
+    /// Total number of bytes requested.
+    uint16_t total_len;
+
+    /// Number of bytes transferred so far.
+    uint16_t done_len;
+
+    /// Number of bytes programmed into the descriptors in flight.
+    uint16_t chunk_len;
+
+    /// Maximum packet size of the endpoint.
+    uint16_t max_size;
+
+    /// Tracks if the DMA accesses @ref buffer directly.
+    bool direct;
+
+    /// Tracks if a transfer is pending on the endpoint.
+    bool pending;
+} dma_xfer_t;
+
+/// Transfer state indexed by endpoint number and direction.
+static dma_xfer_t s_xfer[EP_MAX][2];
+
+/// DMA descriptor lists indexed by endpoint number and direction.
+static dma_desc_t s_desc[EP_MAX][2][DESC_PER_EP] TU_ATTR_ALIGNED(8);
+
+/// DMA buffer for the control endpoint OUT direction, SETUP packets and
+/// OUT data packets are both received into this buffer.
+static uint8_t s_ep0_out_buf[EP0_MAX_PACKET_SIZE] TU_ATTR_ALIGNED(4);
+
+/// DMA buffer for the control endpoint IN direction.
+static uint8_t s_ep0_in_buf[EP0_MAX_PACKET_SIZE] TU_ATTR_ALIGNED(4);
+
+#if CONFIG_ESPUSB_STATIC_ALLOCATION
+/// Bounce buffers for the non-control endpoints, indexed by endpoint number
+/// (minus one) and direction.
+static uint8_t s_bounce_buf[EP_MAX - 1][2][CONFIG_ESPUSB_DCD_DMA_BOUNCE_SIZE]
+    TU_ATTR_ALIGNED(4);
+#endif // CONFIG_ESPUSB_STATIC_ALLOCATION
+
+/// Number of bytes received on the control endpoint before the stack
+/// requested them, valid when @ref s_ep0_out_held is true.
+static uint16_t s_ep0_out_held_len = 0;
+
+/// Tracks if @ref s_ep0_out_buf holds received data which has not yet been
+/// passed to the stack, the control endpoint OUT direction stays disabled
+/// (NAKing further packets) until it has been.
+static bool s_ep0_out_held = false;
+
+/// Last SETUP packet received.
+static uint32_t s_setup_packet[2];
+
+/// Bitmask of the allocated IN FIFOs, FIFO 0 is always used by the control
+/// endpoint.
+static uint16_t s_allocated_fifos = 1;
+
+/// Tracks if a remote wakeup was signalled and the bus has not yet resumed.
+static bool s_remote_wakeup = false;
+
+/// Lock protecting the control endpoint OUT state.
+static portMUX_TYPE s_ep0_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/// Interrupt handle for the USB peripheral.
+static intr_handle_t s_intr_handle = nullptr;
+
+/// @return the address of @param ptr as used by the DMA.
+static inline uint32_t dma_addr(const volatile void *ptr)
+{
+    return (uint32_t)(uintptr_t)ptr;
+}
+
+/// Waits for the core to acknowledge a command.
+///
+/// @param done returns true once the command has been acknowledged.
+///
+/// @return true if the command was acknowledged, false on timeout.
+template <typename Fn>
+static bool wait_for_core(Fn done)
+{
+    uint32_t waited_us = 0;
+    while (!done())
+    {
+        if (waited_us++ >= CORE_TIMEOUT_US)
+        {
+            return false;
+        }
+        esp_rom_delay_us(1);
+    }
+    return true;
+}
+
+/// Arms the control endpoint OUT direction to receive SETUP and OUT data
+/// packets into @ref s_ep0_out_buf.
+static void ep0_out_arm()
+{
+    portENTER_CRITICAL_SAFE(&s_ep0_lock);
+    if (!(USB0.out_ep_reg[0].doepctl & DEPCTL_EPENA) && !s_ep0_out_held)
+    {
+        dma_desc_t *desc = s_desc[0][TUSB_DIR_OUT];
+        desc->buffer = dma_addr(s_ep0_out_buf);
+        desc->status = DESC_BS_HOST_READY | DESC_L | DESC_IOC |
+                       EP0_MAX_PACKET_SIZE;
+        USB0.out_ep_reg[0].doepdma = dma_addr(desc);
+        USB0.out_ep_reg[0].doepctl |= DEPCTL_EPENA | DEPCTL_CNAK;
+    }
+    portEXIT_CRITICAL_SAFE(&s_ep0_lock);
+}
+
+/// Starts the next DMA transfer on an IN endpoint.
+///
+/// @param epnum is the endpoint number.
+static void in_xfer_start(uint8_t epnum)
+{
+    dma_xfer_t *xfer = &s_xfer[epnum][TUSB_DIR_IN];
+    dma_desc_t *desc = s_desc[epnum][TUSB_DIR_IN];
+    uint16_t remaining = xfer->total_len - xfer->done_len;
+    uint8_t count = 0;
+    if (xfer->direct)
+    {
+        // all but the last descriptor have to end on a packet boundary.
+        uint16_t desc_max = DESC_BYTES_M / xfer->max_size * xfer->max_size;
+        uint8_t *buf = xfer->buffer + xfer->done_len;
+        xfer->chunk_len = remaining;
+        do
+        {
+            uint16_t len = std::min(remaining, desc_max);
+            desc[count].buffer = dma_addr(buf);
+            desc[count].status = DESC_BS_HOST_READY | len;
+            buf += len;
+            remaining -= len;
+            count++;
+        } while (remaining && count < DESC_PER_EP);
+    }
+    else
+    {
+        uint16_t len = std::min(remaining, xfer->bounce_size);
+        if (len && xfer->buffer)
+        {
+            memcpy(xfer->bounce, xfer->buffer + xfer->done_len, len);
+        }
+        xfer->chunk_len = len;
+        desc[0].buffer = dma_addr(xfer->bounce);
+        desc[0].status = DESC_BS_HOST_READY | len;
+        count = 1;
+    }
+
+    // the last descriptor ends the transfer, a final packet shorter than the
+    // packet size (including a zero length packet) has to be flagged.
+    uint32_t last = DESC_L | DESC_IOC;
+    uint16_t last_len = desc[count - 1].status & DESC_BYTES_M;
+    if (last_len == 0 || last_len % xfer->max_size)
+    {
+        last |= DESC_SP;
+    }
+    desc[count - 1].status = desc[count - 1].status | last;
+
+    USB0.in_ep_reg[epnum].diepdma = dma_addr(desc);
+    USB0.in_ep_reg[epnum].diepctl |= DEPCTL_EPENA | DEPCTL_CNAK;
+}
+
+/// Starts the next DMA transfer on an OUT endpoint (other than the control
+/// endpoint).
+///
+/// @param epnum is the endpoint number.
+static void out_xfer_start(uint8_t epnum)
+{
+    dma_xfer_t *xfer = &s_xfer[epnum][TUSB_DIR_OUT];
+    dma_desc_t *desc = s_desc[epnum][TUSB_DIR_OUT];
+    uint16_t len = xfer->total_len - xfer->done_len;
+    uint8_t *buf = xfer->buffer + xfer->done_len;
+    if (!xfer->direct)
+    {
+        // OUT descriptors must be a multiple of the packet size, the bounce
+        // buffer absorbs any bytes beyond what was requested.
+        len = std::min(len, xfer->bounce_size);
+        len = std::max<uint16_t>(
+            (len + xfer->max_size - 1) / xfer->max_size * xfer->max_size,
+            xfer->max_size);
+        buf = xfer->bounce;
+    }
+    // direct transfers are a multiple of the packet size which always fits
+    // into a single descriptor, a short packet completes the descriptor.
+    xfer->chunk_len = len;
+    desc->buffer = dma_addr(buf);
+    desc->status = DESC_BS_HOST_READY | DESC_L | DESC_IOC | len;
+
+    USB0.out_ep_reg[epnum].doepdma = dma_addr(desc);
+    USB0.out_ep_reg[epnum].doepctl |= DEPCTL_EPENA | DEPCTL_CNAK;
+}
+
+/// Resets the endpoint state after a bus reset.
+static void bus_reset()
+{
+    for (uint8_t epnum = 0; epnum < EP_MAX; epnum++)
+    {
+        USB0.out_ep_reg[epnum].doepctl |= DEPCTL_SNAK;
+        s_xfer[epnum][TUSB_DIR_OUT].pending = false;
+        s_xfer[epnum][TUSB_DIR_IN].pending = false;
+    }
+    portENTER_CRITICAL_ISR(&s_ep0_lock);
+    s_ep0_out_held = false;
+    portEXIT_CRITICAL_ISR(&s_ep0_lock);
+
+    // clear the device address.
+    USB0.dcfg &= ~DCFG_DEVADDR_M;
+
+    USB0.daintmsk = BIT(0) | BIT(16);
+    USB0.doepmsk = DEPINT_XFERCOMPL | DOEPINT_SETUP | DEPINT_BNA;
+    USB0.diepmsk = DEPINT_XFERCOMPL | DEPINT_BNA;
+
+    // same layout as dcd_esp32sx.c, the receive FIFO is followed by the
+    // control endpoint IN FIFO. The remaining FIFO RAM is assigned as
+    // endpoints are opened.
+    USB0.grxfsiz = RX_FIFO_WORDS;
+    USB0.gnptxfsiz = (EP0_TX_FIFO_WORDS << 16) | RX_FIFO_WORDS;
+    s_allocated_fifos = 1;
+
+    ep0_out_arm();
+}
+
+/// Handles a completed descriptor on the control endpoint OUT direction.
+///
+/// @param desc_status is the descriptor status written back by the DMA.
+static void handle_ep0_out(uint32_t desc_status)
+{
+    dma_xfer_t *xfer = &s_xfer[0][TUSB_DIR_OUT];
+    if (desc_status & DESC_SR)
+    {
+        // back-to-back SETUP packets overwrite each other, the buffer holds
+        // the last one received.
+        memcpy(s_setup_packet, s_ep0_out_buf, sizeof(s_setup_packet));
+        portENTER_CRITICAL_ISR(&s_ep0_lock);
+        xfer->pending = false;
+        s_ep0_out_held = false;
+        portEXIT_CRITICAL_ISR(&s_ep0_lock);
+        ep0_out_arm();
+        dcd_event_setup_received(0, (uint8_t *)s_setup_packet, true);
+        return;
+    }
+
+    uint16_t len = EP0_MAX_PACKET_SIZE - (desc_status & DESC_BYTES_M);
+    portENTER_CRITICAL_ISR(&s_ep0_lock);
+    if (!xfer->pending)
+    {
+        // the stack has not requested the data yet, hold on to it and NAK
+        // further packets until it has been consumed.
+        s_ep0_out_held_len = len;
+        s_ep0_out_held = true;
+        portEXIT_CRITICAL_ISR(&s_ep0_lock);
+        return;
+    }
+    xfer->pending = false;
+    portEXIT_CRITICAL_ISR(&s_ep0_lock);
+    len = std::min(len, xfer->total_len);
+    if (xfer->buffer)
+    {
+        memcpy(xfer->buffer, s_ep0_out_buf, len);
+    }
+    ep0_out_arm();
+    dcd_event_xfer_complete(0, 0x00, len, XFER_RESULT_SUCCESS, true);
+}
+
+/// Handles an interrupt for an OUT endpoint.
+///
+/// @param epnum is the endpoint number.
+static void handle_out_ep_interrupt(uint8_t epnum)
+{
+    uint32_t status = USB0.out_ep_reg[epnum].doepint;
+    USB0.out_ep_reg[epnum].doepint = status;
+    dma_xfer_t *xfer = &s_xfer[epnum][TUSB_DIR_OUT];
+
+    if (status & DEPINT_BNA)
+    {
+        // the DMA found a descriptor which was not ready and disabled the
+        // endpoint.
+        if (epnum == 0)
+        {
+            ep0_out_arm();
+        }
+        else if (xfer->pending)
+        {
+            xfer->pending = false;
+            dcd_event_xfer_complete(0, epnum, xfer->done_len,
+                                    XFER_RESULT_FAILED, true);
+        }
+        return;
+    }
+
+    if (!(status & (DEPINT_XFERCOMPL | DOEPINT_SETUP)))
+    {
+        return;
+    }
+
+    // the SETUP and transfer complete interrupts of a SETUP packet may be
+    // raised separately, the descriptor is re-armed after the first one.
+    uint32_t desc_status = s_desc[epnum][TUSB_DIR_OUT][0].status;
+    if ((desc_status & DESC_BS_M) != DESC_BS_DMA_DONE)
+    {
+        return;
+    }
+
+    if (epnum == 0)
+    {
+        handle_ep0_out(desc_status);
+        return;
+    }
+
+    if (!xfer->pending)
+    {
+        return;
+    }
+    uint16_t received = xfer->chunk_len - (desc_status & DESC_BYTES_M);
+    uint16_t accepted =
+        std::min<uint16_t>(received, xfer->total_len - xfer->done_len);
+    if (!xfer->direct && accepted && xfer->buffer)
+    {
+        memcpy(xfer->buffer + xfer->done_len, xfer->bounce, accepted);
+    }
+    xfer->done_len += accepted;
+    if (!(desc_status & DESC_STS_M) && received == xfer->chunk_len &&
+        xfer->done_len < xfer->total_len)
+    {
+        out_xfer_start(epnum);
+        return;
+    }
+    xfer->pending = false;
+    dcd_event_xfer_complete(0, epnum, xfer->done_len,
+                            (desc_status & DESC_STS_M) ? XFER_RESULT_FAILED
+                                                       : XFER_RESULT_SUCCESS,
+                            true);
+}
+
+/// Handles an interrupt for an IN endpoint.
+///
+/// @param epnum is the endpoint number.
+static void handle_in_ep_interrupt(uint8_t epnum)
+{
+    uint32_t status = USB0.in_ep_reg[epnum].diepint;
+    USB0.in_ep_reg[epnum].diepint = status;
+    dma_xfer_t *xfer = &s_xfer[epnum][TUSB_DIR_IN];
+    if (!xfer->pending ||
+        !(status & (DEPINT_XFERCOMPL | DEPINT_BNA)))
+    {
+        return;
+    }
+
+    bool failed = status & DEPINT_BNA;
+    for (uint8_t idx = 0; idx < DESC_PER_EP && !failed; idx++)
+    {
+        uint32_t desc_status = s_desc[epnum][TUSB_DIR_IN][idx].status;
+        failed = desc_status & DESC_STS_M;
+        if (desc_status & DESC_L)
+        {
+            break;
+        }
+    }
+    if (!failed)
+    {
+        xfer->done_len += xfer->chunk_len;
+        if (xfer->done_len < xfer->total_len)
+        {
+            in_xfer_start(epnum);
+            return;
+        }
+    }
+    xfer->pending = false;
+    if (epnum == 0)
+    {
+        // the control endpoint must be ready for the next SETUP packet even
+        // when the stack does not request the status stage.
+        ep0_out_arm();
+    }
+    dcd_event_xfer_complete(0, epnum | TUSB_DIR_IN_MASK, xfer->done_len,
+                            failed ? XFER_RESULT_FAILED : XFER_RESULT_SUCCESS,
+                            true);
+}
+
+/// USB peripheral interrupt handler.
+static void dcd_dma_int_handler(void *arg)
+{
+    uint32_t status = USB0.gintsts & USB0.gintmsk;
+
+    if (status & GINTSTS_USBRST)
+    {
+        USB0.gintsts = GINTSTS_USBRST;
+        bus_reset();
+    }
+
+    if (status & GINTSTS_ENUMDONE)
+    {
+        USB0.gintsts = GINTSTS_ENUMDONE;
+        // full speed with a 64 byte control endpoint (MPS encoding 0).
+        USB0.in_ep_reg[0].diepctl &= ~DIEPCTL0_MPS_M;
+        dcd_event_bus_reset(0, TUSB_SPEED_FULL, true);
+    }
+
+    if (status & GINTSTS_USBSUSP)
+    {
+        USB0.gintsts = GINTSTS_USBSUSP;
+        dcd_event_bus_signal(0, DCD_EVENT_SUSPEND, true);
+    }
+
+    if (status & GINTSTS_WKUPINT)
+    {
+        USB0.gintsts = GINTSTS_WKUPINT;
+        dcd_event_bus_signal(0, DCD_EVENT_RESUME, true);
+    }
+
+    if (status & GINTSTS_OTGINT)
+    {
+        uint32_t otg_status = USB0.gotgint;
+        USB0.gotgint = otg_status;
+        if (otg_status & GOTGINT_SESENDDET)
+        {
+            dcd_event_bus_signal(0, DCD_EVENT_UNPLUGGED, true);
+        }
+    }
+
+    if (status & GINTSTS_SOF)
+    {
+        USB0.gintsts = GINTSTS_SOF;
+        if (s_remote_wakeup)
+        {
+            // the bus has resumed after a remote wakeup.
+            s_remote_wakeup = false;
+            USB0.gintmsk &= ~GINTSTS_SOF;
+            dcd_event_bus_signal(0, DCD_EVENT_RESUME, true);
+        }
+        else
+        {
+            dcd_event_bus_signal(0, DCD_EVENT_SOF, true);
+        }
+    }
+
+    if (status & (GINTSTS_OEPINT | GINTSTS_IEPINT))
+    {
+        uint32_t pending = USB0.daint & USB0.daintmsk;
+        for (uint8_t epnum = 0; epnum < EP_MAX; epnum++)
+        {
+            if (pending & BIT(16 + epnum))
+            {
+                handle_out_ep_interrupt(epnum);
+            }
+            if (pending & BIT(epnum))
+            {
+                handle_in_ep_interrupt(epnum);
+            }
+        }
+    }
+}
+
+extern "C"
+{
+
+void dcd_init(uint8_t rhport)
+{
+    ESP_LOGV(TAG, "DCD init (descriptor DMA)");
+    USB0.dctl |= DCTL_SFTDISCON;
+    USB0.dcfg |= DCFG_NZSTSOUTHSHK | DCFG_DEVSPD_FS | DCFG_DESCDMA;
+    USB0.gahbcfg |= GAHBCFG_DMAEN | GAHBCFG_HBSTLEN_INCR4 |
+                    GAHBCFG_GLBLINTRMSK;
+
+    for (uint8_t epnum = 0; epnum < EP_MAX; epnum++)
+    {
+        USB0.out_ep_reg[epnum].doepctl |= DEPCTL_SNAK;
+    }
+
+    // the control endpoint always uses the static DMA buffers.
+    s_xfer[0][TUSB_DIR_IN].bounce = s_ep0_in_buf;
+    s_xfer[0][TUSB_DIR_IN].bounce_size = EP0_MAX_PACKET_SIZE;
+    s_xfer[0][TUSB_DIR_IN].max_size = EP0_MAX_PACKET_SIZE;
+    s_xfer[0][TUSB_DIR_OUT].bounce = s_ep0_out_buf;
+    s_xfer[0][TUSB_DIR_OUT].bounce_size = EP0_MAX_PACKET_SIZE;
+    s_xfer[0][TUSB_DIR_OUT].max_size = EP0_MAX_PACKET_SIZE;
+
+    // with DMA enabled the receive FIFO level interrupt is not used.
+    USB0.gintmsk = 0;
+    USB0.gotgint = ~0U;
+    USB0.gintsts = ~0U;
+    USB0.gintmsk = GINTSTS_OTGINT | GINTSTS_USBSUSP | GINTSTS_USBRST |
+                   GINTSTS_ENUMDONE | GINTSTS_IEPINT | GINTSTS_OEPINT |
+                   GINTSTS_WKUPINT;
+
+    dcd_connect(rhport);
+}
+
+void dcd_int_enable(uint8_t rhport)
+{
+    if (s_intr_handle == nullptr)
+    {
+        ESP_ERROR_CHECK(esp_intr_alloc(ETS_USB_INTR_SOURCE,
+                                       ESP_INTR_FLAG_LOWMED,
+                                       dcd_dma_int_handler, nullptr,
+                                       &s_intr_handle));
+    }
+}
+
+void dcd_int_disable(uint8_t rhport)
+{
+    if (s_intr_handle != nullptr)
+    {
+        esp_intr_free(s_intr_handle);
+        s_intr_handle = nullptr;
+    }
+}
+
+void dcd_set_address(uint8_t rhport, uint8_t dev_addr)
+{
+    USB0.dcfg = (USB0.dcfg & ~DCFG_DEVADDR_M) |
+                ((dev_addr << DCFG_DEVADDR_S) & DCFG_DEVADDR_M);
+    // the address takes effect after the status stage has completed.
+    dcd_edpt_xfer(rhport, 0x80, nullptr, 0);
+}
+
+void dcd_remote_wakeup(uint8_t rhport)
+{
+    USB0.dctl |= DCTL_RMTWKUPSIG;
+    // the bus resume is detected via the next SOF.
+    s_remote_wakeup = true;
+    USB0.gintsts = GINTSTS_SOF;
+    USB0.gintmsk |= GINTSTS_SOF;
+    // remote wakeup signalling must be stopped within 1-15ms.
+    vTaskDelay(pdMS_TO_TICKS(1));
+    USB0.dctl &= ~DCTL_RMTWKUPSIG;
+}
+
+void dcd_connect(uint8_t rhport)
+{
+    USB0.dctl &= ~DCTL_SFTDISCON;
+}
+
+void dcd_disconnect(uint8_t rhport)
+{
+    USB0.dctl |= DCTL_SFTDISCON;
+}
+
+bool dcd_edpt_open(uint8_t rhport, tusb_desc_endpoint_t const *desc_edpt)
+{
+    uint8_t epnum = tu_edpt_number(desc_edpt->bEndpointAddress);
+    uint8_t dir = tu_edpt_dir(desc_edpt->bEndpointAddress);
+    uint16_t max_size = tu_edpt_packet_size(desc_edpt);
+    TU_ASSERT(epnum > 0 && epnum < EP_MAX && max_size);
+
+    dma_xfer_t *xfer = &s_xfer[epnum][dir];
+    xfer->max_size = max_size;
+    xfer->pending = false;
+
+    // the bounce buffer is kept across bus resets, it is only replaced if
+    // the endpoint size changes.
+    uint16_t bounce_size =
+        std::max<uint16_t>(CONFIG_ESPUSB_DCD_DMA_BOUNCE_SIZE / max_size *
+                           max_size, max_size);
+#if CONFIG_ESPUSB_STATIC_ALLOCATION
+    if (bounce_size > CONFIG_ESPUSB_DCD_DMA_BOUNCE_SIZE)
+    {
+        ESP_LOGE(TAG, "Endpoint %02x size %d exceeds the DMA buffer size",
+                 desc_edpt->bEndpointAddress, max_size);
+        return false;
+    }
+    xfer->bounce = s_bounce_buf[epnum - 1][dir];
+    xfer->bounce_size = bounce_size;
+#else
+    if (xfer->bounce_size != bounce_size)
+    {
+        InternalDMAHeap::deallocate(xfer->bounce, xfer->bounce_size);
+        xfer->bounce = (uint8_t *)InternalDMAHeap::allocate(bounce_size);
+        xfer->bounce_size = xfer->bounce ? bounce_size : 0;
+        if (xfer->bounce == nullptr)
+        {
+            ESP_LOGE(TAG, "Unable to allocate DMA buffer for endpoint %02x",
+                     desc_edpt->bEndpointAddress);
+            return false;
+        }
+    }
+#endif // CONFIG_ESPUSB_STATIC_ALLOCATION
+
+    uint32_t ctl = DEPCTL_USBACTEP |
+                   (desc_edpt->bmAttributes.xfer << DEPCTL_EPTYPE_S) |
+                   max_size;
+    if (desc_edpt->bmAttributes.xfer != TUSB_XFER_ISOCHRONOUS)
+    {
+        ctl |= DEPCTL_SD0PID;
+    }
+
+    if (dir == TUSB_DIR_OUT)
+    {
+        USB0.out_ep_reg[epnum].doepctl =
+            (USB0.out_ep_reg[epnum].doepctl & ~DEPCTL_MPS_M) | ctl;
+        USB0.daintmsk |= BIT(16 + epnum);
+        return true;
+    }
+
+    uint8_t fifo_num = 0;
+    if (epnum != EP_NOTIF_NUM)
+    {
+        for (fifo_num = 1; fifo_num < EP_FIFO_NUM; fifo_num++)
+        {
+            if (!(s_allocated_fifos & BIT(fifo_num)))
+            {
+                break;
+            }
+        }
+        TU_ASSERT(fifo_num < EP_FIFO_NUM);
+        s_allocated_fifos |= BIT(fifo_num);
+
+        // evenly split the remaining FIFO RAM, same as dcd_esp32sx.c.
+        uint16_t allocated = RX_FIFO_WORDS + EP0_TX_FIFO_WORDS;
+        uint16_t fifo_size =
+            (EP_FIFO_SIZE / 4 - allocated) / (EP_FIFO_NUM - 1);
+        uint32_t fifo_offset = allocated + fifo_size * (fifo_num - 1);
+        USB0.dieptxf[fifo_num - 1] = (fifo_size << 16) | fifo_offset;
+    }
+    USB0.in_ep_reg[epnum].diepctl =
+        (USB0.in_ep_reg[epnum].diepctl & ~(DEPCTL_MPS_M | DEPCTL_TXFNUM_M)) |
+        ctl | (fifo_num << DEPCTL_TXFNUM_S);
+    USB0.daintmsk |= BIT(epnum);
+    return true;
+}
+
+void dcd_edpt_close_all(uint8_t rhport)
+{
+    for (uint8_t epnum = 1; epnum < EP_MAX; epnum++)
+    {
+        USB0.out_ep_reg[epnum].doepctl &= ~DEPCTL_USBACTEP;
+        USB0.in_ep_reg[epnum].diepctl &=
+            ~(DEPCTL_USBACTEP | DEPCTL_TXFNUM_M);
+        s_xfer[epnum][TUSB_DIR_OUT].pending = false;
+        s_xfer[epnum][TUSB_DIR_IN].pending = false;
+    }
+    USB0.daintmsk = BIT(0) | BIT(16);
+    s_allocated_fifos = 1;
+}
+
+bool dcd_edpt_xfer(uint8_t rhport, uint8_t ep_addr, uint8_t *buffer,
+                   uint16_t total_bytes)
+{
+    uint8_t epnum = tu_edpt_number(ep_addr);
+    uint8_t dir = tu_edpt_dir(ep_addr);
+    dma_xfer_t *xfer = &s_xfer[epnum][dir];
+    xfer->buffer = buffer;
+    xfer->total_len = total_bytes;
+    xfer->done_len = 0;
+
+    if (epnum == 0 && dir == TUSB_DIR_OUT)
+    {
+        // the control endpoint OUT direction stays armed for SETUP packets,
+        // data which arrived before this request is completed right away.
+        portENTER_CRITICAL(&s_ep0_lock);
+        bool held = s_ep0_out_held;
+        uint16_t len = std::min(s_ep0_out_held_len, total_bytes);
+        xfer->pending = !held;
+        portEXIT_CRITICAL(&s_ep0_lock);
+        if (held)
+        {
+            // the endpoint stays disabled until the data has been copied.
+            if (buffer)
+            {
+                memcpy(buffer, s_ep0_out_buf, len);
+            }
+            portENTER_CRITICAL(&s_ep0_lock);
+            s_ep0_out_held = false;
+            portEXIT_CRITICAL(&s_ep0_lock);
+        }
+        ep0_out_arm();
+        if (held)
+        {
+            dcd_event_xfer_complete(rhport, ep_addr, len,
+                                    XFER_RESULT_SUCCESS, false);
+        }
+        return true;
+    }
+
+    // the DMA can only access word aligned internal memory, anything else
+    // goes through the bounce buffer. OUT transfers are always a multiple of
+    // the packet size so they also use the bounce buffer when the request
+    // is not.
+    xfer->direct = epnum != 0 && buffer != nullptr && total_bytes &&
+                   esp_ptr_dma_capable(buffer) &&
+                   ((uintptr_t)buffer & 3) == 0 &&
+                   (dir == TUSB_DIR_IN ||
+                    total_bytes % xfer->max_size == 0);
+    xfer->pending = true;
+    if (dir == TUSB_DIR_IN)
+    {
+        in_xfer_start(epnum);
+    }
+    else
+    {
+        out_xfer_start(epnum);
+    }
+    return true;
+}
+
+void dcd_edpt_stall(uint8_t rhport, uint8_t ep_addr)
+{
+    uint8_t epnum = tu_edpt_number(ep_addr);
+    uint8_t dir = tu_edpt_dir(ep_addr);
+    // a transfer in flight is abandoned, the stack does not expect it to
+    // complete.
+    s_xfer[epnum][dir].pending = false;
+    if (dir == TUSB_DIR_IN)
+    {
+        if (epnum == 0 || !(USB0.in_ep_reg[epnum].diepctl & DEPCTL_EPENA))
+        {
+            USB0.in_ep_reg[epnum].diepctl |= DEPCTL_SNAK | DEPCTL_STALL;
+        }
+        else
+        {
+            // stop the endpoint before stalling it.
+            USB0.in_ep_reg[epnum].diepctl |= DEPCTL_SNAK;
+            if (!wait_for_core([epnum]()
+                {
+                    return USB0.in_ep_reg[epnum].diepint &
+                           DIEPINT_INEPNAKEFF;
+                }))
+            {
+                ESP_LOGE(TAG, "Timeout waiting for NAK on endpoint %02x",
+                         ep_addr);
+            }
+            USB0.in_ep_reg[epnum].diepctl |=
+                DEPCTL_SNAK | DEPCTL_STALL | DEPCTL_EPDIS;
+            if (!wait_for_core([epnum]()
+                {
+                    return USB0.in_ep_reg[epnum].diepint & DEPINT_EPDISBLD;
+                }))
+            {
+                ESP_LOGE(TAG, "Timeout disabling endpoint %02x", ep_addr);
+            }
+            USB0.in_ep_reg[epnum].diepint =
+                DIEPINT_INEPNAKEFF | DEPINT_EPDISBLD;
+        }
+
+        // discard anything the DMA already moved into the FIFO.
+        uint32_t fifo_num =
+            (USB0.in_ep_reg[epnum].diepctl & DEPCTL_TXFNUM_M) >>
+            DEPCTL_TXFNUM_S;
+        USB0.grstctl = (fifo_num << GRSTCTL_TXFNUM_S) | GRSTCTL_TXFFLSH;
+        if (!wait_for_core([]()
+            {
+                return !(USB0.grstctl & GRSTCTL_TXFFLSH);
+            }))
+        {
+            ESP_LOGE(TAG, "Timeout flushing IN FIFO %d", fifo_num);
+        }
+    }
+    else if (epnum == 0 || !(USB0.out_ep_reg[epnum].doepctl & DEPCTL_EPENA))
+    {
+        USB0.out_ep_reg[epnum].doepctl |= DEPCTL_STALL;
+    }
+    else
+    {
+        // the global OUT NAK is required to disable an OUT endpoint.
+        USB0.dctl |= DCTL_SGOUTNAK;
+        if (!wait_for_core([]()
+            {
+                return USB0.gintsts & GINTSTS_GOUTNAKEFF;
+            }))
+        {
+            ESP_LOGE(TAG, "Timeout waiting for global OUT NAK");
+        }
+        USB0.out_ep_reg[epnum].doepctl |= DEPCTL_STALL | DEPCTL_EPDIS;
+        if (!wait_for_core([epnum]()
+            {
+                return USB0.out_ep_reg[epnum].doepint & DEPINT_EPDISBLD;
+            }))
+        {
+            ESP_LOGE(TAG, "Timeout disabling endpoint %02x", ep_addr);
+        }
+        USB0.out_ep_reg[epnum].doepint = DEPINT_EPDISBLD;
+        USB0.dctl |= DCTL_CGOUTNAK;
+    }
+}
+
+void dcd_edpt_clear_stall(uint8_t rhport, uint8_t ep_addr)
+{
+    uint8_t epnum = tu_edpt_number(ep_addr);
+    if (tu_edpt_dir(ep_addr) == TUSB_DIR_IN)
+    {
+        USB0.in_ep_reg[epnum].diepctl &= ~DEPCTL_STALL;
+        USB0.in_ep_reg[epnum].diepctl |= DEPCTL_SD0PID;
+    }
+    else
+    {
+        USB0.out_ep_reg[epnum].doepctl &= ~DEPCTL_STALL;
+        USB0.out_ep_reg[epnum].doepctl |= DEPCTL_SD0PID;
+    }
+}
+
+} // extern "C"
+
+#endif // CONFIG_ESPUSB_DCD_DMA
@@ -21,10 +21,825 @@
 #define LOG_LOCAL_LEVEL 0xFF
 #endif
 
+#include <algorithm>
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <string.h>
+#include "latency_histogram.h"
+#include "usb.h"
+
 #if CONFIG_ESPUSB_HID
 
 #include <class/hid/hid.h>
 
+/// Tag used for all logging.
+static constexpr const char * const TAG = "USB:HID";
+
+#if CONFIG_ESPUSB_HID_RAW
+void hid_raw_report_complete();
+void hid_raw_report_received(const uint8_t *data, size_t size);
+#endif // CONFIG_ESPUSB_HID_RAW
+
+#if CONFIG_ESPUSB_HID_KEYBOARD_NKRO
+/// Keyboard state held by the report queue.
+typedef hid_nkro_keyboard_report_t hid_keyboard_state_t;
+#else
+/// Keyboard state held by the report queue.
+typedef hid_keyboard_report_t hid_keyboard_state_t;
+#endif // CONFIG_ESPUSB_HID_KEYBOARD_NKRO
+
+/// Largest report payload handled by the report queue.
+static constexpr size_t MAX_REPORT_SIZE =
+    std::max(sizeof(hid_gamepad_report_t), sizeof(hid_keyboard_state_t));
+
+// the shared interface prefixes each report with the report ID.
+static_assert(MAX_REPORT_SIZE + CONFIG_ESPUSB_HID_SHARED_INTERFACE <=
+              CONFIG_ESPUSB_HID_BUFSIZE,
+              "HID buffer size is too small for the largest report");
+
+/// Number of keys which can be reported via the boot keyboard report.
+static constexpr size_t BOOT_KEY_COUNT = 6;
+
+/// Largest movement a single mouse report can carry.
+static constexpr int16_t MAX_MOUSE_DELTA = 127;
+
+/// Report queue slots, one for each enabled report type.
+///
+/// NOTE: Unless the report types share a single interface the slots are in
+/// the same order as the HID interface instances.
+typedef enum
+{
+#if CONFIG_ESPUSB_HID_KEYBOARD
+    HID_SLOT_KEYBOARD,
+#endif
+#if CONFIG_ESPUSB_HID_MOUSE
+    HID_SLOT_MOUSE,
+#endif
+#if CONFIG_ESPUSB_HID_CONSUMER
+    HID_SLOT_CONSUMER,
+#endif
+#if CONFIG_ESPUSB_HID_GAMEPAD
+    HID_SLOT_GAMEPAD,
+#endif
+    HID_SLOT_COUNT
+} hid_slot_t;
+
+/// State of a single report type in the report queue.
+///
+/// Each report type has a single slot which holds the newest state, when the
+/// endpoint is busy new reports are merged into it rather than queued.
+typedef struct
+{
+    /// Newest report state which has not been sent yet.
+    uint8_t data[MAX_REPORT_SIZE];
+
+    /// Size of @ref data.
+    uint8_t size;
+
+    /// Tracks if @ref data is waiting to be sent.
+    bool pending;
+
+    /// Report queue statistics.
+    esp_usb_hid_report_stats_t stats;
+
+#if CONFIG_ESPUSB_HID_LATENCY_STATS
+    /// Time at which the oldest state in @ref data which has not been sent
+    /// was queued.
+    int64_t queued_us;
+
+    /// Time at which the oldest state in the report being sent was queued,
+    /// zero when no report is in flight.
+    int64_t inflight_queued_us;
+
+    /// Time at which the report being sent was submitted to the endpoint.
+    int64_t inflight_submit_us;
+
+    /// Queued to completed latency samples.
+    LatencyHistogram latency;
+
+    /// Submitted to completed latency samples.
+    LatencyHistogram endpoint;
+#endif // CONFIG_ESPUSB_HID_LATENCY_STATS
+} hid_report_slot_t;
+
+/// Accumulated mouse movement which has not been sent yet, this is kept
+/// outside of the slot since it can exceed what a single report can carry.
+typedef struct
+{
+    /// Horizontal movement.
+    int32_t x;
+
+    /// Vertical movement.
+    int32_t y;
+
+    /// Vertical scroll wheel movement.
+    int32_t wheel;
+
+    /// Horizontal scroll wheel movement.
+    int32_t pan;
+} hid_mouse_motion_t;
+
+/// Lock protecting the report queue.
+static portMUX_TYPE s_hid_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/// Report queue slots, indexed by @ref hid_slot_t.
+static hid_report_slot_t s_hid_slots[HID_SLOT_COUNT];
+
+#if CONFIG_ESPUSB_HID_SHARED_INTERFACE
+/// Slot which is offered the shared endpoint first when it becomes idle, only
+/// used by the USB task.
+static uint8_t s_hid_next_slot = 0;
+#endif // CONFIG_ESPUSB_HID_SHARED_INTERFACE
+
+/// Pending mouse movement.
+static hid_mouse_motion_t s_mouse_motion;
+
+#if CONFIG_ESPUSB_HID_KEYBOARD
+/// Lock held by @ref send_hid_keyboard_string so strings typed by different
+/// tasks do not interleave.
+static SemaphoreHandle_t s_keyboard_type_lock = nullptr;
+
+/// Storage for @ref s_keyboard_type_lock.
+static StaticSemaphore_t s_keyboard_type_lock_storage;
+
+/// Binary semaphore given when a keyboard report has been sent to the host,
+/// taken by the task holding @ref s_keyboard_type_lock.
+static SemaphoreHandle_t s_keyboard_sent = nullptr;
+
+/// Storage for @ref s_keyboard_sent.
+static StaticSemaphore_t s_keyboard_sent_storage;
+#endif // CONFIG_ESPUSB_HID_KEYBOARD
+
+/// Finds the report queue slot used for a report type.
+///
+/// @param report is the report type.
+///
+/// @return the @ref hid_slot_t or @ref HID_SLOT_COUNT if the report type is
+/// not enabled.
+static uint8_t hid_slot(esp_usb_hid_report_t report)
+{
+    switch (report)
+    {
+#if CONFIG_ESPUSB_HID_KEYBOARD
+        case REPORT_ID_KEYBOARD:
+            return HID_SLOT_KEYBOARD;
+#endif // CONFIG_ESPUSB_HID_KEYBOARD
+#if CONFIG_ESPUSB_HID_MOUSE
+        case REPORT_ID_MOUSE:
+            return HID_SLOT_MOUSE;
+#endif // CONFIG_ESPUSB_HID_MOUSE
+#if CONFIG_ESPUSB_HID_CONSUMER
+        case REPORT_ID_CONSUMER_CONTROL:
+            return HID_SLOT_CONSUMER;
+#endif // CONFIG_ESPUSB_HID_CONSUMER
+#if CONFIG_ESPUSB_HID_GAMEPAD
+        case REPORT_ID_GAMEPAD:
+            return HID_SLOT_GAMEPAD;
+#endif // CONFIG_ESPUSB_HID_GAMEPAD
+        default:
+            return HID_SLOT_COUNT;
+    }
+}
+
+/// @return the HID interface instance which sends the reports of a slot.
+static inline uint8_t hid_slot_instance(uint8_t slot)
+{
+#if CONFIG_ESPUSB_HID_SHARED_INTERFACE
+    return HID_INSTANCE_SHARED;
+#else
+    return slot;
+#endif // CONFIG_ESPUSB_HID_SHARED_INTERFACE
+}
+
+/// @return the report ID to send the reports of a slot with, zero when each
+/// report type has its own interface.
+static uint8_t hid_slot_report_id(uint8_t slot)
+{
+#if CONFIG_ESPUSB_HID_SHARED_INTERFACE
+    for (uint8_t report = REPORT_ID_KEYBOARD; report < REPORT_ID_MAX_COUNT;
+         report++)
+    {
+        if (hid_slot((esp_usb_hid_report_t)report) == slot)
+        {
+            return report;
+        }
+    }
+#endif // CONFIG_ESPUSB_HID_SHARED_INTERFACE
+    return 0;
+}
+
+/// @return true if the slot holds the mouse reports.
+static inline bool hid_is_mouse(uint8_t slot)
+{
+#if CONFIG_ESPUSB_HID_MOUSE
+    return slot == HID_SLOT_MOUSE;
+#else
+    return false;
+#endif // CONFIG_ESPUSB_HID_MOUSE
+}
+
+/// @return true if the slot holds the keyboard reports.
+static inline bool hid_is_keyboard(uint8_t slot)
+{
+#if CONFIG_ESPUSB_HID_KEYBOARD
+    return slot == HID_SLOT_KEYBOARD;
+#else
+    return false;
+#endif // CONFIG_ESPUSB_HID_KEYBOARD
+}
+
+/// Clamps accumulated movement to what a single report can carry.
+///
+/// @param value is the accumulated movement, the amount taken is removed.
+///
+/// @return the movement to send.
+static inline int8_t take_mouse_delta(int32_t &value)
+{
+    int32_t delta = std::max<int32_t>(-MAX_MOUSE_DELTA,
+                                      std::min<int32_t>(MAX_MOUSE_DELTA, value));
+    value -= delta;
+    return delta;
+}
+
+/// Takes the pending report for a report type out of the queue.
+///
+/// @param index is the @ref hid_slot_t of the report type.
+/// @param data receives the report payload.
+/// @param size receives the size of the report payload.
+///
+/// @return true if a report was taken.
+///
+/// NOTE: This must be called with @ref s_hid_lock held.
+static bool hid_take(uint8_t index, uint8_t *data, uint8_t &size)
+{
+    hid_report_slot_t &slot = s_hid_slots[index];
+    if (!slot.pending)
+    {
+        return false;
+    }
+    size = slot.size;
+    memcpy(data, slot.data, size);
+    slot.pending = false;
+    if (hid_is_mouse(index))
+    {
+        hid_mouse_report_t *report = (hid_mouse_report_t *)data;
+        report->x = take_mouse_delta(s_mouse_motion.x);
+        report->y = take_mouse_delta(s_mouse_motion.y);
+        report->wheel = take_mouse_delta(s_mouse_motion.wheel);
+        report->pan = take_mouse_delta(s_mouse_motion.pan);
+        // movement that did not fit remains pending for the next poll.
+        slot.pending = s_mouse_motion.x || s_mouse_motion.y ||
+                       s_mouse_motion.wheel || s_mouse_motion.pan;
+    }
+    return true;
+}
+
+/// Puts a report back into the queue after the endpoint rejected it.
+///
+/// @param index is the @ref hid_slot_t of the report type.
+/// @param data is the report payload.
+/// @param size is the size of the report payload.
+///
+/// NOTE: This must be called with @ref s_hid_lock held.
+static void hid_restore(uint8_t index, const uint8_t *data, uint8_t size)
+{
+    hid_report_slot_t &slot = s_hid_slots[index];
+    if (hid_is_mouse(index))
+    {
+        const hid_mouse_report_t *report = (const hid_mouse_report_t *)data;
+        s_mouse_motion.x += report->x;
+        s_mouse_motion.y += report->y;
+        s_mouse_motion.wheel += report->wheel;
+        s_mouse_motion.pan += report->pan;
+        slot.pending = true;
+    }
+    else if (!slot.pending)
+    {
+        // a newer state has not arrived, send this one again.
+        memcpy(slot.data, data, size);
+        slot.size = size;
+        slot.pending = true;
+    }
+}
+
+#if CONFIG_ESPUSB_HID_KEYBOARD_NKRO
+/// Converts an N-key rollover report to a boot keyboard report.
+///
+/// @param nkro is the report to convert.
+/// @param boot receives the converted report, only the six lowest keycodes
+/// are included.
+static void hid_nkro_to_boot(const hid_nkro_keyboard_report_t *nkro,
+                             hid_keyboard_report_t *boot)
+{
+    bzero(boot, sizeof(hid_keyboard_report_t));
+    boot->modifier = nkro->modifier;
+    size_t count = 0;
+    for (size_t index = 0; index < sizeof(nkro->keys) &&
+         count < BOOT_KEY_COUNT; index++)
+    {
+        uint8_t bits = nkro->keys[index];
+        while (bits && count < BOOT_KEY_COUNT)
+        {
+            uint8_t bit = __builtin_ctz(bits);
+            boot->keycode[count++] = (index * 8) + bit;
+            bits &= bits - 1;
+        }
+    }
+}
+#endif // CONFIG_ESPUSB_HID_KEYBOARD_NKRO
+
+/// Submits the pending report of a report type if its endpoint is idle.
+///
+/// @param index is the @ref hid_slot_t of the report type.
+///
+/// @return true if a report was submitted.
+static bool hid_submit(uint8_t index)
+{
+    uint8_t instance = hid_slot_instance(index);
+    uint8_t data[MAX_REPORT_SIZE];
+    uint8_t size = 0;
+    if (!tud_hid_n_ready(instance))
+    {
+        return false;
+    }
+    portENTER_CRITICAL(&s_hid_lock);
+    bool found = hid_take(index, data, size);
+#if CONFIG_ESPUSB_HID_LATENCY_STATS
+    // the timestamps are recorded before submitting since the completion
+    // callback may run before tud_hid_n_report returns.
+    hid_report_slot_t &slot = s_hid_slots[index];
+    int64_t previous_queued_us = slot.inflight_queued_us;
+    int64_t previous_submit_us = slot.inflight_submit_us;
+    if (found)
+    {
+        slot.inflight_queued_us = slot.queued_us;
+        slot.inflight_submit_us = esp_timer_get_time();
+        if (slot.pending)
+        {
+            // mouse movement which did not fit into this report remains
+            // pending, it is measured from now rather than from when the
+            // movement sent with this report was queued.
+            slot.queued_us = slot.inflight_submit_us;
+        }
+    }
+#endif // CONFIG_ESPUSB_HID_LATENCY_STATS
+    portEXIT_CRITICAL(&s_hid_lock);
+    if (!found)
+    {
+        return false;
+    }
+    const uint8_t *report = data;
+    uint8_t report_size = size;
+#if CONFIG_ESPUSB_HID_KEYBOARD_NKRO
+    // a host using the boot protocol ignores the report descriptor and
+    // expects the six key boot report.
+    hid_keyboard_report_t boot_report;
+    if (hid_is_keyboard(index) &&
+        tud_hid_n_get_protocol(instance) == HID_PROTOCOL_BOOT)
+    {
+        hid_nkro_to_boot((const hid_nkro_keyboard_report_t *)data,
+                         &boot_report);
+        report = (const uint8_t *)&boot_report;
+        report_size = sizeof(hid_keyboard_report_t);
+    }
+#endif // CONFIG_ESPUSB_HID_KEYBOARD_NKRO
+    bool sent = tud_hid_n_report(instance, hid_slot_report_id(index), report,
+                                 report_size);
+    portENTER_CRITICAL(&s_hid_lock);
+    if (sent)
+    {
+        s_hid_slots[index].stats.sent++;
+    }
+    else
+    {
+        // another task submitted a report first, the completion callback of
+        // that report will pick this one up.
+        hid_restore(index, data, size);
+#if CONFIG_ESPUSB_HID_LATENCY_STATS
+        slot.queued_us = std::min(slot.queued_us, slot.inflight_queued_us);
+        slot.inflight_queued_us = previous_queued_us;
+        slot.inflight_submit_us = previous_submit_us;
+#endif // CONFIG_ESPUSB_HID_LATENCY_STATS
+    }
+    portEXIT_CRITICAL(&s_hid_lock);
+    return sent;
+}
+
+/// Submits the next pending report for an interface if its endpoint is idle.
+///
+/// @param instance is the HID interface instance.
+static void hid_submit_next(uint8_t instance)
+{
+#if CONFIG_ESPUSB_HID_SHARED_INTERFACE
+    // the report types take turns on the shared endpoint so a report type
+    // which is updated continuously can not hold back the others.
+    for (uint8_t offset = 0; offset < HID_SLOT_COUNT; offset++)
+    {
+        uint8_t index = (s_hid_next_slot + offset) % HID_SLOT_COUNT;
+        if (hid_submit(index))
+        {
+            s_hid_next_slot = (index + 1) % HID_SLOT_COUNT;
+            break;
+        }
+    }
+#else
+    hid_submit(instance);
+#endif // CONFIG_ESPUSB_HID_SHARED_INTERFACE
+}
+
+/// Queues a report, replacing any pending state for the same report type.
+///
+/// @param report is the report type.
+/// @param data is the report payload.
+/// @param size is the size of the report payload.
+/// @param merge_only when true a replaced state is counted as merged rather
+/// than dropped.
+///
+/// @return true if the report was queued.
+static bool hid_queue_report(esp_usb_hid_report_t report, const void *data,
+                             uint8_t size, bool merge_only)
+{
+    uint8_t index = hid_slot(report);
+    if (index >= HID_SLOT_COUNT || !tud_mounted())
+    {
+        return false;
+    }
+    portENTER_CRITICAL(&s_hid_lock);
+    hid_report_slot_t &slot = s_hid_slots[index];
+    slot.stats.queued++;
+#if CONFIG_ESPUSB_HID_LATENCY_STATS
+    if (!slot.pending)
+    {
+        slot.queued_us = esp_timer_get_time();
+    }
+#endif // CONFIG_ESPUSB_HID_LATENCY_STATS
+    if (slot.pending)
+    {
+        if (merge_only || !memcmp(slot.data, data, size))
+        {
+            slot.stats.merged++;
+        }
+        else
+        {
+            slot.stats.dropped++;
+        }
+    }
+    memcpy(slot.data, data, size);
+    slot.size = size;
+    slot.pending = true;
+    portEXIT_CRITICAL(&s_hid_lock);
+    hid_submit(index);
+    return true;
+}
+
+// Queues a HID keyboard report.
+bool send_hid_keyboard_report(uint8_t modifier, const uint8_t keycode[6])
+{
+    return send_hid_keyboard_keys(modifier, keycode,
+                                  keycode ? BOOT_KEY_COUNT : 0);
+}
+
+// Queues a HID keyboard report with any number of pressed keys.
+bool send_hid_keyboard_keys(uint8_t modifier, const uint8_t *keycodes,
+                            size_t count)
+{
+    hid_keyboard_state_t report = {};
+    report.modifier = modifier;
+#if CONFIG_ESPUSB_HID_KEYBOARD_NKRO
+    for (size_t index = 0; index < count; index++)
+    {
+        uint8_t key = keycodes[index];
+        if (key != HID_KEY_NONE && key < HID_NKRO_KEY_COUNT)
+        {
+            report.keys[key / 8] |= (1 << (key % 8));
+        }
+    }
+#else
+    if (keycodes)
+    {
+        memcpy(report.keycode, keycodes, std::min(count, BOOT_KEY_COUNT));
+    }
+#endif // CONFIG_ESPUSB_HID_KEYBOARD_NKRO
+    return hid_queue_report(REPORT_ID_KEYBOARD, &report, sizeof(report),
+                            false);
+}
+
+/// Queues a keyboard report and waits for it to be submitted to the host.
+///
+/// @param modifier is the bitmask of active modifier keys.
+/// @param keycodes is the list of pressed keys.
+/// @param count is the number of entries in @param keycodes.
+/// @param timeout is the maximum number of ticks to wait.
+///
+/// @return true if the report was submitted, false otherwise.
+///
+/// NOTE: Waiting for the report to be submitted ensures the next report does
+/// not replace it, otherwise key transitions could be lost. The caller must
+/// hold @ref s_keyboard_type_lock.
+static bool hid_type_report(uint8_t modifier, const uint8_t *keycodes,
+                            size_t count, TickType_t timeout)
+{
+#if CONFIG_ESPUSB_HID_KEYBOARD
+    // discard a completion from an earlier report, it would only cause an
+    // extra check of the pending flag.
+    xSemaphoreTake(s_keyboard_sent, 0);
+    if (!send_hid_keyboard_keys(modifier, keycodes, count))
+    {
+        return false;
+    }
+    hid_report_slot_t &slot = s_hid_slots[HID_SLOT_KEYBOARD];
+    TickType_t start = xTaskGetTickCount();
+    portENTER_CRITICAL(&s_hid_lock);
+    bool pending = slot.pending;
+    portEXIT_CRITICAL(&s_hid_lock);
+    while (pending)
+    {
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= timeout ||
+            xSemaphoreTake(s_keyboard_sent, timeout - elapsed) != pdTRUE)
+        {
+            break;
+        }
+        portENTER_CRITICAL(&s_hid_lock);
+        pending = slot.pending;
+        portEXIT_CRITICAL(&s_hid_lock);
+    }
+    return !pending;
+#else
+    return false;
+#endif // CONFIG_ESPUSB_HID_KEYBOARD
+}
+
+// Types an ASCII string via the HID keyboard.
+size_t send_hid_keyboard_string(const char *str, uint32_t timeout_ms)
+{
+    // [ascii][0] is true when shift is required, [ascii][1] is the keycode.
+    static const uint8_t ascii_to_keycode[128][2] = { HID_ASCII_TO_KEYCODE };
+    TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+    uint8_t modifier = 0;
+    uint8_t held = HID_KEY_NONE;
+    size_t typed = 0;
+#if CONFIG_ESPUSB_HID_KEYBOARD
+    // every call returns within the report timeouts, so waiting for another
+    // task to finish typing is bounded.
+    xSemaphoreTake(s_keyboard_type_lock, portMAX_DELAY);
+#endif // CONFIG_ESPUSB_HID_KEYBOARD
+    for (; *str; str++)
+    {
+        uint8_t ch = *str;
+        if (ch >= 128 || ascii_to_keycode[ch][1] == HID_KEY_NONE)
+        {
+            ESP_LOGV(TAG, "Skipping unmapped character: %d", ch);
+            continue;
+        }
+        uint8_t key = ascii_to_keycode[ch][1];
+        uint8_t key_modifier =
+            ascii_to_keycode[ch][0] ? KEYBOARD_MODIFIER_LEFTSHIFT : 0;
+        if (key == held || key_modifier != modifier)
+        {
+            // a repeated key must be released before it is pressed again
+            // and a modifier change must reach the host before the key.
+            if (!hid_type_report(key_modifier, nullptr, 0, timeout))
+            {
+                break;
+            }
+            held = HID_KEY_NONE;
+            modifier = key_modifier;
+        }
+        // the previous key is kept pressed while the next key is pressed,
+        // the host only generates an event for the newly pressed key.
+        uint8_t keys[2] = {key, held};
+        if (!hid_type_report(modifier, keys, held ? 2 : 1, timeout))
+        {
+            break;
+        }
+        held = key;
+        typed++;
+    }
+    hid_type_report(0, nullptr, 0, timeout);
+#if CONFIG_ESPUSB_HID_KEYBOARD
+    xSemaphoreGive(s_keyboard_type_lock);
+#endif // CONFIG_ESPUSB_HID_KEYBOARD
+    return typed;
+}
+
+// Queues a HID mouse report.
+bool send_hid_mouse_report(uint8_t buttons, int16_t x, int16_t y,
+                           int16_t vertical, int16_t horizontal)
+{
+#if CONFIG_ESPUSB_HID_MOUSE
+    if (!tud_mounted())
+    {
+        return false;
+    }
+    portENTER_CRITICAL(&s_hid_lock);
+    hid_report_slot_t &slot = s_hid_slots[HID_SLOT_MOUSE];
+    hid_mouse_report_t *report = (hid_mouse_report_t *)slot.data;
+    slot.stats.queued++;
+#if CONFIG_ESPUSB_HID_LATENCY_STATS
+    if (!slot.pending)
+    {
+        slot.queued_us = esp_timer_get_time();
+    }
+#endif // CONFIG_ESPUSB_HID_LATENCY_STATS
+    if (slot.pending)
+    {
+        // movement is always merged, a button change is only lost when the
+        // pending button state is replaced by a different one.
+        if (report->buttons == buttons)
+        {
+            slot.stats.merged++;
+        }
+        else
+        {
+            slot.stats.dropped++;
+        }
+    }
+    report->buttons = buttons;
+    slot.size = sizeof(hid_mouse_report_t);
+    slot.pending = true;
+    s_mouse_motion.x += x;
+    s_mouse_motion.y += y;
+    s_mouse_motion.wheel += vertical;
+    s_mouse_motion.pan += horizontal;
+    portEXIT_CRITICAL(&s_hid_lock);
+    hid_submit(HID_SLOT_MOUSE);
+    return true;
+#else
+    return false;
+#endif // CONFIG_ESPUSB_HID_MOUSE
+}
+
+// Queues a HID consumer control report.
+bool send_hid_consumer_report(uint16_t usage)
+{
+    return hid_queue_report(REPORT_ID_CONSUMER_CONTROL, &usage, sizeof(usage),
+                            false);
+}
+
+// Queues a HID gamepad report.
+bool send_hid_gamepad_report(const hid_gamepad_report_t *report)
+{
+    return hid_queue_report(REPORT_ID_GAMEPAD, report,
+                            sizeof(hid_gamepad_report_t), true);
+}
+
+// Retrieves the HID report queue statistics.
+void get_hid_report_stats(esp_usb_hid_report_t report,
+                          esp_usb_hid_report_stats_t *stats)
+{
+    bzero(stats, sizeof(esp_usb_hid_report_stats_t));
+    uint8_t index = hid_slot(report);
+    if (index < HID_SLOT_COUNT)
+    {
+        portENTER_CRITICAL(&s_hid_lock);
+        hid_report_slot_t &slot = s_hid_slots[index];
+        memcpy(stats, &slot.stats, sizeof(esp_usb_hid_report_stats_t));
+#if CONFIG_ESPUSB_HID_LATENCY_STATS
+        stats->latency_p50_us = slot.latency.percentile(50);
+        stats->latency_p90_us = slot.latency.percentile(90);
+        stats->latency_p99_us = slot.latency.percentile(99);
+        stats->latency_max_us = slot.latency.max();
+        stats->endpoint_p50_us = slot.endpoint.percentile(50);
+        stats->endpoint_p99_us = slot.endpoint.percentile(99);
+        stats->endpoint_max_us = slot.endpoint.max();
+#endif // CONFIG_ESPUSB_HID_LATENCY_STATS
+        portEXIT_CRITICAL(&s_hid_lock);
+    }
+}
+
+// Resets the HID report queue statistics.
+void reset_hid_report_stats()
+{
+    portENTER_CRITICAL(&s_hid_lock);
+    for (auto &slot : s_hid_slots)
+    {
+        bzero(&slot.stats, sizeof(esp_usb_hid_report_stats_t));
+#if CONFIG_ESPUSB_HID_LATENCY_STATS
+        slot.latency.reset();
+        slot.endpoint.reset();
+#endif // CONFIG_ESPUSB_HID_LATENCY_STATS
+    }
+    portEXIT_CRITICAL(&s_hid_lock);
+}
+
+#if CONFIG_ESPUSB_HID_KEYBOARD
+/// Initializes the locks used by @ref send_hid_keyboard_string.
+void init_usb_hid_keyboard()
+{
+    s_keyboard_type_lock =
+        xSemaphoreCreateMutexStatic(&s_keyboard_type_lock_storage);
+    s_keyboard_sent = xSemaphoreCreateBinaryStatic(&s_keyboard_sent_storage);
+}
+#endif // CONFIG_ESPUSB_HID_KEYBOARD
+
+#if CONFIG_ESPUSB_HID_LATENCY_PROBE
+/// Timer used for sending the latency probe reports.
+static esp_timer_handle_t s_probe_timer = nullptr;
+
+/// Sends a gamepad report carrying the time it was queued and schedules the
+/// next probe.
+///
+/// @param arg is not used.
+///
+/// The delay to the next probe includes a random part of the polling interval
+/// so the probes are queued at every point of the interval, this way the
+/// measured latency covers the full range of the polling delay.
+static void hid_probe_timer_cb(void *arg)
+{
+    hid_gamepad_report_t report = {};
+    report.buttons = (uint32_t)esp_timer_get_time();
+    send_hid_gamepad_report(&report);
+    uint64_t delay_us = (CONFIG_ESPUSB_HID_LATENCY_PROBE_PERIOD * 1000ULL) +
+        (esp_random() % (CONFIG_ESPUSB_HID_POLL_INTERVAL * 1000));
+    esp_timer_start_once(s_probe_timer, delay_us);
+}
+
+/// Starts sending the latency probe reports.
+void init_usb_hid_latency_probe()
+{
+    esp_timer_create_args_t timer_args = {};
+    timer_args.callback = hid_probe_timer_cb;
+    timer_args.name = "hid_probe";
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &s_probe_timer));
+    ESP_ERROR_CHECK(
+        esp_timer_start_once(s_probe_timer,
+                             CONFIG_ESPUSB_HID_LATENCY_PROBE_PERIOD * 1000ULL));
+}
+#endif // CONFIG_ESPUSB_HID_LATENCY_PROBE
+
+// Invoked when a report has been sent to the host, the next pending report
+// for the interface (if any) is submitted so it goes out on the next poll.
+// The shared interface only has one report in flight so the first slot of
+// the interface with a report in flight is the one which completed.
+void tud_hid_report_complete_cb(uint8_t instance, uint8_t const *report,
+                                uint8_t len)
+{
+    ESP_LOGV(TAG, "HID(%d) report complete", instance);
+#if CONFIG_ESPUSB_HID_RAW
+    if (instance == HID_INSTANCE_RAW)
+    {
+        hid_raw_report_complete();
+        return;
+    }
+#endif // CONFIG_ESPUSB_HID_RAW
+    if (instance >= HID_INSTANCE_COUNT)
+    {
+        return;
+    }
+#if CONFIG_ESPUSB_HID_LATENCY_STATS
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&s_hid_lock);
+    for (uint8_t index = 0; index < HID_SLOT_COUNT; index++)
+    {
+        hid_report_slot_t &slot = s_hid_slots[index];
+        if (hid_slot_instance(index) == instance && slot.inflight_queued_us)
+        {
+            slot.latency.add(now - slot.inflight_queued_us);
+            slot.endpoint.add(now - slot.inflight_submit_us);
+            slot.inflight_queued_us = 0;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_hid_lock);
+#endif // CONFIG_ESPUSB_HID_LATENCY_STATS
+    hid_submit_next(instance);
+#if CONFIG_ESPUSB_HID_KEYBOARD
+    if (instance == hid_slot_instance(HID_SLOT_KEYBOARD))
+    {
+        xSemaphoreGive(s_keyboard_sent);
+    }
+#endif // CONFIG_ESPUSB_HID_KEYBOARD
+}
+
+#if CONFIG_ESPUSB_HID_KEYBOARD_NKRO
+// Invoked when the host switches between the boot and report protocols, the
+// current keyboard state is sent again in the format the host now expects.
+void tud_hid_set_protocol_cb(uint8_t instance, uint8_t protocol)
+{
+    ESP_LOGD(TAG, "HID(%d) protocol: %s", instance,
+             protocol == HID_PROTOCOL_BOOT ? "boot" : "report");
+    if (instance == hid_slot_instance(HID_SLOT_KEYBOARD))
+    {
+        portENTER_CRITICAL(&s_hid_lock);
+        hid_report_slot_t &slot = s_hid_slots[HID_SLOT_KEYBOARD];
+#if CONFIG_ESPUSB_HID_LATENCY_STATS
+        if (!slot.pending)
+        {
+            slot.queued_us = esp_timer_get_time();
+        }
+#endif // CONFIG_ESPUSB_HID_LATENCY_STATS
+        slot.pending = (slot.size != 0);
+        portEXIT_CRITICAL(&s_hid_lock);
+        hid_submit(HID_SLOT_KEYBOARD);
+    }
+}
+#endif // CONFIG_ESPUSB_HID_KEYBOARD_NKRO
+
 // Invoked when received GET_REPORT control request
 // Application must fill buffer report's content and return its length.
 // Return zero will cause the stack to STALL request
@@ -43,56 +858,29 @@ TU_ATTR_WEAK uint16_t tud_hid_get_report_cb(
 
 // Invoked when received SET_REPORT control request or
 // received data on OUT endpoint ( Report ID = 0, Type = 0 )
-TU_ATTR_WEAK void tud_hid_set_report_cb(
+// Raw HID reports are consumed here, all others are passed to the
+// application via hid_set_report_cb.
+void tud_hid_set_report_cb(
     uint8_t itf, uint8_t report_id, hid_report_type_t report_type,
     uint8_t const *buffer, uint16_t bufsize)
 {
-    (void)itf;
-    (void)report_id;
-    (void)report_type;
+#if CONFIG_ESPUSB_HID_RAW
+    if (itf == HID_INSTANCE_RAW)
+    {
+        hid_raw_report_received(buffer, bufsize);
+        return;
+    }
+#endif // CONFIG_ESPUSB_HID_RAW
+    hid_set_report_cb(itf, report_id, report_type, buffer, bufsize);
 }
 
-//--------------------------------------------------------------------+
-// HID Report Descriptor
-//--------------------------------------------------------------------+
-
-uint8_t const desc_hid_keyboard_report[] =
-{
-    TUD_HID_REPORT_DESC_KEYBOARD()
-};
-
-uint8_t const desc_hid_mouse_report[] =
-{
-    TUD_HID_REPORT_DESC_MOUSE()
-};
-
-uint8_t const desc_hid_consumer_report[] =
+// Default implementation of hid_set_report_cb which discards the report.
+TU_ATTR_WEAK void hid_set_report_cb(uint8_t instance, uint8_t report_id,
+                                    hid_report_type_t report_type,
+                                    const uint8_t *buffer, uint16_t bufsize)
 {
-    TUD_HID_REPORT_DESC_CONSUMER()
-};
-
-uint8_t const desc_hid_gamepad_report[] =
-{
-    TUD_HID_REPORT_DESC_GAMEPAD()
-};
-
-// Invoked when received GET HID REPORT DESCRIPTOR
-// Application return pointer to descriptor
-// Descriptor contents must exist long enough for transfer to complete
-TU_ATTR_WEAK uint8_t const *tud_hid_descriptor_report_cb(uint8_t instance)
-{
-    switch(instance)
-    {
-        case 0:
-            return desc_hid_keyboard_report;
-        case 1:
-            return desc_hid_mouse_report;
-        case 2:
-            return desc_hid_consumer_report;
-        case 3:
-            return desc_hid_gamepad_report;
-    }
-    return nullptr;
+    ESP_LOGV(TAG, "HID(%d) discarding %d byte report (id:%d, type:%d)",
+             instance, bufsize, report_id, report_type);
 }
 
 #endif // CONFIG_ESPUSB_HID
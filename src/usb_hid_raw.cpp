@@ -0,0 +1,176 @@
+// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+
+// if Esp32USB debug is enabled set the local log level higher than any of the
+// pre-defined log levels.
+#if CONFIG_ESPUSB_DEBUG
+#define LOG_LOCAL_LEVEL 0xFF
+#endif
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <string.h>
+#include <atomic>
+#include "usb.h"
+
+/// Tag used for all logging.
+static constexpr const char * const TAG = "USB:HID:RAW";
+
+#if CONFIG_ESPUSB_HID && CONFIG_ESPUSB_HID_RAW
+
+static_assert(HID_RAW_REPORT_SIZE <= CONFIG_ESPUSB_HID_BUFSIZE,
+              "HID buffer size is too small for the raw reports");
+
+/// Queue of IN reports waiting for the host to poll the endpoint.
+static QueueHandle_t s_raw_tx_queue = nullptr;
+
+/// Storage for @ref s_raw_tx_queue.
+static StaticQueue_t s_raw_tx_queue_storage;
+
+/// Report storage for @ref s_raw_tx_queue.
+static uint8_t s_raw_tx_queue_data[CONFIG_ESPUSB_HID_RAW_TX_QUEUE_DEPTH *
+                                   HID_RAW_REPORT_SIZE];
+
+/// Lock used to ensure only one context moves a report from the queue to the
+/// endpoint at a time.
+static SemaphoreHandle_t s_raw_submit_lock = nullptr;
+
+/// Storage for @ref s_raw_submit_lock.
+static StaticSemaphore_t s_raw_submit_lock_storage;
+
+/// Set when a submission was requested while @ref s_raw_submit_lock was held
+/// by another context, the holder retries before returning.
+static std::atomic<bool> s_raw_submit_pending{false};
+
+/// Raw HID transfer statistics.
+static esp_usb_hid_raw_stats_t s_raw_stats;
+
+/// Lock protecting @ref s_raw_stats.
+static portMUX_TYPE s_raw_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/// Moves the oldest queued report to the IN endpoint if it is idle.
+///
+/// NOTE: The report is only removed from the queue once the endpoint has
+/// accepted it so a report is never lost when another task wins the race
+/// for the endpoint. This is called from the USB task and does not wait for
+/// @ref s_raw_submit_lock, when it is held the request is counted and left
+/// to the holder via @ref s_raw_submit_pending.
+static void hid_raw_submit()
+{
+    uint8_t report[HID_RAW_REPORT_SIZE];
+    s_raw_submit_pending = true;
+    while (s_raw_submit_pending)
+    {
+        if (xSemaphoreTake(s_raw_submit_lock, 0) != pdTRUE)
+        {
+            portENTER_CRITICAL(&s_raw_stats_lock);
+            s_raw_stats.tx_submit_busy++;
+            portEXIT_CRITICAL(&s_raw_stats_lock);
+            return;
+        }
+        s_raw_submit_pending = false;
+        if (tud_hid_n_ready(HID_INSTANCE_RAW) &&
+            xQueuePeek(s_raw_tx_queue, report, 0) == pdTRUE &&
+            tud_hid_n_report(HID_INSTANCE_RAW, 0, report,
+                             HID_RAW_REPORT_SIZE))
+        {
+            xQueueReceive(s_raw_tx_queue, report, 0);
+            portENTER_CRITICAL(&s_raw_stats_lock);
+            s_raw_stats.tx_reports++;
+            portEXIT_CRITICAL(&s_raw_stats_lock);
+        }
+        xSemaphoreGive(s_raw_submit_lock);
+    }
+}
+
+/// Initializes the raw HID interface.
+void init_usb_hid_raw()
+{
+    s_raw_tx_queue =
+        xQueueCreateStatic(CONFIG_ESPUSB_HID_RAW_TX_QUEUE_DEPTH,
+                           HID_RAW_REPORT_SIZE, s_raw_tx_queue_data,
+                           &s_raw_tx_queue_storage);
+    s_raw_submit_lock =
+        xSemaphoreCreateMutexStatic(&s_raw_submit_lock_storage);
+}
+
+/// Invoked when an IN report has been collected by the host, the next queued
+/// report (if any) is submitted so it is sent on the next host poll.
+void hid_raw_report_complete()
+{
+    hid_raw_submit();
+}
+
+/// Invoked when an OUT report has been received from the host.
+///
+/// @param data is the received report.
+/// @param size is the size of the received report.
+void hid_raw_report_received(const uint8_t *data, size_t size)
+{
+    portENTER_CRITICAL(&s_raw_stats_lock);
+    s_raw_stats.rx_reports++;
+    portEXIT_CRITICAL(&s_raw_stats_lock);
+#if CONFIG_ESPUSB_HID_RAW_ECHO
+    // this is called from the USB task which must not block, reports which
+    // do not fit in the queue are counted as dropped.
+    send_hid_raw_report(data, size, 0);
+#else
+    hid_raw_report_received_cb(data, size);
+#endif // CONFIG_ESPUSB_HID_RAW_ECHO
+}
+
+// Queues a raw HID IN report.
+bool send_hid_raw_report(const void *data, size_t size, uint32_t timeout_ms)
+{
+    if (s_raw_tx_queue == nullptr || !tud_mounted() ||
+        size > HID_RAW_REPORT_SIZE)
+    {
+        return false;
+    }
+    uint8_t report[HID_RAW_REPORT_SIZE] = {0};
+    memcpy(report, data, size);
+    if (xQueueSend(s_raw_tx_queue, report,
+                   pdMS_TO_TICKS(timeout_ms)) != pdTRUE)
+    {
+        portENTER_CRITICAL(&s_raw_stats_lock);
+        s_raw_stats.tx_dropped++;
+        portEXIT_CRITICAL(&s_raw_stats_lock);
+        return false;
+    }
+    hid_raw_submit();
+    return true;
+}
+
+// Default implementation of hid_raw_report_received_cb which discards the
+// report.
+TU_ATTR_WEAK void hid_raw_report_received_cb(const uint8_t *data, size_t size)
+{
+    ESP_LOGV(TAG, "Discarding %zu byte report", size);
+}
+
+// Retrieves the raw HID transfer statistics.
+void get_hid_raw_stats(esp_usb_hid_raw_stats_t *stats)
+{
+    portENTER_CRITICAL(&s_raw_stats_lock);
+    memcpy(stats, &s_raw_stats, sizeof(esp_usb_hid_raw_stats_t));
+    portEXIT_CRITICAL(&s_raw_stats_lock);
+    stats->tx_queued = s_raw_tx_queue ? uxQueueMessagesWaiting(s_raw_tx_queue)
+                                      : 0;
+}
+
+#endif // CONFIG_ESPUSB_HID && CONFIG_ESPUSB_HID_RAW
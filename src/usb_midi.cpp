@@ -0,0 +1,422 @@
+// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+
+// if Esp32USB debug is enabled set the local log level higher than any of the
+// pre-defined log levels.
+#if CONFIG_ESPUSB_DEBUG
+#define LOG_LOCAL_LEVEL 0xFF
+#endif
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <string.h>
+#include "usb.h"
+
+#include <device/usbd_pvt.h>
+
+/// Tag used for all logging.
+static constexpr const char * const TAG = "USB:MIDI";
+
+#if CONFIG_ESPUSB_MIDI
+
+uint8_t get_usb_midi_in_endpoint();
+
+/// MIDI interface instance used with the tud_midi_n_* APIs.
+static constexpr uint8_t MIDI_ITF = 0;
+
+/// Number of event packets which fit in a single bulk transfer.
+static constexpr size_t MIDI_PACKETS_PER_XFER =
+    CONFIG_ESPUSB_MIDI_FIFO_SIZE / sizeof(esp_usb_midi_packet_t);
+
+/// Number of virtual cables supported by USB-MIDI.
+static constexpr size_t MIDI_CABLE_COUNT = 16;
+
+/// Code Index Numbers used in the event packet header.
+typedef enum : uint8_t
+{
+    CIN_SYSCOMMON_2 = 0x2,
+    CIN_SYSCOMMON_3 = 0x3,
+    CIN_SYSEX_START = 0x4,
+    CIN_SYSEX_END_1 = 0x5,
+    CIN_SYSEX_END_2 = 0x6,
+    CIN_SYSEX_END_3 = 0x7,
+    CIN_PROGRAM_CHANGE = 0xC,
+    CIN_CHANNEL_PRESSURE = 0xD,
+    CIN_SINGLE_BYTE = 0xF,
+} midi_cin_t;
+
+/// Partially received System Exclusive data for a cable.
+typedef struct
+{
+    /// Bytes waiting for a complete event packet.
+    uint8_t data[3];
+
+    /// Number of bytes in @ref data.
+    uint8_t count;
+} midi_sysex_state_t;
+
+static_assert(sizeof(esp_usb_midi_packet_t) == 4,
+              "USB-MIDI event packets must be four bytes");
+
+/// Lock held while packets are added to the TX FIFO so batches and System
+/// Exclusive messages from different tasks do not interleave.
+static SemaphoreHandle_t s_midi_tx_lock = nullptr;
+
+/// Storage for @ref s_midi_tx_lock.
+static StaticSemaphore_t s_midi_tx_lock_storage;
+
+/// Binary semaphore given from @ref __wrap_midid_xfer_cb when the host has
+/// collected an IN transfer, taken by the task holding @ref s_midi_tx_lock.
+static SemaphoreHandle_t s_midi_tx_done = nullptr;
+
+/// Storage for @ref s_midi_tx_done.
+static StaticSemaphore_t s_midi_tx_done_storage;
+
+/// Queue of events received from the host.
+static QueueHandle_t s_midi_rx_queue = nullptr;
+
+/// Storage for @ref s_midi_rx_queue.
+static StaticQueue_t s_midi_rx_queue_storage;
+
+/// Event storage for @ref s_midi_rx_queue.
+static uint8_t s_midi_rx_queue_data[CONFIG_ESPUSB_MIDI_RX_QUEUE_DEPTH *
+                                    sizeof(esp_usb_midi_event_t)];
+
+/// System Exclusive transmit state for each cable.
+static midi_sysex_state_t s_midi_sysex[MIDI_CABLE_COUNT];
+
+/// MIDI transfer statistics.
+static esp_usb_midi_stats_t s_midi_stats;
+
+/// Lock protecting @ref s_midi_stats.
+static portMUX_TYPE s_midi_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/// Returns the size of a MIDI message based on its status byte.
+///
+/// @param status is the status byte of the message.
+///
+/// @return the number of bytes in the message, zero for System Exclusive,
+/// undefined or data bytes.
+static size_t midi_message_size(uint8_t status)
+{
+    switch (status & 0xF0)
+    {
+        case 0x80: // note off
+        case 0x90: // note on
+        case 0xA0: // polyphonic key pressure
+        case 0xB0: // control change
+        case 0xE0: // pitch bend
+            return 3;
+        case 0xC0: // program change
+        case 0xD0: // channel pressure
+            return 2;
+        case 0xF0:
+            switch (status)
+            {
+                case 0xF1: // MTC quarter frame
+                case 0xF3: // song select
+                    return 2;
+                case 0xF2: // song position pointer
+                    return 3;
+                case 0xF6: // tune request
+                case 0xF8 ... 0xFF: // real-time
+                    return (status == 0xF9 || status == 0xFD) ? 0 : 1;
+            }
+    }
+    return 0;
+}
+
+/// Returns the number of MIDI bytes carried by an event packet.
+///
+/// @param cin is the Code Index Number of the packet.
+///
+/// @return the number of MIDI bytes, zero for reserved packet types.
+static uint8_t midi_packet_size(uint8_t cin)
+{
+    switch (cin)
+    {
+        case CIN_SYSEX_END_1:
+        case CIN_SINGLE_BYTE:
+            return 1;
+        case CIN_SYSCOMMON_2:
+        case CIN_SYSEX_END_2:
+        case CIN_PROGRAM_CHANGE:
+        case CIN_CHANNEL_PRESSURE:
+            return 2;
+        case CIN_SYSCOMMON_3:
+        case CIN_SYSEX_START:
+        case CIN_SYSEX_END_3:
+        case 0x8 ... 0xB:
+        case 0xE:
+            return 3;
+    }
+    // 0x0 and 0x1 are reserved for future extensions.
+    return 0;
+}
+
+/// Adds packets to the MIDI TX FIFO.
+///
+/// @param packets are the packets to send.
+/// @param count is the number of packets in @param packets.
+/// @param timeout is the maximum time to wait for space in the TX FIFO.
+///
+/// @return the number of packets added to the TX FIFO.
+///
+/// NOTE: The caller must hold @ref s_midi_tx_lock.
+///
+/// TinyUSB starts a transfer for each packet written while the IN endpoint is
+/// idle. To pack a batch into as few transfers as possible the endpoint is
+/// claimed while the packets are written, each batch ends when the TX FIFO is
+/// full. The endpoint is then released and the FIFO flushed so a single
+/// transfer carries everything queued before waiting for the host to collect
+/// it. When the endpoint is busy the claim fails and the packets are
+/// collected by the transfer which starts when the host takes the in-flight
+/// one.
+static size_t midi_write_packets(const esp_usb_midi_packet_t *packets,
+                                 size_t count, TickType_t timeout)
+{
+    TickType_t start = xTaskGetTickCount();
+    size_t written = 0;
+    // discard a completion from an earlier write, it would only cause an
+    // extra retry.
+    xSemaphoreTake(s_midi_tx_done, 0);
+    while (written < count && tud_mounted())
+    {
+        bool claimed = usbd_edpt_claim(0, get_usb_midi_in_endpoint());
+        while (written < count &&
+               tud_midi_n_packet_write(MIDI_ITF,
+                                       (const uint8_t *)&packets[written]))
+        {
+            written++;
+        }
+        if (claimed)
+        {
+            usbd_edpt_release(0, get_usb_midi_in_endpoint());
+        }
+        // a zero length stream write only starts a transfer for the queued
+        // packets, packet writes do not when the FIFO is already full.
+        tud_midi_n_stream_write(MIDI_ITF, 0, nullptr, 0);
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (written == count || elapsed >= timeout)
+        {
+            break;
+        }
+        // the FIFO is full so a transfer is in flight, wait for the host to
+        // collect it.
+        xSemaphoreTake(s_midi_tx_done, timeout - elapsed);
+    }
+    portENTER_CRITICAL(&s_midi_lock);
+    s_midi_stats.tx_packets += written;
+    s_midi_stats.tx_dropped += count - written;
+    portEXIT_CRITICAL(&s_midi_lock);
+    return written;
+}
+
+/// Initializes the MIDI layer.
+void init_usb_midi()
+{
+    s_midi_tx_lock = xSemaphoreCreateMutexStatic(&s_midi_tx_lock_storage);
+    s_midi_tx_done = xSemaphoreCreateBinaryStatic(&s_midi_tx_done_storage);
+    s_midi_rx_queue =
+        xQueueCreateStatic(CONFIG_ESPUSB_MIDI_RX_QUEUE_DEPTH,
+                           sizeof(esp_usb_midi_event_t), s_midi_rx_queue_data,
+                           &s_midi_rx_queue_storage);
+}
+
+// Sends a MIDI channel voice, system common or real-time message.
+bool send_midi_message(uint8_t cable, const uint8_t *msg, size_t size,
+                       uint32_t timeout_ms)
+{
+    if (cable >= MIDI_CABLE_COUNT || size == 0 ||
+        midi_message_size(msg[0]) != size)
+    {
+        ESP_LOGW(TAG, "Invalid MIDI message %02x (%zu bytes)",
+                 size ? msg[0] : 0, size);
+        return false;
+    }
+    esp_usb_midi_packet_t packet = {0, {0, 0, 0}};
+    uint8_t cin = msg[0] >> 4;
+    if (cin == 0xF)
+    {
+        cin = size == 1 ? CIN_SINGLE_BYTE :
+              size == 2 ? CIN_SYSCOMMON_2 : CIN_SYSCOMMON_3;
+    }
+    packet.header = (cable << 4) | cin;
+    memcpy(packet.data, msg, size);
+    return send_midi_packets(&packet, 1, timeout_ms) == 1;
+}
+
+// Sends pre-built USB-MIDI event packets.
+size_t send_midi_packets(const esp_usb_midi_packet_t *packets, size_t count,
+                         uint32_t timeout_ms)
+{
+    TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+    if (s_midi_tx_lock == nullptr || count == 0 ||
+        xSemaphoreTake(s_midi_tx_lock, timeout) != pdTRUE)
+    {
+        return 0;
+    }
+    size_t written = midi_write_packets(packets, count, timeout);
+    xSemaphoreGive(s_midi_tx_lock);
+    return written;
+}
+
+// Sends part of a System Exclusive message.
+size_t send_midi_sysex(uint8_t cable, const uint8_t *data, size_t size,
+                       uint32_t timeout_ms)
+{
+    TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+    if (s_midi_tx_lock == nullptr || cable >= MIDI_CABLE_COUNT ||
+        xSemaphoreTake(s_midi_tx_lock, timeout) != pdTRUE)
+    {
+        return 0;
+    }
+    midi_sysex_state_t &state = s_midi_sysex[cable];
+    esp_usb_midi_packet_t packets[MIDI_PACKETS_PER_XFER];
+    // number of bytes from data carried by each packet and the ones before it.
+    size_t packet_end[MIDI_PACKETS_PER_XFER];
+    size_t consumed = 0;
+    while (consumed < size)
+    {
+        // build up to one transfer worth of packets at a time so large dumps
+        // are never buffered in full.
+        midi_sysex_state_t start_state = state;
+        size_t count = 0;
+        size_t used = 0;
+        while (consumed + used < size && count < MIDI_PACKETS_PER_XFER)
+        {
+            uint8_t byte = data[consumed + used++];
+            state.data[state.count++] = byte;
+            if (byte == 0xF7)
+            {
+                packets[count].header =
+                    (cable << 4) | (CIN_SYSEX_END_1 + state.count - 1);
+            }
+            else if (state.count == 3)
+            {
+                packets[count].header = (cable << 4) | CIN_SYSEX_START;
+            }
+            else
+            {
+                continue;
+            }
+            memset(packets[count].data, 0, sizeof(packets[count].data));
+            memcpy(packets[count].data, state.data, state.count);
+            state.count = 0;
+            packet_end[count++] = used;
+        }
+        size_t written = midi_write_packets(packets, count, timeout);
+        if (written < count)
+        {
+            // only the bytes of the sent packets are consumed, the state is
+            // rewound to the end of the last sent packet so the caller can
+            // resume the message with the remaining bytes.
+            ESP_LOGW(TAG, "Timeout sending SysEx on cable %d", cable);
+            if (written)
+            {
+                consumed += packet_end[written - 1];
+                state.count = 0;
+            }
+            else
+            {
+                state = start_state;
+            }
+            break;
+        }
+        consumed += used;
+    }
+    xSemaphoreGive(s_midi_tx_lock);
+    return consumed;
+}
+
+// Retrieves the next MIDI event received from the host.
+bool receive_midi_event(esp_usb_midi_event_t *event, uint32_t timeout_ms)
+{
+    return s_midi_rx_queue &&
+           xQueueReceive(s_midi_rx_queue, event,
+                         pdMS_TO_TICKS(timeout_ms)) == pdTRUE;
+}
+
+// Retrieves the MIDI transfer statistics.
+void get_midi_stats(esp_usb_midi_stats_t *stats)
+{
+    portENTER_CRITICAL(&s_midi_lock);
+    memcpy(stats, &s_midi_stats, sizeof(esp_usb_midi_stats_t));
+    portEXIT_CRITICAL(&s_midi_lock);
+}
+
+extern "C"
+{
+
+// Invoked when MIDI event packets have been received from the host.
+void tud_midi_rx_cb(uint8_t itf)
+{
+    // all packets of a transfer share the time it arrived, they are moved
+    // out of the TinyUSB FIFO right away so the OUT endpoint is not NAKed
+    // while the application is busy.
+    esp_usb_midi_event_t event;
+    event.timestamp_us = esp_timer_get_time();
+    esp_usb_midi_packet_t packet;
+    while (tud_midi_n_packet_read(itf, (uint8_t *)&packet))
+    {
+        event.cable = packet.header >> 4;
+        event.size = midi_packet_size(packet.header & 0x0F);
+        memcpy(event.data, packet.data, sizeof(event.data));
+        bool dropped = event.size &&
+            xQueueSend(s_midi_rx_queue, &event, 0) != pdTRUE;
+        portENTER_CRITICAL(&s_midi_lock);
+        s_midi_stats.rx_packets++;
+        s_midi_stats.rx_dropped += dropped;
+        portEXIT_CRITICAL(&s_midi_lock);
+    }
+}
+
+/// Handles a completed transfer in the MIDI class driver (midi_device.c).
+bool __real_midid_xfer_cb(uint8_t rhport, uint8_t ep_addr,
+                          xfer_result_t result, uint32_t xferred_bytes);
+
+/// Handles a completed MIDI transfer and wakes the task waiting in
+/// @ref midi_write_packets when the IN transfer was collected by the host.
+///
+/// @param rhport is the USB port.
+/// @param ep_addr is the endpoint address.
+/// @param result is the transfer result.
+/// @param xferred_bytes is the number of bytes transferred.
+///
+/// @return the result of the class driver.
+///
+/// NOTE: TinyUSB does not provide a MIDI transmit complete callback, all
+/// calls to midid_xfer_cb are redirected to this function by the linker (see
+/// CMakeLists.txt). The class driver starts the next transfer for packets
+/// queued in the meantime before the writer is woken up.
+bool __wrap_midid_xfer_cb(uint8_t rhport, uint8_t ep_addr,
+                          xfer_result_t result, uint32_t xferred_bytes)
+{
+    bool res = __real_midid_xfer_cb(rhport, ep_addr, result, xferred_bytes);
+    if (ep_addr == get_usb_midi_in_endpoint())
+    {
+        xSemaphoreGive(s_midi_tx_done);
+    }
+    return res;
+}
+
+} // extern "C"
+
+#endif // CONFIG_ESPUSB_MIDI
@@ -25,19 +25,27 @@
 // inclusion of esp_log.h. The value below is one higher than ESP_LOG_VERBOSE.
 //#define LOG_LOCAL_LEVEL ESP_LOG_INFO
 
+#include <algorithm>
 #include <endian.h>
+#include <esp_flash_encrypt.h>
 #include <esp_idf_version.h>
 #include <esp_log.h>
 #include <esp_ota_ops.h>
 #include <esp_partition.h>
 #include <esp_system.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <freertos/timers.h>
-#include <vector>
-#include "psram_allocator.h"
+#include "caps_memory_resource.h"
 
 static constexpr const char * const TAG = "USB:MSC";
 
+#if CONFIG_ESPUSB_HEAP_GUARD
+void usb_heap_guard_suspend();
+void usb_heap_guard_resume();
+#endif // CONFIG_ESPUSB_HEAP_GUARD
+
 typedef enum : uint8_t
 {
     PART_EMPTY = 0x00,
@@ -174,26 +182,6 @@ typedef struct TU_ATTR_PACKED               //  start
 static_assert(sizeof(fat_long_filename_t) == sizeof(fat_direntry_t),
               "fat_long_filename_t should be same size as fat_direntry_t");
 
-typedef struct
-{
-    char name[8];
-    char ext[3];
-    const char *content;
-    uint8_t attributes;
-    uint32_t size;
-    uint32_t start_sector;
-    uint32_t end_sector;
-    uint16_t start_cluster;
-    uint16_t end_cluster;
-    const esp_partition_t *partition;
-    std::string printable_name;
-    uint8_t root_dir_sector;
-#if CONFIG_ESPUSB_MSC_LONG_FILENAMES
-    std::vector<fat_long_filename_t,
-                PSRAMAllocator<fat_long_filename_t>> lfn_parts;
-#endif // CONFIG_ESPUSB_MSC_LONG_FILENAMES
-} fat_file_entry_t;
-
 static_assert((CONFIG_ESPUSB_MSC_VDISK_FILE_COUNT & 15) == 0,
               "Number of files on the virtual disk must be a multiple of 16");
 
@@ -265,12 +253,162 @@ static bios_boot_sector_t s_bios_boot_sector =
     .signature = {0x55, 0xaa}
 };
 
-static std::vector<fat_file_entry_t,
-                   PSRAMAllocator<fat_file_entry_t>> s_root_directory;
+#if CONFIG_ESPUSB_MSC_VDISK_IMAGE
+/// Start of the prebuilt virtual disk image (generated by tools/mkvdisk.py and
+/// embedded by the component CMakeLists.txt), it holds every sector up to the
+/// end of the last file.
+extern const uint8_t vdisk_image_start[] asm("_binary_vdisk_img_start");
+
+/// End of the prebuilt virtual disk image.
+extern const uint8_t vdisk_image_end[] asm("_binary_vdisk_img_end");
+#else
+/// Flag for @ref vdisk_file_table_t flags indicating that the file content is
+/// read from a partition rather than memory.
+static constexpr uint8_t VDISK_FILE_PARTITION = 0x01;
+
+/// Virtual disk file table.
+///
+/// The table is stored as a structure of arrays so the fields which are
+/// searched for every sector read (start/end sector and size) are contiguous.
+/// Cluster numbers are not stored as each cluster is a single sector, see
+/// @ref sector_to_cluster. The file names are packed into
+/// @ref s_vdisk_name_arena and the long filename entries are generated from
+/// them when a root directory sector is read.
+typedef struct
+{
+    /// First sector of each file, files are laid out in registration order
+    /// so this is sorted.
+    uint32_t start_sector[CONFIG_ESPUSB_MSC_VDISK_FILE_COUNT];
+
+    /// Last sector of each file.
+    uint32_t end_sector[CONFIG_ESPUSB_MSC_VDISK_FILE_COUNT];
+
+    /// Size of each file (in bytes).
+    uint32_t size[CONFIG_ESPUSB_MSC_VDISK_FILE_COUNT];
+
+    /// Content of each file, this is an esp_partition_t when the
+    /// @ref VDISK_FILE_PARTITION flag is set.
+    const void *source[CONFIG_ESPUSB_MSC_VDISK_FILE_COUNT];
+
+#if CONFIG_ESPUSB_MSC_PARTITION_MMAP && CONFIG_ESPUSB_HEAP_GUARD
+    /// Mapped start of each partition backed file, nullptr when the
+    /// partition is read with esp_partition_read. See @ref map_partition.
+    const uint8_t *mapped[CONFIG_ESPUSB_MSC_VDISK_FILE_COUNT];
+#endif // CONFIG_ESPUSB_MSC_PARTITION_MMAP && CONFIG_ESPUSB_HEAP_GUARD
+
+    /// Null terminated name of each file.
+    const char *name[CONFIG_ESPUSB_MSC_VDISK_FILE_COUNT];
+
+    /// Space padded 8.3 name of each file.
+    char short_name[CONFIG_ESPUSB_MSC_VDISK_FILE_COUNT][11];
+
+    /// Directory entry attributes of each file.
+    uint8_t attributes[CONFIG_ESPUSB_MSC_VDISK_FILE_COUNT];
+
+    /// Root directory sector holding the entries of each file.
+    uint8_t root_dir_sector[CONFIG_ESPUSB_MSC_VDISK_FILE_COUNT];
+
+    /// Number of long filename entries preceding the 8.3 entry of each file.
+    uint8_t lfn_count[CONFIG_ESPUSB_MSC_VDISK_FILE_COUNT];
+
+    /// VDISK_FILE_* flags of each file.
+    uint8_t flags[CONFIG_ESPUSB_MSC_VDISK_FILE_COUNT];
+
+    /// Number of registered files.
+    uint16_t count;
+} vdisk_file_table_t;
+
+// the file table is searched for every sector read so it is kept in internal
+// memory, the names are only needed when a root directory sector is generated
+// and are packed into an arena in PSRAM (when available).
+static vdisk_file_table_t s_files;
+
+#if CONFIG_ESPUSB_STATIC_ALLOCATION
+// in heap-free mode the name arena is backed by a static buffer sized for the
+// worst case: every file having a name of the maximum length.
+static NullResource s_vdisk_null_resource;
+
+/// Static storage for @ref s_vdisk_name_arena, this includes the period and
+/// the null terminator of each name.
+static char s_vdisk_name_buffer[
+    CONFIG_ESPUSB_MSC_VDISK_FILE_COUNT * (MAX_FILENAME_LENGTH + 2)];
+
+static MonotonicArenaResource s_vdisk_name_arena(
+    s_vdisk_name_buffer, sizeof(s_vdisk_name_buffer), &s_vdisk_null_resource);
+#else
+// the arena chunks are included in the @ref PSRAMHeap statistics.
+static HeapTierResource<PSRAMHeap> s_vdisk_name_heap;
+
+// files are registered once and never removed, so the names are packed into
+// an arena. The first chunk covers names averaging 16 characters.
+static MonotonicArenaResource s_vdisk_name_arena(
+    CONFIG_ESPUSB_MSC_VDISK_FILE_COUNT * 16, &s_vdisk_name_heap);
+#endif // CONFIG_ESPUSB_STATIC_ALLOCATION
+
+/// Converts a sector in the file content area to its cluster number.
+///
+/// @param sector is the sector to convert.
+///
+/// @return cluster number, the first file content cluster is two.
+static inline uint32_t sector_to_cluster(uint32_t sector)
+{
+    return sector - FILE_CONTENT_FIRST_SECTOR + 2;
+}
+
+/// Searches the file table for the file containing a sector.
+///
+/// @param lba is the sector to search for.
+///
+/// @return index into @ref s_files or -1 if no file contains the sector.
+static int find_file_by_sector(uint32_t lba)
+{
+    // find the last file which starts at or before the sector.
+    const uint32_t *start = s_files.start_sector;
+    const uint32_t *next = std::upper_bound(start, start + s_files.count, lba);
+    if (next == start || lba > s_files.end_sector[next - start - 1])
+    {
+        return -1;
+    }
+    return next - start - 1;
+}
+
+#if CONFIG_ESPUSB_MSC_PARTITION_MMAP
+/// Size of a memory mapped partition window.
+static constexpr size_t MMAP_WINDOW_SIZE =
+    CONFIG_ESPUSB_MSC_PARTITION_MMAP_WINDOW * 1024;
+
+#if !CONFIG_ESPUSB_HEAP_GUARD
+/// Memory mapped window into a partition backed file.
+typedef struct
+{
+    /// Partition which is mapped, nullptr when nothing is mapped.
+    const esp_partition_t *partition;
+
+    /// Handle of the mapping.
+    spi_flash_mmap_handle_t handle;
+
+    /// Offset of the window from the start of the partition.
+    size_t offset;
+
+    /// Number of bytes mapped.
+    size_t size;
+
+    /// Mapped address of @ref offset.
+    const uint8_t *data;
+} vdisk_mmap_window_t;
+
+// a single window is shared by all partition backed files, the host usually
+// reads one file sequentially so the window only moves every
+// MMAP_WINDOW_SIZE bytes.
+static vdisk_mmap_window_t s_mmap_window;
+#endif // !CONFIG_ESPUSB_HEAP_GUARD
+#endif // CONFIG_ESPUSB_MSC_PARTITION_MMAP
+#endif // CONFIG_ESPUSB_MSC_VDISK_IMAGE
 
 static uint8_t s_root_directory_entry_usage[ROOT_DIR_SECTOR_COUNT];
 
 static xTimerHandle msc_write_timer;
+static StaticTimer_t msc_write_timer_storage;
 static constexpr TickType_t TIMER_EXPIRE_TICKS = pdMS_TO_TICKS(1000);
 static constexpr TickType_t TIMER_TICKS_TO_WAIT = 0;
 static bool msc_write_active = false;
@@ -279,10 +417,31 @@ static esp_ota_handle_t ota_update_handle = 0;
 const esp_partition_t *ota_update_partition = nullptr;
 static size_t ota_bytes_received;
 
+#if CONFIG_ESPUSB_HEAP_GUARD
+/// Stack size of the task starting the OTA update.
+static constexpr uint32_t OTA_BEGIN_TASK_STACK_SIZE = 3072;
+
+/// Stack of the task starting the OTA update.
+static StackType_t s_ota_begin_task_stack[OTA_BEGIN_TASK_STACK_SIZE];
+
+/// Storage for the task starting the OTA update.
+static StaticTask_t s_ota_begin_task_storage;
+
+/// Signaled by @ref msc_ota_begin_task once the OTA update has been started.
+static SemaphoreHandle_t s_ota_begin_done;
+static StaticSemaphore_t s_ota_begin_done_storage;
+
+/// Result of @ref msc_ota_begin from @ref msc_ota_begin_task.
+static esp_err_t s_ota_begin_result;
+#endif // CONFIG_ESPUSB_HEAP_GUARD
+
 static const char * const s_vendor_id = CONFIG_ESPUSB_MSC_VENDOR_ID;
 static const char * const s_product_id = CONFIG_ESPUSB_MSC_PRODUCT_ID;
 static const char * const s_product_rev = CONFIG_ESPUSB_MSC_PRODUCT_REVISION;
 
+static esp_usb_msc_read_stats_t s_msc_read_stats;
+static portMUX_TYPE s_msc_read_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
 /// Utility function to copy a string into a target field using spaces to pad
 /// to a set length.
 ///
@@ -320,6 +479,74 @@ static void msc_write_timeout_cb(xTimerHandle pxTimer)
     ota_bytes_received = 0;
 }
 
+/// Locates the OTA partition to receive the firmware and starts the update.
+///
+/// @return ESP_ERR_NOT_FOUND if there is no free OTA partition, otherwise the
+/// result of esp_ota_begin.
+///
+/// NOTE: The image size is not known until the directory entry is written
+/// so each sector is erased when it is first written rather than erasing the
+/// whole partition up front, which would stall the USB task for seconds.
+static esp_err_t msc_ota_begin()
+{
+    ota_update_partition = esp_ota_get_next_update_partition(NULL);
+    if (ota_update_partition == nullptr ||
+        ota_update_partition == esp_ota_get_running_partition())
+    {
+        ESP_LOGE(TAG, "Unable to locate a free OTA partition.");
+        ota_update_partition = nullptr;
+        return ESP_ERR_NOT_FOUND;
+    }
+#ifdef OTA_WITH_SEQUENTIAL_WRITES
+    size_t erase_size = OTA_WITH_SEQUENTIAL_WRITES;
+#else
+    size_t erase_size = OTA_SIZE_UNKNOWN;
+#endif // OTA_WITH_SEQUENTIAL_WRITES
+    return esp_ota_begin(ota_update_partition, erase_size,
+                         &ota_update_handle);
+}
+
+#if CONFIG_ESPUSB_HEAP_GUARD
+/// Runs @ref msc_ota_begin outside the USB task since the partition lookup
+/// and esp_ota_begin allocate from the heap.
+///
+/// @param param unused.
+static void msc_ota_begin_task(void *param)
+{
+    s_ota_begin_result = msc_ota_begin();
+    xSemaphoreGive(s_ota_begin_done);
+    vTaskDelete(nullptr);
+}
+#endif // CONFIG_ESPUSB_HEAP_GUARD
+
+/// Starts the OTA update via @ref msc_ota_begin.
+///
+/// @return result of @ref msc_ota_begin.
+///
+/// NOTE: With CONFIG_ESPUSB_HEAP_GUARD the update is started by a short lived
+/// task, the USB task only waits for the partition lookup as no sectors are
+/// erased by esp_ota_begin. The task storage is reused by the next update
+/// which can only start after the MSC write timeout, long after the idle
+/// task has cleaned up the previous task.
+static esp_err_t start_ota_update()
+{
+#if CONFIG_ESPUSB_HEAP_GUARD
+    if (xTaskCreateStaticPinnedToCore(msc_ota_begin_task, "usb-msc-ota",
+                                      OTA_BEGIN_TASK_STACK_SIZE, nullptr,
+                                      CONFIG_ESPUSB_TASK_PRIORITY,
+                                      s_ota_begin_task_stack,
+                                      &s_ota_begin_task_storage,
+                                      CONFIG_ESPUSB_TASK_AFFINITY) == nullptr)
+    {
+        return ESP_FAIL;
+    }
+    xSemaphoreTake(s_ota_begin_done, portMAX_DELAY);
+    return s_ota_begin_result;
+#else
+    return msc_ota_begin();
+#endif // CONFIG_ESPUSB_HEAP_GUARD
+}
+
 // default implementation.
 TU_ATTR_WEAK bool ota_update_start_cb(esp_app_desc_t *app_desc)
 {
@@ -393,15 +620,30 @@ void configure_virtual_disk(std::string label, uint32_t serial_number)
         htole32(s_bios_boot_sector.hidden_sectors);
     s_bios_boot_sector.heads = htole32(s_bios_boot_sector.heads);
 
+#if CONFIG_ESPUSB_MSC_VDISK_IMAGE
+    // the label and serial number of the prebuilt image come from its
+    // manifest, the geometry is the same as it is generated from the
+    // configuration.
+    ESP_LOGI(TAG, "Using prebuilt virtual disk image: %d sectors (%d bytes)",
+             (vdisk_image_end - vdisk_image_start) /
+                CONFIG_ESPUSB_MSC_VDISK_SECTOR_SIZE,
+             vdisk_image_end - vdisk_image_start);
+#endif // CONFIG_ESPUSB_MSC_VDISK_IMAGE
+
     // initialize all root directory sectors to have zero file entries.
     memset(s_root_directory_entry_usage, 0, ROOT_DIR_SECTOR_COUNT);
     // track the volume label as part of the first sector.
     s_root_directory_entry_usage[0] = 1;
 
+
     // TODO: remove the usage of FreeRTOS Timer here.
     msc_write_timer =
-        xTimerCreate("msc_write_timer", TIMER_EXPIRE_TICKS, pdTRUE, nullptr,
-                     msc_write_timeout_cb);
+        xTimerCreateStatic("msc_write_timer", TIMER_EXPIRE_TICKS, pdTRUE,
+                           nullptr, msc_write_timeout_cb,
+                           &msc_write_timer_storage);
+#if CONFIG_ESPUSB_HEAP_GUARD
+    s_ota_begin_done = xSemaphoreCreateBinaryStatic(&s_ota_begin_done_storage);
+#endif // CONFIG_ESPUSB_HEAP_GUARD
     current_chip_id = ESP_CHIP_ID_INVALID;
 
     // determine the type of chip that we are currently
@@ -418,188 +660,378 @@ void configure_virtual_disk(std::string label, uint32_t serial_number)
     }
 }
 
-esp_err_t register_virtual_file(const std::string name, const char *content,
+#if CONFIG_ESPUSB_MSC_LONG_FILENAMES && !CONFIG_ESPUSB_MSC_VDISK_IMAGE
+/// Calculates the checksum of an 8.3 name used by long filename entries.
+///
+/// @param short_name is the space padded 8.3 name.
+///
+/// @return checksum of @param short_name.
+static uint8_t lfn_checksum(const char *short_name)
+{
+    uint8_t checksum = 0;
+    const uint8_t *p = (const uint8_t *)short_name;
+    for (size_t index = 11; index; index--)
+    {
+        checksum = ((checksum & 1) << 7) + (checksum >> 1) + *p++;
+    }
+    return checksum;
+}
+
+/// Generates the long filename entries for a file.
+///
+/// @param lfn is the first directory entry to populate.
+/// @param file is the index into @ref s_files.
+///
+/// @return the directory entry after the last long filename entry.
+static fat_direntry_t *generate_lfn_entries(fat_long_filename_t *lfn,
+                                            size_t file)
+{
+    const char *name = s_files.name[file];
+    size_t name_len = strlen(name);
+    uint8_t checksum = lfn_checksum(s_files.short_name[file]);
+    uint8_t count = s_files.lfn_count[file];
+    // the fragments are stored in reverse order, the last fragment first.
+    for (uint8_t fragment = count; fragment; fragment--, lfn++)
+    {
+        bzero(lfn, sizeof(fat_long_filename_t));
+        lfn->sequence = fragment;
+        if (fragment == count)
+        {
+            lfn->sequence |= 0x40; // mark as last in sequence
+        }
+        lfn->checksum = checksum;
+        lfn->attributes = (DIRENT_READ_ONLY | DIRENT_HIDDEN |
+                           DIRENT_SYSTEM | DIRENT_VOLUME_LABEL);
+        // encode up to 13 characters into the three fields available in the
+        // LFN version of the file table entry. The name is terminated by one
+        // null character with any remaining characters padded with 0xFFFF.
+        size_t offs = (fragment - 1) * 13;
+        for (size_t idx = 0; idx < 13; idx++)
+        {
+            uint16_t ch = 0xFFFF;
+            if (offs + idx < name_len)
+            {
+                ch = (uint8_t)name[offs + idx];
+            }
+            else if (offs + idx == name_len)
+            {
+                ch = 0x0000;
+            }
+            if (idx < 5)
+            {
+                lfn->name[idx] = htole16(ch);
+            }
+            else if (idx < 11)
+            {
+                lfn->name2[idx - 5] = htole16(ch);
+            }
+            else
+            {
+                lfn->name3[idx - 11] = htole16(ch);
+            }
+        }
+    }
+    return (fat_direntry_t *)lfn;
+}
+#endif // CONFIG_ESPUSB_MSC_LONG_FILENAMES && !CONFIG_ESPUSB_MSC_VDISK_IMAGE
+
+#if CONFIG_ESPUSB_MSC_PARTITION_MMAP && !CONFIG_ESPUSB_MSC_VDISK_IMAGE
+/// Records the result of creating a memory mapped window.
+///
+/// @param err is the result of esp_partition_mmap.
+static void record_partition_map(esp_err_t err)
+{
+    portENTER_CRITICAL(&s_msc_read_stats_lock);
+    if (err == ESP_OK)
+    {
+        s_msc_read_stats.window_maps++;
+    }
+    else
+    {
+        s_msc_read_stats.map_failures++;
+    }
+    portEXIT_CRITICAL(&s_msc_read_stats_lock);
+}
+
+/// Checks if a partition can be read through a memory mapping.
+///
+/// @param partition is the partition to check.
+///
+/// @return true if reads through a mapping return the partition content.
+///
+/// NOTE: When flash encryption is enabled the flash cache decrypts every read
+/// through a mapping, a partition which is not marked as encrypted is stored
+/// in plain text and must be read with esp_partition_read instead.
+static bool partition_mappable(const esp_partition_t *partition)
+{
+    return !esp_flash_encryption_enabled() || partition->encrypted;
+}
+
+#if CONFIG_ESPUSB_HEAP_GUARD
+/// Maps the start of a partition backed file into the data address space.
+///
+/// @param partition is the partition backing the file.
+/// @param size is the size of the file.
+///
+/// @return address of the mapped content, nullptr if the partition could not
+/// be mapped (or can not be read through a mapping, see
+/// @ref partition_mappable) in which case it is read with esp_partition_read.
+///
+/// NOTE: spi_flash_mmap allocates from the heap so the USB task can not move
+/// a window, instead a fixed window covering the first MMAP_WINDOW_SIZE bytes
+/// of the file is mapped when the application registers it. Reads beyond the
+/// window use esp_partition_read. The window is never released as files can
+/// not be removed.
+static const uint8_t *map_partition(const esp_partition_t *partition,
+                                    size_t size)
+{
+    if (!partition_mappable(partition))
+    {
+        ESP_LOGI(TAG, "%s is not encrypted, using flash reads",
+                 partition->label);
+        return nullptr;
+    }
+    const void *data = nullptr;
+    spi_flash_mmap_handle_t handle;
+    size = std::min(size, MMAP_WINDOW_SIZE);
+    esp_err_t err = size ? esp_partition_mmap(partition, 0, size,
+                                              SPI_FLASH_MMAP_DATA, &data,
+                                              &handle)
+                         : ESP_ERR_INVALID_SIZE;
+    record_partition_map(err);
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Unable to map %s (%zu bytes), using flash reads: %s",
+                 partition->label, size, esp_err_to_name(err));
+        return nullptr;
+    }
+    return static_cast<const uint8_t *>(data);
+}
+#endif // CONFIG_ESPUSB_HEAP_GUARD
+
+/// Copies data from a partition backed file through a memory mapped window.
+///
+/// @param file is the index of the file.
+/// @param partition is the partition backing the file.
+/// @param offset is the offset from the start of @param partition.
+/// @param buffer will receive the data.
+/// @param size is the number of bytes to read.
+///
+/// @return true if the data was copied, false if the data is not mapped and
+/// must be read with esp_partition_read.
+///
+/// NOTE: Only MMAP_WINDOW_SIZE bytes of flash are mapped per window so the
+/// MMU pages remain available to other spi_flash_mmap users (such as the
+/// image verification in esp_ota_end). Only partitions which return their
+/// content through a mapping are mapped, see @ref partition_mappable.
+static bool read_partition_mapped(int file, const esp_partition_t *partition,
+                                  size_t offset, void *buffer, size_t size)
+{
+    if (!partition_mappable(partition))
+    {
+        return false;
+    }
+#if CONFIG_ESPUSB_HEAP_GUARD
+    size_t window_size =
+        std::min((size_t)s_files.size[file], MMAP_WINDOW_SIZE);
+    if (s_files.mapped[file] == nullptr || offset + size > window_size)
+    {
+        return false;
+    }
+    memcpy(buffer, s_files.mapped[file] + offset, size);
+#else
+    if (s_mmap_window.partition != partition ||
+        offset < s_mmap_window.offset ||
+        offset + size > s_mmap_window.offset + s_mmap_window.size)
+    {
+        if (s_mmap_window.partition)
+        {
+            spi_flash_munmap(s_mmap_window.handle);
+            s_mmap_window.partition = nullptr;
+        }
+        // align the window so sequential reads move it as rarely as possible.
+        size_t window_offset = offset - (offset % MMAP_WINDOW_SIZE);
+        size_t window_size =
+            std::min(std::max(MMAP_WINDOW_SIZE, offset + size - window_offset),
+                     partition->size - window_offset);
+        const void *data;
+        esp_err_t err =
+            esp_partition_mmap(partition, window_offset, window_size,
+                               SPI_FLASH_MMAP_DATA, &data,
+                               &s_mmap_window.handle);
+        record_partition_map(err);
+        if (err != ESP_OK)
+        {
+            ESP_LOGD(TAG, "Unable to map %s (%zu bytes at %zu): %s",
+                     partition->label, window_size, window_offset,
+                     esp_err_to_name(err));
+            return false;
+        }
+        ESP_LOGV(TAG, "Mapped %s (%zu bytes at %zu)", partition->label,
+                 window_size, window_offset);
+        s_mmap_window.partition = partition;
+        s_mmap_window.offset = window_offset;
+        s_mmap_window.size = window_size;
+        s_mmap_window.data = static_cast<const uint8_t *>(data);
+    }
+    memcpy(buffer, s_mmap_window.data + (offset - s_mmap_window.offset), size);
+#endif // CONFIG_ESPUSB_HEAP_GUARD
+    return true;
+}
+#endif // CONFIG_ESPUSB_MSC_PARTITION_MMAP && !CONFIG_ESPUSB_MSC_VDISK_IMAGE
+
+esp_err_t register_virtual_file(const std::string &name, const char *content,
                                 uint32_t size, bool read_only,
                                 const esp_partition_t *partition)
 {
+#if CONFIG_ESPUSB_MSC_VDISK_IMAGE
+    // the directory and FAT are part of the prebuilt image and can not change.
+    ESP_LOGE(TAG, "Unable to add %s, the virtual disk uses a prebuilt image!",
+             name.c_str());
+    return ESP_ERR_NOT_SUPPORTED;
+#else
     // one directory entry is reserved for the volume label
-    if (s_root_directory.size() > (CONFIG_ESPUSB_MSC_VDISK_FILE_COUNT - 1))
+    if (s_files.count > (CONFIG_ESPUSB_MSC_VDISK_FILE_COUNT - 1))
     {
         ESP_LOGE(TAG,
                  "Maximum file count has been reached, rejecting new file!");
         return ESP_ERR_INVALID_STATE;
     }
 
-    fat_file_entry_t file = {};
+    size_t file = s_files.count;
+    char *short_name = s_files.short_name[file];
 
     // default base name and extension to spaces
-    memset(file.name, ' ', TU_ARRAY_SIZE(file.name));
-    memset(file.ext, ' ', TU_ARRAY_SIZE(file.ext));
+    memset(short_name, ' ', TU_ARRAY_SIZE(s_files.short_name[file]));
 
     // break the provided filename into base name and extension
+    // NOTE: the name is parsed in place to avoid temporary strings.
     size_t pos = name.find_first_of('.');
-    std::string base_name = name;
-    std::string extension = "";
+    const char *base_name = name.c_str();
+    size_t base_len = name.length();
+    const char *extension = "";
+    size_t ext_len = 0;
     if (pos == std::string::npos)
     {
         // truncate the filename to the maximum length limit
-        if (base_name.length() > MAX_FILENAME_LENGTH)
+        if (base_len > MAX_FILENAME_LENGTH)
         {
-            base_name.resize(MAX_FILENAME_LENGTH);
+            base_len = MAX_FILENAME_LENGTH;
         }
-        // fill the file name and extension to spaces by default.
-        memset(file.name, ' ', 8);
-        memset(file.ext, ' ', 3);
         // copy up to 11 characters of the filename into the name field, this
-        // will spill over into the ext field.
-        memcpy(file.name, base_name.c_str(), std::min((size_t)11
-                                                    , base_name.length()));
+        // will spill over into the extension.
+        memcpy(short_name, base_name, std::min((size_t)11, base_len));
         // force the file name and extension to be upper case.
-        for (size_t index = 0; index < 8; index++)
+        for (size_t index = 0; index < 11; index++)
         {
-            file.name[index] = toupper(file.name[index]);
+            short_name[index] = toupper(short_name[index]);
         }
-        for (size_t index = 0; index < 3; index++)
-        {
-            file.ext[index] = toupper(file.ext[index]);
-        }
-        file.printable_name.assign(std::move(base_name));
     }
     else
     {
-        base_name = name.substr(0, pos);
-        extension = name.substr(pos + 1, 3);
+        base_len = pos;
+        extension = base_name + pos + 1;
+        ext_len = std::min((size_t)3, name.length() - pos - 1);
         // possibly truncate the base name so it fits within the max file length
-        if (base_name.length() > MAX_FILENAME_LENGTH - 3)
+        if (base_len > MAX_FILENAME_LENGTH - 3)
         {
-            base_name.resize(MAX_FILENAME_LENGTH - 3);
+            base_len = MAX_FILENAME_LENGTH - 3;
         }
-        for (size_t index = 0; index < std::min((size_t)8, base_name.length()); index++)
+        for (size_t index = 0; index < std::min((size_t)8, base_len); index++)
         {
-            file.name[index] = toupper(base_name.at(index));
+            short_name[index] = toupper(base_name[index]);
         }
-        for (size_t index = 0; index < extension.length(); index++)
+        for (size_t index = 0; index < ext_len; index++)
         {
-            file.ext[index] = toupper(extension.at(index));
+            short_name[8 + index] = toupper(extension[index]);
         }
-        file.printable_name.assign(std::move(base_name)).append(".").append(extension);
     }
+
+    // pack the printable name into the name arena.
+    bool has_extension = (pos != std::string::npos);
+    size_t name_len = base_len + (has_extension ? ext_len + 1 : 0);
+    char *printable_name =
+        static_cast<char *>(s_vdisk_name_arena.allocate(name_len + 1, 1));
+    memcpy(printable_name, base_name, base_len);
+    if (has_extension)
+    {
+        printable_name[base_len] = '.';
+        memcpy(printable_name + base_len + 1, extension, ext_len);
+    }
+    printable_name[name_len] = '\0';
+    s_files.name[file] = printable_name;
+
+    s_files.lfn_count[file] = 0;
 #if CONFIG_ESPUSB_MSC_LONG_FILENAMES
     // if the filename is longer than the maximum allowed for 8.3 format
-    // convert it to a long filename instead
-    if (file.printable_name.length() > 12)
+    // convert it to a long filename instead, each fragment can hold up to 13
+    // characters.
+    if (name_len > 12)
     {
         // mark the file name as truncated.
-        file.name[6] = '~';
-        file.name[7] = '1';
-        uint8_t lfn_checksum = 0;
-        uint8_t *p = (uint8_t *)file.name;
-        for (size_t index = 11; index; index--)
-        {
-            lfn_checksum = ((lfn_checksum & 1) << 7) +
-                            (lfn_checksum >> 1) + *p++;
-        }
-        size_t offs = 0;
-        uint8_t fragments = 1;
-        while (offs < file.printable_name.length())
-        {
-            fat_long_filename_t part;
-            bzero(&part, sizeof(fat_long_filename_t));
-            std::string name_part = file.printable_name.substr(offs, 13);
-            ESP_LOGD(TAG, "fragment(%d) %s", fragments, name_part.c_str());
-            part.sequence = fragments++;
-            part.checksum = lfn_checksum;
-            part.attributes = (DIRENT_READ_ONLY | DIRENT_HIDDEN |
-                               DIRENT_SYSTEM | DIRENT_VOLUME_LABEL);
-            // all long filename entries must have one null character
-            if (name_part.length() < 13)
-            {
-                name_part += (unsigned char)0x00;
-            }
-            // pad remaining characters with 0xFF
-            while (name_part.length() < 13)
-            {
-                name_part += (unsigned char)0xFF;
-            }
-            // encode the filename parts into the three fields available in the
-            // LFN version of the file table entry
-            for (size_t idx = 0; idx < name_part.length(); idx++)
-            {
-                if (idx < 5)
-                {
-                    part.name[idx] = name_part[idx] != 0xFF ? name_part[idx] : 0xFFFF;
-                }
-                else if (idx < 11)
-                {
-                    part.name2[idx - 5] = name_part[idx] != 0xFF ? name_part[idx] : 0xFFFF;
-                }
-                else
-                {
-                    part.name3[idx - 11] = name_part[idx] != 0xFF ? name_part[idx] : 0xFFFF;
-                }
-            }
-            // insert the fragment at the front of the collection
-            file.lfn_parts.insert(file.lfn_parts.begin(), part);
-            offs += name_part.length();
-        }
-        file.lfn_parts[0].sequence |= 0x40; // mark as last in sequence
-        ESP_LOGI(TAG, "Created %d name fragments", file.lfn_parts.size());
+        short_name[6] = '~';
+        short_name[7] = '1';
+        s_files.lfn_count[file] = (name_len + 12) / 13;
+        ESP_LOGI(TAG, "Created %d name fragments", s_files.lfn_count[file]);
     }
 #endif // CONFIG_ESPUSB_MSC_LONG_FILENAMES
-    file.content = content;
-    file.partition = partition;
-    file.size = size;
-    file.attributes = DIRENT_ARCHIVE;
+    s_files.flags[file] = 0;
+    if (partition)
+    {
+        s_files.source[file] = partition;
+        s_files.flags[file] |= VDISK_FILE_PARTITION;
+#if CONFIG_ESPUSB_MSC_PARTITION_MMAP && CONFIG_ESPUSB_HEAP_GUARD
+        s_files.mapped[file] = map_partition(partition, size);
+#endif // CONFIG_ESPUSB_MSC_PARTITION_MMAP && CONFIG_ESPUSB_HEAP_GUARD
+    }
+    else
+    {
+        s_files.source[file] = content;
+    }
+    s_files.size[file] = size;
+    s_files.attributes[file] = DIRENT_ARCHIVE;
     if (read_only)
     {
-        file.attributes |= DIRENT_READ_ONLY;
+        s_files.attributes[file] |= DIRENT_READ_ONLY;
     }
 
-    if (s_root_directory.empty())
+    if (file == 0)
     {
-        file.start_sector = FILE_CONTENT_FIRST_SECTOR;
-        file.start_cluster = 2;
+        s_files.start_sector[file] = FILE_CONTENT_FIRST_SECTOR;
     }
     else
     {
-        file.start_sector = s_root_directory.back().end_sector + 1;
-        file.start_cluster = s_root_directory.back().end_cluster + 1;
+        s_files.start_sector[file] = s_files.end_sector[file - 1] + 1;
     }
-    file.end_sector = file.start_sector;
-    file.end_sector += (size / s_bios_boot_sector.sector_size);
-    file.end_cluster = file.start_cluster;
-    file.end_cluster += (size / s_bios_boot_sector.sector_size);
+    s_files.end_sector[file] =
+        s_files.start_sector[file] + (size / s_bios_boot_sector.sector_size);
     // scan root directory sectors to assign this file to a root dir sector
+    uint8_t entries_needed = 1 + s_files.lfn_count[file];
     for (uint8_t index = 0; index < ROOT_DIR_SECTOR_COUNT; index++)
     {
-        uint8_t entries_needed = 1;
-#if CONFIG_ESPUSB_MSC_LONG_FILENAMES
-        // if the filename is longer than 12 characters (including period)
-        // calculate the number of additional entries required. Each fragment
-        // can hold up to 13 characters.
-        if (file.printable_name.length() > 12)
-        {
-            // for long filenames we will always need at least one additional
-            // entry
-            entries_needed++;
-            entries_needed += (file.printable_name.length() > 13);
-            entries_needed += (file.printable_name.length() > 26);
-        }
-#endif // CONFIG_ESPUSB_MSC_LONG_FILENAMES
         if (s_root_directory_entry_usage[index] + entries_needed < DIRENTRIES_PER_SECTOR)
         {
             s_root_directory_entry_usage[index] += entries_needed;
-            file.root_dir_sector = index;
+            s_files.root_dir_sector[file] = index;
             break;
         }
     }
-    s_root_directory.push_back(file);
+    s_files.count++;
     ESP_LOGI(TAG,
              "File(%s) sectors: %d - %d, clusters: %d - %d, %d bytes, root: %d",
-             file.printable_name.c_str(), file.start_sector, file.end_sector,
-             file.start_cluster, file.end_cluster, size, file.root_dir_sector);
+             printable_name, s_files.start_sector[file],
+             s_files.end_sector[file],
+             sector_to_cluster(s_files.start_sector[file]),
+             sector_to_cluster(s_files.end_sector[file]), size,
+             s_files.root_dir_sector[file]);
+
+    esp_memory_resource_stats_t stats;
+    s_vdisk_name_arena.get_stats(&stats);
+    ESP_LOGD(TAG, "VDisk names: %zu bytes in %d chunk(s)",
+             stats.bytes_in_use, stats.upstream_allocations);
 
     return ESP_OK;
+#endif // CONFIG_ESPUSB_MSC_VDISK_IMAGE
 }
 
 esp_err_t add_readonly_file_to_virtual_disk(const std::string filename,
@@ -652,6 +1084,22 @@ esp_err_t add_firmware_to_virtual_disk(const std::string firmware_name)
     return ESP_ERR_NOT_FOUND;
 }
 
+// Retrieves the virtual disk partition read statistics.
+void get_msc_read_stats(esp_usb_msc_read_stats_t *stats)
+{
+    portENTER_CRITICAL(&s_msc_read_stats_lock);
+    memcpy(stats, &s_msc_read_stats, sizeof(esp_usb_msc_read_stats_t));
+    portEXIT_CRITICAL(&s_msc_read_stats_lock);
+}
+
+// Resets the virtual disk partition read statistics.
+void reset_msc_read_stats()
+{
+    portENTER_CRITICAL(&s_msc_read_stats_lock);
+    bzero(&s_msc_read_stats, sizeof(esp_usb_msc_read_stats_t));
+    portEXIT_CRITICAL(&s_msc_read_stats_lock);
+}
+
 // Utility macro for invoking an ESP-IDF API with with failure return code.
 #define ESP_RETURN_ON_ERROR_READ(name, return_code, x)          \
     {                                                           \
@@ -725,6 +1173,19 @@ void tud_msc_capacity_cb(uint8_t lun, uint32_t *block_count,
 int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset,
                           void *buffer, uint32_t bufsize)
 {
+#if CONFIG_ESPUSB_MSC_VDISK_IMAGE
+    // every sector is served from the prebuilt image, sectors after the last
+    // file are not part of the image and read as zeros.
+    size_t image_offs = (lba * CONFIG_ESPUSB_MSC_VDISK_SECTOR_SIZE) + offset;
+    size_t image_size = vdisk_image_end - vdisk_image_start;
+    size_t copy_size = 0;
+    if (image_offs < image_size)
+    {
+        copy_size = std::min((size_t)bufsize, image_size - image_offs);
+        memcpy(buffer, vdisk_image_start + image_offs, copy_size);
+    }
+    bzero((uint8_t *)buffer + copy_size, bufsize - copy_size);
+#else
     bzero(buffer, bufsize);
     if (lba == 0)
     {
@@ -735,7 +1196,7 @@ int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset,
     else if (lba < ROOT_DIR_FIRST_SECTOR)
     {
         uint32_t fat_table = (lba - FAT_COPY_0_FIRST_SECTOR);
-        if (fat_table > s_bios_boot_sector.fat_sectors)
+        if (fat_table >= s_bios_boot_sector.fat_sectors)
         {
             fat_table -= s_bios_boot_sector.fat_sectors;
         }
@@ -752,29 +1213,31 @@ int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset,
             buf_16[1] = FAT_CLUSTER_END_OF_FILE;
         }
 
-        for(auto &file : s_root_directory)
+        for (size_t file = 0; file < s_files.count; file++)
         {
+            uint32_t start_cluster =
+                sector_to_cluster(s_files.start_sector[file]);
+            uint32_t end_cluster = sector_to_cluster(s_files.end_sector[file]);
             // check if the file is part of this fat cluster
             // A: file start cluster
             // B: file end cluster
             // C: cluster start
             // D: cluster end
             // in_range: A <= D AND B >= C
-            if (file.start_cluster <= cluster_end &&
-                file.end_cluster >= cluster_start)
+            if (start_cluster <= cluster_end && end_cluster >= cluster_start)
             {
                 ESP_LOGD(TAG, "File: %s (%d-%d) is in range (%d-%d)"
-                       , file.printable_name.c_str(), file.start_cluster
-                       , file.end_cluster, cluster_start, cluster_end);
+                       , s_files.name[file], start_cluster, end_cluster
+                       , cluster_start, cluster_end);
                 for(size_t index = 0; index < 256; index++)
                 {
                     uint32_t target_cluster = cluster_start + index;
                     // if the target cluster is between start and end cluster
                     // of the file mark it as part of the file.
-                    if (target_cluster >= file.start_cluster &&
-                        target_cluster <= file.end_cluster)
+                    if (target_cluster >= start_cluster &&
+                        target_cluster <= end_cluster)
                     {
-                        if (target_cluster != file.end_sector)
+                        if (target_cluster != end_cluster)
                         {
                             buf_16[index] = htole16(target_cluster + 1);
                         }
@@ -804,33 +1267,27 @@ int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset,
             d->start_cluster = 0;
             d++;
         }
-        for (auto &file : s_root_directory)
+        for (size_t file = 0; file < s_files.count; file++)
         {
-            if (file.root_dir_sector != sector_idx)
+            if (s_files.root_dir_sector[file] != sector_idx)
             {
                 continue;
             }
             ESP_LOGD(TAG, "Creating directory entry for: %s",
-                     file.printable_name.c_str());
+                     s_files.name[file]);
 #if CONFIG_ESPUSB_MSC_LONG_FILENAMES
             // add directory entries for name fragments.
-            if (file.lfn_parts.size())
+            if (s_files.lfn_count[file])
             {
-                fat_long_filename_t *lfn = (fat_long_filename_t *)d;
-                for(auto &lfn_part : file.lfn_parts)
-                {
-                    memcpy(lfn, &lfn_part, sizeof(fat_long_filename_t));
-                    lfn++;
-                    d++;
-                }
+                d = generate_lfn_entries((fat_long_filename_t *)d, file);
             }
 #endif // CONFIG_ESPUSB_MSC_LONG_FILENAMES
-            // note this will clear the file extension.
-            space_padded_memcpy(d->name, file.name, 11);
-            space_padded_memcpy(d->ext, file.ext, 3);
-            d->attributes = file.attributes;
-            d->size = file.size;
-            d->start_cluster = file.start_cluster;
+            // NOTE this will overrun d->name and spill over into d->ext
+            memcpy(d->name, s_files.short_name[file], 11);
+            d->attributes = s_files.attributes[file];
+            d->size = htole32(s_files.size[file]);
+            d->start_cluster =
+                htole16(sector_to_cluster(s_files.start_sector[file]));
             d->create_date = 0x4d99;
             d->update_date = 0x4d99;
             // move to the next directory entry in the buffer
@@ -843,40 +1300,82 @@ int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset,
     }
     else
     {
-        // scan the root directory entries for a file that is in the requested sector.
-        for(auto &file : s_root_directory)
+        // search the file table for the file that is in the requested sector.
+        int file = find_file_by_sector(lba);
+        if (file >= 0)
         {
-            if (lba >= file.start_sector && lba <= file.end_sector)
+            // translate the LBA into the on-disk sector index
+            uint32_t sector_idx = lba - s_files.start_sector[file];
+
+            size_t temp_size = bufsize;
+            size_t sector_offset =
+                (sector_idx * s_bios_boot_sector.sector_size) + offset;
+            uint32_t file_size = s_files.size[file];
+            // bounds check to ensure the read does not go beyond the
+            // recorded file size.
+            if (bufsize > (file_size - sector_offset))
             {
-                // translate the LBA into the on-disk sector index
-                uint32_t sector_idx = lba - file.start_sector;
-
-                size_t temp_size = bufsize;
-                size_t sector_offset =
-                    (sector_idx * s_bios_boot_sector.sector_size) + offset;
-                uint32_t file_size = file.size;
-                // bounds check to ensure the read does not go beyond the
-                // recorded file size.
-                if (bufsize > (file_size - sector_offset))
-                {
-                    temp_size = file_size - sector_offset;
-                }
-                ESP_LOGV(TAG, "File(%s) READ %d bytes from lba:%d (offs:%d)",
-                         file.printable_name.c_str(), temp_size, lba, offset);
+                temp_size = file_size - sector_offset;
+            }
+            ESP_LOGV(TAG, "File(%s) READ %d bytes from lba:%d (offs:%d)",
+                     s_files.name[file], temp_size, lba, offset);
 
-                if (file.partition != nullptr)
+            if (s_files.flags[file] & VDISK_FILE_PARTITION)
+            {
+                const esp_partition_t *partition =
+                    (const esp_partition_t *)s_files.source[file];
+                int64_t start_us = esp_timer_get_time();
+                bool mapped = false;
+#if CONFIG_ESPUSB_MSC_PARTITION_MMAP
+                mapped = read_partition_mapped(file, partition, sector_offset,
+                                               buffer, temp_size);
+#endif // CONFIG_ESPUSB_MSC_PARTITION_MMAP
+                if (!mapped)
                 {
+#if CONFIG_ESPUSB_HEAP_GUARD
+                    // encrypted partitions are decrypted through a temporary
+                    // flash mapping which esp_partition_read allocates and
+                    // releases before returning.
+                    if (partition->encrypted)
+                    {
+                        usb_heap_guard_suspend();
+                    }
+#endif // CONFIG_ESPUSB_HEAP_GUARD
+                    esp_err_t read_err = esp_partition_read(
+                        partition, sector_offset, buffer, temp_size);
+#if CONFIG_ESPUSB_HEAP_GUARD
+                    if (partition->encrypted)
+                    {
+                        usb_heap_guard_resume();
+                    }
+#endif // CONFIG_ESPUSB_HEAP_GUARD
                     ESP_RETURN_ON_ERROR_READ("esp_partition_read", -1,
-                        esp_partition_read(file.partition, sector_offset,
-                                               buffer, temp_size));
+                                             read_err);
+                }
+                uint32_t elapsed_us = esp_timer_get_time() - start_us;
+                portENTER_CRITICAL(&s_msc_read_stats_lock);
+                if (mapped)
+                {
+                    s_msc_read_stats.mapped_reads++;
+                    s_msc_read_stats.mapped_bytes += temp_size;
+                    s_msc_read_stats.mapped_us += elapsed_us;
                 }
                 else
                 {
-                    memcpy(buffer, file.content + sector_offset, temp_size);
+                    s_msc_read_stats.flash_reads++;
+                    s_msc_read_stats.flash_bytes += temp_size;
+                    s_msc_read_stats.flash_us += elapsed_us;
                 }
+                portEXIT_CRITICAL(&s_msc_read_stats_lock);
+            }
+            else
+            {
+                memcpy(buffer, (const char *)s_files.source[file] +
+                       sector_offset, temp_size);
             }
         }
     }
+#endif // CONFIG_ESPUSB_MSC_VDISK_IMAGE
 
     return bufsize;
 }
@@ -972,18 +1471,9 @@ int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset,
                     }
                     // it appears to be a firmware, try and find a place to
                     // write it to
-                    ota_update_partition =
-                        esp_ota_get_next_update_partition(NULL);
-                    if (ota_update_partition == nullptr ||
-                        ota_update_partition == esp_ota_get_running_partition())
-                    {
-                        ESP_LOGE(TAG, "Unable to locate a free OTA partition.");
-                        return -1;
-                    }
                     ESP_LOGI(TAG, "Attempting to start OTA image");
                     ESP_RETURN_ON_ERROR_WRITE("esp_ota_begin", -1,
-                        esp_ota_begin(ota_update_partition, OTA_SIZE_UNKNOWN,
-                                        &ota_update_handle));
+                        start_ota_update());
                     ESP_LOGV(TAG, "ota_update_handle:%d", ota_update_handle);
                 }
             }
@@ -0,0 +1,331 @@
+// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+
+// if Esp32USB debug is enabled set the local log level higher than any of the
+// pre-defined log levels.
+#if CONFIG_ESPUSB_DEBUG
+#define LOG_LOCAL_LEVEL 0xFF
+#endif
+
+#include <driver/gpio.h>
+#include <driver/uart.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "usb.h"
+
+/// Tag used for all logging.
+static constexpr const char * const TAG = "USB:UART";
+
+#if CONFIG_ESPUSB_CDC && CONFIG_ESPUSB_CDC_UART_BRIDGE
+
+void cdc_written(const char *buf, size_t size, int64_t start_us);
+
+/// UART used for the bridge.
+static constexpr uart_port_t BRIDGE_UART = CONFIG_ESPUSB_CDC_UART_BRIDGE_PORT;
+
+/// Number of bytes moved between the CDC and UART in a single step.
+static constexpr size_t BRIDGE_CHUNK_SIZE = 512;
+
+/// Stack size for the bridge tasks.
+static constexpr uint32_t BRIDGE_TASK_STACK_SIZE = 2048;
+
+/// Number of bytes in the UART hardware FIFO at which RTS is deasserted.
+static constexpr uint8_t BRIDGE_RTS_THRESHOLD = 100;
+
+/// Maximum time to wait for the host to collect data before checking if it is
+/// still connected.
+static constexpr TickType_t BRIDGE_TX_WAIT_TICKS = pdMS_TO_TICKS(100);
+
+#if CONFIG_ESPUSB_CDC_UART_BRIDGE_MODEM_CTRL
+/// Pin driven by the host DTR state.
+static constexpr gpio_num_t BRIDGE_DTR_GPIO =
+    (gpio_num_t)CONFIG_ESPUSB_CDC_UART_BRIDGE_DTR_PIN;
+
+/// Pin driven by the host RTS state.
+static constexpr gpio_num_t BRIDGE_RTS_GPIO =
+    (gpio_num_t)CONFIG_ESPUSB_CDC_UART_BRIDGE_RTS_PIN;
+#endif // CONFIG_ESPUSB_CDC_UART_BRIDGE_MODEM_CTRL
+
+#if CONFIG_ESPUSB_CDC_UART_BRIDGE_FLOWCTRL
+/// RTS pin for the bridge UART.
+static constexpr int BRIDGE_RTS_PIN = CONFIG_ESPUSB_CDC_UART_BRIDGE_RTS_PIN;
+
+/// CTS pin for the bridge UART.
+static constexpr int BRIDGE_CTS_PIN = CONFIG_ESPUSB_CDC_UART_BRIDGE_CTS_PIN;
+#else
+/// RTS pin for the bridge UART.
+static constexpr int BRIDGE_RTS_PIN = UART_PIN_NO_CHANGE;
+
+/// CTS pin for the bridge UART.
+static constexpr int BRIDGE_CTS_PIN = UART_PIN_NO_CHANGE;
+#endif // CONFIG_ESPUSB_CDC_UART_BRIDGE_FLOWCTRL
+
+/// Task which moves data from the CDC to the UART.
+static TaskHandle_t s_usb_to_uart_task = nullptr;
+
+/// Stack of @ref s_usb_to_uart_task.
+static StackType_t s_usb_to_uart_task_stack[BRIDGE_TASK_STACK_SIZE];
+
+/// Storage for @ref s_usb_to_uart_task.
+static StaticTask_t s_usb_to_uart_task_storage;
+
+/// Task which moves data from the UART to the CDC.
+static TaskHandle_t s_uart_to_usb_task = nullptr;
+
+/// Stack of the task which moves data from the UART to the CDC.
+static StackType_t s_uart_to_usb_task_stack[BRIDGE_TASK_STACK_SIZE];
+
+/// Storage for the task which moves data from the UART to the CDC.
+static StaticTask_t s_uart_to_usb_task_storage;
+
+/// Buffer used by @ref usb_to_uart_task.
+static uint8_t s_usb_to_uart_buf[BRIDGE_CHUNK_SIZE];
+
+/// Buffer used by @ref uart_to_usb_task.
+static uint8_t s_uart_to_usb_buf[BRIDGE_CHUNK_SIZE];
+
+/// Moves data received from the host to the UART.
+///
+/// @param param is not used.
+///
+/// When the UART TX ring buffer is full uart_write_bytes blocks, this leaves
+/// the data in the CDC RX FIFO which causes TinyUSB to stop accepting OUT
+/// packets (NAK) until there is space again.
+static void usb_to_uart_task(void *param)
+{
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        uint32_t len;
+        while ((len = tud_cdc_read(s_usb_to_uart_buf, BRIDGE_CHUNK_SIZE)) > 0)
+        {
+            uart_write_bytes(BRIDGE_UART, s_usb_to_uart_buf, len);
+        }
+    }
+}
+
+/// Moves data received by the UART to the host.
+///
+/// @param param is not used.
+///
+/// When the CDC TX buffer is full the UART is not read, once the UART RX ring
+/// buffer fills the UART hardware deasserts RTS (when flow control is
+/// enabled) to stop the remote device from sending. The task waits for
+/// @ref uart_bridge_tx_complete rather than polling so the TX buffer is
+/// refilled as soon as the host has collected a transfer.
+static void uart_to_usb_task(void *param)
+{
+    while (true)
+    {
+        // block until at least one byte arrives and then collect everything
+        // the driver has buffered so far.
+        int received = uart_read_bytes(BRIDGE_UART, s_uart_to_usb_buf, 1,
+                                       portMAX_DELAY);
+        if (received <= 0)
+        {
+            continue;
+        }
+        int64_t start_us = esp_timer_get_time();
+        size_t len = received;
+        size_t buffered = 0;
+        uart_get_buffered_data_len(BRIDGE_UART, &buffered);
+        buffered = std::min(buffered, BRIDGE_CHUNK_SIZE - len);
+        if (buffered)
+        {
+            received = uart_read_bytes(BRIDGE_UART, s_uart_to_usb_buf + len,
+                                       buffered, 0);
+            len += std::max(received, 0);
+        }
+
+        size_t offs = 0;
+        while (offs < len && tud_cdc_connected())
+        {
+            uint32_t avail = tud_cdc_write_available();
+            if (avail == 0)
+            {
+                // make sure a transfer is in progress and wait for the host
+                // to collect it, a completion which happened since the last
+                // wait is still counted so it can not be missed.
+                tud_cdc_write_flush();
+                ulTaskNotifyTake(pdTRUE, BRIDGE_TX_WAIT_TICKS);
+                continue;
+            }
+            offs += tud_cdc_write(s_uart_to_usb_buf + offs,
+                                  std::min((size_t)avail, len - offs));
+        }
+        if (offs)
+        {
+            cdc_written((const char *)s_uart_to_usb_buf, offs, start_us);
+        }
+    }
+}
+
+/// Invoked by the CDC driver when a CDC IN transfer has completed.
+void uart_bridge_tx_complete()
+{
+    if (s_uart_to_usb_task)
+    {
+        xTaskNotifyGive(s_uart_to_usb_task);
+    }
+}
+
+/// Invoked by the CDC driver when the host changes DTR or RTS.
+///
+/// @param dtr is the DTR state requested by the host.
+/// @param rts is the RTS state requested by the host.
+void uart_bridge_line_state(bool dtr, bool rts)
+{
+#if CONFIG_ESPUSB_CDC_UART_BRIDGE_MODEM_CTRL
+    // the signals are active low, as on a USB serial adapter.
+    gpio_set_level(BRIDGE_DTR_GPIO, !dtr);
+    gpio_set_level(BRIDGE_RTS_GPIO, !rts);
+#endif // CONFIG_ESPUSB_CDC_UART_BRIDGE_MODEM_CTRL
+}
+
+/// Initializes the USB to UART bridge.
+void init_usb_uart_bridge()
+{
+    uart_config_t uart_cfg = {};
+    uart_cfg.baud_rate = CONFIG_ESPUSB_CDC_UART_BRIDGE_BAUD;
+    uart_cfg.data_bits = UART_DATA_8_BITS;
+    uart_cfg.parity = UART_PARITY_DISABLE;
+    uart_cfg.stop_bits = UART_STOP_BITS_1;
+#if CONFIG_ESPUSB_CDC_UART_BRIDGE_FLOWCTRL
+    uart_cfg.flow_ctrl = UART_HW_FLOWCTRL_CTS_RTS;
+#else
+    uart_cfg.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+#endif // CONFIG_ESPUSB_CDC_UART_BRIDGE_FLOWCTRL
+    uart_cfg.rx_flow_ctrl_thresh = BRIDGE_RTS_THRESHOLD;
+    uart_cfg.source_clk = UART_SCLK_APB;
+    ESP_ERROR_CHECK(uart_param_config(BRIDGE_UART, &uart_cfg));
+    ESP_ERROR_CHECK(
+        uart_set_pin(BRIDGE_UART, CONFIG_ESPUSB_CDC_UART_BRIDGE_TX_PIN,
+                     CONFIG_ESPUSB_CDC_UART_BRIDGE_RX_PIN, BRIDGE_RTS_PIN,
+                     BRIDGE_CTS_PIN));
+    ESP_ERROR_CHECK(
+        uart_driver_install(BRIDGE_UART,
+                            CONFIG_ESPUSB_CDC_UART_BRIDGE_RX_BUFSIZE,
+                            CONFIG_ESPUSB_CDC_UART_BRIDGE_TX_BUFSIZE, 0,
+                            nullptr, 0));
+
+#if CONFIG_ESPUSB_CDC_UART_BRIDGE_MODEM_CTRL
+    // both signals start deasserted until the host opens the port.
+    gpio_reset_pin(BRIDGE_DTR_GPIO);
+    gpio_reset_pin(BRIDGE_RTS_GPIO);
+    uart_bridge_line_state(false, false);
+    gpio_set_direction(BRIDGE_DTR_GPIO, GPIO_MODE_OUTPUT);
+    gpio_set_direction(BRIDGE_RTS_GPIO, GPIO_MODE_OUTPUT);
+#endif // CONFIG_ESPUSB_CDC_UART_BRIDGE_MODEM_CTRL
+
+    s_usb_to_uart_task =
+        xTaskCreateStaticPinnedToCore(usb_to_uart_task, "usb->uart",
+                                      BRIDGE_TASK_STACK_SIZE, nullptr,
+                                      CONFIG_ESPUSB_TASK_PRIORITY,
+                                      s_usb_to_uart_task_stack,
+                                      &s_usb_to_uart_task_storage,
+                                      CONFIG_ESPUSB_TASK_AFFINITY);
+    s_uart_to_usb_task =
+        xTaskCreateStaticPinnedToCore(uart_to_usb_task, "uart->usb",
+                                      BRIDGE_TASK_STACK_SIZE, nullptr,
+                                      CONFIG_ESPUSB_TASK_PRIORITY,
+                                      s_uart_to_usb_task_stack,
+                                      &s_uart_to_usb_task_storage,
+                                      CONFIG_ESPUSB_TASK_AFFINITY);
+    if (s_usb_to_uart_task == nullptr || s_uart_to_usb_task == nullptr)
+    {
+        ESP_LOGE(TAG, "Failed to create USB to UART bridge tasks.");
+        abort();
+    }
+    ESP_LOGI(TAG, "USB to UART bridge using UART%d at %d baud", BRIDGE_UART,
+             CONFIG_ESPUSB_CDC_UART_BRIDGE_BAUD);
+}
+
+extern "C"
+{
+
+// Invoked when data has been received on the CDC OUT endpoint.
+void tud_cdc_rx_cb(uint8_t itf)
+{
+    xTaskNotifyGive(s_usb_to_uart_task);
+}
+
+// Invoked when the host changes the line coding.
+void tud_cdc_line_coding_cb(uint8_t itf, cdc_line_coding_t const *coding)
+{
+    ESP_LOGD(TAG, "Line coding: %u baud, %u data bits, parity %u, stop %u",
+             coding->bit_rate, coding->data_bits, coding->parity,
+             coding->stop_bits);
+    if (coding->bit_rate)
+    {
+        uart_set_baudrate(BRIDGE_UART, coding->bit_rate);
+    }
+
+    switch (coding->data_bits)
+    {
+        case 5:
+            uart_set_word_length(BRIDGE_UART, UART_DATA_5_BITS);
+            break;
+        case 6:
+            uart_set_word_length(BRIDGE_UART, UART_DATA_6_BITS);
+            break;
+        case 7:
+            uart_set_word_length(BRIDGE_UART, UART_DATA_7_BITS);
+            break;
+        case 8:
+            uart_set_word_length(BRIDGE_UART, UART_DATA_8_BITS);
+            break;
+        default:
+            ESP_LOGW(TAG, "Unsupported data bits: %u", coding->data_bits);
+    }
+
+    // CDC parity values: 0 = none, 1 = odd, 2 = even, 3 = mark, 4 = space.
+    switch (coding->parity)
+    {
+        case 0:
+            uart_set_parity(BRIDGE_UART, UART_PARITY_DISABLE);
+            break;
+        case 1:
+            uart_set_parity(BRIDGE_UART, UART_PARITY_ODD);
+            break;
+        case 2:
+            uart_set_parity(BRIDGE_UART, UART_PARITY_EVEN);
+            break;
+        default:
+            ESP_LOGW(TAG, "Unsupported parity: %u", coding->parity);
+    }
+
+    // CDC stop bits values: 0 = 1, 1 = 1.5, 2 = 2.
+    switch (coding->stop_bits)
+    {
+        case 0:
+            uart_set_stop_bits(BRIDGE_UART, UART_STOP_BITS_1);
+            break;
+        case 1:
+            uart_set_stop_bits(BRIDGE_UART, UART_STOP_BITS_1_5);
+            break;
+        case 2:
+            uart_set_stop_bits(BRIDGE_UART, UART_STOP_BITS_2);
+            break;
+        default:
+            ESP_LOGW(TAG, "Unsupported stop bits: %u", coding->stop_bits);
+    }
+}
+
+} // extern "C"
+
+#endif // CONFIG_ESPUSB_CDC && CONFIG_ESPUSB_CDC_UART_BRIDGE
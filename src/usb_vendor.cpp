@@ -0,0 +1,462 @@
+// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+
+// if Esp32USB debug is enabled set the local log level higher than any of the
+// pre-defined log levels.
+#if CONFIG_ESPUSB_DEBUG
+#define LOG_LOCAL_LEVEL 0xFF
+#endif
+
+#include <algorithm>
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <string.h>
+#include "usb.h"
+
+#include <device/usbd_pvt.h>
+
+/// Tag used for all logging.
+static constexpr const char * const TAG = "USB:VENDOR";
+
+#if CONFIG_ESPUSB_VENDOR && CONFIG_ESPUSB_VENDOR_STREAMING
+
+/// Largest number of bytes passed to a single endpoint transfer, larger
+/// requests are split into multiple transfers. This is a multiple of the
+/// endpoint size so only the final transfer of a request can end with a short
+/// packet.
+static constexpr uint16_t MAX_XFER_SIZE = 0x8000;
+
+/// Size of a single packet on the vendor endpoints.
+static constexpr uint16_t VENDOR_PACKET_SIZE = CONFIG_ESPUSB_VENDOR_FIFO_SIZE;
+
+/// A read or write request queued by the application.
+typedef struct
+{
+    /// Application buffer, this is passed directly to the endpoint.
+    uint8_t *buf;
+
+    /// Size of @ref buf.
+    size_t size;
+
+    /// Number of bytes transferred so far.
+    size_t done;
+
+    /// Tracks if a zero length packet still has to be sent to end a write
+    /// request which is a multiple of the packet size, otherwise the host
+    /// keeps waiting for more data when it reads more than @ref size bytes.
+    bool zlp;
+
+    /// Callback to invoke when the request completes.
+    vendor_xfer_cb_t cb;
+
+    /// Argument for @ref cb.
+    void *arg;
+} vendor_request_t;
+
+/// State of one direction of the vendor interface.
+typedef struct
+{
+    /// Endpoint address, zero when the interface is not configured.
+    uint8_t ep;
+
+    /// Tracks if a transfer is in progress on @ref ep.
+    bool busy;
+
+    /// Number of bytes requested for the in progress transfer.
+    uint16_t xfer_len;
+
+    /// Queued requests, the request at @ref head is being transferred.
+    vendor_request_t requests[CONFIG_ESPUSB_VENDOR_XFER_QUEUE_DEPTH];
+
+    /// Index of the oldest request in @ref requests.
+    uint8_t head;
+
+    /// Number of requests in @ref requests.
+    uint8_t count;
+} vendor_channel_t;
+
+/// Lock protecting the vendor channels.
+static portMUX_TYPE s_vendor_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/// Host to device channel.
+static vendor_channel_t s_vendor_rx;
+
+/// Device to host channel.
+static vendor_channel_t s_vendor_tx;
+
+/// USB port the vendor interface was opened on.
+static uint8_t s_vendor_rhport = 0;
+
+/// Vendor interface transfer statistics.
+static esp_usb_vendor_stats_t s_vendor_stats;
+
+#if CONFIG_ESPUSB_VENDOR_DIAG
+static void vendor_diag_start();
+#endif // CONFIG_ESPUSB_VENDOR_DIAG
+#if CONFIG_ESPUSB_VENDOR_OTA
+void vendor_ota_start();
+#endif // CONFIG_ESPUSB_VENDOR_OTA
+
+/// Starts a transfer for the oldest queued request if the endpoint is idle.
+///
+/// @param channel is the channel to start a transfer on.
+static void vendor_start(vendor_channel_t &channel)
+{
+    portENTER_CRITICAL(&s_vendor_lock);
+    if (channel.ep == 0 || channel.busy || channel.count == 0)
+    {
+        portEXIT_CRITICAL(&s_vendor_lock);
+        return;
+    }
+    // once all data of a request has been sent this is the zero length
+    // packet ending it.
+    vendor_request_t &req = channel.requests[channel.head];
+    uint8_t *buf = req.buf + req.done;
+    channel.xfer_len = std::min(req.size - req.done, (size_t)MAX_XFER_SIZE);
+    channel.busy = true;
+    uint8_t ep = channel.ep;
+    uint16_t len = channel.xfer_len;
+    portEXIT_CRITICAL(&s_vendor_lock);
+
+    // the request is not removed from the queue until the transfer completes
+    // so the buffer stays owned by the endpoint until then.
+    if (!usbd_edpt_xfer(s_vendor_rhport, ep, buf, len))
+    {
+        ESP_LOGE(TAG, "Failed to start %d byte transfer on EP %02x", len, ep);
+        portENTER_CRITICAL(&s_vendor_lock);
+        channel.busy = false;
+        portEXIT_CRITICAL(&s_vendor_lock);
+    }
+}
+
+/// Queues a request on a channel.
+///
+/// @param channel is the channel to queue the request on.
+/// @param buf is the application buffer.
+/// @param size is the size of @param buf.
+/// @param cb is the callback to invoke when the request completes.
+/// @param arg is passed to @param cb.
+///
+/// @return true if the request was queued.
+static bool vendor_queue(vendor_channel_t &channel, void *buf, size_t size,
+                         vendor_xfer_cb_t cb, void *arg)
+{
+    if (buf == nullptr || size == 0)
+    {
+        return false;
+    }
+    portENTER_CRITICAL(&s_vendor_lock);
+    if (channel.ep == 0 ||
+        channel.count == CONFIG_ESPUSB_VENDOR_XFER_QUEUE_DEPTH)
+    {
+        portEXIT_CRITICAL(&s_vendor_lock);
+        return false;
+    }
+    size_t index =
+        (channel.head + channel.count) % CONFIG_ESPUSB_VENDOR_XFER_QUEUE_DEPTH;
+    vendor_request_t &req = channel.requests[index];
+    req.buf = (uint8_t *)buf;
+    req.size = size;
+    req.done = 0;
+    req.zlp = (&channel == &s_vendor_tx) && (size % VENDOR_PACKET_SIZE) == 0;
+    req.cb = cb;
+    req.arg = arg;
+    channel.count++;
+    portEXIT_CRITICAL(&s_vendor_lock);
+    vendor_start(channel);
+    return true;
+}
+
+/// Completes all queued requests on a channel, used when the interface is
+/// reset by the host.
+///
+/// @param channel is the channel to flush.
+static void vendor_flush(vendor_channel_t &channel)
+{
+    vendor_request_t flushed[CONFIG_ESPUSB_VENDOR_XFER_QUEUE_DEPTH];
+    portENTER_CRITICAL(&s_vendor_lock);
+    size_t count = channel.count;
+    for (size_t index = 0; index < count; index++)
+    {
+        flushed[index] = channel.requests[(channel.head + index) %
+                                          CONFIG_ESPUSB_VENDOR_XFER_QUEUE_DEPTH];
+    }
+    channel.ep = 0;
+    channel.busy = false;
+    channel.head = 0;
+    channel.count = 0;
+    portEXIT_CRITICAL(&s_vendor_lock);
+    for (size_t index = 0; index < count; index++)
+    {
+        if (flushed[index].cb)
+        {
+            flushed[index].cb(flushed[index].buf, flushed[index].done,
+                              flushed[index].arg);
+        }
+    }
+}
+
+// Queues a buffer to be sent to the host.
+bool queue_vendor_write(const void *buf, size_t size, vendor_xfer_cb_t cb,
+                        void *arg)
+{
+    return vendor_queue(s_vendor_tx, (void *)buf, size, cb, arg);
+}
+
+// Queues a buffer to receive data from the host.
+bool queue_vendor_read(void *buf, size_t size, vendor_xfer_cb_t cb, void *arg)
+{
+    return vendor_queue(s_vendor_rx, buf, size, cb, arg);
+}
+
+// Retrieves the vendor interface transfer statistics.
+void get_vendor_stats(esp_usb_vendor_stats_t *stats)
+{
+    portENTER_CRITICAL(&s_vendor_lock);
+    memcpy(stats, &s_vendor_stats, sizeof(esp_usb_vendor_stats_t));
+    portEXIT_CRITICAL(&s_vendor_lock);
+}
+
+// =============================================================================
+// TinyUSB class driver
+// =============================================================================
+
+/// Invoked when the TinyUSB stack is initialized.
+static void vendor_driver_init()
+{
+    bzero(&s_vendor_rx, sizeof(vendor_channel_t));
+    bzero(&s_vendor_tx, sizeof(vendor_channel_t));
+}
+
+/// Invoked when the host resets the device.
+///
+/// @param rhport is the USB port.
+static void vendor_driver_reset(uint8_t rhport)
+{
+    vendor_flush(s_vendor_rx);
+    vendor_flush(s_vendor_tx);
+}
+
+/// Invoked when the host selects a configuration, the vendor interface and
+/// its bulk endpoints are claimed by this driver.
+///
+/// @param rhport is the USB port.
+/// @param itf_desc is the interface descriptor.
+/// @param max_len is the remaining length of the configuration descriptor.
+///
+/// @return the number of descriptor bytes used, zero if the interface is not
+/// a vendor interface.
+static uint16_t vendor_driver_open(uint8_t rhport,
+                                   tusb_desc_interface_t const *itf_desc,
+                                   uint16_t max_len)
+{
+    TU_VERIFY(itf_desc->bInterfaceClass == TUSB_CLASS_VENDOR_SPECIFIC, 0);
+    uint16_t const drv_len = sizeof(tusb_desc_interface_t) +
+        (itf_desc->bNumEndpoints * sizeof(tusb_desc_endpoint_t));
+    TU_VERIFY(itf_desc->bNumEndpoints == 2 && max_len >= drv_len, 0);
+
+    uint8_t ep_out = 0;
+    uint8_t ep_in = 0;
+    TU_ASSERT(usbd_open_edpt_pair(rhport, tu_desc_next(itf_desc), 2,
+                                  TUSB_XFER_BULK, &ep_out, &ep_in), 0);
+    portENTER_CRITICAL(&s_vendor_lock);
+    s_vendor_rhport = rhport;
+    s_vendor_rx.ep = ep_out;
+    s_vendor_tx.ep = ep_in;
+    portEXIT_CRITICAL(&s_vendor_lock);
+    ESP_LOGI(TAG, "Vendor interface opened (OUT:%02x, IN:%02x)", ep_out,
+             ep_in);
+#if CONFIG_ESPUSB_VENDOR_DIAG
+    vendor_diag_start();
+#endif // CONFIG_ESPUSB_VENDOR_DIAG
+#if CONFIG_ESPUSB_VENDOR_OTA
+    vendor_ota_start();
+#endif // CONFIG_ESPUSB_VENDOR_OTA
+    return drv_len;
+}
+
+/// Invoked for class specific control requests, none are supported.
+static bool vendor_driver_control_xfer(uint8_t rhport, uint8_t stage,
+                                       tusb_control_request_t const *request)
+{
+    return false;
+}
+
+/// Invoked when a transfer on one of the vendor endpoints completes.
+///
+/// @param rhport is the USB port.
+/// @param ep_addr is the endpoint address.
+/// @param result is the result of the transfer.
+/// @param xferred_bytes is the number of bytes transferred.
+///
+/// @return true if the endpoint belongs to this driver.
+static bool vendor_driver_xfer(uint8_t rhport, uint8_t ep_addr,
+                               xfer_result_t result, uint32_t xferred_bytes)
+{
+    bool is_tx = (ep_addr == s_vendor_tx.ep);
+    vendor_channel_t &channel = is_tx ? s_vendor_tx : s_vendor_rx;
+    vendor_request_t completed;
+    bool complete = false;
+
+    portENTER_CRITICAL(&s_vendor_lock);
+    channel.busy = false;
+    if (channel.count)
+    {
+        vendor_request_t &req = channel.requests[channel.head];
+        req.done += xferred_bytes;
+        if (is_tx)
+        {
+            s_vendor_stats.tx_bytes += xferred_bytes;
+        }
+        else
+        {
+            s_vendor_stats.rx_bytes += xferred_bytes;
+        }
+        if (channel.xfer_len == 0)
+        {
+            req.zlp = false;
+        }
+        // a short packet ends a read request early, the host has no more
+        // data to send for now.
+        complete = (result != XFER_RESULT_SUCCESS) ||
+                   (req.done >= req.size && !req.zlp) ||
+                   (!is_tx && xferred_bytes < channel.xfer_len);
+        if (complete)
+        {
+            completed = req;
+            channel.head =
+                (channel.head + 1) % CONFIG_ESPUSB_VENDOR_XFER_QUEUE_DEPTH;
+            channel.count--;
+            if (is_tx)
+            {
+                s_vendor_stats.tx_requests++;
+            }
+            else
+            {
+                s_vendor_stats.rx_requests++;
+            }
+        }
+    }
+    portEXIT_CRITICAL(&s_vendor_lock);
+
+    // start the next transfer before invoking the callback so the endpoint
+    // is not idle while the application processes the completed buffer.
+    vendor_start(channel);
+    if (complete && completed.cb)
+    {
+        completed.cb(completed.buf, completed.done, completed.arg);
+    }
+    return true;
+}
+
+/// Vendor class driver which transfers directly to/from application buffers.
+static const usbd_class_driver_t s_vendor_driver =
+{
+#if CFG_TUSB_DEBUG >= 2
+    .name = "ESPUSB-VENDOR",
+#endif
+    .init = vendor_driver_init,
+    .reset = vendor_driver_reset,
+    .open = vendor_driver_open,
+    .control_xfer_cb = vendor_driver_control_xfer,
+    .xfer_cb = vendor_driver_xfer,
+};
+
+extern "C"
+{
+
+// Invoked by TinyUSB to retrieve application provided class drivers.
+usbd_class_driver_t const *usbd_app_driver_get_cb(uint8_t *driver_count)
+{
+    *driver_count = 1;
+    return &s_vendor_driver;
+}
+
+} // extern "C"
+
+#if CONFIG_ESPUSB_VENDOR_DIAG
+
+/// Size of each diagnostic mode buffer.
+static constexpr size_t DIAG_BUFFER_SIZE = 4096;
+
+/// Number of counter values in each diagnostic mode buffer.
+static constexpr size_t DIAG_BUFFER_WORDS = DIAG_BUFFER_SIZE / sizeof(uint32_t);
+
+/// Buffers used by the diagnostic mode, all are kept queued. These are passed
+/// directly to the endpoint so they are kept in internal DMA capable memory.
+DMA_ATTR static uint32_t s_diag_buffers[CONFIG_ESPUSB_VENDOR_XFER_QUEUE_DEPTH]
+                              [DIAG_BUFFER_WORDS];
+
+/// Next counter value to send (source) or expected (sink).
+static uint32_t s_diag_counter = 0;
+
+/// Invoked when a diagnostic mode buffer has been transferred.
+///
+/// @param buf is the buffer.
+/// @param size is the number of bytes transferred.
+/// @param arg is not used.
+static void vendor_diag_cb(void *buf, size_t size, void *arg)
+{
+    uint32_t *words = (uint32_t *)buf;
+#if CONFIG_ESPUSB_VENDOR_DIAG_SOURCE
+    if (size != DIAG_BUFFER_SIZE)
+    {
+        // the interface was reset, the buffer will be queued again once the
+        // interface has been configured.
+        return;
+    }
+    for (size_t index = 0; index < DIAG_BUFFER_WORDS; index++)
+    {
+        words[index] = s_diag_counter++;
+    }
+    queue_vendor_write(buf, DIAG_BUFFER_SIZE, vendor_diag_cb, nullptr);
+#elif CONFIG_ESPUSB_VENDOR_DIAG_SINK
+    for (size_t index = 0; index < size / sizeof(uint32_t); index++)
+    {
+        if (words[index] != s_diag_counter)
+        {
+            portENTER_CRITICAL(&s_vendor_lock);
+            s_vendor_stats.errors++;
+            portEXIT_CRITICAL(&s_vendor_lock);
+        }
+        s_diag_counter = words[index] + 1;
+    }
+    queue_vendor_read(buf, DIAG_BUFFER_SIZE, vendor_diag_cb, nullptr);
+#endif
+}
+
+/// Queues all diagnostic mode buffers.
+static void vendor_diag_start()
+{
+    s_diag_counter = 0;
+    for (auto &buffer : s_diag_buffers)
+    {
+#if CONFIG_ESPUSB_VENDOR_DIAG_SOURCE
+        for (size_t index = 0; index < DIAG_BUFFER_WORDS; index++)
+        {
+            buffer[index] = s_diag_counter++;
+        }
+        queue_vendor_write(buffer, DIAG_BUFFER_SIZE, vendor_diag_cb, nullptr);
+#elif CONFIG_ESPUSB_VENDOR_DIAG_SINK
+        queue_vendor_read(buffer, DIAG_BUFFER_SIZE, vendor_diag_cb, nullptr);
+#endif
+    }
+}
+
+#endif // CONFIG_ESPUSB_VENDOR_DIAG
+
+#endif // CONFIG_ESPUSB_VENDOR && CONFIG_ESPUSB_VENDOR_STREAMING
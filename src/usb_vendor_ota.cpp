@@ -0,0 +1,614 @@
+// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+
+// if Esp32USB debug is enabled set the local log level higher than any of the
+// pre-defined log levels.
+#if CONFIG_ESPUSB_DEBUG
+#define LOG_LOCAL_LEVEL 0xFF
+#endif
+
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <esp_system.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <atomic>
+#include <mbedtls/sha256.h>
+#include <string.h>
+#include "usb.h"
+
+/// Tag used for all logging.
+static constexpr const char * const TAG = "USB:OTA";
+
+#if CONFIG_ESPUSB_VENDOR_STREAMING && CONFIG_ESPUSB_VENDOR_OTA
+
+/// Protocol identifier which starts every command and response.
+static constexpr uint32_t OTA_MAGIC = 0x41544F45; // "EOTA"
+
+/// Commands sent by the host.
+typedef enum : uint8_t
+{
+    /// Starts an update, the payload is @ref ota_begin_t.
+    OTA_CMD_BEGIN = 1,
+
+    /// Image data, the message is always padded to @ref OTA_MESSAGE_SIZE.
+    OTA_CMD_DATA = 2,
+
+    /// Completes an update once all data blocks have been sent.
+    OTA_CMD_END = 3,
+
+    /// Abandons an update.
+    OTA_CMD_ABORT = 4,
+} ota_command_t;
+
+/// Responses sent by the device.
+typedef enum : uint8_t
+{
+    /// Update started, seq holds the window size and value the block size.
+    OTA_RESP_READY = 1,
+
+    /// Blocks up to and including seq have been written, value holds the
+    /// total number of bytes written.
+    OTA_RESP_ACK = 2,
+
+    /// Image verified and selected for the next boot.
+    OTA_RESP_DONE = 3,
+
+    /// The update failed, error holds the reason and the update is aborted.
+    OTA_RESP_ERROR = 4,
+} ota_response_t;
+
+/// Failure reasons reported via @ref OTA_RESP_ERROR.
+typedef enum : uint8_t
+{
+    OTA_ERR_NONE = 0,
+    OTA_ERR_PROTOCOL = 1,
+    OTA_ERR_NOT_STARTED = 2,
+    OTA_ERR_SEQUENCE = 3,
+    OTA_ERR_TOO_LARGE = 4,
+    OTA_ERR_FLASH = 5,
+    OTA_ERR_HASH = 6,
+    OTA_ERR_INCOMPLETE = 7,
+} ota_error_t;
+
+/// Header which starts every command, all values are little-endian.
+typedef struct __attribute__((packed))
+{
+    /// @ref OTA_MAGIC.
+    uint32_t magic;
+
+    /// @ref ota_command_t.
+    uint8_t command;
+
+    /// Reserved, must be zero.
+    uint8_t reserved[3];
+
+    /// Block sequence number (@ref OTA_CMD_DATA), starting from zero.
+    uint32_t seq;
+
+    /// Number of valid payload bytes following the header.
+    uint32_t length;
+} ota_header_t;
+
+/// Payload of @ref OTA_CMD_BEGIN.
+typedef struct __attribute__((packed))
+{
+    /// Size of the application image in bytes.
+    uint32_t image_size;
+
+    /// SHA-256 of the application image.
+    uint8_t sha256[32];
+} ota_begin_t;
+
+/// Response sent to the host, all values are little-endian.
+typedef struct __attribute__((packed))
+{
+    /// @ref OTA_MAGIC.
+    uint32_t magic;
+
+    /// @ref ota_response_t.
+    uint8_t response;
+
+    /// @ref ota_error_t.
+    uint8_t error;
+
+    /// Reserved, always zero.
+    uint16_t reserved;
+
+    /// Response specific, see @ref ota_response_t.
+    uint32_t seq;
+
+    /// Response specific, see @ref ota_response_t.
+    uint32_t value;
+} ota_status_t;
+
+/// Number of image bytes carried by each data block.
+static constexpr size_t OTA_BLOCK_SIZE = CONFIG_ESPUSB_VENDOR_OTA_BLOCK_SIZE;
+
+/// Size of every data message, the host pads the final block so each data
+/// message fills a receive buffer and completes the read request.
+static constexpr size_t OTA_MESSAGE_SIZE = sizeof(ota_header_t) +
+                                           OTA_BLOCK_SIZE;
+
+/// Number of data blocks the host may send before waiting for an ACK, one
+/// receive buffer is kept queued for each.
+static constexpr size_t OTA_WINDOW = CONFIG_ESPUSB_VENDOR_OTA_WINDOW;
+
+/// Maximum time to wait for the host to collect a response.
+static constexpr TickType_t OTA_RESPONSE_TIMEOUT = pdMS_TO_TICKS(1000);
+
+/// Stack size for the update task.
+static constexpr uint32_t OTA_TASK_STACK_SIZE = 3072;
+
+static_assert(OTA_BLOCK_SIZE % 64 == 0,
+              "OTA block size must be a multiple of the endpoint size");
+static_assert(OTA_WINDOW <= CONFIG_ESPUSB_VENDOR_XFER_QUEUE_DEPTH,
+              "OTA window can not exceed the vendor request queue depth");
+
+/// Event passed from the USB task to the update task.
+typedef struct
+{
+    /// Receive buffer which completed, nullptr when the interface has been
+    /// (re)configured by the host.
+    uint8_t *buf;
+
+    /// Number of bytes received into @ref buf.
+    size_t size;
+} ota_event_t;
+
+/// Receive buffers, the host can have one data block in flight per buffer.
+/// These are passed directly to the endpoint so they are kept in internal DMA
+/// capable (word aligned) memory and are not copied via a bounce buffer.
+DMA_ATTR static uint8_t s_ota_rx_buffers[OTA_WINDOW][OTA_MESSAGE_SIZE];
+
+/// Tracks which entries of @ref s_ota_rx_buffers have a read request queued
+/// whose completion has not yet been processed, only used by the update task.
+static bool s_ota_rx_queued[OTA_WINDOW];
+
+/// Set while a configuration event is waiting in @ref s_ota_events, repeated
+/// bus resets only queue a single event.
+static std::atomic<bool> s_ota_configure_pending{false};
+
+/// Response buffers, one for each write request which can be queued, kept in
+/// internal DMA capable memory as for @ref s_ota_rx_buffers.
+DMA_ATTR static ota_status_t
+    s_ota_tx_buffers[CONFIG_ESPUSB_VENDOR_XFER_QUEUE_DEPTH];
+
+/// Index of the next response buffer to use.
+static size_t s_ota_tx_index = 0;
+
+/// Counts the free entries in @ref s_ota_tx_buffers.
+static SemaphoreHandle_t s_ota_tx_free = nullptr;
+
+/// Storage for @ref s_ota_tx_free.
+static StaticSemaphore_t s_ota_tx_free_storage;
+
+/// Queue of events for the update task.
+static QueueHandle_t s_ota_events = nullptr;
+
+/// Storage for @ref s_ota_events.
+static StaticQueue_t s_ota_events_storage;
+
+/// Stack of the update task.
+static StackType_t s_ota_task_stack[OTA_TASK_STACK_SIZE];
+
+/// Storage for the update task.
+static StaticTask_t s_ota_task_storage;
+
+/// Event storage for @ref s_ota_events, one per receive buffer plus one
+/// configuration event. Each receive buffer is queued at most once and
+/// configuration events are merged so the queue can never overflow.
+static uint8_t s_ota_events_data[(OTA_WINDOW + 1) * sizeof(ota_event_t)];
+
+/// Handle for the in-progress image write, zero when no update is active.
+static esp_ota_handle_t s_ota_handle = 0;
+
+/// Partition being written.
+static const esp_partition_t *s_ota_target = nullptr;
+
+/// Streaming hash of the received image.
+static mbedtls_sha256_context s_ota_sha;
+
+/// Expected SHA-256 of the image.
+static uint8_t s_ota_expected_sha[32];
+
+/// Size of the image being received.
+static uint32_t s_ota_image_size = 0;
+
+/// Number of image bytes written so far.
+static uint32_t s_ota_written = 0;
+
+/// Sequence number of the next expected data block.
+static uint32_t s_ota_next_seq = 0;
+
+/// Invoked when a receive buffer has been filled.
+///
+/// @param buf is the receive buffer.
+/// @param size is the number of bytes received.
+/// @param arg is not used.
+static void ota_rx_done(void *buf, size_t size, void *arg)
+{
+    ota_event_t event = {(uint8_t *)buf, size};
+    xQueueSend(s_ota_events, &event, 0);
+}
+
+/// Invoked when a response has been collected by the host.
+///
+/// @param buf is the response buffer.
+/// @param size is the number of bytes sent.
+/// @param arg is not used.
+static void ota_tx_done(void *buf, size_t size, void *arg)
+{
+    xSemaphoreGive(s_ota_tx_free);
+}
+
+/// @return the index of @param buf in @ref s_ota_rx_buffers.
+static size_t ota_rx_index(const uint8_t *buf)
+{
+    return (buf - s_ota_rx_buffers[0]) / OTA_MESSAGE_SIZE;
+}
+
+/// Queues a receive buffer for the next command unless it is already queued.
+///
+/// @param buf is the receive buffer.
+static void ota_queue_rx(uint8_t *buf)
+{
+    size_t index = ota_rx_index(buf);
+    if (s_ota_rx_queued[index])
+    {
+        return;
+    }
+    // this only fails when the host has reset the device, all buffers which
+    // are not queued are queued again once it has been configured again.
+    s_ota_rx_queued[index] =
+        queue_vendor_read(buf, OTA_MESSAGE_SIZE, ota_rx_done, nullptr);
+}
+
+/// Sends a response to the host.
+///
+/// @param response is the @ref ota_response_t to send.
+/// @param error is the @ref ota_error_t to send.
+/// @param seq is the response specific sequence value.
+/// @param value is the response specific value.
+static void ota_respond(ota_response_t response, ota_error_t error,
+                        uint32_t seq, uint32_t value)
+{
+    if (xSemaphoreTake(s_ota_tx_free, OTA_RESPONSE_TIMEOUT) != pdTRUE)
+    {
+        ESP_LOGW(TAG, "Host is not collecting responses, dropping %u:%u",
+                 response, seq);
+        return;
+    }
+    // the responses complete in the order they are queued, the oldest entry
+    // is free when the semaphore could be taken.
+    ota_status_t *status = &s_ota_tx_buffers[s_ota_tx_index];
+    s_ota_tx_index =
+        (s_ota_tx_index + 1) % CONFIG_ESPUSB_VENDOR_XFER_QUEUE_DEPTH;
+    status->magic = OTA_MAGIC;
+    status->response = response;
+    status->error = error;
+    status->reserved = 0;
+    status->seq = seq;
+    status->value = value;
+    if (!queue_vendor_write(status, sizeof(ota_status_t), ota_tx_done,
+                            nullptr))
+    {
+        xSemaphoreGive(s_ota_tx_free);
+    }
+}
+
+/// Aborts the in-progress update (if any).
+static void ota_abort()
+{
+    if (s_ota_handle)
+    {
+        ESP_LOGW(TAG, "Aborting update after %u/%u bytes", s_ota_written,
+                 s_ota_image_size);
+        esp_ota_abort(s_ota_handle);
+        mbedtls_sha256_free(&s_ota_sha);
+    }
+    s_ota_handle = 0;
+    s_ota_target = nullptr;
+    s_ota_image_size = 0;
+    s_ota_written = 0;
+    s_ota_next_seq = 0;
+}
+
+/// Reports a failure to the host and aborts the update.
+///
+/// @param error is the reason for the failure.
+/// @param seq is the sequence number of the block which failed.
+static void ota_fail(ota_error_t error, uint32_t seq)
+{
+    ESP_LOGE(TAG, "Update failed at block %u: %d", seq, error);
+    ota_abort();
+    ota_respond(OTA_RESP_ERROR, error, seq, 0);
+}
+
+/// Starts a new update.
+///
+/// @param begin is the payload of the BEGIN command.
+static void ota_begin(const ota_begin_t *begin)
+{
+    ota_abort();
+    s_ota_target = esp_ota_get_next_update_partition(nullptr);
+    if (s_ota_target == nullptr || begin->image_size == 0 ||
+        begin->image_size > s_ota_target->size)
+    {
+        ESP_LOGE(TAG, "No OTA partition available for %u byte image",
+                 begin->image_size);
+        ota_fail(OTA_ERR_TOO_LARGE, 0);
+        return;
+    }
+#ifdef OTA_WITH_SEQUENTIAL_WRITES
+    // erase each sector as it is written so the erase time overlaps with the
+    // host sending the following blocks.
+    size_t erase_size = OTA_WITH_SEQUENTIAL_WRITES;
+#else
+    size_t erase_size = begin->image_size;
+#endif // OTA_WITH_SEQUENTIAL_WRITES
+    if (ESP_ERROR_CHECK_WITHOUT_ABORT(
+            esp_ota_begin(s_ota_target, erase_size, &s_ota_handle)) != ESP_OK)
+    {
+        s_ota_handle = 0;
+        ota_fail(OTA_ERR_FLASH, 0);
+        return;
+    }
+    mbedtls_sha256_init(&s_ota_sha);
+    mbedtls_sha256_starts_ret(&s_ota_sha, 0);
+    memcpy(s_ota_expected_sha, begin->sha256, sizeof(s_ota_expected_sha));
+    s_ota_image_size = begin->image_size;
+    ESP_LOGI(TAG, "Receiving %u byte image for %s", s_ota_image_size,
+             s_ota_target->label);
+    ota_respond(OTA_RESP_READY, OTA_ERR_NONE, OTA_WINDOW, OTA_BLOCK_SIZE);
+}
+
+/// Writes a data block to the target partition.
+///
+/// @param seq is the sequence number of the block.
+/// @param data is the block data.
+/// @param size is the number of valid bytes in @param data.
+///
+/// @return true if the block was written.
+static bool ota_write(uint32_t seq, const uint8_t *data, size_t size)
+{
+    if (!s_ota_handle)
+    {
+        ota_fail(OTA_ERR_NOT_STARTED, seq);
+        return false;
+    }
+    if (seq != s_ota_next_seq)
+    {
+        ota_fail(OTA_ERR_SEQUENCE, seq);
+        return false;
+    }
+    if (size > OTA_BLOCK_SIZE || size > s_ota_image_size - s_ota_written)
+    {
+        ota_fail(OTA_ERR_TOO_LARGE, seq);
+        return false;
+    }
+    if (ESP_ERROR_CHECK_WITHOUT_ABORT(
+            esp_ota_write(s_ota_handle, data, size)) != ESP_OK)
+    {
+        ota_fail(OTA_ERR_FLASH, seq);
+        return false;
+    }
+    mbedtls_sha256_update_ret(&s_ota_sha, data, size);
+    s_ota_written += size;
+    s_ota_next_seq++;
+    vendor_ota_progress_cb(s_ota_written, s_ota_image_size);
+    return true;
+}
+
+/// Verifies the received image and selects it for the next boot.
+///
+/// @return true if the update completed successfully.
+static bool ota_finish()
+{
+    if (!s_ota_handle)
+    {
+        ota_fail(OTA_ERR_NOT_STARTED, s_ota_next_seq);
+        return false;
+    }
+    if (s_ota_written != s_ota_image_size)
+    {
+        ota_fail(OTA_ERR_INCOMPLETE, s_ota_next_seq);
+        return false;
+    }
+    uint8_t sha[32];
+    mbedtls_sha256_finish_ret(&s_ota_sha, sha);
+    if (memcmp(sha, s_ota_expected_sha, sizeof(sha)))
+    {
+        ota_fail(OTA_ERR_HASH, s_ota_next_seq);
+        return false;
+    }
+    mbedtls_sha256_free(&s_ota_sha);
+    const esp_partition_t *target = s_ota_target;
+    uint32_t written = s_ota_written;
+    esp_err_t err = ESP_ERROR_CHECK_WITHOUT_ABORT(esp_ota_end(s_ota_handle));
+    s_ota_handle = 0;
+    ota_abort();
+    if (err == ESP_OK)
+    {
+        err = ESP_ERROR_CHECK_WITHOUT_ABORT(
+            esp_ota_set_boot_partition(target));
+    }
+    ESP_LOGI(TAG, "Image write to %s complete: %s", target->label,
+             esp_err_to_name(err));
+    if (err != ESP_OK)
+    {
+        ota_respond(OTA_RESP_ERROR, OTA_ERR_FLASH, 0, 0);
+        return false;
+    }
+    ota_respond(OTA_RESP_DONE, OTA_ERR_NONE, 0, written);
+    return true;
+}
+
+/// Processes a received command.
+///
+/// @param buf is the receive buffer holding the command.
+/// @param size is the number of bytes received.
+///
+/// @return true if the update completed successfully.
+static bool ota_process(uint8_t *buf, size_t size)
+{
+    ota_header_t header;
+    if (size < sizeof(ota_header_t))
+    {
+        // short reads are only expected when the host resets the device, the
+        // buffer is reused once the interface is configured again.
+        ota_abort();
+        ota_queue_rx(buf);
+        return false;
+    }
+    memcpy(&header, buf, sizeof(ota_header_t));
+    const uint8_t *payload = buf + sizeof(ota_header_t);
+    size_t payload_size = size - sizeof(ota_header_t);
+    if (header.magic != OTA_MAGIC || header.length > payload_size)
+    {
+        ota_fail(OTA_ERR_PROTOCOL, header.seq);
+        return false;
+    }
+    switch (header.command)
+    {
+        case OTA_CMD_BEGIN:
+            if (header.length < sizeof(ota_begin_t))
+            {
+                ota_fail(OTA_ERR_PROTOCOL, 0);
+                break;
+            }
+            ota_begin((const ota_begin_t *)payload);
+            break;
+        case OTA_CMD_DATA:
+            if (ota_write(header.seq, payload, header.length))
+            {
+                // the buffer is queued again before the ACK is sent so the
+                // host never has more blocks in flight than buffers queued.
+                ota_queue_rx(buf);
+                ota_respond(OTA_RESP_ACK, OTA_ERR_NONE, header.seq,
+                            s_ota_written);
+                return false;
+            }
+            break;
+        case OTA_CMD_END:
+            ota_queue_rx(buf);
+            return ota_finish();
+        case OTA_CMD_ABORT:
+            ota_abort();
+            break;
+        default:
+            ota_fail(OTA_ERR_PROTOCOL, header.seq);
+    }
+    ota_queue_rx(buf);
+    return false;
+}
+
+/// Processes the update protocol, flash writes take a long time so this is
+/// kept out of the USB task while the following blocks are being received.
+///
+/// @param param is not used.
+static void ota_task(void *param)
+{
+    while (true)
+    {
+        ota_event_t event;
+        xQueueReceive(s_ota_events, &event, portMAX_DELAY);
+        if (event.buf == nullptr)
+        {
+            // the interface has been configured, queue every receive buffer
+            // which was returned by the reset which preceded it. A buffer
+            // queued again while a command was being processed is skipped,
+            // if the reset returned it the completion is still queued behind
+            // this event and queues it again.
+            s_ota_configure_pending = false;
+            ota_abort();
+            for (auto &buf : s_ota_rx_buffers)
+            {
+                ota_queue_rx(buf);
+            }
+        }
+        else
+        {
+            s_ota_rx_queued[ota_rx_index(event.buf)] = false;
+            if (ota_process(event.buf, event.size))
+            {
+                vendor_ota_complete_cb();
+            }
+        }
+    }
+}
+
+/// Initializes the vendor firmware update protocol.
+void init_usb_vendor_ota()
+{
+    s_ota_events =
+        xQueueCreateStatic(OTA_WINDOW + 1, sizeof(ota_event_t),
+                           s_ota_events_data, &s_ota_events_storage);
+    s_ota_tx_free =
+        xSemaphoreCreateCountingStatic(CONFIG_ESPUSB_VENDOR_XFER_QUEUE_DEPTH,
+                                       CONFIG_ESPUSB_VENDOR_XFER_QUEUE_DEPTH,
+                                       &s_ota_tx_free_storage);
+    if (xTaskCreateStaticPinnedToCore(ota_task, "usb-ota",
+                                      OTA_TASK_STACK_SIZE, nullptr,
+                                      CONFIG_ESPUSB_TASK_PRIORITY - 1,
+                                      s_ota_task_stack, &s_ota_task_storage,
+                                      CONFIG_ESPUSB_TASK_AFFINITY) == nullptr)
+    {
+        ESP_LOGE(TAG, "Failed to create OTA task.");
+        abort();
+    }
+}
+
+/// Invoked when the vendor interface has been configured by the host.
+void vendor_ota_start()
+{
+    // the queue has room for one configuration event in addition to one
+    // completion per receive buffer, a pending event covers this one too.
+    if (!s_ota_configure_pending.exchange(true))
+    {
+        ota_event_t event = {nullptr, 0};
+        xQueueSend(s_ota_events, &event, 0);
+    }
+}
+
+// Default implementation of vendor_ota_progress_cb which logs every 10%.
+TU_ATTR_WEAK void vendor_ota_progress_cb(size_t written, size_t total)
+{
+    static size_t last_percent = 0;
+    size_t percent = (written * 10 / total) * 10;
+    if (percent != last_percent || written == total)
+    {
+        last_percent = percent;
+        ESP_LOGI(TAG, "Received %zu/%zu bytes (%zu%%)", written, total,
+                 percent);
+    }
+}
+
+// Default implementation of vendor_ota_complete_cb which restarts into the
+// new image.
+TU_ATTR_WEAK void vendor_ota_complete_cb()
+{
+    ESP_LOGI(TAG, "Restarting...");
+    // give the host time to collect the final response.
+    vTaskDelay(pdMS_TO_TICKS(100));
+    esp_restart();
+}
+
+#endif // CONFIG_ESPUSB_VENDOR_STREAMING && CONFIG_ESPUSB_VENDOR_OTA
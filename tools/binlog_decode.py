@@ -0,0 +1,198 @@
+#!/usr/bin/env python3
+# Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Decoder for the esp32usb binary log (CONFIG_ESPUSB_CDC_BINLOG).
+
+Each record carries the address of its format string rather than the text,
+the format strings (and any "%s" arguments) are read from the application
+ELF file which must match the firmware running on the device.
+
+Input can be read from a serial port or from a file containing a capture of
+the raw CDC data. Every record starts with a marker byte and its length and
+ends with a CRC-16, bytes which do not form a valid record (for example text
+written with write_to_cdc) are skipped.
+
+Requires pyelftools and pyserial (only when reading from a serial port).
+"""
+
+import argparse
+import re
+import struct
+import sys
+
+from elftools.elf.elffile import ELFFile
+
+RECORD_MARKER = 0xB1
+MAX_ARGS = 8
+HEADER = struct.Struct('<BBBII')
+CRC = struct.Struct('<H')
+MIN_LENGTH = HEADER.size + CRC.size
+MAX_LENGTH = MIN_LENGTH + (4 * MAX_ARGS)
+
+# %[flags][width][.precision][length]specifier
+FORMAT_SPEC = re.compile(
+    r'%([-+ #0]*)(\d*)(?:\.(\d+))?(hh|h|ll|l|j|z|t)?([diuxXcspo%])')
+
+
+class ElfStrings:
+    """Resolves NUL terminated strings by address from loadable sections."""
+
+    def __init__(self, path):
+        self.sections = []
+        with open(path, 'rb') as elf_file:
+            elf = ELFFile(elf_file)
+            for section in elf.iter_sections():
+                # SHF_ALLOC, only sections which are present on the device
+                if not section['sh_flags'] & 0x2 or \
+                        section['sh_type'] == 'SHT_NOBITS':
+                    continue
+                self.sections.append((section['sh_addr'], section.data()))
+        self.cache = {}
+
+    def lookup(self, address):
+        if address in self.cache:
+            return self.cache[address]
+        for base, data in self.sections:
+            if base <= address < base + len(data):
+                offset = address - base
+                end = data.find(b'\0', offset)
+                if end < 0:
+                    end = len(data)
+                text = data[offset:end].decode('utf-8', errors='replace')
+                self.cache[address] = text
+                return text
+        return None
+
+
+def crc16(data):
+    """CRC-16/X-25, this matches esp_rom_crc16_le(0, data, len)."""
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0x8408 if crc & 1 else crc >> 1
+    return crc ^ 0xFFFF
+
+
+def to_signed(value, length):
+    bits = 8 if length == 'hh' else 16 if length == 'h' else 32
+    value &= (1 << bits) - 1
+    return value - (1 << bits) if value & (1 << (bits - 1)) else value
+
+
+def format_record(strings, fmt, args):
+    args = list(args)
+
+    def replace(match):
+        flags, width, precision, length, spec = match.groups()
+        if spec == '%':
+            return '%'
+        if not args:
+            return '<missing>'
+        value = args.pop(0)
+        if spec == 's':
+            text = strings.lookup(value)
+            value = text if text is not None else '<0x%08x>' % value
+        elif spec == 'p':
+            spec = 'x'
+            flags = '#' + flags
+        elif spec in 'di':
+            value = to_signed(value, length)
+            spec = 'd'
+        elif spec == 'c':
+            value = chr(value & 0xFF)
+        pyfmt = '%' + flags + width
+        if precision is not None:
+            pyfmt += '.' + precision
+        return (pyfmt + spec) % value
+
+    return FORMAT_SPEC.sub(replace, fmt)
+
+
+def decode(stream, strings, out):
+    buffer = b''
+    while True:
+        data = stream.read(256)
+        if not data:
+            if stream_is_file(stream):
+                break
+            continue
+        buffer += data
+        while True:
+            start = buffer.find(bytes([RECORD_MARKER]))
+            if start < 0:
+                buffer = b''
+                break
+            buffer = buffer[start:]
+            if len(buffer) < 2:
+                break
+            length = buffer[1]
+            if not MIN_LENGTH <= length <= MAX_LENGTH:
+                # not a record, resynchronize on the next marker
+                buffer = buffer[1:]
+                continue
+            if len(buffer) < length:
+                break
+            _, _, argc, fmt_addr, timestamp = HEADER.unpack_from(buffer)
+            (crc,) = CRC.unpack_from(buffer, length - CRC.size)
+            if length != MIN_LENGTH + (4 * argc) or \
+                    crc != crc16(buffer[:length - CRC.size]):
+                buffer = buffer[1:]
+                continue
+            args = struct.unpack_from('<%dI' % argc, buffer, HEADER.size)
+            buffer = buffer[length:]
+            fmt = strings.lookup(fmt_addr)
+            if fmt is None:
+                # a valid record from a different firmware build.
+                text = '<unknown format 0x%08x> %s' % (
+                    fmt_addr, ' '.join('0x%08x' % arg for arg in args))
+            else:
+                text = format_record(strings, fmt, args)
+            out.write('[%10.6f] %s\n' % (timestamp / 1e6, text))
+            out.flush()
+
+
+def stream_is_file(stream):
+    return not hasattr(stream, 'in_waiting')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('elf', help='application ELF file')
+    parser.add_argument('input', help='serial port or capture file')
+    parser.add_argument('--capture', action='store_true',
+                        help='treat input as a capture file')
+    args = parser.parse_args()
+
+    strings = ElfStrings(args.elf)
+    if args.capture:
+        with open(args.input, 'rb') as stream:
+            decode(stream, strings, sys.stdout)
+    else:
+        import serial
+        with serial.Serial(args.input, timeout=0.1) as port:
+            # asserting DTR signals the device that a host is connected
+            port.dtr = True
+            port.rts = True
+            try:
+                decode(port, strings, sys.stdout)
+            except KeyboardInterrupt:
+                pass
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,202 @@
+#!/usr/bin/env python3
+# Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Host side client for the esp32usb CDC diagnostic modes.
+
+The device must be built with CONFIG_ESPUSB_CDC_DIAG_MODE set to the mode
+matching the one requested here:
+
+  source: the device sends an incrementing 32-bit counter, this measures
+          device to host throughput and reports missing counter values.
+          This is also used with the "Source through write_to_cdc" device
+          mode which sends the counter via write_to_cdc.
+  sink:   the host sends an incrementing 32-bit counter, this measures host
+          to device throughput (check get_cdc_diag_stats() on the device for
+          verification errors).
+  echo:   the host sends 16 byte probe records and measures the round-trip
+          latency, device side receive/transmit timestamps are reported.
+
+Throughput results can be recorded under a label with --label/--results,
+every recorded label is then printed side by side. This is used to compare
+firmware builds, for example write_to_cdc with and without the bulk
+streaming mode:
+
+  cdc_bench.py /dev/ttyACM0 source --label default --results cdc.json
+  (rebuild with CONFIG_ESPUSB_CDC_BULK_MODE=y)
+  cdc_bench.py /dev/ttyACM0 source --label bulk --results cdc.json
+
+Any serial port can be used, including a pseudo terminal so the same client
+can be used against a simulated device.
+
+Requires pyserial.
+"""
+
+import argparse
+import json
+import os
+import struct
+import sys
+import time
+
+import serial
+
+COUNTER = struct.Struct('<I')
+ECHO_RECORD = struct.Struct('<IIII')
+
+
+def percentile(samples, pct):
+    if not samples:
+        return 0.0
+    ordered = sorted(samples)
+    index = min(len(ordered) - 1, int(round((pct / 100.0) * (len(ordered) - 1))))
+    return ordered[index]
+
+
+def report_rate(label, nbytes, elapsed):
+    print('%s: %d bytes in %.2fs, %.3f MB/s' %
+          (label, nbytes, elapsed, nbytes / elapsed / 1e6))
+    return nbytes / elapsed / 1e6
+
+
+def record_result(path, label, mode, rate):
+    results = {}
+    if os.path.exists(path):
+        with open(path) as f:
+            results = json.load(f)
+    results.setdefault(mode, {})[label] = rate
+    with open(path, 'w') as f:
+        json.dump(results, f, indent=2, sort_keys=True)
+    baseline = results[mode].get('default')
+    print('%s results:' % mode)
+    for name, value in sorted(results[mode].items()):
+        if baseline and name != 'default':
+            print('  %-12s %8.3f MB/s (%+.1f%% vs default)' %
+                  (name, value, (value / baseline - 1.0) * 100.0))
+        else:
+            print('  %-12s %8.3f MB/s' % (name, value))
+
+
+def run_source(port, duration, chunk):
+    received = 0
+    errors = 0
+    dropped = 0
+    expected = None
+    partial = b''
+    start = time.monotonic()
+    while time.monotonic() - start < duration:
+        data = port.read(chunk)
+        if not data:
+            continue
+        received += len(data)
+        data = partial + data
+        usable = len(data) - (len(data) % COUNTER.size)
+        for (value,) in COUNTER.iter_unpack(data[:usable]):
+            if expected is not None and value != expected:
+                errors += 1
+                if value > expected:
+                    dropped += value - expected
+            expected = (value + 1) & 0xFFFFFFFF
+        partial = data[usable:]
+    rate = report_rate('source', received, time.monotonic() - start)
+    print('errors: %d, dropped counter values: %d' % (errors, dropped))
+    return errors == 0, rate
+
+
+def run_sink(port, duration, chunk):
+    words = chunk // COUNTER.size
+    counter = 0
+    sent = 0
+    start = time.monotonic()
+    while time.monotonic() - start < duration:
+        payload = b''.join(COUNTER.pack((counter + i) & 0xFFFFFFFF)
+                           for i in range(words))
+        counter += words
+        sent += port.write(payload)
+    port.flush()
+    return True, report_rate('sink', sent, time.monotonic() - start)
+
+
+def run_echo(port, count, timeout):
+    rtt = []
+    residence = []
+    lost = 0
+    port.timeout = timeout
+    for sequence in range(count):
+        sent_at = time.perf_counter()
+        port.write(ECHO_RECORD.pack(sequence, int(sent_at * 1e6) & 0xFFFFFFFF,
+                                    0, 0))
+        data = port.read(ECHO_RECORD.size)
+        if len(data) != ECHO_RECORD.size:
+            lost += 1
+            port.reset_input_buffer()
+            continue
+        received_at = time.perf_counter()
+        seq, _, dev_rx, dev_tx = ECHO_RECORD.unpack(data)
+        if seq != sequence:
+            lost += 1
+            port.reset_input_buffer()
+            continue
+        rtt.append((received_at - sent_at) * 1e6)
+        residence.append((dev_tx - dev_rx) & 0xFFFFFFFF)
+    print('echo: %d probes, %d lost' % (count, lost))
+    for pct in (50, 90, 99):
+        print('  p%d round-trip: %8.1f us, device residence: %6d us' %
+              (pct, percentile(rtt, pct), percentile(residence, pct)))
+    if rtt:
+        print('  max round-trip: %8.1f us' % max(rtt))
+    return lost == 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('port', help='serial port of the device')
+    parser.add_argument('mode', choices=('source', 'sink', 'echo'))
+    parser.add_argument('--duration', type=float, default=10.0,
+                        help='test duration in seconds (source/sink)')
+    parser.add_argument('--chunk', type=int, default=16384,
+                        help='read/write size in bytes (source/sink)')
+    parser.add_argument('--count', type=int, default=1000,
+                        help='number of probes to send (echo)')
+    parser.add_argument('--timeout', type=float, default=0.5,
+                        help='probe timeout in seconds (echo)')
+    parser.add_argument('--label',
+                        help='name of the firmware build being measured, '
+                             'for example "default" or "bulk" (source/sink)')
+    parser.add_argument('--results',
+                        help='JSON file the labelled throughput is added to, '
+                             'all recorded labels are printed (source/sink)')
+    args = parser.parse_args()
+
+    with serial.Serial(args.port, timeout=0.1) as port:
+        # asserting DTR and RTS signals the device that a host is connected
+        port.dtr = True
+        port.rts = True
+        time.sleep(0.1)
+        port.reset_input_buffer()
+        rate = None
+        if args.mode == 'source':
+            ok, rate = run_source(port, args.duration, args.chunk)
+        elif args.mode == 'sink':
+            ok, rate = run_sink(port, args.duration, args.chunk)
+        else:
+            ok = run_echo(port, args.count, args.timeout)
+    if rate is not None and args.results:
+        record_result(args.results, args.label or 'default', args.mode, rate)
+    return 0 if ok else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+# Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Host side implementation of the esp32usb CDC framing (CONFIG_ESPUSB_CDC_FRAMING).
+
+Each frame is the payload followed by its CRC-32 (zlib) in little-endian
+format, COBS encoded and terminated by a zero byte. This can be imported as a
+module (encode_frame / FrameDecoder) or run directly to send a frame and print
+the frames received from the device.
+
+Requires pyserial when run directly.
+"""
+
+import argparse
+import struct
+import sys
+import time
+import zlib
+
+CRC = struct.Struct('<I')
+
+
+def cobs_encode(data):
+    out = bytearray()
+    for start, block in _blocks(data):
+        out.append(len(block) + 1)
+        out += block
+    return bytes(out)
+
+
+def _blocks(data):
+    offs = 0
+    more = True
+    while more:
+        end = offs
+        while end < len(data) and end - offs < 254 and data[end] != 0:
+            end += 1
+        yield offs, data[offs:end]
+        run = end - offs
+        offs = end
+        if offs < len(data) and run < 254:
+            offs += 1
+        else:
+            more = offs < len(data)
+
+
+def encode_frame(payload):
+    """Returns the encoded form of payload including the delimiter."""
+    payload = bytes(payload)
+    return cobs_encode(payload + CRC.pack(zlib.crc32(payload))) + b'\0'
+
+
+class FrameDecoder:
+    """Streaming decoder, feed() returns a list of valid payloads."""
+
+    def __init__(self, max_size=4096):
+        self.max_size = max_size
+        self.encoded = bytearray()
+        self.errors = 0
+
+    def feed(self, data):
+        frames = []
+        for ch in data:
+            if ch != 0:
+                if len(self.encoded) <= self.max_size + 8:
+                    self.encoded.append(ch)
+                continue
+            if self.encoded:
+                payload = self._decode(bytes(self.encoded))
+                if payload is None:
+                    self.errors += 1
+                else:
+                    frames.append(payload)
+            self.encoded.clear()
+        return frames
+
+    def _decode(self, encoded):
+        out = bytearray()
+        offs = 0
+        while offs < len(encoded):
+            code = encoded[offs]
+            block = encoded[offs + 1:offs + code]
+            if len(block) != code - 1:
+                return None
+            out += block
+            offs += code
+            if code != 0xFF and offs < len(encoded):
+                out.append(0)
+        if len(out) < CRC.size or len(out) - CRC.size > self.max_size:
+            return None
+        payload = bytes(out[:-CRC.size])
+        (crc,) = CRC.unpack(out[-CRC.size:])
+        return payload if zlib.crc32(payload) == crc else None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('port', help='serial port of the device')
+    parser.add_argument('payload', nargs='?',
+                        help='hex encoded payload to send')
+    parser.add_argument('--listen', type=float, default=1.0,
+                        help='time in seconds to print received frames')
+    args = parser.parse_args()
+
+    import serial
+    decoder = FrameDecoder()
+    with serial.Serial(args.port, timeout=0.1) as port:
+        # asserting DTR and RTS signals the device that a host is connected
+        port.dtr = True
+        port.rts = True
+        if args.payload is not None:
+            port.write(encode_frame(bytes.fromhex(args.payload)))
+        start = time.monotonic()
+        while time.monotonic() - start < args.listen:
+            for frame in decoder.feed(port.read(256)):
+                print(frame.hex())
+    if decoder.errors:
+        print('discarded frames: %d' % decoder.errors, file=sys.stderr)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
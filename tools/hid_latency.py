@@ -0,0 +1,207 @@
+#!/usr/bin/env python3
+# Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Input latency measurement for the esp32usb HID interfaces.
+
+The device must be built with CONFIG_ESPUSB_HID_LATENCY_PROBE enabled, it
+then sends gamepad reports at random points of the polling interval with the
+time each report was queued (device clock, microseconds) in the 32-bit
+buttons field. The host timestamps every report as it is read, the
+difference between the two clocks is the latency plus an unknown offset.
+
+The offset (and the drift between the clocks) is removed by fitting a line
+through the smallest difference seen in each second of the capture, so the
+reported latency is relative to the fastest report. This is the part of the
+latency which depends on the polling interval and the host scheduling, the
+constant part of the host input stack is not included.
+
+Results can be recorded under a label with --label/--results, every recorded
+label is then printed side by side. This is used to compare firmware builds
+with different CONFIG_ESPUSB_HID_POLL_INTERVAL values:
+
+  hid_latency.py --label 10ms --results hid.json
+  (rebuild with CONFIG_ESPUSB_HID_POLL_INTERVAL=1)
+  hid_latency.py --label 1ms --results hid.json
+
+Requires the hidapi python bindings (pip install hidapi).
+"""
+
+import argparse
+import json
+import os
+import struct
+import sys
+import time
+
+# int8 x, y, z, rz, rx, ry, uint8 hat, uint32 buttons
+GAMEPAD_REPORT = struct.Struct('<6bBI')
+
+# Generic Desktop page, Game Pad usage.
+USAGE_PAGE_DESKTOP = 0x01
+USAGE_GAMEPAD = 0x05
+
+
+def percentile(samples, pct):
+    if not samples:
+        return 0.0
+    ordered = sorted(samples)
+    index = min(len(ordered) - 1, int(round((pct / 100.0) * (len(ordered) - 1))))
+    return ordered[index]
+
+
+def find_device(hid, vid, pid):
+    for info in hid.enumerate(vid, pid):
+        if info.get('usage_page') == USAGE_PAGE_DESKTOP and \
+                info.get('usage') == USAGE_GAMEPAD:
+            return info['path']
+    # the shared interface reports the usage of its first collection, fall
+    # back to any interface which is not the raw (vendor defined) one.
+    for info in hid.enumerate(vid, pid):
+        if info.get('usage_page', 0) < 0xFF00:
+            return info['path']
+    return None
+
+
+def parse_report(data, report_id):
+    """Returns the device timestamp carried by a probe report or None."""
+    if report_id:
+        if not data or data[0] != report_id:
+            return None
+        data = data[1:]
+    if len(data) < GAMEPAD_REPORT.size:
+        return None
+    return GAMEPAD_REPORT.unpack_from(data)[-1]
+
+
+def capture(dev, duration, report_id):
+    """Collects (host_us, device_us) pairs, device_us is unwrapped."""
+    samples = []
+    last = None
+    wraps = 0
+    end = time.monotonic() + duration
+    while time.monotonic() < end:
+        data = dev.read(64, 100)
+        host_us = time.perf_counter_ns() // 1000
+        if not data:
+            continue
+        device_us = parse_report(bytes(data), report_id)
+        if device_us is None:
+            continue
+        if last is not None and device_us < last:
+            wraps += 1
+        last = device_us
+        samples.append((host_us, device_us + (wraps << 32)))
+    return samples
+
+
+def latencies(samples):
+    """Removes the clock offset and drift, see the module description."""
+    if len(samples) < 2:
+        return []
+    start = samples[0][0]
+    windows = {}
+    for host_us, device_us in samples:
+        second = (host_us - start) // 1000000
+        diff = host_us - device_us
+        if second not in windows or diff < windows[second][1]:
+            windows[second] = (host_us - start, diff)
+    points = list(windows.values())
+    if len(points) < 2:
+        slope, intercept = 0.0, points[0][1]
+    else:
+        n = len(points)
+        mean_x = sum(x for x, _ in points) / n
+        mean_y = sum(y for _, y in points) / n
+        var = sum((x - mean_x) ** 2 for x, _ in points)
+        slope = sum((x - mean_x) * (y - mean_y) for x, y in points) / var
+        intercept = mean_y - slope * mean_x
+    result = [(host_us - device_us) - (intercept + slope * (host_us - start))
+              for host_us, device_us in samples]
+    # the fitted line can pass slightly above individual minima.
+    floor = min(result)
+    return [value - floor for value in result]
+
+
+def record_result(path, label, summary):
+    results = {}
+    if os.path.exists(path):
+        with open(path) as f:
+            results = json.load(f)
+    results[label] = summary
+    with open(path, 'w') as f:
+        json.dump(results, f, indent=2, sort_keys=True)
+    print('%-12s %8s %8s %8s %8s %8s' %
+          ('label', 'reports', 'p50 us', 'p90 us', 'p99 us', 'max us'))
+    for name, value in sorted(results.items()):
+        print('%-12s %8d %8.0f %8.0f %8.0f %8.0f' %
+              (name, value['reports'], value['p50'], value['p90'],
+               value['p99'], value['max']))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--vid', type=lambda x: int(x, 0), default=0x303A,
+                        help='USB vendor ID of the device')
+    parser.add_argument('--pid', type=lambda x: int(x, 0), default=0,
+                        help='USB product ID of the device (0 for any)')
+    parser.add_argument('--duration', type=float, default=30.0,
+                        help='capture duration in seconds')
+    parser.add_argument('--report-id', type=int, default=0,
+                        help='report ID of the gamepad reports, only needed '
+                             'with CONFIG_ESPUSB_HID_SHARED_INTERFACE (4)')
+    parser.add_argument('--label',
+                        help='name of the firmware build being measured, '
+                             'for example "10ms" or "1ms"')
+    parser.add_argument('--results',
+                        help='JSON file the labelled result is added to, all '
+                             'recorded labels are printed')
+    args = parser.parse_args()
+
+    import hid
+    path = find_device(hid, args.vid, args.pid)
+    if path is None:
+        print('gamepad interface not found', file=sys.stderr)
+        return 1
+    dev = hid.device()
+    dev.open_path(path)
+    try:
+        samples = capture(dev, args.duration, args.report_id)
+    finally:
+        dev.close()
+
+    values = latencies(samples)
+    if not values:
+        print('no probe reports received, is '
+              'CONFIG_ESPUSB_HID_LATENCY_PROBE enabled?', file=sys.stderr)
+        return 1
+    summary = {
+        'reports': len(values),
+        'p50': percentile(values, 50),
+        'p90': percentile(values, 90),
+        'p99': percentile(values, 99),
+        'max': max(values),
+    }
+    print('%d reports, latency relative to the fastest report:' % len(values))
+    for pct in (50, 90, 99):
+        print('  p%d: %8.0f us' % (pct, summary['p%d' % pct]))
+    print('  max: %7.0f us' % summary['max'])
+    if args.results:
+        record_result(args.results, args.label or 'default', summary)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
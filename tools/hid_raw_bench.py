@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+# Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Throughput benchmark for the esp32usb raw HID interface.
+
+The device must be built with CONFIG_ESPUSB_HID_RAW and
+CONFIG_ESPUSB_HID_RAW_ECHO enabled. Reports carrying a sequence number are
+written to the device while the echoed reports are read back, the achieved
+rate in each direction and any lost or corrupted reports are printed.
+
+Requires the hidapi python bindings (pip install hidapi).
+"""
+
+import argparse
+import struct
+import sys
+import threading
+import time
+
+REPORT_SIZE = 64
+SEQUENCE = struct.Struct('<I')
+
+
+def make_report(seq):
+    # sequence number followed by a pattern derived from it so corruption
+    # anywhere in the report is detected.
+    fill = bytes(((seq + index) & 0xFF for index in range(
+        REPORT_SIZE - SEQUENCE.size)))
+    return SEQUENCE.pack(seq) + fill
+
+
+def find_device(hid, vid, pid):
+    for info in hid.enumerate(vid, pid):
+        # the raw interface is the one with the vendor defined usage page.
+        if info.get('usage_page', 0) >= 0xFF00:
+            return info['path']
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--vid', type=lambda x: int(x, 0), default=0x303A,
+                        help='USB vendor ID of the device')
+    parser.add_argument('--pid', type=lambda x: int(x, 0), default=0,
+                        help='USB product ID of the device (0 for any)')
+    parser.add_argument('--count', type=int, default=5000,
+                        help='number of reports to send')
+    parser.add_argument('--window', type=int, default=8,
+                        help='maximum number of reports in flight, this '
+                             'should not exceed '
+                             'CONFIG_ESPUSB_HID_RAW_TX_QUEUE_DEPTH')
+    args = parser.parse_args()
+
+    import hid
+    path = find_device(hid, args.vid, args.pid)
+    if path is None:
+        print('raw HID interface not found', file=sys.stderr)
+        return 1
+    dev = hid.device()
+    dev.open_path(path)
+
+    # limit the reports in flight so the device echo queue never overflows.
+    window = threading.Semaphore(args.window)
+    done = threading.Event()
+    received = {'count': 0, 'errors': 0, 'last': None}
+
+    def reader():
+        expected = 0
+        while received['count'] < args.count:
+            data = bytes(dev.read(REPORT_SIZE, 1000))
+            if not data:
+                if done.is_set():
+                    break
+                continue
+            (seq,) = SEQUENCE.unpack(data[:SEQUENCE.size])
+            if seq != expected or data != make_report(seq):
+                received['errors'] += 1
+            expected = seq + 1
+            received['count'] += 1
+            received['last'] = time.monotonic()
+            window.release()
+
+    thread = threading.Thread(target=reader, daemon=True)
+    thread.start()
+    start = time.monotonic()
+    count = 0
+    for seq in range(args.count):
+        if not window.acquire(timeout=2):
+            print('device stopped echoing reports', file=sys.stderr)
+            break
+        # the leading zero is the report ID expected by hidapi.
+        dev.write(b'\0' + make_report(seq))
+        count += 1
+    sent = time.monotonic()
+    thread.join(timeout=5)
+    done.set()
+    dev.close()
+
+    out_rate = count * REPORT_SIZE / (sent - start)
+    print('OUT: %d reports in %.2fs, %.1f KB/s'
+          % (count, sent - start, out_rate / 1000))
+    if received['count']:
+        elapsed = received['last'] - start
+        print('IN:  %d reports in %.2fs, %.1f KB/s'
+              % (received['count'], elapsed,
+                 received['count'] * REPORT_SIZE / elapsed / 1000))
+    lost = args.count - received['count']
+    if lost or received['errors']:
+        print('lost: %d, out of sequence/corrupt: %d'
+              % (lost, received['errors']))
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
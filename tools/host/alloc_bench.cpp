@@ -0,0 +1,252 @@
+// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Host benchmark for the memory resources declared in caps_memory_resource.h.
+//
+// Simulates registering virtual disk files (one name allocation per file)
+// and a small block churn, comparing a heap allocation per object with the
+// arena and pool resources. Reports the time per allocation and the number
+// of heap calls made, checks that releasing the pool accounts every
+// outstanding block and that an arena backed by a heap tier is included in
+// the tier statistics. Build and run from the repository root:
+//
+//   g++ -std=gnu++17 -O2 -Itools/host/include -Iinclude
+//       tools/host/alloc_bench.cpp src/usb_caps_memory_resource.cpp
+//       -o alloc_bench
+//   ./alloc_bench [file count] [iterations]
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "caps_memory_resource.h"
+
+/// Result of one benchmark run.
+typedef struct
+{
+    /// Average time per allocation (nanoseconds).
+    double ns_per_alloc;
+
+    /// Heap calls made during the last iteration.
+    size_t heap_calls;
+
+    /// Usage statistics of the resource after the last iteration.
+    esp_memory_resource_stats_t stats;
+} bench_result_t;
+
+/// Name lengths used for the simulated files, averaging 16 characters.
+static size_t name_length(size_t file)
+{
+    return 8 + (file * 7) % 17;
+}
+
+/// Allocates a name for every file from @param resource, then releases them.
+///
+/// @param resource is the resource to allocate from.
+/// @param arena is non-null when @param resource is an arena which is
+/// released as a whole rather than per allocation.
+/// @param files is the number of files to register.
+/// @param names receives the allocated names.
+static void register_files(memory_resource_t *resource,
+                           MonotonicArenaResource *arena, size_t files,
+                           std::vector<char *> &names)
+{
+    for (size_t file = 0; file < files; file++)
+    {
+        size_t len = name_length(file);
+        char *name = static_cast<char *>(resource->allocate(len + 1, 1));
+        memset(name, 'a' + (file % 26), len);
+        name[len] = '\0';
+        names[file] = name;
+    }
+    if (arena)
+    {
+        arena->release();
+        return;
+    }
+    for (size_t file = 0; file < files; file++)
+    {
+        resource->deallocate(names[file], name_length(file) + 1, 1);
+    }
+}
+
+/// Runs @ref register_files @param iterations times.
+static bench_result_t bench_files(memory_resource_t *resource,
+                                  MonotonicArenaResource *arena,
+                                  AccountingResource *stats_source,
+                                  size_t files, size_t iterations)
+{
+    std::vector<char *> names(files);
+    bench_result_t result{};
+    auto start = std::chrono::steady_clock::now();
+    for (size_t iteration = 0; iteration < iterations; iteration++)
+    {
+        size_t calls = host_heap_calls;
+        register_files(resource, arena, files, names);
+        result.heap_calls = host_heap_calls - calls;
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    result.ns_per_alloc =
+        std::chrono::duration<double, std::nano>(elapsed).count() /
+        (files * iterations);
+    stats_source->get_stats(&result.stats);
+    return result;
+}
+
+/// Allocates and releases small blocks of varying size in a sliding window,
+/// similar to transient buffers on the USB task.
+static bench_result_t bench_churn(memory_resource_t *resource,
+                                  AccountingResource *stats_source,
+                                  size_t count, size_t iterations)
+{
+    static constexpr size_t WINDOW = 32;
+    void *blocks[WINDOW] = {};
+    size_t sizes[WINDOW] = {};
+    bench_result_t result{};
+    auto start = std::chrono::steady_clock::now();
+    for (size_t iteration = 0; iteration < iterations; iteration++)
+    {
+        size_t calls = host_heap_calls;
+        for (size_t index = 0; index < count; index++)
+        {
+            size_t slot = index % WINDOW;
+            if (blocks[slot])
+            {
+                resource->deallocate(blocks[slot], sizes[slot], 4);
+            }
+            sizes[slot] = 8 + (index * 13) % 120;
+            blocks[slot] = resource->allocate(sizes[slot], 4);
+        }
+        result.heap_calls = host_heap_calls - calls;
+    }
+    for (size_t slot = 0; slot < WINDOW; slot++)
+    {
+        if (blocks[slot])
+        {
+            resource->deallocate(blocks[slot], sizes[slot], 4);
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    result.ns_per_alloc =
+        std::chrono::duration<double, std::nano>(elapsed).count() /
+        (count * iterations);
+    stats_source->get_stats(&result.stats);
+    return result;
+}
+
+/// Checks that releasing a pool with outstanding small and large allocations
+/// accounts the small blocks as deallocated and keeps the large ones.
+///
+/// @return true if the statistics are consistent.
+static bool check_pool_release()
+{
+    static constexpr size_t LARGE_SIZE = PoolResource::MAX_BLOCK_SIZE + 1;
+    CapsResource heap(MALLOC_CAP_DEFAULT);
+    PoolResource pool(&heap);
+    for (size_t index = 0; index < 10; index++)
+    {
+        (void)pool.allocate(16 + index, 4);
+    }
+    void *large = pool.allocate(LARGE_SIZE, 4);
+    pool.release();
+    esp_memory_resource_stats_t stats;
+    pool.get_stats(&stats);
+    bool ok = stats.allocations == 11 && stats.deallocations == 10 &&
+              stats.bytes_in_use == LARGE_SIZE;
+    pool.deallocate(large, LARGE_SIZE, 4);
+    pool.get_stats(&stats);
+    ok = ok && stats.deallocations == stats.allocations &&
+         stats.bytes_in_use == 0;
+    heap.get_stats(&stats);
+    return ok && stats.bytes_in_use == 0;
+}
+
+/// Checks that the chunks of an arena backed by a @ref HeapTierResource are
+/// counted by the heap tier, as used for the virtual disk file names.
+///
+/// @return true if the statistics are consistent.
+static bool check_tier_resource()
+{
+    esp_heap_tier_stats_t before;
+    esp_heap_tier_stats_t after;
+    PSRAMHeap::get_stats(&before);
+    HeapTierResource<PSRAMHeap> tier;
+    {
+        MonotonicArenaResource arena(256, &tier);
+        for (size_t index = 0; index < 64; index++)
+        {
+            (void)arena.allocate(16, 1);
+        }
+        PSRAMHeap::get_stats(&after);
+    }
+    esp_memory_resource_stats_t stats;
+    tier.get_stats(&stats);
+    bool ok = after.allocations - before.allocations ==
+                  stats.upstream_allocations &&
+              after.bytes_in_use - before.bytes_in_use == stats.peak_bytes;
+    PSRAMHeap::get_stats(&after);
+    return ok && stats.upstream_allocations > 1 &&
+           after.bytes_in_use == before.bytes_in_use &&
+           after.frees - before.frees == stats.deallocations;
+}
+
+/// Prints one result line.
+static void report(const char *name, const bench_result_t &result)
+{
+    printf("%-22s %8.1f ns/alloc %8zu heap calls %8zu peak bytes\n", name,
+           result.ns_per_alloc, result.heap_calls, result.stats.peak_bytes);
+}
+
+int main(int argc, char **argv)
+{
+    size_t files = argc > 1 ? strtoul(argv[1], nullptr, 0) : 500;
+    size_t iterations = argc > 2 ? strtoul(argv[2], nullptr, 0) : 1000;
+
+    printf("registering %zu file names, %zu iterations\n", files, iterations);
+    {
+        CapsResource heap(MALLOC_CAP_DEFAULT);
+        report("heap per name", bench_files(&heap, nullptr, &heap, files,
+                                            iterations));
+    }
+    {
+        CapsResource heap(MALLOC_CAP_DEFAULT);
+        MonotonicArenaResource arena(files * 16, &heap);
+        report("arena", bench_files(&arena, &arena, &arena, files,
+                                    iterations));
+    }
+    {
+        CapsResource heap(MALLOC_CAP_DEFAULT);
+        PoolResource pool(&heap);
+        report("pool", bench_files(&pool, nullptr, &pool, files, iterations));
+    }
+
+    printf("small block churn, %zu blocks, %zu iterations\n", files,
+           iterations);
+    {
+        CapsResource heap(MALLOC_CAP_DEFAULT);
+        report("heap", bench_churn(&heap, &heap, files, iterations));
+    }
+    {
+        CapsResource heap(MALLOC_CAP_DEFAULT);
+        PoolResource pool(&heap);
+        report("pool", bench_churn(&pool, &pool, files, iterations));
+    }
+
+    bool released = check_pool_release();
+    printf("pool release accounting: %s\n", released ? "PASS" : "FAIL");
+    bool tiered = check_tier_resource();
+    printf("heap tier accounting: %s\n", tiered ? "PASS" : "FAIL");
+    return (released && tiered) ? 0 : 1;
+}
@@ -0,0 +1,422 @@
+// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Host test for the in-application flasher (src/usb_cdc_flasher.cpp).
+//
+// The flasher runs unmodified against the simulated TinyUSB CDC interface,
+// partition table and OTA API from tools/host/include. The test acts as
+// esptool talking to its flasher stub: DTR and RTS stay deasserted for the
+// whole session (as they do after the download request sequence handled by
+// src/usb_cdc.cpp) and every command is SLIP framed. The test checks:
+//
+//   1. data received before the session starts is left in the RX buffer for
+//      the application (cdc_app_rx_cb).
+//   2. SYNC is answered with eight responses and READ_REG returns the chip
+//      detection register.
+//   3. a compressed image sent with FLASH_DEFL_BEGIN/DATA/END is written
+//      unmodified to the next OTA partition, including blocks which contain
+//      bytes that need SLIP escaping.
+//   4. SPI_FLASH_MD5 for the flash offset used by the host returns the MD5
+//      of the image.
+//   5. FLASH_DEFL_END requesting a reboot ends the session, selects the new
+//      image for booting and restarts.
+//
+// Build and run from the repository root:
+//
+//   g++ -std=gnu++17 -O2 -pthread -Itools/host/include -Iinclude
+//       tools/host/cdc_flasher_session.cpp -o cdc_flasher_session -lz
+//   ./cdc_flasher_session [image bytes]
+
+#define CONFIG_IDF_TARGET_ESP32S2 1
+#define CONFIG_ESPUSB_CDC 1
+#define CONFIG_ESPUSB_CDC_RX_BUFSIZE 512
+#define CONFIG_ESPUSB_CDC_TX_BUFSIZE 512
+#define CONFIG_ESPUSB_CDC_EP_BUFSIZE 64
+#define CONFIG_ESPUSB_CDC_FIFO_SIZE 64
+#define CONFIG_ESPUSB_CDC_FLASHER 1
+#define CONFIG_ESPUSB_TASK_PRIORITY 5
+#define CONFIG_ESPUSB_TASK_AFFINITY tskNO_AFFINITY
+
+#include "../../src/usb_cdc_flasher.cpp"
+
+#include <esp_timer.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/// Value of the chip detection register reported by the simulated chip
+/// (ESP32-S2).
+static constexpr uint32_t CHIP_MAGIC = 0x000007C6;
+
+/// Flash offset the host writes the image to.
+static constexpr uint32_t IMAGE_OFFSET = 0x10000;
+
+/// Time to wait for a response (milliseconds).
+static constexpr uint32_t RESPONSE_TIMEOUT_MS = 2000;
+
+// Invoked by the simulated bus when an IN transfer has completed, this is
+// normally handled by usb_cdc.cpp.
+extern "C" void tud_cdc_tx_complete_cb(uint8_t itf)
+{
+}
+
+// Flushes the CDC in the same way as usb_cdc.cpp.
+void flush_cdc()
+{
+    tud_cdc_write_flush();
+}
+
+/// Number of failed checks.
+static unsigned s_failures = 0;
+
+/// Records the result of a check.
+///
+/// @param ok is the result of the check.
+/// @param what describes the check.
+static void check(bool ok, const char *what)
+{
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    if (!ok)
+    {
+        s_failures++;
+    }
+}
+
+/// Decoded response from the flasher.
+typedef struct
+{
+    uint8_t op;
+    uint32_t value;
+    std::vector<uint8_t> data;
+    uint8_t status;
+    uint8_t error;
+} response_t;
+
+/// Data received from the IN endpoint which has not been decoded yet.
+static std::vector<uint8_t> s_in_data;
+
+/// Appends a 32-bit little-endian value to @param buf.
+static void put_le32(std::vector<uint8_t> &buf, uint32_t value)
+{
+    for (size_t index = 0; index < sizeof(uint32_t); index++)
+    {
+        buf.push_back(value >> (index * 8));
+    }
+}
+
+/// Sends a SLIP framed command packet to the device.
+///
+/// @param op is the command.
+/// @param data is the command payload.
+/// @param checksum is the checksum field of the command.
+static void send_command(uint8_t op, const std::vector<uint8_t> &data,
+                         uint32_t checksum = 0)
+{
+    std::vector<uint8_t> packet = {0x00, op, (uint8_t)data.size(),
+                                   (uint8_t)(data.size() >> 8)};
+    put_le32(packet, checksum);
+    packet.insert(packet.end(), data.begin(), data.end());
+
+    std::vector<uint8_t> frame = {SLIP_END};
+    for (auto ch : packet)
+    {
+        if (ch == SLIP_END || ch == SLIP_ESC)
+        {
+            frame.push_back(SLIP_ESC);
+            frame.push_back(ch == SLIP_END ? SLIP_ESC_END : SLIP_ESC_ESC);
+        }
+        else
+        {
+            frame.push_back(ch);
+        }
+    }
+    frame.push_back(SLIP_END);
+    host_cdc_send(frame.data(), frame.size());
+}
+
+/// Decodes the next complete SLIP frame from @ref s_in_data.
+///
+/// @param frame receives the decoded frame.
+///
+/// @return true if a frame was decoded.
+static bool decode_frame(std::vector<uint8_t> &frame)
+{
+    auto start = std::find(s_in_data.begin(), s_in_data.end(), SLIP_END);
+    if (start == s_in_data.end())
+    {
+        return false;
+    }
+    auto end = std::find(start + 1, s_in_data.end(), SLIP_END);
+    if (end == s_in_data.end())
+    {
+        return false;
+    }
+    frame.clear();
+    for (auto it = start + 1; it != end; ++it)
+    {
+        if (*it == SLIP_ESC && it + 1 != end)
+        {
+            ++it;
+            frame.push_back(*it == SLIP_ESC_END ? SLIP_END : SLIP_ESC);
+        }
+        else
+        {
+            frame.push_back(*it);
+        }
+    }
+    s_in_data.erase(s_in_data.begin(), end + 1);
+    return true;
+}
+
+/// Waits for the next response from the flasher.
+///
+/// @param response receives the decoded response.
+///
+/// @return true if a response was received before the timeout.
+static bool wait_response(response_t &response)
+{
+    std::vector<uint8_t> frame;
+    int64_t start_us = esp_timer_get_time();
+    while (esp_timer_get_time() - start_us < RESPONSE_TIMEOUT_MS * 1000)
+    {
+        host_cdc_receive(s_in_data);
+        while (decode_frame(frame))
+        {
+            if (frame.size() < COMMAND_HEADER_SIZE + 2 || frame[0] != 0x01)
+            {
+                // not a response, for example the empty frame between two
+                // adjacent delimiters.
+                continue;
+            }
+            uint16_t len = frame[2] | (frame[3] << 8);
+            if (len != frame.size() - COMMAND_HEADER_SIZE)
+            {
+                continue;
+            }
+            response.op = frame[1];
+            response.value = frame[4] | (frame[5] << 8) | (frame[6] << 16) |
+                             ((uint32_t)frame[7] << 24);
+            response.data.assign(frame.begin() + COMMAND_HEADER_SIZE,
+                                 frame.end() - 2);
+            response.status = frame[frame.size() - 2];
+            response.error = frame[frame.size() - 1];
+            return true;
+        }
+        usleep(1000);
+    }
+    return false;
+}
+
+/// Sends a command and waits for its response.
+///
+/// @param op is the command.
+/// @param data is the command payload.
+/// @param response receives the response.
+/// @param checksum is the checksum field of the command.
+///
+/// @return true if a successful response for @param op was received.
+static bool command(uint8_t op, const std::vector<uint8_t> &data,
+                    response_t &response, uint32_t checksum = 0)
+{
+    send_command(op, data, checksum);
+    return wait_response(response) && response.op == op &&
+           response.status == 0;
+}
+
+/// Runs the SYNC and READ_REG exchange esptool uses to connect.
+static void test_connect()
+{
+    std::vector<uint8_t> sync = {0x07, 0x07, 0x12, 0x20};
+    sync.insert(sync.end(), 32, 0x55);
+    send_command(CMD_SYNC, sync);
+    size_t synced = 0;
+    response_t response;
+    while (synced < SYNC_RESPONSE_COUNT && wait_response(response) &&
+           response.op == CMD_SYNC && response.status == 0)
+    {
+        synced++;
+    }
+    check(synced == SYNC_RESPONSE_COUNT, "SYNC answered eight times");
+
+    std::vector<uint8_t> read_reg;
+    put_le32(read_reg, CHIP_DETECT_MAGIC_REG);
+    check(command(CMD_READ_REG, read_reg, response) &&
+          response.value == CHIP_MAGIC, "READ_REG returns the chip magic");
+}
+
+/// Writes @param image with FLASH_DEFL_* commands and verifies it.
+static void test_flash(const std::vector<uint8_t> &image)
+{
+    uLongf packed_len = compressBound(image.size());
+    std::vector<uint8_t> packed(packed_len);
+    compress2(packed.data(), &packed_len, image.data(), image.size(), 9);
+    packed.resize(packed_len);
+    size_t blocks = (packed.size() + MAX_BLOCK_SIZE - 1) / MAX_BLOCK_SIZE;
+    printf("image: %zu bytes, %zu compressed in %zu blocks\n", image.size(),
+           packed.size(), blocks);
+
+    response_t response;
+    std::vector<uint8_t> begin;
+    put_le32(begin, image.size());
+    put_le32(begin, blocks);
+    put_le32(begin, MAX_BLOCK_SIZE);
+    put_le32(begin, IMAGE_OFFSET);
+    check(command(CMD_FLASH_DEFL_BEGIN, begin, response),
+          "FLASH_DEFL_BEGIN accepted");
+
+    bool escaped = false;
+    size_t accepted = 0;
+    for (size_t seq = 0; seq < blocks; seq++)
+    {
+        size_t offs = seq * MAX_BLOCK_SIZE;
+        size_t len = std::min(MAX_BLOCK_SIZE, packed.size() - offs);
+        std::vector<uint8_t> data;
+        put_le32(data, len);
+        put_le32(data, seq);
+        put_le32(data, 0);
+        put_le32(data, 0);
+        uint8_t checksum = CHECKSUM_SEED;
+        for (size_t index = offs; index < offs + len; index++)
+        {
+            checksum ^= packed[index];
+            escaped |= (packed[index] == SLIP_END ||
+                        packed[index] == SLIP_ESC);
+        }
+        data.insert(data.end(), packed.begin() + offs,
+                    packed.begin() + offs + len);
+        if (command(CMD_FLASH_DEFL_DATA, data, response, checksum))
+        {
+            accepted++;
+        }
+    }
+    check(accepted == blocks, "every FLASH_DEFL_DATA block accepted");
+    check(escaped, "image data contains bytes which need SLIP escaping");
+
+    // esptool ends each image without a reboot and verifies it before
+    // moving on to the next one.
+    std::vector<uint8_t> end;
+    put_le32(end, 1);
+    check(command(CMD_FLASH_DEFL_END, end, response),
+          "FLASH_DEFL_END accepted");
+
+    const esp_partition_t *target = &host_partitions[1];
+    const std::vector<uint8_t> &written = host_partition_data(target);
+    check(std::equal(image.begin(), image.end(), written.begin()),
+          "image written to the next OTA partition");
+
+    uint8_t expected[ESP_ROM_MD5_DIGEST_LEN];
+    md5_context_t ctx;
+    esp_rom_md5_init(&ctx);
+    esp_rom_md5_update(&ctx, image.data(), image.size());
+    esp_rom_md5_final(expected, &ctx);
+    std::vector<uint8_t> md5;
+    put_le32(md5, IMAGE_OFFSET);
+    put_le32(md5, image.size());
+    put_le32(md5, 0);
+    put_le32(md5, 0);
+    check(command(CMD_SPI_FLASH_MD5, md5, response) &&
+          response.data.size() == sizeof(expected) &&
+          std::equal(response.data.begin(), response.data.end(), expected),
+          "SPI_FLASH_MD5 matches the image");
+}
+
+/// Sends data before the session has started, the flasher must leave it for
+/// the application.
+static void test_app_data()
+{
+    static constexpr uint8_t APP_DATA[] = "application data\n";
+    host_cdc_send(APP_DATA, sizeof(APP_DATA));
+    int64_t start_us = esp_timer_get_time();
+    while (tud_cdc_available() < sizeof(APP_DATA) &&
+           esp_timer_get_time() - start_us < RESPONSE_TIMEOUT_MS * 1000)
+    {
+        usleep(1000);
+    }
+    // give the flasher task time to (wrongly) consume the data.
+    usleep(20000);
+    uint8_t data[sizeof(APP_DATA)];
+    check(tud_cdc_available() == sizeof(APP_DATA) &&
+          tud_cdc_read(data, sizeof(data)) == sizeof(APP_DATA) &&
+          memcmp(data, APP_DATA, sizeof(APP_DATA)) == 0,
+          "data outside of a session left for the application");
+}
+
+/// Ends the session with a reboot request.
+static void test_reboot()
+{
+    response_t response;
+    std::vector<uint8_t> end;
+    put_le32(end, 0);
+    check(command(CMD_FLASH_DEFL_END, end, response),
+          "FLASH_DEFL_END with reboot accepted");
+    int64_t start_us = esp_timer_get_time();
+    while (host_restart_count == 0 &&
+           esp_timer_get_time() - start_us < RESPONSE_TIMEOUT_MS * 1000)
+    {
+        usleep(1000);
+    }
+    check(!s_flasher_active, "flashing session ended");
+    check(host_ota().boot == &host_partitions[1],
+          "new image selected for booting");
+    check(host_restart_count == 1, "restarted into the new image");
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size = argc > 1 ? strtoul(argv[1], nullptr, 0) : 256 * 1024;
+
+    // the MD5 implementation of the simulated ROM is checked against the
+    // RFC 1321 test vector, the image MD5 check depends on it.
+    static constexpr uint8_t ABC_MD5[ESP_ROM_MD5_DIGEST_LEN] =
+    {
+        0x90, 0x01, 0x50, 0x98, 0x3c, 0xd2, 0x4f, 0xb0,
+        0xd6, 0x96, 0x3f, 0x7d, 0x28, 0xe1, 0x7f, 0x72,
+    };
+    uint8_t digest[ESP_ROM_MD5_DIGEST_LEN];
+    md5_context_t ctx;
+    esp_rom_md5_init(&ctx);
+    esp_rom_md5_update(&ctx, "abc", 3);
+    esp_rom_md5_final(digest, &ctx);
+    check(memcmp(digest, ABC_MD5, sizeof(digest)) == 0,
+          "simulated ROM MD5 matches the RFC 1321 test vector");
+
+    // a mix of repeated and random data so the image compresses but still
+    // produces every byte value in the compressed stream.
+    std::vector<uint8_t> image(size);
+    uint32_t seed = 0x12345678;
+    for (size_t index = 0; index < size; index++)
+    {
+        seed = seed * 1664525 + 1013904223;
+        image[index] = (index & 0x100) ? (seed >> 24) : (index & 0x3F);
+    }
+
+    host_reg_write(CHIP_DETECT_MAGIC_REG, CHIP_MAGIC);
+    init_usb_cdc_flasher();
+    host_cdc_start();
+    // DTR and RTS stay deasserted, usb_cdc.cpp starts the session once it
+    // has seen the download request sequence.
+    host_cdc_set_dtr(false);
+    test_app_data();
+    cdc_flasher_start();
+
+    test_connect();
+    test_flash(image);
+    test_reboot();
+    check(!tud_cdc_connected(), "DTR deasserted for the whole session");
+
+    printf("%s\n", s_failures ? "FAILED" : "PASSED");
+    fflush(stdout);
+    // the flasher task never returns, skip running the static destructors.
+    _Exit(s_failures ? 1 : 0);
+}
@@ -0,0 +1,947 @@
+// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Register level simulation test for the descriptor DMA device driver
+// (src/usb_dcd_dma.cpp).
+//
+// The driver runs unmodified against the simulated USB0 registers from
+// tools/host/include/soc/usb_struct.h. This file models the parts of the
+// USB peripheral (a DWC2 core) the driver depends on: the descriptor DMA of
+// each endpoint (descriptor fetch, buffer status, byte counts and the L, SP,
+// IOC and SR flags), the endpoint and device interrupts, the IN endpoint NAK
+// and disable handshake, the global OUT NAK and the TX FIFO flush. A
+// simulated USB host sends SETUP, OUT and IN tokens and the interrupt is
+// raised after each transaction, as the hardware would. The DMA programming
+// rules are checked on every descriptor fetch: descriptors and buffers in
+// DMA capable memory, word aligned buffers, OUT descriptors and all but the
+// last IN descriptor a multiple of the packet size, SP set on IN descriptors
+// ending with a short packet and no DMA address written while the endpoint
+// is enabled.
+//
+// The test checks:
+//
+//   1. control transfers: SETUP packets, control reads and writes (also when
+//      the OUT data arrives before the stack requests it), SET_ADDRESS and
+//      stalling the control endpoint.
+//   2. bulk transfers from DMA capable buffers complete with a single
+//      interrupt regardless of their length, including a transfer using two
+//      descriptors, short packets and zero length packets.
+//   3. buffers the DMA can not access (heap, unaligned or OUT requests which
+//      are not a multiple of the packet size) go through the bounce buffer.
+//   4. stalling a bulk endpoint with a transfer in flight, and the driver
+//      giving up when the core does not acknowledge the endpoint disable.
+//
+// Build and run from the repository root (add
+// -DCONFIG_ESPUSB_STATIC_ALLOCATION=1 for the static bounce buffers):
+//
+//   g++ -std=gnu++17 -O2 -Itools/host/include -Iinclude
+//       tools/host/dcd_dma_sim.cpp -o dcd_dma_sim
+//   ./dcd_dma_sim
+
+#define CONFIG_ESPUSB_DCD_DMA 1
+#define CONFIG_ESPUSB_DCD_DMA_BOUNCE_SIZE 512
+
+#include "../../src/usb_dcd_dma.cpp"
+
+#include <stdarg.h>
+#include <vector>
+
+// Register and descriptor fields interpreted by the simulated core, these
+// follow the DWC2 databook and are intentionally not shared with the driver.
+static constexpr uint32_t SIM_GAHBCFG_GLBLINTRMSK = (1U << 0);
+static constexpr uint32_t SIM_GAHBCFG_DMAEN = (1U << 5);
+static constexpr uint32_t SIM_GRSTCTL_TXFFLSH = (1U << 5);
+static constexpr uint32_t SIM_GRSTCTL_TXFNUM_S = 6;
+static constexpr uint32_t SIM_GINTSTS_GOUTNAKEFF = (1U << 7);
+static constexpr uint32_t SIM_GINTSTS_USBRST = (1U << 12);
+static constexpr uint32_t SIM_GINTSTS_ENUMDONE = (1U << 13);
+static constexpr uint32_t SIM_GINTSTS_IEPINT = (1U << 18);
+static constexpr uint32_t SIM_GINTSTS_OEPINT = (1U << 19);
+static constexpr uint32_t SIM_DCFG_DEVADDR_S = 4;
+static constexpr uint32_t SIM_DCFG_DESCDMA = (1U << 23);
+static constexpr uint32_t SIM_DCTL_SFTDISCON = (1U << 1);
+static constexpr uint32_t SIM_DCTL_SGOUTNAK = (1U << 9);
+static constexpr uint32_t SIM_DCTL_CGOUTNAK = (1U << 10);
+static constexpr uint32_t SIM_DEPCTL_MPS_M = 0x7FF;
+static constexpr uint32_t SIM_DEPCTL_USBACTEP = (1U << 15);
+static constexpr uint32_t SIM_DEPCTL_STALL = (1U << 21);
+static constexpr uint32_t SIM_DEPCTL_TXFNUM_S = 22;
+static constexpr uint32_t SIM_DEPCTL_CNAK = (1U << 26);
+static constexpr uint32_t SIM_DEPCTL_SNAK = (1U << 27);
+static constexpr uint32_t SIM_DEPCTL_SD0PID = (1U << 28);
+static constexpr uint32_t SIM_DEPCTL_SD1PID = (1U << 29);
+static constexpr uint32_t SIM_DEPCTL_EPDIS = (1U << 30);
+static constexpr uint32_t SIM_DEPCTL_EPENA = (1U << 31);
+static constexpr uint32_t SIM_DEPINT_XFERCOMPL = (1U << 0);
+static constexpr uint32_t SIM_DEPINT_EPDISBLD = (1U << 1);
+static constexpr uint32_t SIM_DOEPINT_SETUP = (1U << 3);
+static constexpr uint32_t SIM_DIEPINT_INEPNAKEFF = (1U << 6);
+static constexpr uint32_t SIM_DEPINT_BNA = (1U << 9);
+static constexpr uint32_t SIM_DESC_BS_M = (3U << 30);
+static constexpr uint32_t SIM_DESC_BS_HOST_READY = (0U << 30);
+static constexpr uint32_t SIM_DESC_BS_DMA_BUSY = (1U << 30);
+static constexpr uint32_t SIM_DESC_BS_DMA_DONE = (2U << 30);
+static constexpr uint32_t SIM_DESC_L = (1U << 27);
+static constexpr uint32_t SIM_DESC_SP = (1U << 26);
+static constexpr uint32_t SIM_DESC_IOC = (1U << 25);
+static constexpr uint32_t SIM_DESC_SR = (1U << 24);
+static constexpr uint32_t SIM_DESC_BYTES_M = 0xFFFF;
+
+/// Number of endpoints (in each direction) of the simulated core.
+static constexpr uint8_t SIM_EP_NUM = 7;
+
+/// Packet size of the control endpoint.
+static constexpr uint16_t SIM_EP0_SIZE = 64;
+
+/// Packet size of the bulk endpoints.
+static constexpr uint16_t SIM_BULK_SIZE = 64;
+
+/// Handshake of a transaction on the simulated bus.
+typedef enum
+{
+    SIM_ACK,
+    SIM_NAK,
+    SIM_STALL
+} sim_handshake_t;
+
+/// DMA state of an endpoint direction.
+typedef struct
+{
+    /// Address of the descriptor in use.
+    uint32_t desc_addr;
+
+    /// Byte count of the descriptor when it was fetched.
+    uint32_t desc_bytes;
+
+    /// Number of bytes of the descriptor transferred so far.
+    uint32_t offset;
+
+    /// Tracks if the descriptor at @ref desc_addr has been fetched.
+    bool fetched;
+
+    /// Tracks if the endpoint NAKs all tokens (set with SNAK, cleared with
+    /// CNAK).
+    bool nak;
+} sim_dma_t;
+
+/// DMA state indexed by endpoint number and direction.
+static sim_dma_t s_sim_dma[SIM_EP_NUM][2];
+
+/// When set the core does not acknowledge NAK, endpoint disable or FIFO
+/// flush requests.
+static bool s_sim_unresponsive = false;
+
+/// Number of DMA programming errors found.
+static unsigned s_sim_errors = 0;
+
+/// Number of times the interrupt handler was called.
+static unsigned s_sim_interrupts = 0;
+
+/// TX FIFOs flushed, in order.
+static std::vector<uint32_t> s_sim_flushed_fifos;
+
+/// Number of failed checks.
+static unsigned s_failures = 0;
+
+/// Records a DMA programming error.
+///
+/// @param fmt is the printf style description of the error.
+static void sim_error(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    printf("DMA ERROR: ");
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+    s_sim_errors++;
+}
+
+/// @return the control register of an endpoint.
+static HostUsbReg<false> &sim_ctl(uint8_t epnum, uint8_t dir)
+{
+    return dir == TUSB_DIR_IN ? USB0.in_ep_reg[epnum].diepctl
+                              : USB0.out_ep_reg[epnum].doepctl;
+}
+
+/// @return the interrupt register of an endpoint.
+static HostUsbReg<true> &sim_int(uint8_t epnum, uint8_t dir)
+{
+    return dir == TUSB_DIR_IN ? USB0.in_ep_reg[epnum].diepint
+                              : USB0.out_ep_reg[epnum].doepint;
+}
+
+/// @return the packet size of an endpoint.
+static uint16_t sim_packet_size(uint8_t epnum, uint8_t dir)
+{
+    if (epnum)
+    {
+        return sim_ctl(epnum, dir) & SIM_DEPCTL_MPS_M;
+    }
+    // the control endpoint uses an encoded size, 0 is 64 bytes.
+    return SIM_EP0_SIZE >> (USB0.in_ep_reg[0].diepctl & 3);
+}
+
+/// Updates the endpoint interrupt summary registers.
+static void sim_update_interrupts()
+{
+    uint32_t daint = 0;
+    for (uint8_t epnum = 0; epnum < SIM_EP_NUM; epnum++)
+    {
+        if (USB0.in_ep_reg[epnum].diepint & USB0.diepmsk)
+        {
+            daint |= 1U << epnum;
+        }
+        if (USB0.out_ep_reg[epnum].doepint & USB0.doepmsk)
+        {
+            daint |= 1U << (16 + epnum);
+        }
+    }
+    USB0.daint.raw() = daint;
+    uint32_t &gintsts = USB0.gintsts.raw();
+    gintsts &= ~(SIM_GINTSTS_IEPINT | SIM_GINTSTS_OEPINT);
+    if (daint & USB0.daintmsk & 0xFFFF)
+    {
+        gintsts |= SIM_GINTSTS_IEPINT;
+    }
+    if (daint & USB0.daintmsk & 0xFFFF0000)
+    {
+        gintsts |= SIM_GINTSTS_OEPINT;
+    }
+}
+
+/// Calls the interrupt handler until no unmasked interrupt is pending.
+static void sim_irq()
+{
+    for (unsigned count = 0; count < 16; count++)
+    {
+        sim_update_interrupts();
+        if (!(USB0.gahbcfg & SIM_GAHBCFG_GLBLINTRMSK) ||
+            host_intr_handler == nullptr ||
+            !(USB0.gintsts & USB0.gintmsk))
+        {
+            return;
+        }
+        s_sim_interrupts++;
+        host_intr_handler(host_intr_arg);
+    }
+    sim_error("interrupt %08x not cleared by the handler",
+              (uint32_t)USB0.gintsts);
+}
+
+/// Models a write to an endpoint control register.
+///
+/// @param epnum is the endpoint number.
+/// @param dir is the endpoint direction.
+/// @param old is the value before the write.
+/// @param value is the value written.
+static void sim_ctl_written(uint8_t epnum, uint8_t dir, uint32_t old,
+                            uint32_t value)
+{
+    sim_dma_t &dma = s_sim_dma[epnum][dir];
+    uint32_t &ctl = sim_ctl(epnum, dir).raw();
+
+    // the command bits read as zero, the enable bit is only cleared by the
+    // core.
+    ctl &= ~(SIM_DEPCTL_CNAK | SIM_DEPCTL_SNAK | SIM_DEPCTL_SD0PID |
+             SIM_DEPCTL_SD1PID | SIM_DEPCTL_EPDIS | SIM_DEPCTL_EPENA);
+    ctl |= (old | value) & SIM_DEPCTL_EPENA;
+
+    if (value & SIM_DEPCTL_SNAK)
+    {
+        dma.nak = true;
+        if (dir == TUSB_DIR_IN && !s_sim_unresponsive)
+        {
+            sim_int(epnum, dir).raw() |= SIM_DIEPINT_INEPNAKEFF;
+        }
+    }
+    if (value & SIM_DEPCTL_CNAK)
+    {
+        dma.nak = false;
+    }
+
+    if ((value & SIM_DEPCTL_EPENA) && !(old & SIM_DEPCTL_EPENA))
+    {
+        if (!(USB0.gahbcfg & SIM_GAHBCFG_DMAEN) ||
+            !(USB0.dcfg & SIM_DCFG_DESCDMA))
+        {
+            sim_error("endpoint %d/%d enabled without descriptor DMA", epnum,
+                      dir);
+        }
+        dma.desc_addr = dir == TUSB_DIR_IN ? USB0.in_ep_reg[epnum].diepdma
+                                           : USB0.out_ep_reg[epnum].doepdma;
+        dma.fetched = false;
+    }
+
+    if ((value & SIM_DEPCTL_EPDIS) && (old & SIM_DEPCTL_EPENA))
+    {
+        if (dir == TUSB_DIR_OUT &&
+            !(USB0.gintsts & SIM_GINTSTS_GOUTNAKEFF))
+        {
+            sim_error("OUT endpoint %d disabled without global OUT NAK",
+                      epnum);
+        }
+        if (dir == TUSB_DIR_IN && !dma.nak)
+        {
+            sim_error("IN endpoint %d disabled without NAK", epnum);
+        }
+        if (!s_sim_unresponsive)
+        {
+            ctl &= ~SIM_DEPCTL_EPENA;
+            sim_int(epnum, dir).raw() |= SIM_DEPINT_EPDISBLD;
+        }
+    }
+}
+
+/// Models the side effects of a register write, called by the simulated
+/// register block for every write.
+static void sim_reg_written(const void *reg, uint32_t old, uint32_t value)
+{
+    if (reg == &USB0.dctl)
+    {
+        if ((value & SIM_DCTL_SGOUTNAK) && !s_sim_unresponsive)
+        {
+            USB0.gintsts.raw() |= SIM_GINTSTS_GOUTNAKEFF;
+        }
+        if (value & SIM_DCTL_CGOUTNAK)
+        {
+            USB0.gintsts.raw() &= ~SIM_GINTSTS_GOUTNAKEFF;
+        }
+        USB0.dctl.raw() &= ~(SIM_DCTL_SGOUTNAK | SIM_DCTL_CGOUTNAK);
+    }
+    else if (reg == &USB0.grstctl && (value & SIM_GRSTCTL_TXFFLSH))
+    {
+        s_sim_flushed_fifos.push_back((value >> SIM_GRSTCTL_TXFNUM_S) & 0x1F);
+        if (!s_sim_unresponsive)
+        {
+            USB0.grstctl.raw() &= ~SIM_GRSTCTL_TXFFLSH;
+        }
+    }
+    for (uint8_t epnum = 0; epnum < SIM_EP_NUM; epnum++)
+    {
+        if (reg == &USB0.in_ep_reg[epnum].diepctl)
+        {
+            sim_ctl_written(epnum, TUSB_DIR_IN, old, value);
+        }
+        else if (reg == &USB0.out_ep_reg[epnum].doepctl)
+        {
+            sim_ctl_written(epnum, TUSB_DIR_OUT, old, value);
+        }
+        else if ((reg == &USB0.in_ep_reg[epnum].diepdma &&
+                  (USB0.in_ep_reg[epnum].diepctl & SIM_DEPCTL_EPENA)) ||
+                 (reg == &USB0.out_ep_reg[epnum].doepdma &&
+                  (USB0.out_ep_reg[epnum].doepctl & SIM_DEPCTL_EPENA)))
+        {
+            sim_error("DMA address of endpoint %d written while enabled",
+                      epnum);
+        }
+    }
+    sim_update_interrupts();
+}
+
+/// Fetches the current descriptor of an endpoint.
+///
+/// @param epnum is the endpoint number.
+/// @param dir is the endpoint direction.
+///
+/// @return the descriptor (status and buffer address) or nullptr if it is
+/// not ready, in which case the endpoint has been disabled.
+static uint32_t *sim_fetch(uint8_t epnum, uint8_t dir)
+{
+    sim_dma_t &dma = s_sim_dma[epnum][dir];
+    uint32_t *desc = (uint32_t *)host_dma_ptr(dma.desc_addr);
+    if (desc == nullptr || (dma.desc_addr & 3))
+    {
+        sim_error("descriptor %08x of endpoint %d/%d is not DMA capable "
+                  "memory", dma.desc_addr, epnum, dir);
+        sim_ctl(epnum, dir).raw() &= ~SIM_DEPCTL_EPENA;
+        return nullptr;
+    }
+    if (dma.fetched)
+    {
+        return desc;
+    }
+    if ((desc[0] & SIM_DESC_BS_M) != SIM_DESC_BS_HOST_READY)
+    {
+        // buffer not available, the core disables the endpoint.
+        sim_int(epnum, dir).raw() |= SIM_DEPINT_BNA;
+        sim_ctl(epnum, dir).raw() &= ~SIM_DEPCTL_EPENA;
+        return nullptr;
+    }
+    uint32_t bytes = desc[0] & SIM_DESC_BYTES_M;
+    if (bytes && (host_dma_ptr(desc[1]) == nullptr ||
+                  host_dma_ptr(desc[1] + bytes - 1) == nullptr))
+    {
+        sim_error("buffer %08x of endpoint %d/%d is not DMA capable memory",
+                  desc[1], epnum, dir);
+    }
+    if (desc[1] & 3)
+    {
+        sim_error("buffer %08x of endpoint %d/%d is not word aligned",
+                  desc[1], epnum, dir);
+    }
+    if ((dir == TUSB_DIR_OUT || !(desc[0] & SIM_DESC_L)) &&
+        bytes % sim_packet_size(epnum, dir))
+    {
+        sim_error("descriptor of endpoint %d/%d with %u bytes is not a "
+                  "multiple of the packet size", epnum, dir, bytes);
+    }
+    if (dir == TUSB_DIR_IN && (bytes % sim_packet_size(epnum, dir) || !bytes) &&
+        !(desc[0] & SIM_DESC_SP))
+    {
+        sim_error("descriptor of endpoint %d with %u bytes ends with a short "
+                  "packet without SP", epnum, bytes);
+    }
+    desc[0] = (desc[0] & ~SIM_DESC_BS_M) | SIM_DESC_BS_DMA_BUSY;
+    dma.desc_bytes = bytes;
+    dma.offset = 0;
+    dma.fetched = true;
+    return desc;
+}
+
+/// Closes the current descriptor of an endpoint.
+///
+/// @param epnum is the endpoint number.
+/// @param dir is the endpoint direction.
+/// @param desc is the descriptor.
+/// @param flags are added to the descriptor status (SP or SR).
+static void sim_close(uint8_t epnum, uint8_t dir, uint32_t *desc,
+                      uint32_t flags)
+{
+    sim_dma_t &dma = s_sim_dma[epnum][dir];
+    desc[0] = (desc[0] & ~(SIM_DESC_BS_M | SIM_DESC_BYTES_M)) |
+              SIM_DESC_BS_DMA_DONE | flags | (dma.desc_bytes - dma.offset);
+    dma.fetched = false;
+    if (desc[0] & SIM_DESC_IOC)
+    {
+        sim_int(epnum, dir).raw() |= SIM_DEPINT_XFERCOMPL;
+    }
+    if (desc[0] & SIM_DESC_L)
+    {
+        sim_ctl(epnum, dir).raw() &= ~SIM_DEPCTL_EPENA;
+    }
+    else
+    {
+        dma.desc_addr += 2 * sizeof(uint32_t);
+    }
+}
+
+/// Sends a SETUP packet to the control endpoint.
+///
+/// @param setup is the SETUP packet.
+static void sim_setup(const uint8_t setup[8])
+{
+    sim_irq();
+    // a SETUP packet clears the stall of the control endpoint.
+    USB0.in_ep_reg[0].diepctl.raw() &= ~SIM_DEPCTL_STALL;
+    USB0.out_ep_reg[0].doepctl.raw() &= ~SIM_DEPCTL_STALL;
+    if (!(USB0.out_ep_reg[0].doepctl & SIM_DEPCTL_EPENA))
+    {
+        sim_error("SETUP packet received while the control endpoint is not "
+                  "armed");
+        return;
+    }
+    uint32_t *desc = sim_fetch(0, TUSB_DIR_OUT);
+    if (desc)
+    {
+        memcpy(host_dma_ptr(desc[1]), setup, 8);
+        s_sim_dma[0][TUSB_DIR_OUT].offset = 8;
+        sim_close(0, TUSB_DIR_OUT, desc, SIM_DESC_SR);
+        USB0.out_ep_reg[0].doepint.raw() |= SIM_DOEPINT_SETUP;
+    }
+    sim_irq();
+}
+
+/// Sends an OUT packet.
+///
+/// @param epnum is the endpoint number.
+/// @param data is the packet data.
+/// @param len is the length of the packet.
+///
+/// @return the handshake of the device.
+static sim_handshake_t sim_out(uint8_t epnum, const uint8_t *data,
+                               uint16_t len)
+{
+    sim_irq();
+    sim_dma_t &dma = s_sim_dma[epnum][TUSB_DIR_OUT];
+    uint32_t ctl = USB0.out_ep_reg[epnum].doepctl;
+    if (ctl & SIM_DEPCTL_STALL)
+    {
+        return SIM_STALL;
+    }
+    if (!(ctl & SIM_DEPCTL_EPENA) || dma.nak ||
+        (USB0.gintsts & SIM_GINTSTS_GOUTNAKEFF))
+    {
+        return SIM_NAK;
+    }
+    uint32_t *desc = sim_fetch(epnum, TUSB_DIR_OUT);
+    if (desc == nullptr)
+    {
+        sim_irq();
+        return SIM_NAK;
+    }
+    if (len > dma.desc_bytes - dma.offset)
+    {
+        sim_error("OUT packet of %u bytes overruns the descriptor of endpoint "
+                  "%d", len, epnum);
+        len = dma.desc_bytes - dma.offset;
+    }
+    if (len)
+    {
+        memcpy(host_dma_ptr(desc[1]) + dma.offset, data, len);
+    }
+    dma.offset += len;
+    uint16_t mps = sim_packet_size(epnum, TUSB_DIR_OUT);
+    if (len < mps || dma.offset == dma.desc_bytes)
+    {
+        sim_close(epnum, TUSB_DIR_OUT, desc, len < mps ? SIM_DESC_SP : 0);
+    }
+    sim_irq();
+    return SIM_ACK;
+}
+
+/// Sends an IN token.
+///
+/// @param epnum is the endpoint number.
+/// @param packet receives the packet sent by the device.
+///
+/// @return the handshake of the device, the packet is only valid for
+/// SIM_ACK.
+static sim_handshake_t sim_in(uint8_t epnum, std::vector<uint8_t> &packet)
+{
+    sim_irq();
+    sim_dma_t &dma = s_sim_dma[epnum][TUSB_DIR_IN];
+    uint32_t ctl = USB0.in_ep_reg[epnum].diepctl;
+    if (ctl & SIM_DEPCTL_STALL)
+    {
+        return SIM_STALL;
+    }
+    if (!(ctl & SIM_DEPCTL_EPENA) || dma.nak)
+    {
+        return SIM_NAK;
+    }
+    if (epnum && !((ctl >> SIM_DEPCTL_TXFNUM_S) & 0xF))
+    {
+        sim_error("IN endpoint %d enabled without a TX FIFO", epnum);
+    }
+    uint32_t *desc = sim_fetch(epnum, TUSB_DIR_IN);
+    if (desc == nullptr)
+    {
+        sim_irq();
+        return SIM_NAK;
+    }
+    uint16_t mps = sim_packet_size(epnum, TUSB_DIR_IN);
+    uint32_t len = std::min<uint32_t>(mps, dma.desc_bytes - dma.offset);
+    uint8_t *buf = host_dma_ptr(desc[1]);
+    packet.assign(buf + dma.offset, buf + dma.offset + len);
+    dma.offset += len;
+    // a descriptor flagged with SP ends with a short or zero length packet.
+    if (dma.offset == dma.desc_bytes && (len < mps || !(desc[0] & SIM_DESC_SP)))
+    {
+        sim_close(epnum, TUSB_DIR_IN, desc, 0);
+    }
+    sim_irq();
+    return SIM_ACK;
+}
+
+/// Signals a bus reset followed by the speed enumeration.
+static void sim_bus_reset()
+{
+    sim_irq();
+    USB0.gintsts.raw() |= SIM_GINTSTS_USBRST;
+    sim_irq();
+    USB0.gintsts.raw() |= SIM_GINTSTS_ENUMDONE;
+    sim_irq();
+}
+
+/// Reads packets from an IN endpoint until a short packet is received or
+/// the endpoint NAKs.
+///
+/// @param epnum is the endpoint number.
+/// @param data receives the data.
+///
+/// @return the number of packets received.
+static size_t host_read(uint8_t epnum, std::vector<uint8_t> &data)
+{
+    size_t packets = 0;
+    std::vector<uint8_t> packet;
+    while (sim_in(epnum, packet) == SIM_ACK)
+    {
+        data.insert(data.end(), packet.begin(), packet.end());
+        packets++;
+        if (packet.size() < sim_packet_size(epnum, TUSB_DIR_IN))
+        {
+            break;
+        }
+    }
+    return packets;
+}
+
+/// Writes data to an OUT endpoint, ending with a short packet if the length
+/// is not a multiple of the packet size.
+///
+/// @param epnum is the endpoint number.
+/// @param data is the data to write.
+/// @param len is the number of bytes to write.
+///
+/// @return true if all packets were accepted.
+static bool host_write(uint8_t epnum, const uint8_t *data, size_t len)
+{
+    uint16_t mps = sim_packet_size(epnum, TUSB_DIR_OUT);
+    for (size_t offs = 0; offs < len; offs += mps)
+    {
+        uint16_t size = std::min<size_t>(mps, len - offs);
+        if (sim_out(epnum, data + offs, size) != SIM_ACK)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Records the result of a check.
+///
+/// @param ok is the result of the check.
+/// @param fmt is the printf style description of the check.
+static void check(bool ok, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    printf("%s: ", ok ? "PASS" : "FAIL");
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+    if (!ok)
+    {
+        s_failures++;
+    }
+}
+
+/// Removes the oldest event reported by the driver and checks that it is a
+/// completed transfer.
+///
+/// @param ep_addr is the expected endpoint address.
+/// @param len is the expected number of bytes transferred.
+///
+/// @return true if the event matched.
+static bool expect_xfer(uint8_t ep_addr, uint32_t len)
+{
+    if (host_dcd_events.empty())
+    {
+        return false;
+    }
+    host_dcd_event_t event = host_dcd_events.front();
+    host_dcd_events.pop_front();
+    return event.id == DCD_EVENT_XFER_COMPLETE && event.ep_addr == ep_addr &&
+           event.len == len && event.result == XFER_RESULT_SUCCESS;
+}
+
+/// Removes the oldest event reported by the driver and checks that it is a
+/// SETUP packet.
+///
+/// @param setup is the expected SETUP packet.
+///
+/// @return true if the event matched.
+static bool expect_setup(const uint8_t setup[8])
+{
+    if (host_dcd_events.empty())
+    {
+        return false;
+    }
+    host_dcd_event_t event = host_dcd_events.front();
+    host_dcd_events.pop_front();
+    return event.id == DCD_EVENT_SETUP_RECEIVED &&
+           !memcmp(event.setup, setup, 8);
+}
+
+/// Fills a buffer with a pseudo random pattern.
+///
+/// @param buf is the buffer to fill.
+/// @param len is the number of bytes to fill.
+/// @param seed selects the pattern.
+static void fill(uint8_t *buf, size_t len, uint32_t seed)
+{
+    for (size_t idx = 0; idx < len; idx++)
+    {
+        seed = seed * 1664525 + 1013904223;
+        buf[idx] = seed >> 24;
+    }
+}
+
+/// @return true if the control endpoint is armed for the next SETUP packet.
+static bool ep0_armed()
+{
+    return USB0.out_ep_reg[0].doepctl & SIM_DEPCTL_EPENA;
+}
+
+/// Buffer in DMA capable memory used for IN transfers.
+alignas(4) static uint8_t s_in_buf[65536];
+
+/// Buffer in DMA capable memory used for OUT transfers.
+alignas(4) static uint8_t s_out_buf[4096];
+
+/// Runs a control read of @param len bytes.
+static void test_control_read(uint16_t len)
+{
+    const uint8_t setup[8] = {0x80, 0x06, 0x00, 0x02, 0x00, 0x00,
+                              (uint8_t)len, (uint8_t)(len >> 8)};
+    sim_setup(setup);
+    bool setup_ok = expect_setup(setup);
+
+    fill(s_in_buf, len, len);
+    unsigned interrupts = s_sim_interrupts;
+    dcd_edpt_xfer(0, 0x80, s_in_buf, len);
+    std::vector<uint8_t> data;
+    size_t packets = host_read(0, data);
+    bool data_ok = data.size() == len && !memcmp(data.data(), s_in_buf, len) &&
+                   expect_xfer(0x80, len);
+    interrupts = s_sim_interrupts - interrupts;
+
+    dcd_edpt_xfer(0, 0x00, nullptr, 0);
+    bool status_ok = sim_out(0, nullptr, 0) == SIM_ACK && expect_xfer(0x00, 0);
+    check(setup_ok && data_ok && status_ok && ep0_armed() &&
+          host_dcd_events.empty(),
+          "control read of %u bytes: %zu packets, %u interrupt(s)", len,
+          packets, interrupts);
+}
+
+/// Runs a control write where the data arrives before the stack requests
+/// it.
+static void test_control_write_early()
+{
+    const uint8_t setup[8] = {0x21, 0x09, 0x00, 0x02, 0x00, 0x00, 10, 0};
+    uint8_t data[10];
+    uint8_t received[10] = {};
+    fill(data, sizeof(data), 10);
+    sim_setup(setup);
+    bool setup_ok = expect_setup(setup);
+
+    bool held = sim_out(0, data, sizeof(data)) == SIM_ACK &&
+                host_dcd_events.empty() &&
+                sim_out(0, data, sizeof(data)) == SIM_NAK;
+    dcd_edpt_xfer(0, 0x00, received, sizeof(received));
+    bool data_ok = expect_xfer(0x00, sizeof(data)) &&
+                   !memcmp(received, data, sizeof(data)) && ep0_armed();
+
+    dcd_edpt_xfer(0, 0x80, nullptr, 0);
+    std::vector<uint8_t> packet;
+    bool status_ok = sim_in(0, packet) == SIM_ACK && packet.empty() &&
+                     expect_xfer(0x80, 0);
+    check(setup_ok && held && data_ok && status_ok && host_dcd_events.empty(),
+          "control write with the data received before it was requested");
+}
+
+/// Runs a SET_ADDRESS request.
+static void test_set_address()
+{
+    const uint8_t setup[8] = {0x00, 0x05, 9, 0x00, 0x00, 0x00, 0x00, 0x00};
+    sim_setup(setup);
+    bool setup_ok = expect_setup(setup);
+    dcd_set_address(0, 9);
+    std::vector<uint8_t> packet;
+    bool status_ok = sim_in(0, packet) == SIM_ACK && packet.empty() &&
+                     expect_xfer(0x80, 0);
+    check(setup_ok && status_ok &&
+          ((USB0.dcfg >> SIM_DCFG_DEVADDR_S) & 0x7F) == 9,
+          "SET_ADDRESS sets the device address and completes the status "
+          "stage");
+}
+
+/// Stalls the control endpoint and checks the next SETUP packet clears it.
+static void test_control_stall()
+{
+    const uint8_t unsupported[8] = {0x80, 0x06, 0x00, 0x0F, 0, 0, 5, 0};
+    sim_setup(unsupported);
+    bool setup_ok = expect_setup(unsupported);
+    dcd_edpt_stall(0, 0x80);
+    dcd_edpt_stall(0, 0x00);
+    std::vector<uint8_t> packet;
+    bool stalled = sim_in(0, packet) == SIM_STALL &&
+                   sim_out(0, nullptr, 0) == SIM_STALL;
+    check(setup_ok && stalled, "control endpoint stalled");
+    test_control_read(18);
+}
+
+/// Opens a bulk endpoint.
+///
+/// @param ep_addr is the endpoint address.
+///
+/// @return true if the endpoint was opened.
+static bool open_bulk(uint8_t ep_addr)
+{
+    tusb_desc_endpoint_t desc = {7, 5, ep_addr, {TUSB_XFER_BULK},
+                                 SIM_BULK_SIZE, 0};
+    return dcd_edpt_open(0, &desc);
+}
+
+/// Sends @param len bytes from @param buf on the bulk IN endpoint.
+///
+/// @param what describes the buffer.
+/// @param expected_interrupts is the expected number of interrupts.
+static void test_bulk_in(const uint8_t *buf, uint16_t len, const char *what,
+                         unsigned expected_interrupts)
+{
+    unsigned interrupts = s_sim_interrupts;
+    dcd_edpt_xfer(0, 0x81, (uint8_t *)buf, len);
+    std::vector<uint8_t> data;
+    size_t packets = host_read(1, data);
+    interrupts = s_sim_interrupts - interrupts;
+    size_t expected_packets = len / SIM_BULK_SIZE +
+                              ((len % SIM_BULK_SIZE || !len) ? 1 : 0);
+    check(data.size() == len && !memcmp(data.data(), buf, len) &&
+          expect_xfer(0x81, len) && host_dcd_events.empty() &&
+          packets == expected_packets &&
+          interrupts == expected_interrupts,
+          "bulk IN of %u bytes from %s: %zu packets, %u interrupt(s)", len,
+          what, packets, interrupts);
+}
+
+/// Receives @param len bytes into @param buf on the bulk OUT endpoint.
+///
+/// @param request is the number of bytes requested by the stack.
+/// @param what describes the buffer.
+/// @param expected_interrupts is the expected number of interrupts.
+static void test_bulk_out(uint8_t *buf, uint16_t request, uint16_t len,
+                          const char *what, unsigned expected_interrupts)
+{
+    std::vector<uint8_t> data(len);
+    fill(data.data(), len, len);
+    memset(buf, 0, request);
+    unsigned interrupts = s_sim_interrupts;
+    dcd_edpt_xfer(0, 0x01, buf, request);
+    bool accepted = host_write(1, data.data(), len);
+    interrupts = s_sim_interrupts - interrupts;
+    check(accepted && !memcmp(buf, data.data(), len) &&
+          expect_xfer(0x01, len) && host_dcd_events.empty() &&
+          interrupts == expected_interrupts,
+          "bulk OUT of %u bytes (%u requested) into %s: %u interrupt(s)",
+          len, request, what, interrupts);
+}
+
+/// Stalls the bulk endpoints while a transfer is in flight.
+static void test_bulk_stall()
+{
+    std::vector<uint8_t> packet;
+    fill(s_in_buf, 256, 256);
+    dcd_edpt_xfer(0, 0x81, s_in_buf, 256);
+    dcd_edpt_stall(0, 0x81);
+    bool in_stalled = sim_in(1, packet) == SIM_STALL &&
+                      !(USB0.in_ep_reg[1].diepctl & SIM_DEPCTL_EPENA) &&
+                      !s_sim_flushed_fifos.empty() &&
+                      s_sim_flushed_fifos.back() == 1;
+    dcd_edpt_clear_stall(0, 0x81);
+    bool in_cleared = sim_in(1, packet) == SIM_NAK && host_dcd_events.empty();
+    check(in_stalled && in_cleared,
+          "bulk IN endpoint stalled with a transfer in flight");
+    test_bulk_in(s_in_buf, 100, "DMA capable memory after a stall", 1);
+
+    dcd_edpt_xfer(0, 0x01, s_out_buf, 512);
+    dcd_edpt_stall(0, 0x01);
+    bool out_stalled = sim_out(1, s_out_buf, SIM_BULK_SIZE) == SIM_STALL &&
+                       !(USB0.out_ep_reg[1].doepctl & SIM_DEPCTL_EPENA) &&
+                       !(USB0.gintsts & SIM_GINTSTS_GOUTNAKEFF);
+    dcd_edpt_clear_stall(0, 0x01);
+    bool out_cleared = sim_out(1, s_out_buf, SIM_BULK_SIZE) == SIM_NAK &&
+                       host_dcd_events.empty();
+    check(out_stalled && out_cleared,
+          "bulk OUT endpoint stalled with a transfer in flight");
+    test_bulk_out(s_out_buf, 128, 128, "DMA capable memory after a stall", 1);
+}
+
+/// Stalls the bulk IN endpoint while the core does not acknowledge the NAK,
+/// disable and flush requests.
+static void test_unresponsive_stall()
+{
+    dcd_edpt_xfer(0, 0x81, s_in_buf, SIM_BULK_SIZE);
+    s_sim_unresponsive = true;
+    uint64_t start_us = host_rom_delay_us;
+    dcd_edpt_stall(0, 0x81);
+    uint64_t waited_us = host_rom_delay_us - start_us;
+    s_sim_unresponsive = false;
+    std::vector<uint8_t> packet;
+    check(waited_us >= 3000 && waited_us <= 3 * (CORE_TIMEOUT_US + 1) &&
+          sim_in(1, packet) == SIM_STALL,
+          "stall gives up after %llu us when the core does not respond",
+          (unsigned long long)waited_us);
+}
+
+/// Closes all endpoints and checks the IN FIFOs are released.
+static void test_close_all()
+{
+    dcd_edpt_close_all(0);
+    bool closed = !(USB0.in_ep_reg[1].diepctl & SIM_DEPCTL_USBACTEP) &&
+                  !(USB0.out_ep_reg[1].doepctl & SIM_DEPCTL_USBACTEP);
+    bool reopened = open_bulk(0x82) &&
+                    ((USB0.in_ep_reg[2].diepctl >> SIM_DEPCTL_TXFNUM_S) &
+                     0xF) == 1;
+    check(closed && reopened, "closing all endpoints releases the IN FIFOs");
+}
+
+int main(int argc, char **argv)
+{
+    host_usb_reg_written = sim_reg_written;
+
+    dcd_init(0);
+    dcd_int_enable(0);
+    check((USB0.gahbcfg & SIM_GAHBCFG_DMAEN) &&
+          (USB0.dcfg & SIM_DCFG_DESCDMA) && host_intr_handler != nullptr &&
+          !(USB0.dctl & SIM_DCTL_SFTDISCON),
+          "descriptor DMA enabled, interrupt allocated and device connected");
+
+    sim_bus_reset();
+    bool reset = !host_dcd_events.empty() &&
+                 host_dcd_events.front().id == DCD_EVENT_BUS_RESET;
+    host_dcd_events.clear();
+    check(reset && ep0_armed(), "bus reset arms the control endpoint");
+
+    test_control_read(18);
+    test_control_read(100);
+    test_control_write_early();
+    test_set_address();
+    test_control_stall();
+
+    check(open_bulk(0x01) && open_bulk(0x81) &&
+          ((USB0.in_ep_reg[1].diepctl >> SIM_DEPCTL_TXFNUM_S) & 0xF) == 1 &&
+          (USB0.in_ep_reg[1].diepctl & SIM_DEPCTL_MPS_M) == SIM_BULK_SIZE &&
+          USB0.dieptxf[0] != 0,
+          "bulk endpoints opened with a TX FIFO");
+
+    fill(s_in_buf, sizeof(s_in_buf), 1);
+    test_bulk_in(s_in_buf, 1000, "DMA capable memory", 1);
+    test_bulk_in(s_in_buf, 128, "DMA capable memory", 1);
+    test_bulk_in(s_in_buf, 0, "DMA capable memory", 1);
+    test_bulk_in(s_in_buf, 65535, "DMA capable memory (two descriptors)", 1);
+    std::vector<uint8_t> heap_in(1500);
+    fill(heap_in.data(), heap_in.size(), 2);
+    test_bulk_in(heap_in.data(), heap_in.size(), "the heap (bounce buffer)",
+                 3);
+    test_bulk_in(s_in_buf + 1, 100, "an unaligned buffer (bounce buffer)", 1);
+
+    test_bulk_out(s_out_buf, 512, 512, "DMA capable memory", 1);
+    test_bulk_out(s_out_buf, 512, 138, "DMA capable memory", 1);
+    test_bulk_out(s_out_buf, 100, 100, "a partial packet (bounce buffer)", 1);
+    std::vector<uint8_t> heap_out(1000);
+    test_bulk_out(heap_out.data(), heap_out.size(), heap_out.size(),
+                  "the heap (bounce buffer)", 2);
+    check(sim_out(1, s_out_buf, SIM_BULK_SIZE) == SIM_NAK,
+          "bulk OUT endpoint NAKs without a transfer");
+
+    test_bulk_stall();
+    test_unresponsive_stall();
+    test_close_all();
+
+    check(s_sim_errors == 0, "%u DMA programming error(s)", s_sim_errors);
+    printf("%u check(s) failed\n", s_failures);
+    return s_failures ? 1 : 0;
+}
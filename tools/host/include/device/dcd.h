@@ -0,0 +1,180 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file dcd.h
+/// Host replacement for the TinyUSB device controller driver API used by the
+/// host tools in this directory. The events reported by the driver are
+/// recorded in @ref host_dcd_events instead of being passed to the stack.
+
+#pragma once
+
+#include <deque>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "tusb_config.h"
+
+#define TU_ATTR_PACKED __attribute__((packed))
+#define TU_ATTR_ALIGNED(x) __attribute__((aligned(x)))
+
+#define TU_ASSERT(cond)                                                \
+    do                                                                 \
+    {                                                                  \
+        if (!(cond))                                                   \
+        {                                                              \
+            fprintf(stderr, "%s:%d: assertion %s failed\n", __FILE__,  \
+                    __LINE__, #cond);                                  \
+            return false;                                              \
+        }                                                              \
+    } while (0)
+
+typedef enum
+{
+    TUSB_DIR_OUT = 0,
+    TUSB_DIR_IN = 1,
+    TUSB_DIR_IN_MASK = 0x80
+} tusb_dir_t;
+
+typedef enum
+{
+    TUSB_XFER_CONTROL = 0,
+    TUSB_XFER_ISOCHRONOUS,
+    TUSB_XFER_BULK,
+    TUSB_XFER_INTERRUPT
+} tusb_xfer_type_t;
+
+typedef enum
+{
+    TUSB_SPEED_FULL = 0,
+    TUSB_SPEED_LOW,
+    TUSB_SPEED_HIGH
+} tusb_speed_t;
+
+typedef enum
+{
+    XFER_RESULT_SUCCESS,
+    XFER_RESULT_FAILED,
+    XFER_RESULT_STALLED
+} xfer_result_t;
+
+typedef enum
+{
+    DCD_EVENT_INVALID = 0,
+    DCD_EVENT_BUS_RESET,
+    DCD_EVENT_UNPLUGGED,
+    DCD_EVENT_SOF,
+    DCD_EVENT_SUSPEND,
+    DCD_EVENT_RESUME,
+    DCD_EVENT_SETUP_RECEIVED,
+    DCD_EVENT_XFER_COMPLETE
+} dcd_eventid_t;
+
+typedef struct TU_ATTR_PACKED
+{
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bEndpointAddress;
+    struct TU_ATTR_PACKED
+    {
+        uint8_t xfer : 2;
+        uint8_t sync : 2;
+        uint8_t usage : 2;
+        uint8_t : 2;
+    } bmAttributes;
+    uint16_t wMaxPacketSize;
+    uint8_t bInterval;
+} tusb_desc_endpoint_t;
+
+static inline uint8_t tu_edpt_number(uint8_t addr)
+{
+    return addr & ~TUSB_DIR_IN_MASK;
+}
+
+static inline tusb_dir_t tu_edpt_dir(uint8_t addr)
+{
+    return (addr & TUSB_DIR_IN_MASK) ? TUSB_DIR_IN : TUSB_DIR_OUT;
+}
+
+static inline uint16_t tu_edpt_packet_size(tusb_desc_endpoint_t const *desc)
+{
+    return desc->wMaxPacketSize & 0x7FF;
+}
+
+/// Event reported by the device driver.
+typedef struct
+{
+    /// Type of the event.
+    dcd_eventid_t id;
+
+    /// Endpoint address, only for DCD_EVENT_XFER_COMPLETE.
+    uint8_t ep_addr;
+
+    /// Number of bytes transferred, only for DCD_EVENT_XFER_COMPLETE.
+    uint32_t len;
+
+    /// Result of the transfer, only for DCD_EVENT_XFER_COMPLETE.
+    uint8_t result;
+
+    /// SETUP packet, only for DCD_EVENT_SETUP_RECEIVED.
+    uint8_t setup[8];
+} host_dcd_event_t;
+
+/// Events reported by the device driver, oldest first.
+inline std::deque<host_dcd_event_t> host_dcd_events;
+
+static inline void dcd_event_bus_signal(uint8_t rhport, dcd_eventid_t eid,
+                                        bool in_isr)
+{
+    host_dcd_events.push_back({eid});
+}
+
+static inline void dcd_event_bus_reset(uint8_t rhport, tusb_speed_t speed,
+                                       bool in_isr)
+{
+    host_dcd_events.push_back({DCD_EVENT_BUS_RESET});
+}
+
+static inline void dcd_event_setup_received(uint8_t rhport,
+                                            uint8_t const *setup, bool in_isr)
+{
+    host_dcd_event_t event = {DCD_EVENT_SETUP_RECEIVED};
+    memcpy(event.setup, setup, sizeof(event.setup));
+    host_dcd_events.push_back(event);
+}
+
+static inline void dcd_event_xfer_complete(uint8_t rhport, uint8_t ep_addr,
+                                           uint32_t xferred_bytes,
+                                           uint8_t result, bool in_isr)
+{
+    host_dcd_events.push_back(
+        {DCD_EVENT_XFER_COMPLETE, ep_addr, xferred_bytes, result});
+}
+
+extern "C"
+{
+void dcd_init(uint8_t rhport);
+void dcd_int_enable(uint8_t rhport);
+void dcd_int_disable(uint8_t rhport);
+void dcd_set_address(uint8_t rhport, uint8_t dev_addr);
+void dcd_remote_wakeup(uint8_t rhport);
+void dcd_connect(uint8_t rhport);
+void dcd_disconnect(uint8_t rhport);
+bool dcd_edpt_open(uint8_t rhport, tusb_desc_endpoint_t const *desc_edpt);
+void dcd_edpt_close_all(uint8_t rhport);
+bool dcd_edpt_xfer(uint8_t rhport, uint8_t ep_addr, uint8_t *buffer,
+                   uint16_t total_bytes);
+void dcd_edpt_stall(uint8_t rhport, uint8_t ep_addr);
+void dcd_edpt_clear_stall(uint8_t rhport, uint8_t ep_addr);
+}
@@ -0,0 +1,59 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file gpio.h
+/// Host replacement for the ESP-IDF GPIO driver used by the host tools in
+/// this directory, the output level of each pin is recorded.
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef int gpio_num_t;
+
+typedef enum
+{
+    GPIO_MODE_DISABLE = 0,
+    GPIO_MODE_INPUT = 1,
+    GPIO_MODE_OUTPUT = 2,
+} gpio_mode_t;
+
+/// Number of simulated pins.
+static constexpr int HOST_GPIO_COUNT = 49;
+
+/// @return the level last set for each pin.
+static inline uint32_t *host_gpio_levels()
+{
+    static uint32_t levels[HOST_GPIO_COUNT];
+    return levels;
+}
+
+static inline esp_err_t gpio_reset_pin(gpio_num_t pin)
+{
+    host_gpio_levels()[pin] = 0;
+    return ESP_OK;
+}
+
+static inline esp_err_t gpio_set_direction(gpio_num_t pin, gpio_mode_t mode)
+{
+    return ESP_OK;
+}
+
+static inline esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level)
+{
+    host_gpio_levels()[pin] = level;
+    return ESP_OK;
+}
@@ -0,0 +1,330 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file uart.h
+/// Host replacement for the ESP-IDF UART driver used by the host tools in
+/// this directory. Each UART is simulated with its TX looped back to its RX
+/// (and RTS to CTS). A wire thread moves bytes from the TX ring buffer to the
+/// RX ring buffer at the configured baud rate and frame format. With
+/// hardware flow control the wire stops while the RX side is full (RTS
+/// deasserted), without it bytes which do not fit are lost (overrun).
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <thread>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+typedef int uart_port_t;
+
+typedef enum
+{
+    UART_DATA_5_BITS = 0,
+    UART_DATA_6_BITS = 1,
+    UART_DATA_7_BITS = 2,
+    UART_DATA_8_BITS = 3,
+} uart_word_length_t;
+
+typedef enum
+{
+    UART_PARITY_DISABLE = 0,
+    UART_PARITY_EVEN = 2,
+    UART_PARITY_ODD = 3,
+} uart_parity_t;
+
+typedef enum
+{
+    UART_STOP_BITS_1 = 1,
+    UART_STOP_BITS_1_5 = 2,
+    UART_STOP_BITS_2 = 3,
+} uart_stop_bits_t;
+
+typedef enum
+{
+    UART_HW_FLOWCTRL_DISABLE = 0,
+    UART_HW_FLOWCTRL_RTS = 1,
+    UART_HW_FLOWCTRL_CTS = 2,
+    UART_HW_FLOWCTRL_CTS_RTS = 3,
+} uart_hw_flowcontrol_t;
+
+typedef enum
+{
+    UART_SCLK_APB = 0,
+} uart_sclk_t;
+
+typedef struct
+{
+    int baud_rate;
+    uart_word_length_t data_bits;
+    uart_parity_t parity;
+    uart_stop_bits_t stop_bits;
+    uart_hw_flowcontrol_t flow_ctrl;
+    uint8_t rx_flow_ctrl_thresh;
+    uart_sclk_t source_clk;
+} uart_config_t;
+
+typedef void *QueueHandle_t;
+
+#define UART_PIN_NO_CHANGE (-1)
+
+/// Number of simulated UARTs.
+static constexpr uart_port_t HOST_UART_COUNT = 3;
+
+/// Size of the simulated UART hardware RX FIFO.
+static constexpr size_t HOST_UART_HW_FIFO_SIZE = 128;
+
+/// State of a simulated UART.
+typedef struct
+{
+    /// Lock protecting all other fields.
+    std::mutex lock;
+
+    /// Signalled when data is added to or removed from the ring buffers.
+    std::condition_variable cv;
+
+    /// Current configuration.
+    uart_config_t config;
+
+    /// Data waiting to be sent.
+    std::deque<uint8_t> tx;
+
+    /// Data received and not yet read.
+    std::deque<uint8_t> rx;
+
+    /// Size of the TX ring buffer.
+    size_t tx_size;
+
+    /// Size of the RX ring buffer.
+    size_t rx_size;
+
+    /// Tracks if uart_driver_install has been called.
+    bool installed;
+
+    /// Number of bytes lost because the RX side was full.
+    uint64_t overruns;
+
+    /// Number of times the wire was stopped by flow control.
+    uint64_t flow_stalls;
+
+    /// Number of bytes moved over the wire.
+    uint64_t wire_bytes;
+} host_uart_t;
+
+/// @return the state of the simulated @param port.
+static inline host_uart_t &host_uart(uart_port_t port)
+{
+    static host_uart_t uarts[HOST_UART_COUNT];
+    return uarts[port];
+}
+
+/// @return the number of bits used on the wire for a single byte.
+static inline uint32_t host_uart_frame_bits(const uart_config_t &config)
+{
+    uint32_t bits = 1 + 5 + config.data_bits;
+    bits += (config.parity != UART_PARITY_DISABLE) ? 1 : 0;
+    bits += (config.stop_bits == UART_STOP_BITS_1) ? 1 : 2;
+    return bits;
+}
+
+/// Moves bytes from TX to RX of @param port at the configured baud rate.
+static inline void host_uart_wire(uart_port_t port)
+{
+    host_uart_t &uart = host_uart(port);
+    auto last = std::chrono::steady_clock::now();
+    double budget = 0;
+    bool stalled = false;
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(250));
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> guard(uart.lock);
+        double elapsed = std::chrono::duration<double>(now - last).count();
+        last = now;
+        budget += elapsed * uart.config.baud_rate /
+                  host_uart_frame_bits(uart.config);
+        if (uart.tx.empty())
+        {
+            // an idle line does not accumulate credit.
+            budget = 0;
+            continue;
+        }
+        bool flow_ctrl = (uart.config.flow_ctrl == UART_HW_FLOWCTRL_CTS_RTS);
+        // the RX interrupt stops emptying the hardware FIFO once the ring
+        // buffer is full, RTS is deasserted at the FIFO threshold.
+        size_t rx_limit = uart.rx_size + (flow_ctrl ?
+            uart.config.rx_flow_ctrl_thresh : HOST_UART_HW_FIFO_SIZE);
+        bool moved = false;
+        while (budget >= 1 && !uart.tx.empty())
+        {
+            if (uart.rx.size() >= rx_limit)
+            {
+                if (flow_ctrl)
+                {
+                    if (!stalled)
+                    {
+                        uart.flow_stalls++;
+                        stalled = true;
+                    }
+                    budget = 0;
+                    break;
+                }
+                uart.overruns++;
+            }
+            else
+            {
+                uart.rx.push_back(uart.tx.front());
+                stalled = false;
+            }
+            uart.tx.pop_front();
+            uart.wire_bytes++;
+            budget -= 1;
+            moved = true;
+        }
+        if (moved)
+        {
+            uart.cv.notify_all();
+        }
+    }
+}
+
+static inline esp_err_t uart_param_config(uart_port_t port,
+                                          const uart_config_t *config)
+{
+    std::lock_guard<std::mutex> guard(host_uart(port).lock);
+    host_uart(port).config = *config;
+    return ESP_OK;
+}
+
+static inline esp_err_t uart_set_pin(uart_port_t port, int tx, int rx,
+                                     int rts, int cts)
+{
+    return ESP_OK;
+}
+
+static inline esp_err_t uart_driver_install(uart_port_t port, int rx_size,
+                                            int tx_size, int queue_size,
+                                            QueueHandle_t *queue, int flags)
+{
+    host_uart_t &uart = host_uart(port);
+    {
+        std::lock_guard<std::mutex> guard(uart.lock);
+        if (uart.installed)
+        {
+            return ESP_FAIL;
+        }
+        uart.rx_size = rx_size;
+        uart.tx_size = tx_size;
+        uart.installed = true;
+    }
+    std::thread(host_uart_wire, port).detach();
+    return ESP_OK;
+}
+
+static inline int uart_write_bytes(uart_port_t port, const void *src,
+                                   size_t size)
+{
+    host_uart_t &uart = host_uart(port);
+    const uint8_t *data = static_cast<const uint8_t *>(src);
+    std::unique_lock<std::mutex> guard(uart.lock);
+    for (size_t offs = 0; offs < size; offs++)
+    {
+        uart.cv.wait(guard,
+                     [&uart]() { return uart.tx.size() < uart.tx_size; });
+        uart.tx.push_back(data[offs]);
+    }
+    return size;
+}
+
+static inline int uart_read_bytes(uart_port_t port, void *buf,
+                                  uint32_t length, TickType_t ticks)
+{
+    host_uart_t &uart = host_uart(port);
+    uint8_t *data = static_cast<uint8_t *>(buf);
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(ticks);
+    uint32_t received = 0;
+    std::unique_lock<std::mutex> guard(uart.lock);
+    while (true)
+    {
+        while (received < length && !uart.rx.empty())
+        {
+            data[received++] = uart.rx.front();
+            uart.rx.pop_front();
+        }
+        if (received == length || ticks == 0)
+        {
+            break;
+        }
+        if (ticks == portMAX_DELAY)
+        {
+            uart.cv.wait(guard);
+        }
+        else if (uart.cv.wait_until(guard, deadline) ==
+                 std::cv_status::timeout)
+        {
+            ticks = 0;
+        }
+    }
+    if (received)
+    {
+        uart.cv.notify_all();
+    }
+    return received;
+}
+
+static inline esp_err_t uart_get_buffered_data_len(uart_port_t port,
+                                                   size_t *size)
+{
+    std::lock_guard<std::mutex> guard(host_uart(port).lock);
+    *size = host_uart(port).rx.size();
+    return ESP_OK;
+}
+
+static inline esp_err_t uart_set_baudrate(uart_port_t port, uint32_t baud)
+{
+    std::lock_guard<std::mutex> guard(host_uart(port).lock);
+    host_uart(port).config.baud_rate = baud;
+    return ESP_OK;
+}
+
+static inline esp_err_t uart_set_word_length(uart_port_t port,
+                                             uart_word_length_t bits)
+{
+    std::lock_guard<std::mutex> guard(host_uart(port).lock);
+    host_uart(port).config.data_bits = bits;
+    return ESP_OK;
+}
+
+static inline esp_err_t uart_set_parity(uart_port_t port,
+                                        uart_parity_t parity)
+{
+    std::lock_guard<std::mutex> guard(host_uart(port).lock);
+    host_uart(port).config.parity = parity;
+    return ESP_OK;
+}
+
+static inline esp_err_t uart_set_stop_bits(uart_port_t port,
+                                           uart_stop_bits_t stop_bits)
+{
+    std::lock_guard<std::mutex> guard(host_uart(port).lock);
+    host_uart(port).config.stop_bits = stop_bits;
+    return ESP_OK;
+}
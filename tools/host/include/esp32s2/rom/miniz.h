@@ -0,0 +1,83 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file miniz.h
+/// Host replacement for the ROM tinfl decompressor used by the host tools in
+/// this directory, backed by zlib (link with -lz). Only zlib wrapped streams
+/// (TINFL_FLAG_PARSE_ZLIB_HEADER) are supported. tinfl_init always starts a
+/// new zlib stream, the previous stream is not released since the
+/// decompressor storage is not initialized when it is first passed in.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+#define TINFL_LZ_DICT_SIZE 32768
+#define TINFL_FLAG_PARSE_ZLIB_HEADER 1
+#define TINFL_FLAG_HAS_MORE_INPUT 2
+
+typedef enum
+{
+    TINFL_STATUS_BAD_PARAM = -3,
+    TINFL_STATUS_ADLER32_MISMATCH = -2,
+    TINFL_STATUS_FAILED = -1,
+    TINFL_STATUS_DONE = 0,
+    TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+    TINFL_STATUS_HAS_MORE_OUTPUT = 2,
+} tinfl_status;
+
+typedef struct
+{
+    z_stream stream;
+} tinfl_decompressor;
+
+static inline void tinfl_init(tinfl_decompressor *r)
+{
+    memset(&r->stream, 0, sizeof(r->stream));
+    inflateInit(&r->stream);
+}
+
+static inline tinfl_status tinfl_decompress(tinfl_decompressor *r,
+                                            const uint8_t *in_buf,
+                                            size_t *in_size,
+                                            uint8_t *out_buf_start,
+                                            uint8_t *out_buf_next,
+                                            size_t *out_size, uint32_t flags)
+{
+    if (!(flags & TINFL_FLAG_PARSE_ZLIB_HEADER))
+    {
+        return TINFL_STATUS_BAD_PARAM;
+    }
+    r->stream.next_in = (Bytef *)in_buf;
+    r->stream.avail_in = *in_size;
+    r->stream.next_out = out_buf_next;
+    r->stream.avail_out = *out_size;
+    int ret = inflate(&r->stream, Z_NO_FLUSH);
+    *in_size -= r->stream.avail_in;
+    *out_size -= r->stream.avail_out;
+    if (ret == Z_STREAM_END)
+    {
+        return TINFL_STATUS_DONE;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR)
+    {
+        return TINFL_STATUS_FAILED;
+    }
+    return r->stream.avail_out ? TINFL_STATUS_NEEDS_MORE_INPUT :
+                                 TINFL_STATUS_HAS_MORE_OUTPUT;
+}
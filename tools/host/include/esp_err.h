@@ -0,0 +1,61 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file esp_err.h
+/// Host replacement for the ESP-IDF error codes used by the host tools in
+/// this directory.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_NOT_FOUND 0x105
+#define ESP_ERR_TIMEOUT 0x107
+
+#define ESP_ERROR_CHECK(x)                                             \
+    do                                                                 \
+    {                                                                  \
+        esp_err_t err_rc_ = (x);                                       \
+        if (err_rc_ != ESP_OK)                                         \
+        {                                                              \
+            fprintf(stderr, "%s:%d: %s failed (%d)\n", __FILE__,       \
+                    __LINE__, #x, err_rc_);                            \
+            abort();                                                   \
+        }                                                              \
+    } while (0)
+
+#define ESP_ERROR_CHECK_WITHOUT_ABORT(x)                               \
+    ({                                                                 \
+        esp_err_t err_rc_ = (x);                                       \
+        if (err_rc_ != ESP_OK)                                         \
+        {                                                              \
+            fprintf(stderr, "%s:%d: %s failed (%d)\n", __FILE__,       \
+                    __LINE__, #x, err_rc_);                            \
+        }                                                              \
+        err_rc_;                                                       \
+    })
+
+static inline const char *esp_err_to_name(esp_err_t err)
+{
+    return err == ESP_OK ? "ESP_OK" : "ERROR";
+}
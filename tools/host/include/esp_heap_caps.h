@@ -0,0 +1,95 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file esp_heap_caps.h
+/// Host replacement for the ESP-IDF heap capabilities allocator used by the
+/// host tools in this directory. Every call is counted in
+/// @ref host_heap_calls. MALLOC_CAP_DMA is served from a static arena so
+/// the memory is DMA capable as described in soc/soc_memory_layout.h, freed
+/// arena memory is not reused. All other capabilities are served by malloc.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define MALLOC_CAP_EXEC     (1 << 0)
+#define MALLOC_CAP_32BIT    (1 << 1)
+#define MALLOC_CAP_8BIT     (1 << 2)
+#define MALLOC_CAP_DMA      (1 << 3)
+#define MALLOC_CAP_SPIRAM   (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+#define MALLOC_CAP_DEFAULT  (1 << 12)
+
+/// Number of heap allocations made through this allocator.
+inline size_t host_heap_calls = 0;
+
+/// Size of the arena serving MALLOC_CAP_DMA allocations.
+static constexpr size_t HOST_DMA_ARENA_SIZE = 64 * 1024;
+
+/// Arena serving MALLOC_CAP_DMA allocations.
+alignas(8) inline uint8_t host_dma_arena[HOST_DMA_ARENA_SIZE];
+
+/// Number of bytes of @ref host_dma_arena in use.
+inline size_t host_dma_arena_used = 0;
+
+/// Allocates memory from @ref host_dma_arena.
+///
+/// @param alignment is the required alignment, a power of two.
+/// @param size is the number of bytes to allocate.
+///
+/// @return the allocated memory or nullptr if the arena is exhausted.
+static inline void *host_dma_alloc(size_t alignment, size_t size)
+{
+    size_t offset = (host_dma_arena_used + alignment - 1) & ~(alignment - 1);
+    if (offset + size > HOST_DMA_ARENA_SIZE)
+    {
+        return nullptr;
+    }
+    host_dma_arena_used = offset + size;
+    return host_dma_arena + offset;
+}
+
+static inline void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+    host_heap_calls++;
+    if (caps & MALLOC_CAP_DMA)
+    {
+        return host_dma_alloc(8, size);
+    }
+    return malloc(size);
+}
+
+static inline void *heap_caps_aligned_alloc(size_t alignment, size_t size,
+                                            uint32_t caps)
+{
+    void *p = nullptr;
+    host_heap_calls++;
+    if (caps & MALLOC_CAP_DMA)
+    {
+        return host_dma_alloc(alignment, size);
+    }
+    return posix_memalign(&p, alignment, size) ? nullptr : p;
+}
+
+static inline void heap_caps_free(void *p)
+{
+    uint8_t *mem = (uint8_t *)p;
+    if (mem < host_dma_arena || mem >= host_dma_arena + HOST_DMA_ARENA_SIZE)
+    {
+        free(p);
+    }
+}
@@ -0,0 +1,60 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file esp_intr_alloc.h
+/// Host replacement for the ESP-IDF interrupt allocator used by the host
+/// tools in this directory. Only one interrupt can be allocated, a
+/// simulation raises it by calling @ref host_intr_handler.
+
+#pragma once
+
+#include <stddef.h>
+#include "esp_err.h"
+
+#define ETS_USB_INTR_SOURCE 48
+#define ESP_INTR_FLAG_LOWMED ((1 << 1) | (1 << 2) | (1 << 3))
+
+typedef void (*intr_handler_t)(void *arg);
+typedef struct host_intr *intr_handle_t;
+
+/// Handler of the allocated interrupt, nullptr if none is allocated.
+inline intr_handler_t host_intr_handler = nullptr;
+
+/// Argument passed to @ref host_intr_handler.
+inline void *host_intr_arg = nullptr;
+
+static inline esp_err_t esp_intr_alloc(int source, int flags,
+                                       intr_handler_t handler, void *arg,
+                                       intr_handle_t *ret_handle)
+{
+    if (host_intr_handler != nullptr)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    host_intr_handler = handler;
+    host_intr_arg = arg;
+    if (ret_handle)
+    {
+        *ret_handle = (intr_handle_t)&host_intr_handler;
+    }
+    return ESP_OK;
+}
+
+static inline esp_err_t esp_intr_free(intr_handle_t handle)
+{
+    host_intr_handler = nullptr;
+    host_intr_arg = nullptr;
+    return ESP_OK;
+}
@@ -0,0 +1,130 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file esp_ota_ops.h
+/// Host replacement for the ESP-IDF OTA API used by the host tools in this
+/// directory. Images are written to the partitions of esp_partition.h, only
+/// one update can be in progress at a time.
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+
+typedef uint32_t esp_ota_handle_t;
+
+typedef struct
+{
+    uint32_t magic_word;
+    uint32_t secure_version;
+    uint32_t reserv1[2];
+    char version[32];
+    char project_name[32];
+    char time[16];
+    char date[16];
+    char idf_ver[32];
+    uint8_t app_elf_sha256[32];
+    uint32_t reserv2[20];
+} esp_app_desc_t;
+
+/// State of the simulated OTA update.
+typedef struct
+{
+    /// Partition being written, nullptr when no update is in progress.
+    const esp_partition_t *target;
+
+    /// Number of bytes written to @ref target.
+    size_t written;
+
+    /// Partition selected by esp_ota_set_boot_partition.
+    const esp_partition_t *boot;
+
+    /// Handle of the update in progress.
+    esp_ota_handle_t handle;
+} host_ota_t;
+
+/// @return the simulated OTA update state.
+static inline host_ota_t &host_ota()
+{
+    static host_ota_t ota = {nullptr, 0, nullptr, 0};
+    return ota;
+}
+
+static inline const esp_partition_t *esp_ota_get_running_partition()
+{
+    return &host_partitions[0];
+}
+
+static inline const esp_partition_t *esp_ota_get_next_update_partition(
+    const esp_partition_t *start)
+{
+    return host_ota().boot == &host_partitions[1] ? &host_partitions[2] :
+                                                    &host_partitions[1];
+}
+
+static inline esp_err_t esp_ota_begin(const esp_partition_t *partition,
+                                      size_t image_size,
+                                      esp_ota_handle_t *handle)
+{
+    host_ota_t &ota = host_ota();
+    if (ota.target != nullptr || image_size > partition->size)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    std::vector<uint8_t> &data = host_partition_data(partition);
+    std::fill(data.begin(), data.end(), 0xFF);
+    ota.target = partition;
+    ota.written = 0;
+    *handle = ++ota.handle;
+    return ESP_OK;
+}
+
+static inline esp_err_t esp_ota_write(esp_ota_handle_t handle,
+                                      const void *data, size_t size)
+{
+    host_ota_t &ota = host_ota();
+    if (ota.target == nullptr || handle != ota.handle ||
+        size > ota.target->size - ota.written)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(host_partition_data(ota.target).data() + ota.written, data, size);
+    ota.written += size;
+    return ESP_OK;
+}
+
+static inline esp_err_t esp_ota_end(esp_ota_handle_t handle)
+{
+    host_ota_t &ota = host_ota();
+    if (ota.target == nullptr || handle != ota.handle)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    ota.target = nullptr;
+    return ESP_OK;
+}
+
+static inline esp_err_t esp_ota_abort(esp_ota_handle_t handle)
+{
+    return esp_ota_end(handle);
+}
+
+static inline esp_err_t esp_ota_set_boot_partition(
+    const esp_partition_t *partition)
+{
+    host_ota().boot = partition;
+    return ESP_OK;
+}
@@ -0,0 +1,147 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file esp_partition.h
+/// Host replacement for the ESP-IDF partition API used by the host tools in
+/// this directory. The partition table is a fixed factory, ota_0 and ota_1
+/// layout and each partition is backed by a vector which starts erased. The
+/// running application is in the factory partition.
+
+#pragma once
+
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "esp_err.h"
+
+typedef enum
+{
+    ESP_PARTITION_TYPE_APP = 0x00,
+    ESP_PARTITION_TYPE_DATA = 0x01,
+} esp_partition_type_t;
+
+typedef enum
+{
+    ESP_PARTITION_SUBTYPE_APP_FACTORY = 0x00,
+    ESP_PARTITION_SUBTYPE_APP_OTA_0 = 0x10,
+    ESP_PARTITION_SUBTYPE_APP_OTA_1 = 0x11,
+    ESP_PARTITION_SUBTYPE_ANY = 0xFF,
+} esp_partition_subtype_t;
+
+typedef struct
+{
+    esp_partition_type_t type;
+    esp_partition_subtype_t subtype;
+    uint32_t address;
+    uint32_t size;
+    char label[17];
+    bool encrypted;
+} esp_partition_t;
+
+/// Number of partitions in the simulated partition table.
+static constexpr size_t HOST_PARTITION_COUNT = 3;
+
+/// Simulated partition table.
+inline const esp_partition_t host_partitions[HOST_PARTITION_COUNT] =
+{
+    {ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_FACTORY, 0x10000,
+     0x100000, "factory", false},
+    {ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, 0x110000,
+     0x100000, "ota_0", false},
+    {ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, 0x210000,
+     0x100000, "ota_1", false},
+};
+
+/// @return the contents of @param partition.
+static inline std::vector<uint8_t> &host_partition_data(
+    const esp_partition_t *partition)
+{
+    static std::vector<uint8_t> data[HOST_PARTITION_COUNT];
+    std::vector<uint8_t> &contents = data[partition - host_partitions];
+    if (contents.empty())
+    {
+        contents.assign(partition->size, 0xFF);
+    }
+    return contents;
+}
+
+/// Position of an iterator in @ref host_partitions.
+typedef struct host_partition_iterator
+{
+    size_t index;
+    esp_partition_type_t type;
+    esp_partition_subtype_t subtype;
+} *esp_partition_iterator_t;
+
+/// Moves @param it to the next matching partition.
+///
+/// @return @param it or nullptr (after releasing it) when there are no more
+/// matching partitions.
+static inline esp_partition_iterator_t host_partition_seek(
+    esp_partition_iterator_t it)
+{
+    while (it->index < HOST_PARTITION_COUNT)
+    {
+        const esp_partition_t &part = host_partitions[it->index];
+        if (part.type == it->type &&
+            (it->subtype == ESP_PARTITION_SUBTYPE_ANY ||
+             part.subtype == it->subtype))
+        {
+            return it;
+        }
+        it->index++;
+    }
+    delete it;
+    return nullptr;
+}
+
+static inline esp_partition_iterator_t esp_partition_find(
+    esp_partition_type_t type, esp_partition_subtype_t subtype,
+    const char *label)
+{
+    return host_partition_seek(
+        new host_partition_iterator{0, type, subtype});
+}
+
+static inline const esp_partition_t *esp_partition_get(
+    esp_partition_iterator_t it)
+{
+    return &host_partitions[it->index];
+}
+
+static inline esp_partition_iterator_t esp_partition_next(
+    esp_partition_iterator_t it)
+{
+    it->index++;
+    return host_partition_seek(it);
+}
+
+static inline void esp_partition_iterator_release(esp_partition_iterator_t it)
+{
+    delete it;
+}
+
+static inline esp_err_t esp_partition_read(const esp_partition_t *partition,
+                                           size_t offset, void *dst,
+                                           size_t size)
+{
+    if (offset > partition->size || size > partition->size - offset)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(dst, host_partition_data(partition).data() + offset, size);
+    return ESP_OK;
+}
@@ -0,0 +1,145 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file esp_rom_md5.h
+/// Host replacement for the ROM MD5 functions used by the host tools in this
+/// directory (RFC 1321).
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define ESP_ROM_MD5_DIGEST_LEN 16
+
+typedef struct
+{
+    uint32_t state[4];
+    uint64_t length;
+    uint8_t block[64];
+} md5_context_t;
+
+/// Processes one 64 byte block.
+static inline void host_md5_block(uint32_t state[4], const uint8_t *block)
+{
+    static constexpr uint32_t K[64] =
+    {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf,
+        0x4787c62a, 0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af,
+        0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e,
+        0x49b40821, 0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+        0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8, 0x21e1cde6,
+        0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+        0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122,
+        0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039,
+        0xe6db99e5, 0x1fa27cf8, 0xc4ac5665, 0xf4292244, 0x432aff97,
+        0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d,
+        0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+        0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+    };
+    static constexpr uint8_t SHIFT[16] =
+    {
+        7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21,
+    };
+    uint32_t words[16];
+    for (size_t index = 0; index < 16; index++)
+    {
+        words[index] = (uint32_t)block[index * 4] |
+                       ((uint32_t)block[index * 4 + 1] << 8) |
+                       ((uint32_t)block[index * 4 + 2] << 16) |
+                       ((uint32_t)block[index * 4 + 3] << 24);
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    for (size_t round = 0; round < 64; round++)
+    {
+        uint32_t f, g;
+        if (round < 16)
+        {
+            f = (b & c) | (~b & d);
+            g = round;
+        }
+        else if (round < 32)
+        {
+            f = (d & b) | (~d & c);
+            g = (5 * round + 1) & 15;
+        }
+        else if (round < 48)
+        {
+            f = b ^ c ^ d;
+            g = (3 * round + 5) & 15;
+        }
+        else
+        {
+            f = c ^ (b | ~d);
+            g = (7 * round) & 15;
+        }
+        uint32_t shift = SHIFT[(round / 16) * 4 + (round & 3)];
+        uint32_t sum = a + f + K[round] + words[g];
+        a = d;
+        d = c;
+        c = b;
+        b += (sum << shift) | (sum >> (32 - shift));
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+static inline void esp_rom_md5_init(md5_context_t *ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->length = 0;
+}
+
+static inline void esp_rom_md5_update(md5_context_t *ctx, const void *data,
+                                      uint32_t size)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    while (size)
+    {
+        size_t used = ctx->length & 63;
+        size_t chunk = 64 - used < size ? 64 - used : size;
+        memcpy(ctx->block + used, bytes, chunk);
+        ctx->length += chunk;
+        bytes += chunk;
+        size -= chunk;
+        if ((ctx->length & 63) == 0)
+        {
+            host_md5_block(ctx->state, ctx->block);
+        }
+    }
+}
+
+static inline void esp_rom_md5_final(uint8_t *digest, md5_context_t *ctx)
+{
+    uint64_t bits = ctx->length * 8;
+    uint8_t pad[72] = {0x80};
+    size_t pad_len = ((ctx->length & 63) < 56 ? 56 : 120) - (ctx->length & 63);
+    for (size_t index = 0; index < 8; index++)
+    {
+        pad[pad_len + index] = bits >> (index * 8);
+    }
+    esp_rom_md5_update(ctx, pad, pad_len + 8);
+    for (size_t index = 0; index < ESP_ROM_MD5_DIGEST_LEN; index++)
+    {
+        digest[index] = ctx->state[index / 4] >> ((index & 3) * 8);
+    }
+}
@@ -0,0 +1,31 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file esp_rom_sys.h
+/// Host replacement for the ROM delay used by the host tools in this
+/// directory. Delays are only accounted in @ref host_rom_delay_us, they do
+/// not wait.
+
+#pragma once
+
+#include <stdint.h>
+
+/// Total number of microseconds passed to esp_rom_delay_us.
+inline uint64_t host_rom_delay_us = 0;
+
+static inline void esp_rom_delay_us(uint32_t us)
+{
+    host_rom_delay_us += us;
+}
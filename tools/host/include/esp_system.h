@@ -0,0 +1,30 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file esp_system.h
+/// Host replacement for esp_restart used by the host tools in this
+/// directory, a restart is only recorded.
+
+#pragma once
+
+#include <atomic>
+
+/// Number of times esp_restart has been called.
+inline std::atomic<unsigned> host_restart_count{0};
+
+static inline void esp_restart()
+{
+    host_restart_count++;
+}
@@ -0,0 +1,124 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file task.h
+/// Host replacement for the FreeRTOS task API used by the host tools in this
+/// directory. Every task is a detached std::thread, task notifications are
+/// implemented with a counter and condition variable. Priorities and core
+/// affinity are ignored.
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "FreeRTOS.h"
+
+typedef uint8_t StackType_t;
+typedef void (*TaskFunction_t)(void *);
+
+/// State of a host task.
+typedef struct host_task
+{
+    /// Lock protecting @ref notify.
+    std::mutex lock;
+
+    /// Signalled when @ref notify is incremented.
+    std::condition_variable cv;
+
+    /// Notification value.
+    uint32_t notify{0};
+} *TaskHandle_t;
+
+/// Storage for a statically allocated task, not used on the host.
+typedef struct
+{
+    int unused;
+} StaticTask_t;
+
+/// @return the task state slot of the calling thread.
+static inline TaskHandle_t &host_task_slot()
+{
+    static thread_local TaskHandle_t task = nullptr;
+    return task;
+}
+
+/// @return the task state of the calling thread, threads which were not
+/// created via xTaskCreateStaticPinnedToCore get one on first use.
+static inline TaskHandle_t host_current_task()
+{
+    TaskHandle_t &task = host_task_slot();
+    if (task == nullptr)
+    {
+        task = new host_task;
+    }
+    return task;
+}
+
+static inline TaskHandle_t xTaskCreateStaticPinnedToCore(
+    TaskFunction_t fn, const char *name, uint32_t stack_size, void *param,
+    UBaseType_t priority, StackType_t *stack, StaticTask_t *storage,
+    BaseType_t core)
+{
+    TaskHandle_t task = new host_task;
+    std::thread([task, fn, param]()
+    {
+        host_task_slot() = task;
+        fn(param);
+    }).detach();
+    return task;
+}
+
+static inline TickType_t xTaskGetTickCount()
+{
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+static inline void vTaskDelay(TickType_t ticks)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+static inline void xTaskNotifyGive(TaskHandle_t task)
+{
+    std::lock_guard<std::mutex> guard(task->lock);
+    task->notify++;
+    task->cv.notify_all();
+}
+
+static inline uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    TaskHandle_t task = host_current_task();
+    std::unique_lock<std::mutex> guard(task->lock);
+    auto ready = [task]() { return task->notify != 0; };
+    if (ticks == portMAX_DELAY)
+    {
+        task->cv.wait(guard, ready);
+    }
+    else
+    {
+        task->cv.wait_for(guard, std::chrono::milliseconds(ticks), ready);
+    }
+    uint32_t value = task->notify;
+    if (value)
+    {
+        task->notify = clear ? 0 : value - 1;
+    }
+    return value;
+}
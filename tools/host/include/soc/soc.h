@@ -0,0 +1,61 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file soc.h
+/// Host replacement for the register access macros used by the host tools in
+/// this directory. Registers are read through @ref host_reg_read which
+/// returns the values set via @ref host_reg_write, all other registers read
+/// as zero.
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <stdint.h>
+
+/// State of the simulated registers.
+typedef struct
+{
+    /// Lock protecting @ref values.
+    std::mutex lock;
+
+    /// Register values indexed by address.
+    std::map<uint32_t, uint32_t> values;
+} host_regs_t;
+
+/// @return the simulated registers.
+static inline host_regs_t &host_regs()
+{
+    static host_regs_t regs;
+    return regs;
+}
+
+/// @return the value of the register at @param addr.
+static inline uint32_t host_reg_read(uint32_t addr)
+{
+    std::lock_guard<std::mutex> guard(host_regs().lock);
+    auto it = host_regs().values.find(addr);
+    return it == host_regs().values.end() ? 0 : it->second;
+}
+
+/// Sets the value of the register at @param addr.
+static inline void host_reg_write(uint32_t addr, uint32_t value)
+{
+    std::lock_guard<std::mutex> guard(host_regs().lock);
+    host_regs().values[addr] = value;
+}
+
+#define REG_READ(addr) host_reg_read(addr)
+#define REG_WRITE(addr, value) host_reg_write(addr, value)
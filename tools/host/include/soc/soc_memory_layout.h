@@ -0,0 +1,56 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file soc_memory_layout.h
+/// Host replacement for the memory layout checks used by the host tools in
+/// this directory. The static data of the program (which includes the DMA
+/// arena of esp_heap_caps.h) stands in for the internal RAM of the chip, it
+/// is DMA capable and the DMA addresses it with 32 bits. Heap and stack
+/// memory is not DMA capable, like PSRAM on the chip.
+
+#pragma once
+
+#include <stdint.h>
+
+extern "C" char __data_start[];
+extern "C" char _end[];
+
+static inline bool esp_ptr_dma_capable(const void *p)
+{
+    return (const char *)p >= __data_start && (const char *)p < _end;
+}
+
+/// Converts a 32-bit DMA address back to a pointer.
+///
+/// @param addr is the address as programmed into the DMA.
+///
+/// @return the memory referred to by @param addr or nullptr if it is not
+/// DMA capable memory.
+static inline uint8_t *host_dma_ptr(uint32_t addr)
+{
+    uintptr_t base = (uintptr_t)__data_start;
+    uintptr_t p = addr;
+    if (sizeof(uintptr_t) > sizeof(uint32_t))
+    {
+        // the static data is far smaller than 4GiB, it shares the upper half
+        // of its addresses with the start of the data or the next 4GiB.
+        p |= base & ~(uintptr_t)UINT32_MAX;
+        if (p < base)
+        {
+            p += (uintptr_t)UINT32_MAX + 1;
+        }
+    }
+    return esp_ptr_dma_capable((const void *)p) ? (uint8_t *)p : nullptr;
+}
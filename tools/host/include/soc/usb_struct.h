@@ -0,0 +1,139 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file usb_struct.h
+/// Host replacement for the USB peripheral register block (USB0) used by the
+/// host tools in this directory. Only the registers used by the device driver
+/// are provided. Each register keeps its value and calls
+/// @ref host_usb_reg_written after every write so a simulation can model the
+/// side effects of the write, the interrupt registers are write one to
+/// clear.
+
+#pragma once
+
+#include <stdint.h>
+
+/// Called after a register of @ref USB0 has been written.
+///
+/// @param reg is the register written.
+/// @param old is the value of the register before the write.
+/// @param value is the value written.
+inline void (*host_usb_reg_written)(const void *reg, uint32_t old,
+                                    uint32_t value) = nullptr;
+
+/// Register of the USB peripheral.
+///
+/// @param W1C is true if the register bits are cleared by writing a one.
+template <bool W1C>
+class HostUsbReg
+{
+public:
+    HostUsbReg &operator=(const HostUsbReg &) = delete;
+
+    HostUsbReg &operator=(uint32_t value)
+    {
+        write(value);
+        return *this;
+    }
+
+    HostUsbReg &operator|=(uint32_t value)
+    {
+        write(value_ | value);
+        return *this;
+    }
+
+    HostUsbReg &operator&=(uint32_t value)
+    {
+        write(value_ & value);
+        return *this;
+    }
+
+    operator uint32_t() const
+    {
+        return value_;
+    }
+
+    /// @return the register value, the simulation uses this to change the
+    /// register without triggering @ref host_usb_reg_written.
+    uint32_t &raw()
+    {
+        return value_;
+    }
+
+private:
+    /// Current value of the register.
+    uint32_t value_{0};
+
+    /// Writes the register and reports the write.
+    ///
+    /// @param value is the value written.
+    void write(uint32_t value)
+    {
+        uint32_t old = value_;
+        value_ = W1C ? (value_ & ~value) : value;
+        if (host_usb_reg_written)
+        {
+            host_usb_reg_written(this, old, value);
+        }
+    }
+};
+
+/// IN endpoint registers.
+typedef struct
+{
+    HostUsbReg<false> diepctl;
+    HostUsbReg<true> diepint;
+    HostUsbReg<false> dieptsiz;
+    HostUsbReg<false> diepdma;
+    HostUsbReg<false> dtxfsts;
+    HostUsbReg<false> diepdmab;
+} usb_in_endpoint_t;
+
+/// OUT endpoint registers.
+typedef struct
+{
+    HostUsbReg<false> doepctl;
+    HostUsbReg<true> doepint;
+    HostUsbReg<false> doeptsiz;
+    HostUsbReg<false> doepdma;
+    HostUsbReg<false> doepdmab;
+} usb_out_endpoint_t;
+
+/// USB peripheral registers.
+typedef struct
+{
+    HostUsbReg<false> gotgctl;
+    HostUsbReg<true> gotgint;
+    HostUsbReg<false> gahbcfg;
+    HostUsbReg<false> gusbcfg;
+    HostUsbReg<false> grstctl;
+    HostUsbReg<true> gintsts;
+    HostUsbReg<false> gintmsk;
+    HostUsbReg<false> grxfsiz;
+    HostUsbReg<false> gnptxfsiz;
+    HostUsbReg<false> dieptxf[4];
+    HostUsbReg<false> dcfg;
+    HostUsbReg<false> dctl;
+    HostUsbReg<false> dsts;
+    HostUsbReg<false> diepmsk;
+    HostUsbReg<false> doepmsk;
+    HostUsbReg<false> daint;
+    HostUsbReg<false> daintmsk;
+    usb_in_endpoint_t in_ep_reg[7];
+    usb_out_endpoint_t out_ep_reg[7];
+} usb_dev_t;
+
+/// The USB peripheral.
+inline usb_dev_t USB0;
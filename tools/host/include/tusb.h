@@ -0,0 +1,316 @@
+/// \copyright
+/// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+///     http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+///
+/// \file tusb.h
+/// Host replacement for the parts of TinyUSB used by the host tools in this
+/// directory. The CDC class API is backed by simulated FIFOs and a bus thread
+/// acting as the USB host which runs one full-speed frame per millisecond.
+/// As with TinyUSB an OUT packet is only accepted (otherwise NAKed) while the
+/// RX FIFO has room for a complete endpoint buffer, an IN transfer is started
+/// when a packet worth of data is queued or the FIFO is flushed.
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+#include "tusb_config.h"
+
+#define TU_ATTR_PACKED __attribute__((packed))
+#define TU_ATTR_WEAK __attribute__((weak))
+#define TU_ATTR_ALIGNED(x) __attribute__((aligned(x)))
+
+typedef struct TU_ATTR_PACKED
+{
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t bcdUSB;
+    uint8_t bDeviceClass;
+    uint8_t bDeviceSubClass;
+    uint8_t bDeviceProtocol;
+    uint8_t bMaxPacketSize0;
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    uint8_t iManufacturer;
+    uint8_t iProduct;
+    uint8_t iSerialNumber;
+    uint8_t bNumConfigurations;
+} tusb_desc_device_t;
+
+typedef struct TU_ATTR_PACKED
+{
+    uint32_t bit_rate;
+    uint8_t stop_bits;
+    uint8_t parity;
+    uint8_t data_bits;
+} cdc_line_coding_t;
+
+extern "C"
+{
+void tud_cdc_rx_cb(uint8_t itf);
+void tud_cdc_tx_complete_cb(uint8_t itf);
+void tud_cdc_line_coding_cb(uint8_t itf, cdc_line_coding_t const *coding);
+}
+
+/// Size of a full-speed bulk packet.
+static constexpr size_t HOST_CDC_PACKET_SIZE = 64;
+
+/// Maximum number of bulk packets in a full-speed frame.
+static constexpr size_t HOST_CDC_PACKETS_PER_FRAME = 19;
+
+/// State of the simulated CDC interface.
+typedef struct
+{
+    /// Lock protecting all other fields.
+    std::mutex lock;
+
+    /// Device TX FIFO.
+    std::deque<uint8_t> tx_fifo;
+
+    /// Device RX FIFO.
+    std::deque<uint8_t> rx_fifo;
+
+    /// Data of the IN transfer in flight.
+    std::vector<uint8_t> in_xfer;
+
+    /// Tracks if an IN transfer is in flight.
+    bool in_busy;
+
+    /// Data the host has not yet sent.
+    std::deque<uint8_t> host_out;
+
+    /// Data the host has received.
+    std::vector<uint8_t> host_in;
+
+    /// Tracks if the host has configured the device.
+    bool mounted;
+
+    /// DTR state set by the host.
+    bool dtr;
+
+    /// Tracks if the host has stopped reading the IN endpoint.
+    bool in_paused;
+
+    /// Number of IN tokens NAKed by the host not reading.
+    uint64_t in_naks;
+
+    /// Number of OUT packets NAKed due to the RX FIFO being full.
+    uint64_t out_naks;
+} host_cdc_t;
+
+/// @return the simulated CDC interface.
+static inline host_cdc_t &host_cdc()
+{
+    static host_cdc_t cdc;
+    return cdc;
+}
+
+static inline bool tud_mounted()
+{
+    std::lock_guard<std::mutex> guard(host_cdc().lock);
+    return host_cdc().mounted;
+}
+
+static inline bool tud_ready()
+{
+    return tud_mounted();
+}
+
+static inline bool tud_cdc_connected()
+{
+    std::lock_guard<std::mutex> guard(host_cdc().lock);
+    return host_cdc().dtr;
+}
+
+static inline uint32_t tud_cdc_available()
+{
+    std::lock_guard<std::mutex> guard(host_cdc().lock);
+    return host_cdc().rx_fifo.size();
+}
+
+static inline uint32_t tud_cdc_read(void *buf, uint32_t size)
+{
+    host_cdc_t &cdc = host_cdc();
+    std::lock_guard<std::mutex> guard(cdc.lock);
+    uint32_t len = std::min<size_t>(size, cdc.rx_fifo.size());
+    std::copy_n(cdc.rx_fifo.begin(), len, static_cast<uint8_t *>(buf));
+    cdc.rx_fifo.erase(cdc.rx_fifo.begin(), cdc.rx_fifo.begin() + len);
+    return len;
+}
+
+static inline uint32_t tud_cdc_write_available()
+{
+    std::lock_guard<std::mutex> guard(host_cdc().lock);
+    return CFG_TUD_CDC_TX_BUFSIZE - host_cdc().tx_fifo.size();
+}
+
+static inline uint32_t tud_cdc_write_flush()
+{
+    host_cdc_t &cdc = host_cdc();
+    std::lock_guard<std::mutex> guard(cdc.lock);
+    if (cdc.in_busy || cdc.tx_fifo.empty())
+    {
+        return 0;
+    }
+    size_t len = std::min<size_t>(cdc.tx_fifo.size(), CFG_TUD_CDC_EP_BUFSIZE);
+    cdc.in_xfer.assign(cdc.tx_fifo.begin(), cdc.tx_fifo.begin() + len);
+    cdc.tx_fifo.erase(cdc.tx_fifo.begin(), cdc.tx_fifo.begin() + len);
+    cdc.in_busy = true;
+    return len;
+}
+
+static inline uint32_t tud_cdc_write(const void *buf, uint32_t size)
+{
+    host_cdc_t &cdc = host_cdc();
+    uint32_t len;
+    bool flush;
+    {
+        std::lock_guard<std::mutex> guard(cdc.lock);
+        len = std::min<size_t>(size,
+                               CFG_TUD_CDC_TX_BUFSIZE - cdc.tx_fifo.size());
+        const uint8_t *data = static_cast<const uint8_t *>(buf);
+        cdc.tx_fifo.insert(cdc.tx_fifo.end(), data, data + len);
+        flush = cdc.tx_fifo.size() >= HOST_CDC_PACKET_SIZE;
+    }
+    if (flush)
+    {
+        tud_cdc_write_flush();
+    }
+    return len;
+}
+
+/// Runs one frame of IN/OUT transactions on the simulated bus.
+static inline void host_cdc_frame()
+{
+    host_cdc_t &cdc = host_cdc();
+    size_t packets = 0;
+    while (packets < HOST_CDC_PACKETS_PER_FRAME)
+    {
+        bool completed = false;
+        bool received = false;
+        {
+            std::lock_guard<std::mutex> guard(cdc.lock);
+            if (cdc.in_busy && cdc.in_paused)
+            {
+                cdc.in_naks++;
+            }
+            else if (cdc.in_busy)
+            {
+                cdc.host_in.insert(cdc.host_in.end(), cdc.in_xfer.begin(),
+                                   cdc.in_xfer.end());
+                packets += std::max<size_t>(1,
+                    (cdc.in_xfer.size() + HOST_CDC_PACKET_SIZE - 1) /
+                    HOST_CDC_PACKET_SIZE);
+                cdc.in_xfer.clear();
+                cdc.in_busy = false;
+                completed = true;
+            }
+            if (!cdc.host_out.empty())
+            {
+                if (CFG_TUD_CDC_RX_BUFSIZE - cdc.rx_fifo.size() >=
+                    CFG_TUD_CDC_EP_BUFSIZE)
+                {
+                    size_t len = std::min(cdc.host_out.size(),
+                                          HOST_CDC_PACKET_SIZE);
+                    cdc.rx_fifo.insert(cdc.rx_fifo.end(),
+                                       cdc.host_out.begin(),
+                                       cdc.host_out.begin() + len);
+                    cdc.host_out.erase(cdc.host_out.begin(),
+                                       cdc.host_out.begin() + len);
+                    packets++;
+                    received = true;
+                }
+                else
+                {
+                    cdc.out_naks++;
+                }
+            }
+        }
+        if (completed)
+        {
+            // TinyUSB starts the next transfer after the callback returns.
+            tud_cdc_tx_complete_cb(0);
+            tud_cdc_write_flush();
+        }
+        if (received)
+        {
+            tud_cdc_rx_cb(0);
+        }
+        if (!completed && !received)
+        {
+            break;
+        }
+    }
+}
+
+/// Starts the thread which acts as the USB host.
+static inline void host_cdc_start()
+{
+    {
+        std::lock_guard<std::mutex> guard(host_cdc().lock);
+        host_cdc().mounted = true;
+    }
+    std::thread([]()
+    {
+        while (true)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            host_cdc_frame();
+        }
+    }).detach();
+}
+
+/// Sets the DTR state seen by the device.
+static inline void host_cdc_set_dtr(bool dtr)
+{
+    std::lock_guard<std::mutex> guard(host_cdc().lock);
+    host_cdc().dtr = dtr;
+}
+
+/// Sends a SET_LINE_CODING request to the device.
+static inline void host_cdc_set_line_coding(uint32_t baud, uint8_t data_bits,
+                                            uint8_t parity, uint8_t stop_bits)
+{
+    cdc_line_coding_t coding = {baud, stop_bits, parity, data_bits};
+    tud_cdc_line_coding_cb(0, &coding);
+}
+
+/// Queues data to be sent to the device on the OUT endpoint.
+static inline void host_cdc_send(const uint8_t *data, size_t size)
+{
+    std::lock_guard<std::mutex> guard(host_cdc().lock);
+    host_cdc().host_out.insert(host_cdc().host_out.end(), data, data + size);
+}
+
+/// Moves the data received from the IN endpoint so far into @param data.
+static inline void host_cdc_receive(std::vector<uint8_t> &data)
+{
+    std::lock_guard<std::mutex> guard(host_cdc().lock);
+    data.insert(data.end(), host_cdc().host_in.begin(),
+                host_cdc().host_in.end());
+    host_cdc().host_in.clear();
+}
+
+/// Stops or resumes reading the IN endpoint.
+static inline void host_cdc_pause_in(bool paused)
+{
+    std::lock_guard<std::mutex> guard(host_cdc().lock);
+    host_cdc().in_paused = paused;
+}
@@ -0,0 +1,201 @@
+// Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Host loopback test for the USB to UART bridge (src/usb_uart_bridge.cpp).
+//
+// The bridge runs unmodified against the simulated TinyUSB CDC interface and
+// UART driver from tools/host/include. The simulated UART has its TX looped
+// back to its RX and RTS to CTS, so a pattern sent by the host on the CDC
+// OUT endpoint goes out on the UART, is received again and has to come back
+// on the CDC IN endpoint unchanged. The test checks:
+//
+//   1. line coding requests are applied to the UART (baud rate, data bits,
+//      parity and stop bits).
+//   2. the pattern comes back complete and in order at the requested baud
+//      rate (3 Mbaud by default).
+//   3. while the host stops reading the IN endpoint the UART is stopped by
+//      RTS/CTS and, as the UART TX buffer fills, the OUT endpoint is NAKed.
+//      No data is lost.
+//
+// Build and run from the repository root:
+//
+//   g++ -std=gnu++17 -O2 -pthread -Itools/host/include -Iinclude
+//       tools/host/uart_bridge_loopback.cpp -o uart_bridge_loopback
+//   ./uart_bridge_loopback [bytes] [baud]
+
+#define CONFIG_ESPUSB_CDC 1
+#define CONFIG_ESPUSB_CDC_RX_BUFSIZE 512
+#define CONFIG_ESPUSB_CDC_TX_BUFSIZE 512
+#define CONFIG_ESPUSB_CDC_EP_BUFSIZE 64
+#define CONFIG_ESPUSB_CDC_UART_BRIDGE 1
+#define CONFIG_ESPUSB_CDC_UART_BRIDGE_PORT 1
+#define CONFIG_ESPUSB_CDC_UART_BRIDGE_BAUD 115200
+#define CONFIG_ESPUSB_CDC_UART_BRIDGE_TX_PIN 17
+#define CONFIG_ESPUSB_CDC_UART_BRIDGE_RX_PIN 18
+#define CONFIG_ESPUSB_CDC_UART_BRIDGE_FLOWCTRL 1
+#define CONFIG_ESPUSB_CDC_UART_BRIDGE_RTS_PIN 15
+#define CONFIG_ESPUSB_CDC_UART_BRIDGE_CTS_PIN 16
+#define CONFIG_ESPUSB_CDC_UART_BRIDGE_RX_BUFSIZE 4096
+#define CONFIG_ESPUSB_CDC_UART_BRIDGE_TX_BUFSIZE 4096
+#define CONFIG_ESPUSB_TASK_PRIORITY 5
+#define CONFIG_ESPUSB_TASK_AFFINITY tskNO_AFFINITY
+
+#include "../../src/usb_uart_bridge.cpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+/// Time the host stops reading the IN endpoint for (milliseconds).
+static constexpr uint32_t PAUSE_MS = 250;
+
+// Invoked by the simulated bus when an IN transfer has completed, this is
+// normally done by usb_cdc.cpp.
+extern "C" void tud_cdc_tx_complete_cb(uint8_t itf)
+{
+    uart_bridge_tx_complete();
+}
+
+// Flush policy of usb_cdc.cpp (flush after every write).
+void cdc_written(const char *buf, size_t size, int64_t start_us)
+{
+    tud_cdc_write_flush();
+}
+
+/// Number of failed checks.
+static unsigned s_failures = 0;
+
+/// Records the result of a check.
+///
+/// @param ok is the result of the check.
+/// @param what describes the check.
+static void check(bool ok, const char *what)
+{
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    if (!ok)
+    {
+        s_failures++;
+    }
+}
+
+/// Sends a line coding request and checks the UART configuration.
+static void test_line_coding(uint32_t baud, uint8_t data_bits, uint8_t parity,
+                             uint8_t stop_bits, uart_word_length_t word,
+                             uart_parity_t uart_parity,
+                             uart_stop_bits_t uart_stop)
+{
+    host_cdc_set_line_coding(baud, data_bits, parity, stop_bits);
+    uart_config_t config;
+    {
+        std::lock_guard<std::mutex> guard(host_uart(BRIDGE_UART).lock);
+        config = host_uart(BRIDGE_UART).config;
+    }
+    char what[96];
+    snprintf(what, sizeof(what), "line coding %u baud, %u data bits, parity "
+             "%u, stop bits %u", baud, data_bits, parity, stop_bits);
+    check(config.baud_rate == (int)baud && config.data_bits == word &&
+          config.parity == uart_parity && config.stop_bits == uart_stop,
+          what);
+}
+
+/// Sends @param size bytes through the loopback and verifies them.
+static void test_loopback(size_t size, uint32_t baud)
+{
+    std::vector<uint8_t> pattern(size);
+    uint32_t seed = 0x12345678;
+    for (auto &value : pattern)
+    {
+        seed = seed * 1664525 + 1013904223;
+        value = seed >> 24;
+    }
+
+    std::vector<uint8_t> received;
+    received.reserve(size);
+    host_cdc_send(pattern.data(), pattern.size());
+    uint32_t bits = host_uart_frame_bits(host_uart(BRIDGE_UART).config);
+    double line_rate = (double)baud / bits;
+    int64_t timeout_us = (int64_t)((size / line_rate) * 3e6) + 2000000 +
+                         (PAUSE_MS * 1000);
+    int64_t start_us = esp_timer_get_time();
+    bool paused = false;
+    uint64_t stalls_before = host_uart(BRIDGE_UART).flow_stalls;
+    while (received.size() < size &&
+           esp_timer_get_time() - start_us < timeout_us)
+    {
+        usleep(1000);
+        host_cdc_receive(received);
+        if (!paused && received.size() >= size / 3)
+        {
+            // the host stops reading, this has to push back all the way to
+            // the OUT endpoint without losing data.
+            paused = true;
+            host_cdc_pause_in(true);
+            usleep(PAUSE_MS * 1000);
+            host_cdc_pause_in(false);
+        }
+    }
+    double elapsed =
+        (esp_timer_get_time() - start_us) / 1e6 - (paused ? PAUSE_MS / 1e3 : 0);
+
+    host_uart_t &uart = host_uart(BRIDGE_UART);
+    uint64_t stalls, overruns;
+    {
+        std::lock_guard<std::mutex> guard(uart.lock);
+        stalls = uart.flow_stalls - stalls_before;
+        overruns = uart.overruns;
+    }
+    uint64_t out_naks, in_naks;
+    {
+        std::lock_guard<std::mutex> guard(host_cdc().lock);
+        out_naks = host_cdc().out_naks;
+        in_naks = host_cdc().in_naks;
+    }
+
+    printf("loopback: %zu of %zu bytes in %.2fs (excluding the %ums pause), "
+           "%.1f KB/s, line rate %.1f KB/s\n", received.size(), size,
+           elapsed, PAUSE_MS, received.size() / elapsed / 1e3,
+           line_rate / 1e3);
+    printf("flow control: %llu UART stalls, %llu OUT NAKs, %llu IN NAKs, "
+           "%llu overruns\n", (unsigned long long)stalls,
+           (unsigned long long)out_naks, (unsigned long long)in_naks,
+           (unsigned long long)overruns);
+
+    check(received.size() == size, "all data received");
+    check(received == pattern, "data received in order and unmodified");
+    check(overruns == 0, "no UART overruns");
+    check(stalls > 0, "RTS/CTS stopped the UART while the host was paused");
+    check(out_naks > 0, "OUT endpoint NAKed while the UART was full");
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size = argc > 1 ? strtoul(argv[1], nullptr, 0) : 512 * 1024;
+    uint32_t baud = argc > 2 ? strtoul(argv[2], nullptr, 0) : 3000000;
+
+    init_usb_uart_bridge();
+    host_cdc_start();
+    host_cdc_set_dtr(true);
+
+    test_line_coding(115200, 7, 2, 2, UART_DATA_7_BITS, UART_PARITY_EVEN,
+                     UART_STOP_BITS_2);
+    test_line_coding(9600, 5, 1, 1, UART_DATA_5_BITS, UART_PARITY_ODD,
+                     UART_STOP_BITS_1_5);
+    test_line_coding(baud, 8, 0, 0, UART_DATA_8_BITS, UART_PARITY_DISABLE,
+                     UART_STOP_BITS_1);
+    test_loopback(size, baud);
+
+    printf("%s\n", s_failures ? "FAILED" : "PASSED");
+    fflush(stdout);
+    // the bridge tasks never return, skip running the static destructors.
+    _Exit(s_failures ? 1 : 0);
+}
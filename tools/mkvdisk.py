@@ -0,0 +1,267 @@
+#!/usr/bin/env python3
+# Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Virtual disk image generator for the esp32usb MSC interface.
+
+Builds the complete FAT-16 image of the virtual disk (boot sector, both FAT
+copies, root directory and file content) from a manifest so the device can
+serve every sector directly from flash when CONFIG_ESPUSB_MSC_VDISK_IMAGE is
+enabled. This is normally invoked by the component CMakeLists.txt with the
+geometry from the project configuration.
+
+The layout matches the one usb_msc.cpp generates when files are registered at
+runtime: one sector per cluster, files are stored contiguously in manifest
+order and the directory entries of a file are placed in the first root
+directory sector with room for them.
+
+Manifest (JSON), file paths are relative to the manifest:
+
+  {
+    "label": "esp32usb",
+    "serial_number": "0x0100",
+    "files": [
+      {"name": "readme.txt", "path": "readme.txt"},
+      {"path": "www/index.html"}
+    ]
+  }
+
+When "name" is omitted the base name of "path" is used. All files are
+presented as read-only.
+"""
+
+import argparse
+import json
+import os
+import struct
+import sys
+
+BOOT_SECTOR = struct.Struct('<3s8sHBHBHHBHHHIIBBBI11s8s')
+DIRENTRY = struct.Struct('<11sBBBHHHHHHHI')
+LFN_ENTRY = struct.Struct('<B10sBBB12sH4s')
+
+DIRENT_READ_ONLY = 0x01
+DIRENT_VOLUME_LABEL = 0x08
+DIRENT_ARCHIVE = 0x20
+DIRENT_LFN = 0x0F
+
+MEDIA_DESCRIPTOR = 0xF8
+FAT_CLUSTER_END_OF_FILE = 0xFFFF
+DIRENTRY_DATE = 0x4D99
+
+
+class ImageError(Exception):
+    pass
+
+
+def short_name(name, max_length):
+    """Returns the space padded 8.3 name and the (possibly truncated) name."""
+    pos = name.find('.')
+    if pos < 0:
+        base = name[:max_length]
+        return base[:11].upper().ljust(11), base
+    base = name[:min(pos, max_length - 3)]
+    ext = name[pos + 1:pos + 4]
+    return base[:8].upper().ljust(8) + ext.upper().ljust(3), base + '.' + ext
+
+
+def lfn_checksum(name83):
+    checksum = 0
+    for ch in name83:
+        checksum = (((checksum & 1) << 7) + (checksum >> 1) + ch) & 0xFF
+    return checksum
+
+
+def lfn_entries(name, name83, count):
+    """Generates the long filename entries, the last fragment first."""
+    checksum = lfn_checksum(name83)
+    entries = []
+    for fragment in range(count, 0, -1):
+        chars = []
+        for idx in range(13):
+            offs = (fragment - 1) * 13 + idx
+            if offs < len(name):
+                chars.append(ord(name[offs]) & 0xFF)
+            elif offs == len(name):
+                chars.append(0x0000)
+            else:
+                chars.append(0xFFFF)
+        encoded = struct.pack('<13H', *chars)
+        sequence = fragment | (0x40 if fragment == count else 0)
+        entries.append(LFN_ENTRY.pack(sequence, encoded[0:10], DIRENT_LFN, 0,
+                                      checksum, encoded[10:22], 0,
+                                      encoded[22:26]))
+    return entries
+
+
+def build_image(manifest, base_dir, sector_size, sector_count,
+                reserved_sectors, file_count, long_filenames):
+    """Builds the image, returns it as a bytearray."""
+    per_sector = sector_size // DIRENTRY.size
+    fat_sectors = (sector_count * 2 + sector_size - 1) // sector_size
+    root_dir_first = reserved_sectors + fat_sectors * 2
+    root_dir_count = file_count // per_sector
+    content_first = root_dir_first + root_dir_count
+    max_length = 38 if long_filenames else 11
+
+    files = manifest.get('files', [])
+    if len(files) > file_count - 1:
+        raise ImageError('{} files exceed the limit of {}'.format(
+            len(files), file_count - 1))
+
+    label = manifest.get('label', 'esp32s2').encode('ascii')[:11]
+    serial = manifest.get('serial_number', 0)
+    if isinstance(serial, str):
+        serial = int(serial, 0)
+
+    # lay out the files and assign their root directory sectors.
+    usage = [0] * root_dir_count
+    usage[0] = 1
+    entries = []
+    next_sector = content_first
+    for entry in files:
+        path = os.path.join(base_dir, entry['path'])
+        with open(path, 'rb') as f:
+            content = f.read()
+        name83, name = short_name(entry.get('name', os.path.basename(path)),
+                                  max_length)
+        name83 = bytearray(name83.encode('ascii'))
+        lfn_count = 0
+        if long_filenames and len(name) > 12:
+            name83[6:8] = b'~1'
+            lfn_count = (len(name) + 12) // 13
+        start = next_sector
+        end = start + len(content) // sector_size
+        next_sector = end + 1
+        needed = 1 + lfn_count
+        root_sector = None
+        for index in range(root_dir_count):
+            if usage[index] + needed < per_sector:
+                usage[index] += needed
+                root_sector = index
+                break
+        if root_sector is None:
+            raise ImageError('no root directory room for ' + name)
+        entries.append((name, bytes(name83), lfn_count, start, end, content,
+                        root_sector))
+    if next_sector > sector_count:
+        raise ImageError('files need {} sectors, the disk has {}'.format(
+            next_sector, sector_count))
+
+    image = bytearray(next_sector * sector_size)
+
+    boot = BOOT_SECTOR.pack(b'\xEB\x3C\x90', b'MSDOS5.0', sector_size, 1,
+                            reserved_sectors, 2, file_count,
+                            sector_count if sector_count < 0x10000 else 0,
+                            MEDIA_DESCRIPTOR, fat_sectors, 1, 1, 0,
+                            sector_count if sector_count >= 0x10000 else 0,
+                            0x80, 0, 0x29, serial, label.ljust(11),
+                            b'FAT16   ')
+    image[0:len(boot)] = boot
+    image[510:512] = b'\x55\xAA'
+
+    # both FAT copies are identical, clusters start at two for the first
+    # content sector.
+    fat = bytearray(fat_sectors * sector_size)
+    struct.pack_into('<HH', fat, 0, 0xFF00 | MEDIA_DESCRIPTOR,
+                     FAT_CLUSTER_END_OF_FILE)
+    for _, _, _, start, end, _, _ in entries:
+        for sector in range(start, end + 1):
+            cluster = sector - content_first + 2
+            link = cluster + 1 if sector != end else FAT_CLUSTER_END_OF_FILE
+            struct.pack_into('<H', fat, cluster * 2, link)
+    for copy in range(2):
+        offs = (reserved_sectors + copy * fat_sectors) * sector_size
+        image[offs:offs + len(fat)] = fat
+
+    for index in range(root_dir_count):
+        offs = (root_dir_first + index) * sector_size
+        dirents = []
+        if index == 0:
+            dirents.append(DIRENTRY.pack(label.ljust(11),
+                                         DIRENT_ARCHIVE | DIRENT_VOLUME_LABEL,
+                                         0, 0, 0, 0, 0, 0, 0, 0, 0, 0))
+        for name, name83, lfn_count, start, _, content, root_sector \
+                in entries:
+            if root_sector != index:
+                continue
+            if lfn_count:
+                dirents.extend(lfn_entries(name, name83, lfn_count))
+            dirents.append(DIRENTRY.pack(name83,
+                                         DIRENT_ARCHIVE | DIRENT_READ_ONLY,
+                                         0, 0, 0, DIRENTRY_DATE, 0, 0, 0,
+                                         DIRENTRY_DATE,
+                                         start - content_first + 2,
+                                         len(content)))
+        sector = b''.join(dirents)
+        image[offs:offs + len(sector)] = sector
+
+    for _, _, _, start, _, content, _ in entries:
+        offs = start * sector_size
+        image[offs:offs + len(content)] = content
+
+    return image
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('manifest', help='JSON manifest of the files')
+    parser.add_argument('output', nargs='?', help='image file to write')
+    parser.add_argument('--sector-size', type=int, default=512,
+                        help='CONFIG_ESPUSB_MSC_VDISK_SECTOR_SIZE')
+    parser.add_argument('--sector-count', type=int, default=8192,
+                        help='CONFIG_ESPUSB_MSC_VDISK_SECTOR_COUNT')
+    parser.add_argument('--reserved-sectors', type=int, default=1,
+                        help='CONFIG_ESPUSB_MSC_VDISK_RESERVED_SECTOR_COUNT')
+    parser.add_argument('--file-count', type=int, default=64,
+                        help='CONFIG_ESPUSB_MSC_VDISK_FILE_COUNT')
+    parser.add_argument('--long-filenames', action='store_true',
+                        help='CONFIG_ESPUSB_MSC_LONG_FILENAMES is enabled')
+    parser.add_argument('--list-inputs', action='store_true',
+                        help='print the files the image is built from, one '
+                             'per line, instead of building it')
+    args = parser.parse_args()
+
+    with open(args.manifest) as f:
+        manifest = json.load(f)
+    base_dir = os.path.dirname(os.path.abspath(args.manifest))
+    if args.list_inputs:
+        # used by CMakeLists.txt at configure time to list the image inputs
+        # in DEPENDS, DEPFILE is not supported by all CMake versions and
+        # generators used with ESP-IDF.
+        for entry in manifest.get('files', []):
+            print(os.path.join(base_dir, entry['path']))
+        return 0
+    if args.output is None:
+        parser.error('the output image is required')
+    try:
+        image = build_image(
+            manifest, base_dir,
+            args.sector_size, args.sector_count, args.reserved_sectors,
+            args.file_count, args.long_filenames)
+    except (ImageError, OSError, UnicodeError) as e:
+        print('mkvdisk: {}'.format(e), file=sys.stderr)
+        return 1
+
+    with open(args.output, 'wb') as f:
+        f.write(image)
+    print('{}: {} files, {} sectors ({} bytes)'.format(
+        args.output, len(manifest.get('files', [])),
+        len(image) // args.sector_size, len(image)))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
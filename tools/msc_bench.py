@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+# Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Read throughput benchmark for the esp32usb virtual disk.
+
+Reads a file from the mounted virtual disk (or a range of the block device)
+and reports the throughput. On Linux the file is opened with O_DIRECT so every
+pass is read from the device rather than the page cache, elsewhere only the
+first pass is meaningful unless the disk is remounted between runs.
+
+To compare the partition read paths run this against a partition backed file
+(for example the firmware) with CONFIG_ESPUSB_MSC_PARTITION_MMAP disabled and
+enabled, recording each result under a label:
+
+  msc_bench.py /media/esp32usb/firmware.bin --label default --results msc.json
+  (rebuild with CONFIG_ESPUSB_MSC_PARTITION_MMAP enabled)
+  msc_bench.py /media/esp32usb/firmware.bin --label mmap --results msc.json
+
+get_msc_read_stats() on the device reports the time the USB task spent on the
+reads of each path.
+"""
+
+import argparse
+import json
+import mmap
+import os
+import sys
+import time
+
+
+def read_pass(path, offset, length, chunk):
+    flags = os.O_RDONLY | getattr(os, 'O_DIRECT', 0)
+    fd = os.open(path, flags)
+    # O_DIRECT requires an aligned buffer, anonymous maps are page aligned.
+    buf = mmap.mmap(-1, chunk)
+    total = 0
+    try:
+        os.lseek(fd, offset, os.SEEK_SET)
+        while length is None or total < length:
+            count = os.readv(fd, [buf])
+            if count <= 0:
+                break
+            total += count
+    finally:
+        os.close(fd)
+        buf.close()
+    if length is not None:
+        total = min(total, length)
+    return total
+
+
+def record_result(path, label, rate):
+    results = {}
+    if os.path.exists(path):
+        with open(path) as f:
+            results = json.load(f)
+    results[label] = rate
+    with open(path, 'w') as f:
+        json.dump(results, f, indent=2, sort_keys=True)
+    baseline = results.get('default')
+    print('results:')
+    for name, value in sorted(results.items()):
+        if baseline and name != 'default':
+            print('  %-12s %8.3f MB/s (%+.1f%% vs default)' %
+                  (name, value, (value / baseline - 1.0) * 100.0))
+        else:
+            print('  %-12s %8.3f MB/s' % (name, value))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('path',
+                        help='file on the virtual disk or its block device')
+    parser.add_argument('--offset', type=int, default=0,
+                        help='byte offset to start reading at, must be a '
+                             'multiple of the sector size')
+    parser.add_argument('--length', type=int, default=None,
+                        help='bytes to read per pass (default: to the end)')
+    parser.add_argument('--chunk', type=int, default=65536,
+                        help='bytes per read request, must be a multiple of '
+                             'the sector size')
+    parser.add_argument('--passes', type=int, default=3,
+                        help='number of times to read the data')
+    parser.add_argument('--label',
+                        help='name of the firmware build being measured, '
+                             'for example "default" or "mmap"')
+    parser.add_argument('--results',
+                        help='JSON file the labelled average throughput is '
+                             'added to, all recorded labels are printed')
+    args = parser.parse_args()
+
+    if not hasattr(os, 'O_DIRECT'):
+        print('O_DIRECT is not available, passes after the first may be '
+              'served from the page cache', file=sys.stderr)
+
+    rates = []
+    for index in range(args.passes):
+        start = time.monotonic()
+        nbytes = read_pass(args.path, args.offset, args.length, args.chunk)
+        elapsed = time.monotonic() - start
+        rates.append(nbytes / elapsed / 1e6)
+        print('pass %d: %d bytes in %.2fs, %.3f MB/s' %
+              (index + 1, nbytes, elapsed, rates[-1]))
+    if rates:
+        print('average: %.3f MB/s, best: %.3f MB/s' %
+              (sum(rates) / len(rates), max(rates)))
+        if args.results:
+            record_result(args.results, args.label or 'default',
+                          sum(rates) / len(rates))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+# Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Host side client for the esp32usb vendor interface diagnostic modes.
+
+The device must be built with CONFIG_ESPUSB_VENDOR_STREAMING and
+CONFIG_ESPUSB_VENDOR_DIAG_MODE set to the mode matching the one requested
+here:
+
+  source: the device sends an incrementing 32-bit counter, this measures
+          device to host throughput and reports missing counter values.
+  sink:   the host sends an incrementing 32-bit counter, this measures host
+          to device throughput (check get_vendor_stats() on the device for
+          verification errors).
+
+The data pattern matches tools/cdc_bench.py so the results of both can be
+compared directly.
+
+Requires pyusb.
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+import usb.core
+import usb.util
+
+COUNTER = struct.Struct('<I')
+
+
+def report_rate(label, nbytes, elapsed):
+    print('%s: %d bytes in %.2fs, %.3f MB/s' %
+          (label, nbytes, elapsed, nbytes / elapsed / 1e6))
+
+
+def find_endpoints(dev):
+    for cfg in dev:
+        for intf in cfg:
+            if intf.bInterfaceClass != 0xFF:
+                continue
+            ep_in = usb.util.find_descriptor(intf, custom_match=lambda ep:
+                usb.util.endpoint_direction(ep.bEndpointAddress) ==
+                usb.util.ENDPOINT_IN)
+            ep_out = usb.util.find_descriptor(intf, custom_match=lambda ep:
+                usb.util.endpoint_direction(ep.bEndpointAddress) ==
+                usb.util.ENDPOINT_OUT)
+            return intf, ep_in, ep_out
+    return None, None, None
+
+
+def run_source(ep_in, duration, chunk):
+    received = 0
+    errors = 0
+    dropped = 0
+    expected = None
+    partial = b''
+    start = time.monotonic()
+    while time.monotonic() - start < duration:
+        try:
+            data = bytes(ep_in.read(chunk, timeout=100))
+        except usb.core.USBTimeoutError:
+            continue
+        received += len(data)
+        data = partial + data
+        usable = len(data) - (len(data) % COUNTER.size)
+        for (value,) in COUNTER.iter_unpack(data[:usable]):
+            if expected is not None and value != expected:
+                errors += 1
+                if value > expected:
+                    dropped += value - expected
+            expected = (value + 1) & 0xFFFFFFFF
+        partial = data[usable:]
+    report_rate('source', received, time.monotonic() - start)
+    print('errors: %d, dropped counter values: %d' % (errors, dropped))
+    return errors == 0
+
+
+def run_sink(ep_out, duration, chunk):
+    words = chunk // COUNTER.size
+    counter = 0
+    sent = 0
+    start = time.monotonic()
+    while time.monotonic() - start < duration:
+        payload = b''.join(COUNTER.pack((counter + i) & 0xFFFFFFFF)
+                           for i in range(words))
+        counter += words
+        sent += ep_out.write(payload, timeout=1000)
+    report_rate('sink', sent, time.monotonic() - start)
+    return True
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('mode', choices=('source', 'sink'))
+    parser.add_argument('--vid', type=lambda x: int(x, 0), default=0x303A,
+                        help='USB vendor ID of the device')
+    parser.add_argument('--pid', type=lambda x: int(x, 0), default=None,
+                        help='USB product ID of the device (default: any)')
+    parser.add_argument('--duration', type=float, default=10.0,
+                        help='test duration in seconds')
+    parser.add_argument('--chunk', type=int, default=16384,
+                        help='read/write size in bytes, this should be a '
+                             'multiple of 64')
+    args = parser.parse_args()
+
+    if args.pid is None:
+        dev = usb.core.find(idVendor=args.vid)
+    else:
+        dev = usb.core.find(idVendor=args.vid, idProduct=args.pid)
+    if dev is None:
+        print('device not found', file=sys.stderr)
+        return 1
+    intf, ep_in, ep_out = find_endpoints(dev)
+    if intf is None:
+        print('vendor interface not found', file=sys.stderr)
+        return 1
+    usb.util.claim_interface(dev, intf)
+    try:
+        if args.mode == 'source':
+            ok = run_source(ep_in, args.duration, args.chunk)
+        else:
+            ok = run_sink(ep_out, args.duration, args.chunk)
+    finally:
+        usb.util.release_interface(dev, intf)
+    return 0 if ok else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
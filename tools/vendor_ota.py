@@ -0,0 +1,332 @@
+#!/usr/bin/env python3
+# Copyright 2021 Mike Dunston (https://github.com/atanisoft)
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Firmware update client for the esp32usb vendor interface.
+
+The device must be built with CONFIG_ESPUSB_VENDOR_OTA enabled. The
+application image is sent in fixed size blocks, up to the window size
+reported by the device can be in flight while the device writes earlier
+blocks to flash. The device verifies the SHA-256 of the image before
+selecting it for the next boot and restarts into it.
+
+Protocol (all values little-endian):
+
+  command:  magic 'EOTA' (u32), command (u8), reserved (3 bytes),
+            seq (u32), length (u32), payload
+            BEGIN (1): payload is image size (u32) + SHA-256 (32 bytes)
+            DATA  (2): payload is one block, padded to the block size
+            END   (3), ABORT (4): no payload
+  response: magic 'EOTA' (u32), response (u8), error (u8), reserved (u16),
+            seq (u32), value (u32)
+            READY (1): seq is the window, value the block size
+            ACK   (2): blocks up to seq written, value is bytes written
+            DONE  (3): image verified, value is bytes written
+            ERROR (4): error holds the reason, the update was aborted
+
+--simulate runs the protocol against an in-process device model with a
+configurable link and flash speed so the effect of the block and window
+sizes can be measured without hardware.
+
+Requires pyusb (not needed for --simulate).
+"""
+
+import argparse
+import hashlib
+import queue
+import struct
+import sys
+import threading
+import time
+
+MAGIC = 0x41544F45
+HEADER = struct.Struct('<IB3xII')
+BEGIN = struct.Struct('<I32s')
+STATUS = struct.Struct('<IBBHII')
+
+CMD_BEGIN = 1
+CMD_DATA = 2
+CMD_END = 3
+CMD_ABORT = 4
+
+RESP_READY = 1
+RESP_ACK = 2
+RESP_DONE = 3
+RESP_ERROR = 4
+
+ERRORS = {
+    1: 'protocol error',
+    2: 'update not started',
+    3: 'block out of sequence',
+    4: 'image too large',
+    5: 'flash write failed',
+    6: 'SHA-256 mismatch',
+    7: 'image incomplete',
+}
+
+
+class OtaError(Exception):
+    pass
+
+
+class UsbTransport:
+    """Bulk endpoints of the vendor interface of a real device."""
+
+    def __init__(self, vid, pid):
+        import usb.core
+        import usb.util
+        self.usb = usb
+        if pid is None:
+            self.dev = usb.core.find(idVendor=vid)
+        else:
+            self.dev = usb.core.find(idVendor=vid, idProduct=pid)
+        if self.dev is None:
+            raise OtaError('device not found')
+        self.intf = None
+        for cfg in self.dev:
+            for intf in cfg:
+                if intf.bInterfaceClass == 0xFF:
+                    self.intf = intf
+                    break
+        if self.intf is None:
+            raise OtaError('vendor interface not found')
+        self.ep_in = usb.util.find_descriptor(self.intf, custom_match=lambda ep:
+            usb.util.endpoint_direction(ep.bEndpointAddress) ==
+            usb.util.ENDPOINT_IN)
+        self.ep_out = usb.util.find_descriptor(self.intf, custom_match=lambda ep:
+            usb.util.endpoint_direction(ep.bEndpointAddress) ==
+            usb.util.ENDPOINT_OUT)
+        usb.util.claim_interface(self.dev, self.intf)
+
+    def write(self, data):
+        self.ep_out.write(data, timeout=5000)
+
+    def read(self, timeout):
+        try:
+            return bytes(self.ep_in.read(STATUS.size, timeout=int(timeout * 1000)))
+        except self.usb.core.USBTimeoutError:
+            return None
+
+    def close(self):
+        self.usb.util.release_interface(self.dev, self.intf)
+
+
+class SimTransport:
+    """In-process model of the device side of the protocol.
+
+    Transfers take len / link_rate seconds, blocks are written to flash by a
+    separate thread taking len / flash_rate seconds (plus the sector erase
+    time for each new 4KiB sector) which mirrors the update task on the
+    device.
+    """
+
+    SECTOR_SIZE = 4096
+
+    def __init__(self, block_size, window, link_rate, flash_rate, erase_time):
+        self.block_size = block_size
+        self.window = window
+        self.link_rate = link_rate
+        self.flash_rate = flash_rate
+        self.erase_time = erase_time
+        # one receive buffer per block in flight.
+        self.rx = queue.Queue(maxsize=window)
+        self.tx = queue.Queue()
+        self.thread = threading.Thread(target=self._device, daemon=True)
+        self.thread.start()
+
+    def write(self, data):
+        time.sleep(len(data) / self.link_rate)
+        self.rx.put(bytes(data))
+
+    def read(self, timeout):
+        try:
+            return self.tx.get(timeout=timeout)
+        except queue.Empty:
+            return None
+
+    def close(self):
+        self.rx.put(None)
+
+    def _respond(self, response, error=0, seq=0, value=0):
+        self.tx.put(STATUS.pack(MAGIC, response, error, 0, seq, value))
+
+    def _device(self):
+        sha = None
+        size = written = next_seq = 0
+        expected = b''
+        while True:
+            data = self.rx.get()
+            if data is None:
+                return
+            magic, command, seq, length = HEADER.unpack_from(data)
+            payload = data[HEADER.size:HEADER.size + length]
+            if magic != MAGIC:
+                self._respond(RESP_ERROR, 1, seq)
+            elif command == CMD_BEGIN:
+                size, expected = BEGIN.unpack(payload)
+                sha = hashlib.sha256()
+                written = next_seq = 0
+                self._respond(RESP_READY, 0, self.window, self.block_size)
+            elif command == CMD_DATA:
+                if sha is None:
+                    self._respond(RESP_ERROR, 2, seq)
+                elif seq != next_seq:
+                    self._respond(RESP_ERROR, 3, seq)
+                    sha = None
+                else:
+                    sectors = ((written + length + self.SECTOR_SIZE - 1) //
+                               self.SECTOR_SIZE -
+                               (written + self.SECTOR_SIZE - 1) //
+                               self.SECTOR_SIZE)
+                    time.sleep(length / self.flash_rate +
+                               sectors * self.erase_time)
+                    sha.update(payload)
+                    written += length
+                    next_seq += 1
+                    self._respond(RESP_ACK, 0, seq, written)
+            elif command == CMD_END:
+                if sha is None:
+                    self._respond(RESP_ERROR, 2, next_seq)
+                elif written != size:
+                    self._respond(RESP_ERROR, 7, next_seq)
+                elif sha.digest() != expected:
+                    self._respond(RESP_ERROR, 6, next_seq)
+                else:
+                    self._respond(RESP_DONE, 0, 0, written)
+                sha = None
+            elif command == CMD_ABORT:
+                sha = None
+
+
+def command(cmd, seq=0, payload=b'', pad_to=0):
+    data = HEADER.pack(MAGIC, cmd, seq, len(payload)) + payload
+    if len(data) < pad_to:
+        data += b'\xFF' * (pad_to - len(data))
+    return data
+
+
+def read_status(transport, timeout):
+    data = transport.read(timeout)
+    if data is None:
+        raise OtaError('timeout waiting for the device')
+    magic, response, error, _, seq, value = STATUS.unpack(data)
+    if magic != MAGIC:
+        raise OtaError('invalid response from the device')
+    if response == RESP_ERROR:
+        raise OtaError('device reported %s at block %d' %
+                       (ERRORS.get(error, 'error %d' % error), seq))
+    return response, seq, value
+
+
+def progress(written, total, start):
+    elapsed = max(time.monotonic() - start, 1e-6)
+    print('\r%6.1f%% %d/%d bytes, %.1f KB/s' %
+          (written * 100.0 / total, written, total, written / elapsed / 1000),
+          end='', flush=True)
+
+
+def update(transport, image, timeout):
+    transport.write(command(CMD_BEGIN, 0,
+                            BEGIN.pack(len(image), hashlib.sha256(image).digest())))
+    response, window, block_size = read_status(transport, timeout)
+    if response != RESP_READY:
+        raise OtaError('unexpected response %d to BEGIN' % response)
+    blocks = (len(image) + block_size - 1) // block_size
+    message_size = HEADER.size + block_size
+    print('sending %d bytes in %d blocks of %d bytes, window %d' %
+          (len(image), blocks, block_size, window))
+
+    start = time.monotonic()
+    acked = 0
+    written = 0
+    for seq in range(blocks):
+        # wait for an acknowledgement once the window is full, the device
+        # has no receive buffer for further blocks until then.
+        while seq - acked >= window:
+            response, ack_seq, written = read_status(transport, timeout)
+            if response == RESP_ACK:
+                acked = ack_seq + 1
+                progress(written, len(image), start)
+        block = image[seq * block_size:(seq + 1) * block_size]
+        transport.write(command(CMD_DATA, seq, block, message_size))
+    while acked < blocks:
+        response, ack_seq, written = read_status(transport, timeout)
+        if response == RESP_ACK:
+            acked = ack_seq + 1
+            progress(written, len(image), start)
+    elapsed = time.monotonic() - start
+    print()
+
+    transport.write(command(CMD_END))
+    response, _, written = read_status(transport, timeout)
+    if response != RESP_DONE:
+        raise OtaError('unexpected response %d to END' % response)
+    print('%d bytes written and verified in %.2fs, %.1f KB/s' %
+          (written, elapsed, written / elapsed / 1000))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('image', help='application image (build/app.bin)')
+    parser.add_argument('--vid', type=lambda x: int(x, 0), default=0x303A,
+                        help='USB vendor ID of the device')
+    parser.add_argument('--pid', type=lambda x: int(x, 0), default=None,
+                        help='USB product ID of the device (default: any)')
+    parser.add_argument('--timeout', type=float, default=5.0,
+                        help='response timeout in seconds')
+    sim = parser.add_argument_group('simulation')
+    sim.add_argument('--simulate', action='store_true',
+                     help='use the simulated device instead of USB')
+    sim.add_argument('--block-size', type=int, default=4096,
+                     help='CONFIG_ESPUSB_VENDOR_OTA_BLOCK_SIZE to simulate')
+    sim.add_argument('--window', type=int, default=4,
+                     help='CONFIG_ESPUSB_VENDOR_OTA_WINDOW to simulate')
+    sim.add_argument('--link-rate', type=float, default=1.0,
+                     help='USB bulk throughput in MB/s')
+    sim.add_argument('--flash-rate', type=float, default=0.4,
+                     help='flash write throughput in MB/s')
+    sim.add_argument('--erase-time', type=float, default=0.02,
+                     help='4KiB sector erase time in seconds')
+    args = parser.parse_args()
+
+    with open(args.image, 'rb') as image_file:
+        image = image_file.read()
+
+    try:
+        if args.simulate:
+            transport = SimTransport(args.block_size, args.window,
+                                     args.link_rate * 1e6,
+                                     args.flash_rate * 1e6, args.erase_time)
+        else:
+            transport = UsbTransport(args.vid, args.pid)
+    except OtaError as err:
+        print(err, file=sys.stderr)
+        return 1
+    try:
+        update(transport, image, args.timeout)
+    except OtaError as err:
+        print('\nupdate failed: %s' % err, file=sys.stderr)
+        try:
+            transport.write(command(CMD_ABORT))
+        except Exception:
+            pass
+        return 1
+    finally:
+        transport.close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())